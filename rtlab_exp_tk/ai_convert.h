@@ -0,0 +1,185 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  AI Convert dot h
+  ----------------
+  Raw AI codes to volts, with everything that depends only on the channel's
+  chanspec worked out ahead of time.  For each slot (a position in a scan, 
+  or a channel id -- whatever the caller indexes by) there is a gain and an 
+  offset, so that
+
+      volts = offset[slot] + gain[slot] * code
+
+  which is one multiply-add per sample: no range table lookup, no divide by
+  maxdata and no test of the range's units, no matter how many ranges the 
+  board has.  chanspec[slot] remembers what the pair was computed for, so a 
+  caller can notice a gain change with a single compare and recompute just 
+  that slot.
+
+  Comedi's polynomial calibrations aren't available to kcomedilib, so 
+  this is the same linear conversion comedi_to_phys() does.
+
+  Compile with -DTEST_AI_CONVERT (make -f Makefile.sim check) for a 
+  self-checking test against that.
+*/
+#ifndef _AI_CONVERT_H
+#define _AI_CONVERT_H
+
+#include "shared_stuff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* a chanspec CR_PACK() never makes -- marks a slot that has to be set */
+#define AI_CONVERT_STALE (~0U)
+
+struct ai_convert {
+  double       gain[SHD_MAX_CHANNELS];     /* volts per code               */
+  double       offset[SHD_MAX_CHANNELS];   /* volts at code 0              */
+  unsigned int chanspec[SHD_MAX_CHANNELS]; /* what the above are for       */
+};
+
+static inline void ai_convert_init(struct ai_convert *c)
+{
+  unsigned int i;
+
+  for (i = 0; i < SHD_MAX_CHANNELS; i++) {
+    c->gain[i] = 0.0;
+    c->offset[i] = 0.0;
+    c->chanspec[i] = AI_CONVERT_STALE;
+  }
+}
+
+/* min and max are the range's ends, already in volts (or whatever unit the
+   caller wants out) */
+static inline void ai_convert_set(struct ai_convert *c, unsigned int slot,
+                                  unsigned int chanspec, double min, 
+                                  double max, unsigned int maxdata)
+{
+  c->gain[slot] = maxdata ? (max - min) / (double)maxdata : 0.0;
+  c->offset[slot] = min;
+  c->chanspec[slot] = chanspec;
+}
+
+/* for when there is no range to be had for chanspec -- every code comes 
+   out as 'bad' */
+static inline void ai_convert_set_bad(struct ai_convert *c, unsigned int slot,
+                                      unsigned int chanspec, double bad)
+{
+  c->gain[slot] = 0.0;
+  c->offset[slot] = bad;
+  c->chanspec[slot] = chanspec;
+}
+
+static inline double ai_convert_one(const struct ai_convert *c, 
+                                    unsigned int slot, unsigned int code)
+{
+  return c->offset[slot] + c->gain[slot] * code;
+}
+
+/* The block kernel: codes[0..n) are a whole scan, slot i of c is for 
+   codes[i], and the volts land in out[i].data */
+static inline void ai_convert_scan(const struct ai_convert *c, 
+                                   const unsigned int *codes,
+                                   SampleStruct *out, unsigned int n)
+{
+  const double *g = c->gain, *o = c->offset;
+  unsigned int i;
+
+  for (i = 0; i < n; i++) 
+    out[i].data = o[i] + g[i] * codes[i];
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef TEST_AI_CONVERT
+/*
+  Checks ai_convert_one() and ai_convert_scan() against comedi_to_phys()'s
+  formula, min + (max - min) * code / maxdata, for 12, 16 and 24 bit 
+  boards over a few ranges: every code for 12 bits and 4096 of them, 
+  ends included, otherwise.  Also that init leaves every slot stale and 
+  set_bad puts out 'bad' whatever the code.
+*/
+#include <stdio.h>
+#include <math.h>
+
+static double test_to_phys(unsigned int code, double min, double max, 
+                           unsigned int maxdata)
+{
+  return min + (max - min) * ((double)code / (double)maxdata);
+}
+
+int main(void)
+{
+  static struct ai_convert c;
+  static const double ranges[][2] = 
+    { { -10.0, 10.0 }, { -5.0, 5.0 }, { -1.0, 1.0 }, { 0.0, 10.0 } };
+  static const unsigned int bits[] = { 12, 16, 24 };
+  unsigned int codes[SHD_MAX_CHANNELS], i, r, b, n = 0, code;
+  SampleStruct out[SHD_MAX_CHANNELS];
+  double want, worst = 0.0;
+  int bad = 0;
+
+  ai_convert_init(&c);
+  for (i = 0; i < SHD_MAX_CHANNELS; i++) 
+    if (c.chanspec[i] != AI_CONVERT_STALE) bad++;
+
+  /* one slot per range and bit depth */
+  for (b = 0; b < 3; b++)
+    for (r = 0; r < 4; r++)
+      ai_convert_set(&c, b * 4 + r, r, ranges[r][0], ranges[r][1], 
+                     (1U << bits[b]) - 1);
+  ai_convert_set_bad(&c, 12, 0, -99.0);
+
+  for (b = 0; b < 3; b++) {
+    unsigned int maxdata = (1U << bits[b]) - 1;
+    for (i = 0; i <= 4095; i++) { /* every 12 bit code, 0 and maxdata */
+      code = (unsigned int)((uint64)maxdata * i / 4095);
+      for (r = 0; r < 4; r++) {
+        want = test_to_phys(code, ranges[r][0], ranges[r][1], maxdata);
+        if (fabs(ai_convert_one(&c, b * 4 + r, code) - want) > worst)
+          worst = fabs(ai_convert_one(&c, b * 4 + r, code) - want);
+        n++;
+      }
+    }
+  }
+  if (worst > 1e-12) bad++;
+
+  /* the block version has to agree with the one at a time one exactly */
+  for (i = 0; i < SHD_MAX_CHANNELS; i++) codes[i] = (i * 2654435761U) >> 20;
+  ai_convert_scan(&c, codes, out, SHD_MAX_CHANNELS);
+  for (i = 0; i < SHD_MAX_CHANNELS; i++)
+    if (out[i].data != ai_convert_one(&c, i, codes[i])) bad++;
+  if (out[12].data != -99.0) bad++;
+
+  printf("ai_convert: %u codes checked, worst error %g V, %d problems\n",
+         n, worst, bad);
+  return bad ? 1 : 0;
+}
+#endif
+
+#endif
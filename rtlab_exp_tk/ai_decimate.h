@@ -0,0 +1,272 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  AI Decimate dot h
+  -----------------
+  Oversampling: each channel can be converted factor times per scan 
+  instead of once (see SharedMemStruct.ai_oversample), and those codes are
+  filtered back down to one sample per scan here, so that everything past
+  the acquisition still sees one sample per channel per scan.
+
+  The filter is a CIC (cascaded integrator-comb) decimator of order 1 to
+  AI_MAX_CIC_ORDER, all integer.  Order 1 is just the boxcar: the sum of 
+  the scan's factor codes.  Higher orders take in the neighbouring scans 
+  as well, for a steeper anti-alias rolloff at the price of a delay of
+  (order - 1) / 2 scans.  Either way what comes out is the codes' average
+  times factor^order, so it keeps the bits the averaging gained, and the 
+  caller divides that gain back out (ai_decimate_gain()) when it converts
+  to volts -- see ai_convert.h.
+
+  The integrators wrap, which a CIC filter doesn't mind as long as the 
+  output itself fits in 32 bits.  For codes of 16 bits or less it always
+  does; for bigger ones ai_decimate_set() lowers the order until it does.
+
+  Until an order N filter has seen N scans of a channel it puts out the
+  boxcar instead (scaled to the same gain), so that there is no startup
+  transient when a channel is turned on or its settings change.
+
+  Compile with -DTEST_AI_DECIMATE (make -f Makefile.sim check) for a 
+  self-checking test of the gain, the decimation and the warmup.
+*/
+#ifndef _AI_DECIMATE_H
+#define _AI_DECIMATE_H
+
+#include "shared_stuff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ai_decimate_slot {
+  unsigned int factor, order;            /* R and N                       */
+  unsigned int gain, boxcar_gain;        /* R^N and R^(N-1)               */
+  unsigned int warm;                     /* outputs since the last reset  */
+  unsigned int integ[AI_MAX_CIC_ORDER];  /* run at the conversion rate    */
+  unsigned int comb[AI_MAX_CIC_ORDER];   /* run at the scan rate          */
+  unsigned int last;                     /* integ[0] at the last output   */
+};
+
+/* one slot per position in a scan, or per channel id -- whatever the 
+   caller indexes by, like struct ai_convert */
+struct ai_decimate {
+  struct ai_decimate_slot slot[SHD_MAX_CHANNELS];
+};
+
+/* sets slot up for factor codes per scan and an order order filter, and
+   starts it over.  maxdata is the channel's, for the overflow check. */
+static inline void ai_decimate_set(struct ai_decimate *d, unsigned int slot,
+                                   unsigned int factor, unsigned int order,
+                                   unsigned int maxdata)
+{
+  struct ai_decimate_slot *s = &d->slot[slot];
+  unsigned long long top;
+  unsigned int i;
+
+  if (factor < 1) factor = 1;
+  if (factor > AI_MAX_OVERSAMPLE) factor = AI_MAX_OVERSAMPLE;
+  if (order < 1 || factor == 1) order = 1;
+  if (order > AI_MAX_CIC_ORDER) order = AI_MAX_CIC_ORDER;
+
+  for (;;) {
+    for (i = 0, top = (unsigned long long)maxdata + 1; i < order; i++) 
+      top *= factor;
+    if (top <= 0x100000000ULL || order == 1) break;
+    order--;
+  }
+
+  s->factor = factor;
+  s->order = order;
+  for (i = 0, s->boxcar_gain = 1; i + 1 < order; i++) s->boxcar_gain *= factor;
+  s->gain = s->boxcar_gain * factor;
+  s->warm = s->last = 0;
+  for (i = 0; i < AI_MAX_CIC_ORDER; i++) s->integ[i] = s->comb[i] = 0;
+}
+
+/* starts slot over, as it is set up -- for after a gap in its codes */
+static inline void ai_decimate_reset(struct ai_decimate *d, unsigned int slot)
+{
+  struct ai_decimate_slot *s = &d->slot[slot];
+  unsigned int i;
+
+  s->warm = s->last = 0;
+  for (i = 0; i < AI_MAX_CIC_ORDER; i++) s->integ[i] = s->comb[i] = 0;
+}
+
+static inline unsigned int ai_decimate_gain(const struct ai_decimate *d,
+                                            unsigned int slot)
+{
+  return d->slot[slot].gain;
+}
+
+/* one code into slot, in the order they were converted */
+static inline void ai_decimate_put(struct ai_decimate *d, unsigned int slot,
+                                   unsigned int code)
+{
+  struct ai_decimate_slot *s = &d->slot[slot];
+  unsigned int i;
+
+  s->integ[0] += code;
+  for (i = 1; i < s->order; i++) s->integ[i] += s->integ[i - 1];
+}
+
+/* slot's output for the scan, once all its codes are in, times 
+   ai_decimate_gain() */
+static inline unsigned int ai_decimate_get(struct ai_decimate *d, 
+                                           unsigned int slot)
+{
+  struct ai_decimate_slot *s = &d->slot[slot];
+  unsigned int i, y = s->integ[s->order - 1], prev, boxcar;
+
+  for (i = 0; i < s->order; i++) {
+    prev = s->comb[i];
+    s->comb[i] = y;
+    y -= prev;
+  }
+  boxcar = s->integ[0] - s->last;
+  s->last = s->integ[0];
+
+  if (s->warm + 1 < s->order) {
+    /* the filter hasn't filled up yet */
+    s->warm++;
+    return boxcar * s->boxcar_gain;
+  }
+  return y;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef TEST_AI_DECIMATE
+/*
+  Checks every factor and order against the CIC's impulse response done 
+  the slow way: the boxcar of factor taps convolved with itself order 
+  times, summed over the codes in 64 bits and sampled once per scan.  The
+  first order - 1 outputs after a set or a reset have to be the scan's 
+  boxcar times boxcar_gain instead.  Also a constant in gives exactly 
+  gain times it out, that 24 bit codes get their order lowered until 
+  maxdata * gain fits in 32 bits, and that full scale 24 bit codes, which 
+  wrap the integrators over and over, still come out right.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_SCANS 300
+
+static unsigned int test_codes[TEST_SCANS * AI_MAX_OVERSAMPLE];
+
+/* the order N response: taps[0 .. N * (R - 1)] */
+static unsigned int test_taps(unsigned long long *taps, unsigned int factor, 
+                              unsigned int order)
+{
+  unsigned long long tmp[AI_MAX_CIC_ORDER * AI_MAX_OVERSAMPLE];
+  unsigned int len = 1, i, j, k;
+
+  taps[0] = 1;
+  for (k = 0; k < order; k++) {
+    for (i = 0; i < len + factor - 1; i++) tmp[i] = 0;
+    for (i = 0; i < len; i++)
+      for (j = 0; j < factor; j++) tmp[i + j] += taps[i];
+    len += factor - 1;
+    for (i = 0; i < len; i++) taps[i] = tmp[i];
+  }
+  return len;
+}
+
+/* runs TEST_SCANS scans of test_codes through slot 0 as set up, resetting
+   it halfway, and returns the number of wrong outputs */
+static int test_run(struct ai_decimate *d, unsigned int maxdata)
+{
+  struct ai_decimate_slot *s = &d->slot[0];
+  unsigned long long taps[AI_MAX_CIC_ORDER * AI_MAX_OVERSAMPLE], want;
+  unsigned int R = s->factor, len = test_taps(taps, R, s->order);
+  unsigned int scan, start = 0, i, last, got;
+  int bad = 0;
+
+  if ((unsigned long long)maxdata * s->gain > 0xffffffffULL) bad++;
+  for (scan = 0; scan < TEST_SCANS; scan++) {
+    if (scan == TEST_SCANS / 2) {
+      ai_decimate_reset(d, 0);
+      start = scan;
+    }
+    for (i = 0; i < R; i++) ai_decimate_put(d, 0, test_codes[scan * R + i]);
+    got = ai_decimate_get(d, 0);
+
+    last = scan * R + R - 1;
+    want = 0;
+    if (scan - start + 1 < s->order)
+      for (i = 0; i < R; i++) 
+        want += (unsigned long long)test_codes[last - i] * s->boxcar_gain;
+    else
+      for (i = 0; i < len; i++)
+        want += taps[i] * test_codes[last - i];
+    if (got != want) bad++;
+  }
+  return bad;
+}
+
+int main(void)
+{
+  static struct ai_decimate d;
+  unsigned int R, N, i, n = 0, want_order, gain;
+  int bad = 0;
+
+  for (R = 1; R <= AI_MAX_OVERSAMPLE; R++)
+    for (N = 1; N <= AI_MAX_CIC_ORDER; N++) {
+      /* random 16 bit codes */
+      for (i = 0; i < TEST_SCANS * R; i++) 
+        test_codes[i] = (unsigned int)rand() & 0xffff;
+      ai_decimate_set(&d, 0, R, N, 0xffff);
+      if (d.slot[0].order != (R == 1 ? 1 : N)) bad++;
+      bad += test_run(&d, 0xffff);
+
+      /* a constant comes out times gain, warm or not */
+      ai_decimate_set(&d, 0, R, N, 0xffff);
+      for (gain = 1, i = 0; i < d.slot[0].order; i++) gain *= R;
+      if (ai_decimate_gain(&d, 0) != gain) bad++;
+      for (i = 0; i < TEST_SCANS * R; i++) test_codes[i] = 12345;
+      bad += test_run(&d, 0xffff);
+
+      /* full scale 24 bit codes, order lowered to fit */
+      ai_decimate_set(&d, 0, R, N, 0xffffff);
+      want_order = R == 1 ? 1 : N;
+      while (want_order > 1) {
+        unsigned long long top = 0x1000000ULL;
+        for (i = 0; i < want_order; i++) top *= R;
+        if (top <= 0x100000000ULL) break;
+        want_order--;
+      }
+      if (d.slot[0].order != want_order) bad++;
+      for (i = 0; i < TEST_SCANS * R; i++) 
+        test_codes[i] = i % 3 ? 0xffffff : (unsigned int)rand() & 0xffffff;
+      bad += test_run(&d, 0xffffff);
+      n += 3;
+    }
+
+  printf("ai_decimate: %u filters checked, %d problems\n", n, bad);
+  return bad ? 1 : 0;
+}
+#endif
+
+#endif
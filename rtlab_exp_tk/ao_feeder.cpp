@@ -0,0 +1,270 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <qobject.h>
+#include <comedilib.h>
+#include "ao_feeder.h"
+#include "dsdstream.h"
+
+/* how many scans we read from the file at a time */
+#define FEED_BLOCK_SCANS 1024
+
+AORingFeeder::AORingFeeder(const ShmController & s)
+  throw (ShmException, NoComediDeviceException)
+  : shm(s), ring(0), ring_bytes(0), dev(0), nds(0), raw(0), raw_cols(0),
+    at_eof(false), finished(false), n_put(0)
+{
+  char devfile[32];
+
+  Assert<ShmException>
+    (shm.aoRingSlots() && shm.type() != ShmController::NotSharedOrUnknown,
+     QObject::tr("No AO playback ring"),
+     QObject::tr("The loaded " RTLAB_MODULE_NAME " has no AO playback ring. "
+                 "It is either too old, or was loaded with ao_ring=0."));
+
+  ring_bytes = AO_RING_BYTES(shm.aoRingSlots(), shm.aoRingStride());
+  ring = reinterpret_cast<AORing *>
+    (ShmController::attachRegion(shm.type(), AO_RING_NAME, ring_bytes));
+
+  if (!ring || ring->magic != AO_RING_MAGIC
+      || ring->n_slots != shm.aoRingSlots()
+      || ring->stride != shm.aoRingStride()) {
+    ShmController::detachRegion(shm.type(), AO_RING_NAME, ring);
+    throw ShmException(QObject::tr("Could not attach to ") + AO_RING_NAME,
+                       QObject::tr("The AO playback ring exported by "
+                                   RTLAB_MODULE_NAME " could not be attached "
+                                   "to, or it does not look like an AO ring "
+                                   "of the size advertised in the shared "
+                                   "memory struct."));
+  }
+
+  /* only for the ranges -- rtlab.o does all the writing */
+  snprintf(devfile, sizeof(devfile), "/dev/comedi%d", shm.aoMinor());
+  dev = comedi_open(devfile);
+  if (!dev) {
+    ShmController::detachRegion(shm.type(), AO_RING_NAME, ring);
+    throw NoComediDeviceException
+      ("Could not open comedi device",
+       QString("comedi_open() failed on ") + devfile + ": "
+       + comedi_strerror(comedi_errno()));
+  }
+}
+
+AORingFeeder::~AORingFeeder()
+{
+  /* left alone, rtlab.o would sit there counting underruns forever */
+  if (ao_ring_busy(ring) && !finished) stop();
+  closeFile();
+  comedi_close(dev);
+  ShmController::detachRegion(shm.type(), AO_RING_NAME, ring);
+}
+
+void
+AORingFeeder::closeFile()
+{
+  delete nds; nds = 0;
+  if (raw) fclose(raw);
+  raw = 0;
+}
+
+void
+AORingFeeder::openNDS(const QString & file, const vector<uint> & c)
+  throw (FileException)
+{
+  closeFile();
+  cols = c;
+  nds = new DSDIStream(file);
+  if (!nds->isOpen()) {
+    closeFile();
+    throw FileNotFoundException("File not found", 
+                                QString("Could not open ") + file);
+  }
+}
+
+void
+AORingFeeder::openRaw(const QString & file, uint n_cols,
+                      const vector<uint> & c)
+  throw (FileException)
+{
+  closeFile();
+  for (uint i = 0; i < c.size(); i++)
+    Assert<FileException>(c[i] < n_cols, "Bad column",
+                          QString("Column %1 was asked for, but the file "
+                                  "only has %2.").arg(c[i]).arg(n_cols));
+  cols = c;
+  raw_cols = n_cols;
+  if ( !(raw = fopen(file.latin1(), "rb")) )
+    throw FileNotFoundException("File not found", 
+                                QString("Could not open ") + file + ": "
+                                + strerror(errno));
+}
+
+uint
+AORingFeeder::readScans(uint n) throw (FileException)
+{
+  uint n_cols = cols.size(), got;
+
+  volts.resize(n * n_cols);
+
+  for (got = 0; got < n; got++) {
+    if (nds) {
+      vector<SampleStruct> v;
+
+      if (!nds->readNextScan(v)) break;
+      /* channels that are off this scan keep their last value */
+      for (uint s = 0; s < v.size(); s++)
+        for (uint i = 0; i < n_cols; i++)
+          if (v[s].channel_id == cols[i]) last_volts[i] = v[s].data;
+    } else {
+      if (fread(&raw_scan[0], sizeof(double), raw_cols, raw) != raw_cols) {
+        Assert<FileException>(!ferror(raw), "Read error",
+                              "An error occurred reading the raw AO file.");
+        break;
+      }
+      for (uint i = 0; i < n_cols; i++) last_volts[i] = raw_scan[cols[i]];
+    }
+    for (uint i = 0; i < n_cols; i++) volts[got * n_cols + i] = last_volts[i];
+  }
+
+  if (got < n) at_eof = true;
+  return got;
+}
+
+void
+AORingFeeder::fill() throw (FileException)
+{
+  uint n_cols = cols.size(), space, n, i;
+
+  while (!at_eof && (space = ao_ring_space(ring))) {
+    n = readScans(space < FEED_BLOCK_SCANS ? space : FEED_BLOCK_SCANS);
+    codes.resize(n * n_cols);
+    /* comedi_from_phys(), minus the per-value range lookup */
+    for (i = 0; i < n * n_cols; i++) {
+      uint c = i % n_cols;
+      double d = (volts[i] - range_min[c]) / (range_max[c] - range_min[c])
+                 * maxdata[c] + 0.5;
+      codes[i] = (d < 0.0 ? 0 : (d > maxdata[c] ? uint(maxdata[c]) : uint(d)));
+    }
+    /* space only ever grows behind our back, so it all fits */
+    if (n) n_put += ao_ring_put(ring, &codes[0], n_cols, n);
+  }
+}
+
+bool
+AORingFeeder::waitForAck(volatile const uint *ack, uint req)
+{
+  struct timeval start, now;
+
+  /* rtlab.o picks requests up within a tick, so allow two ticks plus
+     plenty of slack for a loaded machine */
+  uint timeout_ms = 2000 + 2000 / (shm.samplingRateHz() ?
+                                   shm.samplingRateHz() : 1);
+
+  gettimeofday(&start, 0);
+  while (*ack != req) {
+    usleep(1000);
+    gettimeofday(&now, 0);
+    if ((now.tv_sec - start.tv_sec) * 1000
+        + (now.tv_usec - start.tv_usec) / 1000 > long(timeout_ms))
+      return false;
+  }
+  return true;
+}
+
+void
+AORingFeeder::start(const vector<uint> & chans, uint range, uint aref,
+                    scan_index_t start_scan, scan_index_t stop_scan)
+  throw (IllegalStateException, FileException)
+{
+  uint n_cols = cols.size(), i;
+
+  Assert<IllegalStateException>
+    (nds || raw, "No waveform", "AORingFeeder::start() was called before "
+     "a waveform file was opened.");
+  Assert<IllegalStateException>
+    (chans.size() == n_cols && n_cols && n_cols <= ring->stride,
+     "Wrong number of AO channels",
+     QString("There are %1 columns to play, on %2 AO channels, but there "
+             "must be one channel per column, and at most %3 of them.")
+     .arg(n_cols).arg(chans.size()).arg(ring->stride));
+  Assert<IllegalStateException>
+    (!ao_ring_busy(ring), "AO ring busy",
+     "The AO playback ring is already in use.  Stop it first.");
+
+  chanspecs.resize(n_cols);
+  range_min.resize(n_cols);
+  range_max.resize(n_cols);
+  maxdata.resize(n_cols);
+  last_volts.assign(n_cols, 0.0);
+  raw_scan.resize(raw_cols);
+  for (i = 0; i < n_cols; i++) {
+    comedi_range *r = comedi_get_range(dev, shm.aoSubdev(), chans[i], range);
+
+    Assert<IllegalStateException>
+      (r && r->max > r->min, "Bad AO channel or range",
+       QString("AO channel %1 doesn't exist or doesn't have range %2.")
+       .arg(chans[i]).arg(range));
+    chanspecs[i] = CR_PACK(chans[i], range, aref);
+    range_min[i] = r->min;
+    range_max[i] = r->max;
+    maxdata[i] = comedi_get_maxdata(dev, shm.aoSubdev(), chans[i]);
+  }
+
+  at_eof = finished = false;
+  n_put = 0;
+  ao_ring_begin(ring);
+  fill();
+  ao_ring_start(ring, &chanspecs[0], n_cols, start_scan, stop_scan);
+
+  Assert<IllegalStateException>
+    (waitForAck(&ring->start_ack, ring->start_req),
+     "No answer from " RTLAB_MODULE_NAME,
+     RTLAB_MODULE_NAME " didn't pick up the AO playback request.  Is its RT "
+     "loop running?");
+  Assert<IllegalStateException>
+    (ring->state != AO_RING_BADPARM, "Bad AO channel or range",
+     RTLAB_MODULE_NAME " refused the AO channels or range it was given.");
+
+  /* the whole file fit -- eof has to come after the start, which clears it */
+  if (at_eof) { ao_ring_finish(ring); finished = true; }
+}
+
+bool
+AORingFeeder::pump() throw (FileException)
+{
+  if (!ao_ring_busy(ring)) return false;
+
+  fill();
+  if (at_eof && !finished) { ao_ring_finish(ring); finished = true; }
+  return true;
+}
+
+void
+AORingFeeder::stop()
+{
+  ao_ring_stop(ring);
+  waitForAck(&ring->stop_ack, ring->stop_req);
+}
@@ -0,0 +1,125 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _AO_FEEDER_H
+#define _AO_FEEDER_H
+
+#include <vector>
+#include <stdio.h>
+#include <qstring.h>
+#include "ao_ring.h"
+#include "shm.h"
+#include "common.h"
+#include "exception.h"
+
+class DSDIStream;
+struct comedi_t_struct;
+
+/*
+   AORingFeeder --
+
+   Streams a waveform from disk into rtlab.o's AO playback ring (see
+   ao_ring.h), which rtlab.o plays out one scan per tick.  The waveform 
+   comes from either
+
+     - an NDS file: the samples of NDS channel cols[i] go to ao chans[i]
+       (a channel that is off in some scan holds its last value), or
+     - a raw file of native doubles, in volts, n_cols to a scan: column
+       cols[i] goes to ao chans[i]
+
+   and is played at rtlab.o's sampling rate, whatever rate it was 
+   recorded at.  Volts are converted to codes here with comedilib, for
+   the range given to start(), so rtlab.o only ever sees raw codes.
+
+   Call pump() often enough that the ring never runs dry -- the ring holds
+   ringSeconds() worth -- until it returns false.  Underruns (ticks that 
+   found the ring empty) are counted by rtlab.o, see underruns().
+*/
+class AORingFeeder
+{
+ public:
+  /* attaches to the ring of the rtlab.o that shm is attached to */
+  AORingFeeder(const ShmController & shm) 
+    throw (ShmException, NoComediDeviceException);
+  ~AORingFeeder();
+
+  /* pick the waveform to play, see above */
+  void openNDS(const QString & file, const vector<uint> & cols) 
+    throw (FileException);
+  void openRaw(const QString & file, uint n_cols, 
+               const vector<uint> & cols) 
+    throw (FileException);
+
+  /* Fills the ring and asks rtlab.o to play the waveform on the ao 
+     channels chans (as many as there are cols) at comedi range 'range',
+     starting with the tick whose scan index is start_scan (or right away,
+     if that's gone by) and stopping at stop_scan (never, if 0) or when 
+     the file ends.  Returns once rtlab.o has accepted, or throws if it
+     doesn't like the channels/range, or is already playing something. */
+  void start(const vector<uint> & chans, uint range, uint aref,
+             scan_index_t start_scan, scan_index_t stop_scan = 0) 
+    throw (IllegalStateException, FileException);
+
+  /* Tops up the ring from the file.  Returns false once playback is over
+     (or was never started), true if it's still waiting or playing. */
+  bool pump() throw (FileException);
+
+  /* stop playing right away, leaving the outputs where they are */
+  void stop();
+
+  int state() const { return ring->state; } /* an enum AORingState */
+  uint underruns() const { return ring->underruns; }
+  scan_index_t firstUnderrun() const { return ring->first_underrun; }
+  scan_index_t lastUnderrun() const { return ring->last_underrun; }
+  scan_index_t startedAt() const { return ring->started_at; }
+  uint64 scansPut() const { return n_put; }
+  double ringSeconds() const 
+    { return ring->n_slots / double(shm.samplingRateHz()); }
+
+ private:
+  void closeFile();
+  /* reads up to n scans into volts, returns how many */
+  uint readScans(uint n) throw (FileException);
+  /* puts as much of the file in the ring as will fit */
+  void fill() throw (FileException);
+  /* waits (a while) for rtlab.o to ack our last request */
+  bool waitForAck(volatile const uint *ack, uint req);
+
+  const ShmController & shm;
+  AORing *ring;
+  uint ring_bytes;
+  struct comedi_t_struct *dev;
+
+  vector<uint> cols, chanspecs;
+  vector<double> range_min, range_max, maxdata; /* for each column */
+  vector<double> volts, last_volts, raw_scan; /* volts is a block of 
+                                                 scans, see readScans() */
+  vector<uint> codes;
+
+  DSDIStream *nds;
+  FILE *raw;
+  uint raw_cols;
+  bool at_eof, finished;
+  uint64 n_put;
+};
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/* 
+   ao_play -- streams a waveform from an NDS or raw file out of rtlab.o's
+   analog outputs, through the AO playback ring (see ao_ring.h and 
+   ao_feeder.h).
+
+   rtlab.o writes one scan per tick, so the waveform plays at rtlab.o's 
+   sampling rate.  Prints progress and underruns (ticks on which the ring
+   was empty because we didn't keep up) as it goes.
+*/
+
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <comedi.h>
+
+#include "common.h"
+#include "exception.h"
+#include "shm.h"
+#include "ao_feeder.h"
+
+static volatile sig_atomic_t please_stop = 0;
+
+static void stopHandler(int sig) { (void)sig; please_stop = 1; }
+
+static void usage(const char *prog)
+{
+  cerr 
+    << "Usage: " << prog << " [options] FILE" << endl << endl
+    << "Plays FILE out of rtlab.o's analog outputs, one scan per RT tick."
+    << endl << endl
+    << "  -R NCOLS    FILE is raw native doubles (volts), NCOLS to a scan," 
+    << endl
+    << "              rather than an NDS file" << endl
+    << "  -C COLS     NDS channels (or raw columns) to play, eg 0,2" 
+    << " (default: 0)" << endl
+    << "  -o CHANS    AO channels to play them on, in the same order"
+    << " (default: 0,1,..)" << endl
+    << "  -g RANGE    comedi AO range index (default: 0)" << endl
+    << "  -a AREF     analog reference: ground, common, diff or other" << endl
+    << "  -s SCAN     start at scan index SCAN (default: a half second from"
+    << " now)" << endl
+    << "  -d SECS     start SECS seconds from now instead" << endl
+    << "  -e SCAN     stop at scan index SCAN (default: end of file)" << endl
+    << "  -i SECS     print progress every SECS seconds (default: 1)" << endl
+    << "  -h          this help" << endl;
+}
+
+/* parses "0-3,7" into a list of numbers, keeping the order given */
+static bool parseList(const char *str, vector<uint> & out)
+{
+  char *buf = strdup(str), *save = 0;
+  bool ok = true;
+
+  for (char *tok = strtok_r(buf, ",", &save); tok && ok; 
+       tok = strtok_r(0, ",", &save)) {
+    char *end;
+    long lo = strtol(tok, &end, 10), hi = lo;
+    
+    if (end == tok) ok = false;
+    else if (*end == '-') hi = strtol(end + 1, &end, 10);
+    if (*end || lo < 0 || hi < lo) ok = false;
+    for (long i = lo; ok && i <= hi; i++) out.push_back(i);
+  }
+  free(buf);
+  return ok && out.size();
+}
+
+static const char *stateName(int s)
+{
+  static const char *names[] = 
+    { "idle", "waiting", "playing", "done", "stopped", "bad channel/range" };
+  return (s >= 0 && s < int(sizeof(names) / sizeof(*names))) ? names[s] : "?";
+}
+
+int 
+main(int argc, char *argv[])
+{
+  const char *cols_arg = "0", *chans_arg = 0, *aref_arg = 0;
+  int raw_cols = 0, range = 0, opt;
+  double delay_secs = 0.5, stat_secs = 1.0;
+  scan_index_t start_scan = 0, stop_scan = 0;
+  bool have_start = false;
+
+  while ( (opt = getopt(argc, argv, "R:C:o:g:a:s:d:e:i:h")) != -1 ) {
+    switch (opt) {
+    case 'R': raw_cols = atoi(optarg); break;
+    case 'C': cols_arg = optarg; break;
+    case 'o': chans_arg = optarg; break;
+    case 'g': range = atoi(optarg); break;
+    case 'a': aref_arg = optarg; break;
+    case 's': start_scan = strtoull(optarg, 0, 10); have_start = true; break;
+    case 'd': delay_secs = atof(optarg); break;
+    case 'e': stop_scan = strtoull(optarg, 0, 10); break;
+    case 'i': stat_secs = atof(optarg); break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if (optind != argc - 1) { usage(argv[0]); return 1; }
+  if (stat_secs <= 0.0) stat_secs = 1.0;
+
+  vector<uint> cols, chans;
+  if (!parseList(cols_arg, cols) || (chans_arg && !parseList(chans_arg, chans)))
+    { usage(argv[0]); return 1; }
+  if (!chans_arg)
+    for (uint i = 0; i < cols.size(); i++) chans.push_back(i);
+
+  uint aref = AREF_GROUND;
+  if (aref_arg) {
+    static const char *arefs[] = { "ground", "common", "diff", "other" };
+    static const uint aref_vals[] = 
+      { AREF_GROUND, AREF_COMMON, AREF_DIFF, AREF_OTHER };
+    uint i;
+    for (i = 0; i < 4 && strcmp(aref_arg, arefs[i]); i++) 
+      ;
+    if (i == 4) { usage(argv[0]); return 1; }
+    aref = aref_vals[i];
+  }
+
+  ShmController *shmCtl = 0;
+  AORingFeeder *feeder = 0;
+  int retval = 0;
+
+  try {
+    shmCtl = new ShmControllerWithFifo;
+    feeder = new AORingFeeder(*shmCtl);
+
+    if (raw_cols > 0) feeder->openRaw(argv[optind], raw_cols, cols);
+    else feeder->openNDS(argv[optind], cols);
+
+    if (!have_start)
+      start_scan = shmCtl->scanIndex() 
+                   + scan_index_t(delay_secs * shmCtl->samplingRateHz());
+
+    signal(SIGINT, stopHandler);
+    signal(SIGTERM, stopHandler);
+    signal(SIGHUP, stopHandler);
+
+    feeder->start(chans, range, aref, start_scan, stop_scan);
+
+    cout << "Playing " << argv[optind] << " on " << chans.size() 
+         << " AO channel(s) at " << shmCtl->samplingRateHz() 
+         << "Hz from scan " << Convert(start_scan).cStr()
+         << " (ring holds " << feeder->ringSeconds() << "s)" << endl;
+
+    struct timeval last_stat, now;
+    gettimeofday(&last_stat, 0);
+
+    /* a quarter of the ring between top-ups is plenty of margin */
+    uint nap_us = uint(feeder->ringSeconds() * 250000.0);
+    if (nap_us > 100000) nap_us = 100000;
+    if (nap_us < 1000) nap_us = 1000;
+
+    while (!please_stop && feeder->pump()) {
+      usleep(nap_us);
+      gettimeofday(&now, 0);
+      if ((now.tv_sec - last_stat.tv_sec) 
+          + (now.tv_usec - last_stat.tv_usec) / 1e6 >= stat_secs) {
+        fprintf(stdout, "scan %llu  %s  put %llu  underruns %u\n",
+                static_cast<unsigned long long>(shmCtl->scanIndex()),
+                stateName(feeder->state()), 
+                static_cast<unsigned long long>(feeder->scansPut()),
+                feeder->underruns());
+        fflush(stdout);
+        last_stat = now;
+      }
+    }
+
+    if (please_stop) feeder->stop();
+
+    cout << "Done (" << stateName(feeder->state()) << ").  Put " 
+         << Convert(feeder->scansPut()).cStr() << " scans, "
+         << feeder->underruns() << " underruns";
+    if (feeder->underruns())
+      cout << " (scans " << Convert(feeder->firstUnderrun()).cStr() 
+           << " to " << Convert(feeder->lastUnderrun()).cStr() 
+           << ")";
+    cout << "." << endl;
+    if (feeder->underruns()) retval = 2;
+
+  } catch (Exception & e) {
+    e.errorReportingMode() = Exception::Console;
+    e.showError();
+    retval = 1;
+  }
+
+  delete feeder;
+  delete shmCtl;
+
+  return retval;
+}
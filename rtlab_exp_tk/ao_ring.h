@@ -0,0 +1,248 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  AO Ring dot h
+  -------------
+  A single-producer/single-consumer ring of analog output scans in shared
+  memory, for playing back long waveforms (a recorded ECG, say) that are
+  much too big to precompute into a stimulator table and far too fast to
+  send through rtlab_cmd or the control fifo one value at a time.
+
+  The producer is a userspace feeder (AORingFeeder, or rtlab_sim -p) that
+  streams scans in from a file.  The consumer is rtlab.o's playAORing(),
+  which writes one scan per tick -- one comedi_data_write() per channel.
+  In burst mode, where a tick covers several scan periods, it writes the
+  first of the tick's scans and skips over the rest, so the waveform 
+  still plays at the right speed but the outputs only change once a tick.
+  Each scan is 'stride' raw AO codes (lsampl_t's), of which the first 
+  n_chans are used.  The feeder does the volts -> code conversion so that
+  the RT side never has to.
+
+  To play something, the feeder:
+
+    1. waits for the ring to be idle (or asks for a stop and waits for it)
+    2. calls ao_ring_begin(), and puts the first scans in with ao_ring_put()
+    3. calls ao_ring_start() with the channels and the scan_index at which
+       playback should begin (and optionally the one at which it ends)
+    4. keeps the ring topped up with ao_ring_put(), and calls 
+       ao_ring_finish() after the last scan
+
+  Playback begins on the tick whose scan_index is start_scan (or the very
+  next tick, if that's already gone by) and ends when the data runs out 
+  after ao_ring_finish(), when stop_scan is reached, or on ao_ring_stop().
+  The outputs are left at the last value written, just like the DAC would.
+
+  If the feeder falls behind, the tick finds the ring empty, writes 
+  nothing (so the outputs hold) and counts an underrun.  Playback then 
+  carries on from where it was, so every underrun pushes the rest of the
+  waveform back a tick.  In burst mode a tick that finds fewer scans than
+  it covers plays what there is and counts an underrun too.  underruns,
+  first_underrun and last_underrun say how many and where.
+
+  Each side only ever writes its own half of the header, and the halves 
+  and the data are on separate cache lines.  Requests go from the feeder 
+  to rtlab.o by bumping start_req/stop_req; rtlab.o copies the request 
+  into start_ack/stop_ack once it has acted on it.
+*/
+#ifndef _AO_RING_H
+#define _AO_RING_H
+
+#include "sample_ring.h" /* for the barriers and sample_ring_pow2_floor() */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+# define AO_RING_NAME "DAQ System AO Ring" /* text ID for mbuff/rtai shm    */
+# define AO_RING_MAGIC 0x414f5247          /* 'AORG'                       */
+# define AO_RING_MAX_CHANS 16              /* most columns a scan can have  */
+# define AO_RING_ALIGNED __attribute__((aligned(SAMPLE_RING_CACHELINE)))
+
+enum AORingState {
+  AO_RING_IDLE = 0,  /* never started                                      */
+  AO_RING_WAITING,   /* started, but start_scan hasn't come yet            */
+  AO_RING_PLAYING,
+  AO_RING_DONE,      /* ran out of data after ao_ring_finish(), or hit 
+                        stop_scan                                          */
+  AO_RING_STOPPED,   /* stopped by ao_ring_stop()                          */
+  AO_RING_BADPARM    /* ao_ring_start() was given a channel or range that
+                        the AO subdevice doesn't have                      */
+};
+
+struct AORing {
+  /* set by rtlab.o at init time, read-only afterwards                      */
+  unsigned int magic;
+  unsigned int n_slots;             /* scans, always a power of 2           */
+  unsigned int stride;              /* codes per scan in buf                */
+
+  /* written by the feeder only                                             */
+  volatile unsigned int head AO_RING_ALIGNED; /* scans ever put, mod 2^32   */
+  volatile unsigned int start_req;  /* bumped by ao_ring_start()            */
+  volatile unsigned int stop_req;   /* bumped by ao_ring_stop()             */
+  volatile int eof;                 /* nothing more will come after head    */
+  unsigned int first;               /* position of the first scan to play   */
+  unsigned int n_chans;             /* columns in use, <= stride            */
+  unsigned int chanspec[AO_RING_MAX_CHANS]; /* CR_PACK(chan, range, aref) 
+                                               for each column              */
+  scan_index_t start_scan;          /* when to begin                        */
+  scan_index_t stop_scan;           /* when to end, 0 for never             */
+
+  /* written by rtlab.o only                                                */
+  volatile unsigned int tail AO_RING_ALIGNED; /* scans played, like head    */
+  volatile unsigned int start_ack;  
+  volatile unsigned int stop_ack;
+  volatile int state;               /* an enum AORingState                  */
+  volatile unsigned int underruns;  /* ticks that found the ring empty/short*/
+  volatile scan_index_t started_at; /* scan_index of the first scan played  */
+  volatile scan_index_t first_underrun, last_underrun; /* scan_index'es     */
+
+  unsigned int buf[1] AO_RING_ALIGNED; /* actually n_slots * stride lsampl_t
+                                          codes                             */
+};
+
+#ifndef __cplusplus
+typedef struct AORing AORing;
+#endif
+
+/* the number of bytes of shared memory to allocate */
+#define AO_RING_BYTES(n_slots, stride) \
+  ((unsigned long)(((struct AORing *)0)->buf) \
+   + (unsigned long)(n_slots) * (stride) * sizeof(unsigned int))
+
+/*---------------------------------------------------------------------------
+  rtlab.o's side
+---------------------------------------------------------------------------*/
+
+/* n_slots must be a power of 2, stride at most AO_RING_MAX_CHANS */
+static inline void ao_ring_init(struct AORing *r, unsigned int n_slots, 
+                                unsigned int stride)
+{
+  memset(r, 0, AO_RING_BYTES(0, 0));
+  r->n_slots = n_slots;
+  r->stride = stride;
+  r->state = AO_RING_IDLE;
+  SAMPLE_RING_WMB();
+  r->magic = AO_RING_MAGIC;
+}
+
+/*---------------------------------------------------------------------------
+  The feeder's side
+---------------------------------------------------------------------------*/
+
+/* true while rtlab.o has yet to pick up the last ao_ring_start() or 
+   ao_ring_stop(), or is waiting for or playing a waveform */
+static inline int ao_ring_busy(const struct AORing *r)
+{
+  return r->start_req != r->start_ack || r->stop_req != r->stop_ack
+         || r->state == AO_RING_WAITING || r->state == AO_RING_PLAYING;
+}
+
+/* Marks the start of a new waveform: the next scan put is the first one
+   the next ao_ring_start() will play.  Don't call while ao_ring_busy(). */
+static inline void ao_ring_begin(struct AORing *r)
+{
+  r->first = r->head;
+}
+
+/* How many scans ao_ring_put() has room for.  Until rtlab.o has picked up
+   the ao_ring_start(), everything from 'first' on is still unplayed. */
+static inline unsigned int ao_ring_space(const struct AORing *r)
+{
+  unsigned int tail = r->first;
+
+  if (r->start_ack == r->start_req 
+      && (r->state == AO_RING_WAITING || r->state == AO_RING_PLAYING)) {
+    SAMPLE_RING_RMB();
+    tail = r->tail;
+  }
+  return r->n_slots - (r->head - tail);
+}
+
+/* Appends up to n scans of n_chans codes each (which need not be the 
+   ring's stride) and returns how many fit, see ao_ring_space() */
+static inline unsigned int ao_ring_put(struct AORing *r, 
+                                       const unsigned int *scans, 
+                                       unsigned int n_chans, unsigned int n)
+{
+  unsigned int space = ao_ring_space(r), head = r->head, i;
+  unsigned int mask = r->n_slots - 1;
+
+  if (n > space) n = space;
+  if (n_chans > r->stride) n_chans = r->stride;
+  for (i = 0; i < n; i++, scans += n_chans) 
+    memcpy(r->buf + ((head + i) & mask) * r->stride, scans, 
+           n_chans * sizeof(unsigned int));
+
+  /* the scans must be visible before the new head is */
+  SAMPLE_RING_WMB();
+  r->head = head + n;
+  return n;
+}
+
+/* Asks rtlab.o to play what was put since ao_ring_begin() (and whatever
+   comes after) on the n_chans AO channels given as 
+   CR_PACK(chan, range, aref), from start_scan until stop_scan, or until
+   the data runs out if stop_scan is 0.  Check state afterwards, once
+   start_ack has caught up: AO_RING_BADPARM means a chanspec was no good.
+   Don't call while ao_ring_busy(). */
+static inline void ao_ring_start(struct AORing *r, 
+                                 const unsigned int *chanspec, 
+                                 unsigned int n_chans,
+                                 scan_index_t start_scan, 
+                                 scan_index_t stop_scan)
+{
+  unsigned int i;
+
+  if (n_chans > AO_RING_MAX_CHANS) n_chans = AO_RING_MAX_CHANS;
+  if (n_chans > r->stride) n_chans = r->stride;
+  r->n_chans = n_chans;
+  for (i = 0; i < n_chans; i++) r->chanspec[i] = chanspec[i];
+  r->start_scan = start_scan;
+  r->stop_scan = stop_scan;
+  r->eof = 0;
+  /* everything above must be visible before the request is */
+  SAMPLE_RING_WMB();
+  r->start_req++;
+}
+
+/* no more scans will be put, so stop (without an underrun) once the ones
+   already there have been played */
+static inline void ao_ring_finish(struct AORing *r)
+{
+  /* the final head must be visible before eof is */
+  SAMPLE_RING_WMB();
+  r->eof = 1;
+}
+
+/* stop playing now, leaving the outputs where they are */
+static inline void ao_ring_stop(struct AORing *r)
+{
+  r->stop_req++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,6 +20,7 @@
  * Boston, MA 02111-1307, USA, or go to their website at
  * http://www.gnu.org.
  */
+#ifdef __KERNEL__
 #include <linux/module.h> 
 #include <linux/kernel.h>
 #include <linux/init.h>
@@ -29,6 +30,7 @@
 #include <linux/string.h>
 
 #include <linux/comedilib.h>
+#endif
 
 #include "rt_process.h"
 #include "rtos_middleman.h"
@@ -480,7 +482,8 @@ int apd_control_init (void)
   for (i=0; i<NumAPDs; i++) memcpy(&apd_state[i],&default_apd_state,sizeof(struct APDState));
   for (i=0; i<NumAOchannels; i++) memcpy(&stim_state[i],&default_stim_state,sizeof(struct StimState));
 
-  if ((retval = rtp_register_function(do_apd_control_stuff))
+  if ((retval = rtp_require_fp("apd_control"))
+      || (retval = rtp_register_function(do_apd_control_stuff))
       || (retval = init_shared_mem())
       || (retval = rtp_find_free_rtf(&shm->fifo_minor, MC_FIFO_SZ))
       || (retval = init_ao_chan()) 
@@ -20,6 +20,7 @@
  * Boston, MA 02111-1307, USA, or go to their website at
  * http://www.gnu.org.
  */
+#ifdef __KERNEL__
 #include <linux/module.h> 
 #include <linux/kernel.h>
 #include <linux/init.h>
@@ -30,6 +31,7 @@
 #include <linux/proc_fs.h>
 
 #include <linux/comedilib.h>
+#endif
 
 #include "rt_process.h"
 #include "rtos_middleman.h"
@@ -164,6 +166,9 @@ int avn_stim_init (void)
     return -ETIME;
   }
 
+  /* calc_rr() and calc_stim() are all floating point */
+  if ( (retval = rtp_require_fp("avn_stim")) )  return retval;
+
   if ( (retval = rtp_register_function(do_avn_control_stuff))
        || (retval = init_shared_mem())
        || (retval = rtp_find_free_rtf(&shm->fifo_minor, AVN_FIFO_SZ))
@@ -328,7 +333,14 @@ static void calc_rr()
     NEXT_SAVED;
     
     /* save rr interval in milliseconds */
+#ifdef RTLAB_FIXED_POINT
+    /* rtlab.o only keeps it in scans, 24.8 fixed point */
+    RRI_CURR = RRI_SAVED = 
+      round(spike_info.period_fx[shm->spike_channel] * 1000.0 
+            / ((double)SPIKE_PERIOD_FX_ONE * rtp_shm->sampling_rate_hz));
+#else
     RRI_CURR = RRI_SAVED = round(spike_info.period[shm->spike_channel]);   
+#endif
 }
 
 static void calc_stim(void)
@@ -0,0 +1,111 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <stdio.h>
+#include <qstring.h>
+#include "codes_source.h"
+
+SampleStructCodesSource::SampleStructCodesSource(SampleStructSource *i, 
+                                                 const ShmController & s)
+  throw (NoComediDeviceException)
+  : in(i), shm(s)
+{
+  char devfile[32];
+  uint b;
+
+  ai_convert_init(&convert);
+
+  for (b = 0; b < shm.numAIBoards(); b++) {
+    comedi_t *dev;
+
+    snprintf(devfile, sizeof(devfile), "/dev/comedi%d", shm.aiBoard(b).minor);
+    if ( !(dev = comedi_open(devfile)) ) {
+      QString err = QString("comedi_open() failed on ") + devfile + ": "
+                    + comedi_strerror(comedi_errno());
+
+      for (b = 0; b < devs.size(); b++) comedi_close(devs[b]);
+      delete in;
+      throw NoComediDeviceException("Could not open comedi device", err);
+    }
+    devs.push_back(dev);
+  }
+}
+
+SampleStructCodesSource::~SampleStructCodesSource()
+{
+  for (uint b = 0; b < devs.size(); b++) comedi_close(devs[b]);
+  delete in;
+}
+
+/* the same conversion rtlab.o would have done, see set_ai_convert() in 
+   rt_process.c */
+void
+SampleStructCodesSource::setRange(uint chan, uint range)
+{
+  uint chanspec = CR_PACK(chan, range, 0);
+
+  for (uint b = 0; b < devs.size(); b++) {
+    const AIBoardInfo & info = shm.aiBoard(b);
+    comedi_range *r;
+
+    if (chan < info.first_chan || chan >= info.first_chan + info.n_chans) 
+      continue;
+    r = comedi_get_range(devs[b], info.subdev, chan - info.first_chan, range);
+    if (!r) break;
+    double scale = (r->unit == UNIT_mA ? 0.001 : 1.0);
+    ai_convert_set(&convert, chan, chanspec, r->min * scale, r->max * scale,
+                   comedi_get_maxdata(devs[b], info.subdev, 
+                                      chan - info.first_chan));
+    return;
+  }
+  ai_convert_set_bad(&convert, chan, chanspec, -666666.66);
+}
+
+const SampleStruct *
+SampleStructCodesSource::read(int b_time)
+{
+  const SampleStruct *s = in->read(b_time);
+  uint i, n = in->numSamplesLastRead(), c;
+  /* spike_period_fx is in 1/SPIKE_PERIOD_FX_ONEths of a scan */
+  const double ms_per_fx = 1000.0 
+    / (SPIKE_PERIOD_FX_ONE * (shm.samplingRateHz() ? shm.samplingRateHz() : 1));
+  SampleStruct *out;
+
+  num_bytes_last_read = n * sizeof(SampleStruct);
+  if (num_bytes_last_read > read_memory_sz) {
+    if (read_memory) delete read_memory;
+    read_memory_sz = num_bytes_last_read;
+    read_memory = (SampleStruct *)new char[read_memory_sz];
+  }
+
+  for (i = 0, out = read_memory; i < n; i++, out++) {
+    *out = s[i];
+    c = out->channel_id;
+    if (convert.chanspec[c] != CR_PACK(c, out->range, 0)) 
+      setRange(c, out->range);
+    out->data = convert.offset[c] 
+      + convert.gain[c] * out->code / (double)out->code_gain;
+    if (out->spike) out->spike_period = out->spike_period_fx * ms_per_fx;
+  }
+
+  return read_memory;
+}
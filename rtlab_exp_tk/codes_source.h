@@ -0,0 +1,71 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _CODES_SOURCE_H
+#define _CODES_SOURCE_H
+
+#include <vector>
+#include <comedilib.h>
+#include "sample_source.h"
+#include "ai_convert.h"
+#include "exception.h"
+#include "shm.h"
+
+/*
+   SampleStructCodesSource --
+
+   A fixed point rtlab.o (see SharedMemStruct.ai_fixed_point) puts out 
+   SampleStructs with just the ADC codes in them, and spike periods in
+   scans.  This wraps the source that reads those and fills in .data 
+   (volts) and .spike_period (ms) the way any other rtlab.o would have, 
+   so that nothing downstream can tell the difference.  The ranges are 
+   looked up with comedilib, on the AI boards listed in the shm.
+
+   It hands out a copy, so whatever in read straight out of (the AI ring,
+   say) is free again as soon as read() returns.
+*/
+class SampleStructCodesSource : public SampleStructSource
+{
+ public:
+  /* Takes ownership of in, and deletes it even if this throws.  shm is 
+     rtlab.o's, and has to outlive us. */
+  SampleStructCodesSource(SampleStructSource *in, const ShmController & shm)
+    throw (NoComediDeviceException);
+
+  virtual ~SampleStructCodesSource();
+
+  virtual size_t numBytesReady() const { return in->numBytesReady(); }
+  virtual int numSamplesReady() const { return in->numSamplesReady(); }
+  virtual const SampleStruct * read(int b_time = -1);
+  virtual void flush() { in->flush(); }
+  virtual int suggestPollWaitTime() const { return in->suggestPollWaitTime(); }
+
+ private:
+  void setRange(uint chan, uint range);
+
+  SampleStructSource *in;
+  const ShmController & shm;
+  vector<comedi_t *> devs; /* one per AI board */
+  struct ai_convert convert; /* indexed by channel id */
+};
+
+#endif
@@ -23,11 +23,15 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h> 
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <iostream>
 
 #include <comedilib.h>
 
@@ -37,11 +41,31 @@
 #undef SHARED_MEM_STRUCT_SUBCLASS
 
 #include "comedi_coprocess.h"
+#include "ai_convert.h"
 #include "exception.h"
 #include "comedi_device.h"
 #include "probe.h"
+#include "rtlab_defaults.h"
+
+/* how much stack the acquisition thread touches up front so that it never
+   page faults on its stack in the loop */
+static const int PREFAULT_STACK_BYTES = 64 * 1024;
+static volatile char prefault_sink;
+
+static inline void timespec_add_ns(struct timespec & ts, int64 ns)
+{
+  ns += ts.tv_nsec;
+  ts.tv_sec += ns / BILLION;
+  ts.tv_nsec = ns % BILLION;
+}
 
-static inline void microsleep(long time_us);
+/* a - b, in ns */
+static inline int64 timespec_diff_ns(const struct timespec & a, 
+                                     const struct timespec & b)
+{
+  return static_cast<int64>(a.tv_sec - b.tv_sec) * BILLION 
+         + (a.tv_nsec - b.tv_nsec);
+}
 
 ComediCoprocess::ComediCoprocess() { init(Probe::probeDevices()[0]); }
 ComediCoprocess::ComediCoprocess(const ComediDevice & d) { init(d); }
@@ -51,6 +75,13 @@ void ComediCoprocess::init(const ComediDevice & d)
 
   device = d,  ai_dev = 0,   ao_dev = 0, 
   thread = 0, sample_buffer = 0, sbuf_i = 0; /* i hope pthread_t is an int! */
+  ai_ring = 0;
+
+  rt_priority = 0, rt_cpu = -1, rt_lock_memory = false;
+  overrun_policy = CatchUp, max_catch_up = 10;
+  n_overruns = n_skipped = 0;
+  n_backlog = 0, backlog_overruns = backlog_skipped = 0;
+  pthread_mutex_init(&stats_lock, 0);
 
   Assert<SystemResourceException>
     (!::pipe(pipe), "INTERNAL ERROR: Could not create pipe.",
@@ -74,14 +105,17 @@ void ComediCoprocess::init(const ComediDevice & d)
   ai_fifo_minor = pipe[0]; /* cheap hack */
 
   ao_fifo_minor = -1;
+  ai_ring_slots = 0;
   /* num AI channels in use */
-  n_ai_chans = aiSubDev.n_channels; 
+  n_ai_chans = (aiSubDev.n_channels > SHD_MAX_CHANNELS 
+                ? SHD_MAX_CHANNELS : aiSubDev.n_channels); 
   n_ao_chans = aoSubDev.n_channels;
   sampling_rate_hz = INITIAL_SAMPLING_RATE_HZ;
   scan_index = 0;
 
   /* initialize the spike_params member */
   init_spike_params(&spike_params);
+  spike_detect_init(&spikes);
   
   for (uint i = 0; i < n_ai_chans || i < n_ao_chans; i++) { 
     /* set channel parameters */   
@@ -99,6 +133,8 @@ void ComediCoprocess::init(const ComediDevice & d)
 
   sample_buffer = new SampleStruct[sample_buffer_size];
 
+  initRing();
+
   ao_dev = ai_dev = comedi_open(device.filename);
 
     /* nothing */
@@ -111,6 +147,84 @@ ComediCoprocess::~ComediCoprocess()
   if (ai_dev != ao_dev) comedi_close(ao_dev);
   close(pipe[0]); close(pipe[1]);
   if (sample_buffer) { delete sample_buffer; sample_buffer = 0; }
+  if (ai_ring) { shmdt(ai_ring); ai_ring = 0; }
+  pthread_mutex_destroy(&stats_lock);
+}
+
+/* 
+   Sized like rtlab.o sizes its ring: DEFAULT_FIFO_SECS worth of samples 
+   at the current rate, rounded down to a power of 2, and capped at 
+   DEFAULT_MAX_RING bytes the way rtlab.o caps it at max_ring.  It's a 
+   private SysV segment so that it would survive a fork(), and it's marked
+   for removal right away so that it never outlives us.
+*/
+void ComediCoprocess::initRing()
+{
+  uint n = sample_ring_pow2_floor(DEFAULT_FIFO_SECS * sampling_rate_hz 
+                                  * n_ai_chans);
+  uint max_n = sample_ring_pow2_floor( (DEFAULT_MAX_RING 
+                                        - SAMPLE_RING_BYTES(0)) 
+                                       / sizeof(SampleStruct) );
+
+  if (n > max_n) n = max_n;
+  if (!n) return;
+
+  int shmid = shmget(IPC_PRIVATE, SAMPLE_RING_BYTES(n), IPC_CREAT | 0600);
+  void *addr = (shmid < 0 ? reinterpret_cast<void *>(-1) : shmat(shmid, 0, 0));
+
+  if (shmid >= 0) shmctl(shmid, IPC_RMID, 0);
+
+  if (addr == reinterpret_cast<void *>(-1)) {
+    cerr << "ComediCoprocess: could not allocate a " << n << " sample ring ("
+         << strerror(errno) << "), falling back to a pipe." << endl;
+    return;
+  }
+
+  ai_ring = reinterpret_cast<SampleRing *>(addr);
+  sample_ring_init(ai_ring, n);
+  ai_ring_slots = n;
+}
+
+void ComediCoprocess::setRealtime(int prio, int cpu, bool lock_memory)
+{
+  rt_priority = prio, rt_cpu = cpu, rt_lock_memory = lock_memory;
+}
+
+void ComediCoprocess::setOverrunPolicy(OverrunPolicy p, uint max_cu)
+{
+  overrun_policy = p, max_catch_up = max_cu;
+}
+
+LatencyHistogram ComediCoprocess::jitterHistogram() const
+{
+  pthread_mutex_lock(&stats_lock);
+  LatencyHistogram ret(jitter);
+  pthread_mutex_unlock(&stats_lock);
+  return ret;
+}
+
+scan_index_t ComediCoprocess::numOverruns() const
+{
+  pthread_mutex_lock(&stats_lock);
+  scan_index_t ret = n_overruns;
+  pthread_mutex_unlock(&stats_lock);
+  return ret;
+}
+
+scan_index_t ComediCoprocess::numScansSkipped() const
+{
+  pthread_mutex_lock(&stats_lock);
+  scan_index_t ret = n_skipped;
+  pthread_mutex_unlock(&stats_lock);
+  return ret;
+}
+
+void ComediCoprocess::resetStats()
+{
+  pthread_mutex_lock(&stats_lock);
+  jitter.reset();
+  n_overruns = n_skipped = 0;
+  pthread_mutex_unlock(&stats_lock);
 }
 
 
@@ -126,9 +240,35 @@ void ComediCoprocess::start()
   stop(); /* kill any already-running threads */
 
   //comedi_lock(ai_dev, device.find(ComediSubDevice::AnalogInput).id);
-  int err = 
-    pthread_create(&thread, 0, pthread_friendly_threadLoop_wrapper, 
-                   reinterpret_cast<void *>(this));
+
+  if (rt_lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+    cerr << "ComediCoprocess: mlockall() failed (" << strerror(errno) 
+         << "), continuing with unlocked memory." << endl;
+
+  int err = EPERM;
+
+  if (rt_priority > 0) {
+    pthread_attr_t attr;
+    struct sched_param sp;
+
+    sp.sched_priority = rt_priority;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &sp);
+    err = pthread_create(&thread, &attr, pthread_friendly_threadLoop_wrapper,
+                         reinterpret_cast<void *>(this));
+    pthread_attr_destroy(&attr);
+
+    if (err == EPERM || err == EINVAL)
+      cerr << "ComediCoprocess: could not run SCHED_FIFO at priority " 
+           << rt_priority << " (" << strerror(err) 
+           << "), continuing with normal scheduling." << endl;
+  }
+
+  if (err == EPERM || err == EINVAL)
+    err = pthread_create(&thread, 0, pthread_friendly_threadLoop_wrapper, 
+                         reinterpret_cast<void *>(this));
   
   Assert<SystemResourceException>
     (!err, 
@@ -148,12 +288,35 @@ void ComediCoprocess::stop()
 }
 
 
+void
+ComediCoprocess::applyThreadRealtime()
+{
+#ifdef CPU_SET
+  if (rt_cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(rt_cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+      cerr << "ComediCoprocess: could not pin to cpu " << rt_cpu << " (" 
+           << strerror(err) << "), continuing unpinned." << endl;
+  }
+#endif
+
+  /* touch the stack we are going to use so it's all faulted in (and locked,
+     if mlockall() worked) before we start */
+  char stack[PREFAULT_STACK_BYTES];
+  memset(stack, 0, sizeof(stack));
+  prefault_sink = stack[PREFAULT_STACK_BYTES - 1]; /* keeps the memset live */
+}
+
 void 
 ComediCoprocess::threadLoop()
 {
-  struct timeval loop_begin, loop_end;
-  long looptime_us = 0, period_us = 0;
+  struct timespec next, now;
+  int64 period_ns, behind_ns;
   uint chan;
+  int scan_start;
   static const uint max_insns = 9; /* for some reason, comedi barfs if doing
                                       more than 9 insns at a time */
   comedi_insn insn[max_insns];
@@ -161,26 +324,34 @@ ComediCoprocess::threadLoop()
   lsampl_t databuf[max_insns];
   vector<comedi_range> ranges = device.find(ComediSubDevice::AnalogInput).ranges();
   lsampl_t maxdata = device.find(ComediSubDevice::AnalogInput).maxData();
+  struct ai_convert convert; /* indexed by channel id */
 
+  ai_convert_init(&convert);
   insn_list.insns = insn;
 
-  while(1) {
-    gettimeofday(&loop_begin, 0);
+  applyThreadRealtime();
 
+  /* the schedule is absolute: each deadline is the previous deadline plus
+     one period, so sleep/wakeup latency doesn't accumulate into drift */
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while(1) {
     pthread_testcancel();        
    
-    for (chan = 0; chan < n_ai_chans; ) {
+    scan_start = sbuf_i;
+
+    for (chan = next_chan_on(0, ai_chans_in_use, n_ai_chans); 
+         chan < n_ai_chans; ) {
 
       for (insn_list.n_insns = 0; chan < n_ai_chans 
-                                  && insn_list.n_insns < max_insns; chan++) {
-        if (is_chan_on(chan, ai_chans_in_use)) {
-          insn[insn_list.n_insns].insn = INSN_READ;
-          insn[insn_list.n_insns].n = 1;
-          insn[insn_list.n_insns].data = databuf + insn_list.n_insns;
-          insn[insn_list.n_insns].subdev = ai_subdev;
-          insn[insn_list.n_insns].chanspec = ai_chan[chan]; 
-          insn_list.n_insns++;
-        }      
+                                  && insn_list.n_insns < max_insns; 
+           chan = next_chan_on(chan + 1, ai_chans_in_use, n_ai_chans)) {
+        insn[insn_list.n_insns].insn = INSN_READ;
+        insn[insn_list.n_insns].n = 1;
+        insn[insn_list.n_insns].data = databuf + insn_list.n_insns;
+        insn[insn_list.n_insns].subdev = ai_subdev;
+        insn[insn_list.n_insns].chanspec = ai_chan[chan]; 
+        insn_list.n_insns++;
       }
       
       if (insn_list.n_insns) 
@@ -192,44 +363,84 @@ ComediCoprocess::threadLoop()
         
         sample.scan_index = scan_index;
         sample.channel_id = CR_CHAN(insn[i].chanspec);
-        comedi_range r = ranges[CR_RANGE(insn[i].chanspec)];
-        sample.data = comedi_to_phys(databuf[i], &r, maxdata);
-        sample.spike = 0; // hack for now
+        if (convert.chanspec[sample.channel_id] != insn[i].chanspec) {
+          /* gain changed, or first time round */
+          const comedi_range & r = ranges[CR_RANGE(insn[i].chanspec)];
+          ai_convert_set(&convert, sample.channel_id, insn[i].chanspec,
+                         r.min, r.max, maxdata);
+        }
+        sample.data = ai_convert_one(&convert, sample.channel_id, databuf[i]);
+        sample.spike = 0;
         sample.spike_period = 0;
       }
 
     }
 
-    flushBuffer();
+    /* same spike detection as rtlab.o, timed by our (absolute) schedule */
+    spike_detect_scan(&spikes, &spike_params, sample_buffer + scan_start, 
+                      sbuf_i - scan_start, 
+                      static_cast<int64>(next.tv_sec) * BILLION + next.tv_nsec,
+                      0, BILLION / sampling_rate_hz);
+
+    if (ai_ring) {
+      sample_ring_put(ai_ring, sample_buffer, sbuf_i);
+      sbuf_i = 0;
+    } else 
+      flushBuffer();
 
     scan_index++;
 
-    period_us = 1000000 / sampling_rate_hz;
+    period_ns = BILLION / sampling_rate_hz;
+    timespec_add_ns(next, period_ns);
 
-    gettimeofday(&loop_end, 0);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    behind_ns = timespec_diff_ns(now, next);
 
-    looptime_us =  (loop_end.tv_sec * 1000000 + loop_end.tv_usec) - 
-                   (loop_begin.tv_sec * 1000000 + loop_begin.tv_usec);
-    
-    if (period_us > looptime_us) microsleep(period_us - looptime_us);
+    if (behind_ns > 0) {
+      /* overrun: we're already late for the next period */
+      scan_index_t missed = behind_ns / period_ns;
+      bool skip = missed && (overrun_policy == Skip || missed > max_catch_up);
+      
+      if (skip) {
+        scan_index += missed;
+        timespec_add_ns(next, missed * period_ns);
+      }
+
+      backlog_overruns++;
+      if (skip) backlog_skipped += missed;
+
+      /* CatchUp, or less than a period behind: don't sleep at all */
+    } else {
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 0) 
+             == EINTR) 
+        ;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    behind_ns = timespec_diff_ns(now, next);
+
+    /* if the backlog is full, a reader has had the lock for 
+       STATS_BACKLOG periods and this one goes uncounted */
+    if (n_backlog < STATS_BACKLOG) 
+      backlog_us[n_backlog++] = behind_ns > 0 ? behind_ns / 1000 : 0;
+    postStats();
   }
 
 }
 
-/* busy sleep */
-inline void microsleep(long time_us)
+/* Called from threadLoop() only.  It must never wait on a lower priority
+   thread that has stats_lock, so it doesn't wait at all: if the lock is 
+   taken, the backlog just waits for the next period. */
+void ComediCoprocess::postStats()
 {
-  struct timeval begin_tv, now_tv;
-  long long int now, begin, time = time_us;
+  if (pthread_mutex_trylock(&stats_lock)) return;
 
-  gettimeofday(&begin_tv, 0);
-  begin = begin_tv.tv_sec * 1000000; begin += begin_tv.tv_usec;
-  
-  do {
-    gettimeofday(&now_tv, 0);
-    now  = now_tv.tv_sec * 1000000; now += now_tv.tv_usec;
-  } while ( (now - begin) <= time);
-  
+  for (uint i = 0; i < n_backlog; i++) jitter.add(backlog_us[i]);
+  n_overruns += backlog_overruns;
+  n_skipped += backlog_skipped;
+  pthread_mutex_unlock(&stats_lock);
+
+  n_backlog = 0, backlog_overruns = backlog_skipped = 0;
 }
 
 
@@ -256,6 +467,7 @@ void ComediCoprocess::flushBuffer()
 #include <string>
 #include "probe.h"
 #include "shm.h"
+#include "ring_source.h"
 
 bool stop = false;
 
@@ -264,6 +476,7 @@ void sig(int)
   stop = true;
 }
 
+/* usage: test_comedi_coprocess [n_chans [rt_priority [cpu [skip]]]] */
 int main(int argc, char *argv[])
 {
   int n_chans = 0;
@@ -271,9 +484,13 @@ int main(int argc, char *argv[])
   signal(SIGINT, sig);
 
   ComediCoprocess cc;
-  ShmController sc(&cc);
+  ShmControllerLocal sc(&cc);
 
   if (argc > 1) n_chans = QString(argv[1]).toInt();
+  if (argc > 2) cc.setRealtime(QString(argv[2]).toInt(), 
+                               argc > 3 ? QString(argv[3]).toInt() : -1);
+  if (argc > 4 && QString(argv[4]) == "skip") 
+    cc.setOverrunPolicy(ComediCoprocess::Skip);
 
   if ( n_chans <= 0 || n_chans > sc.numChannels(ComediSubDevice::AnalogInput) )
     n_chans = sc.numChannels(ComediSubDevice::AnalogInput);
@@ -286,15 +503,16 @@ int main(int argc, char *argv[])
        << "Hz... (press ctrl-c to end)" << endl;
   cc.start();
 
-  int n_read, ss_size = sc.samplingRateHz();
   scan_index_t sample_ct = 0, startIndex = 0, endIndex = 0;
   bool gotStartIndex = false;
-  
-  SampleStruct ss[ss_size];
+  SampleStructSource *src;
 
-  while ( (n_read = read(cc.fifoFd(), ss, sizeof(SampleStruct) * ss_size)) > -1 
-          && !stop) {
-    int n_samps = n_read / sizeof(SampleStruct);
+  if (cc.ring()) src = new SampleStructRingSource(cc.ring());
+  else           src = new SampleStructFIFOSource(cc.fifoFd());
+
+  while (!stop) {
+    const SampleStruct *ss = src->read(1);
+    int n_samps = src->numSamplesLastRead();
 
     //cout << "---------------" << endl;
     for (int i = 0; i < n_samps; i++, sample_ct++) {
@@ -313,5 +531,19 @@ int main(int argc, char *argv[])
   cerr << "Read: " << sample_ct << " samples, " 
        << uint64_to_cstr(endIndex - startIndex + 1ULL) << " scans." << endl;
   cerr << "Skipped: " << uint64_to_cstr(n_skipped) << " samples." << endl;
+
+  cc.stop();
+  delete src;
+
+  LatencyHistogram j = cc.jitterHistogram();
+  cerr << "Wakeup jitter (us) over " << uint64_to_cstr(j.count()) 
+       << " periods: mean " << j.mean() 
+       << "  p50 " << uint64_to_cstr(j.percentile(0.5))
+       << "  p99 " << uint64_to_cstr(j.percentile(0.99))
+       << "  p99.9 " << uint64_to_cstr(j.percentile(0.999))
+       << "  max " << uint64_to_cstr(j.max()) << endl;
+  cerr << "Overruns: " << uint64_to_cstr(cc.numOverruns()) 
+       << " periods, scans skipped by the pacer: " 
+       << uint64_to_cstr(cc.numScansSkipped()) << endl;
 }
 #endif
@@ -23,8 +23,12 @@
 #ifndef _COMEDI_COPROCESS_H
 #define _COMEDI_COPROCESS_H
 
+#include <pthread.h>
 #include "comedi_device.h"
 #include "shared_stuff.h"
+#include "sample_ring.h"
+#include "spike_detect.h"
+#include "pipeline_stats.h" /* for LatencyHistogram */
 
 
 /* 
@@ -46,6 +50,20 @@
    to determine if it shuld create this class and start() it or if it should
    attempt to attach to rt_process via the ShmController's utility method 
    attach().
+
+   Pacing: scans are done on an absolute CLOCK_MONOTONIC schedule
+   (clock_nanosleep() with TIMER_ABSTIME), so there is no busy waiting, 
+   no drift and wall-clock changes don't affect us.  How late each period
+   actually started goes into jitterHistogram().  The loop only ever 
+   trylocks the statistics, so reading or resetting them can't hold it up
+   (see postStats()).  If we fall behind, the
+   OverrunPolicy decides whether to run the missed periods back-to-back
+   or to skip them.  Skipped periods still advance scan_index, so readers
+   see them as dropped samples.
+
+   Samples go into a SampleRing (see sample_ring.h), one put per scan --
+   read them with a SampleStructRingSource on ring().  The pipe (fifoFd())
+   is only used if the ring could not be allocated.
 */
    
 class ComediCoprocess : public SharedMemStruct
@@ -57,6 +75,28 @@ class ComediCoprocess : public SharedMemStruct
   void start();
   void stop();
   int fifoFd() { return ai_fifo_minor; /* ai_fifo_minor == pipe[0] */ }
+  SampleRing *ring() { return ai_ring; } /* NULL if we fell back to pipe */
+
+  /* Real-time knobs, these take effect at the next start().
+     rt_priority > 0 runs the acquisition thread SCHED_FIFO at that 
+     priority, cpu >= 0 pins it to that cpu, and lock_memory mlockall()'s
+     the process.  All of these need privileges -- if we don't have them
+     we print a warning and carry on without. */
+  void setRealtime(int rt_priority, int cpu = -1, bool lock_memory = true);
+
+  enum OverrunPolicy {
+    CatchUp, /* missed periods are run back-to-back until we're on schedule
+                again, unless we are more than max_catch_up periods behind,
+                in which case they are skipped */
+    Skip     /* missed periods are always skipped */
+  };
+  void setOverrunPolicy(OverrunPolicy p, uint max_catch_up = 10);
+
+  /* Statistics, safe to call while running */
+  LatencyHistogram jitterHistogram() const; /* wakeup lateness, in us */
+  scan_index_t numOverruns() const; /* periods that started late */
+  scan_index_t numScansSkipped() const;
+  void resetStats();
 
  private:
   void init (const ComediDevice & d);
@@ -65,6 +105,11 @@ class ComediCoprocess : public SharedMemStruct
                          while(1) ! */
 
   void flushBuffer(); /* attempts to flush sample_buffer to pipe[1] */
+  void postStats(); /* moves the backlog below into the stats, if it can */
+  void initRing();
+
+  void applyThreadRealtime(); /* affinity, stack prefault -- called from 
+                                 the thread itself */
 
   /* The below simply does: 
      reinterpret_cast<ComediCoprocess *>(arg)->threadLoop();
@@ -80,6 +125,26 @@ class ComediCoprocess : public SharedMemStruct
   int sample_buffer_size;  
   SampleStruct *sample_buffer;
   int sbuf_i; /* index into next free pos in sample_buffer */
+
+  SampleRing *ai_ring; /* SysV shm, already IPC_RMID'ed */
+
+  struct spike_info spikes; /* spike detector state, see spike_detect.h */
+
+  int rt_priority, rt_cpu;
+  bool rt_lock_memory;
+  OverrunPolicy overrun_policy;
+  uint max_catch_up;
+
+  mutable pthread_mutex_t stats_lock;
+  LatencyHistogram jitter;
+  scan_index_t n_overruns, n_skipped;
+
+  /* what threadLoop() has for the above and hasn't got stats_lock for 
+     yet -- only the thread touches these */
+  enum { STATS_BACKLOG = 256 };
+  uint64 backlog_us[STATS_BACKLOG];
+  uint n_backlog;
+  scan_index_t backlog_overruns, backlog_skipped;
 };
 
 
@@ -0,0 +1,498 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <comedilib.h>
+
+#include "common.h"
+#include "exception.h"
+#include "comedi_source.h"
+
+SampleStructComediSource::SampleStructComediSource(const ComediDevice & d)
+  : device(d), dev(0), subdev(-1), lsampl(false), bytes_per_sample(0),
+    running_rate(0), running(false), map(0), map_sz(0), buf_pos(0), 
+    scan_bytes(0), scans_lost(0)
+{
+  const ComediSubDevice & ai = device.find(ComediSubDevice::AnalogInput);
+
+  Assert<NoComediDeviceException>
+    (!ai.isNull(), "No Analog Input Subdevice", 
+     QString("The comedi device ") + device.filename + 
+     " doesn't seem to have an analog input subdevice!");
+
+  subdev = ai.id;
+  dev = comedi_open(device.filename.latin1());
+
+  Assert<NoComediDeviceException>
+    (dev != 0, "Could not open comedi device", 
+     QString("comedi_open() failed on ") + device.filename + ": " 
+     + comedi_strerror(comedi_errno()));
+  
+  int flags = comedi_get_subdevice_flags(dev, subdev);
+
+  if (flags < 0 || !(flags & SDF_CMD) 
+      || comedi_get_read_subdevice(dev) != subdev) {
+    comedi_close(dev); dev = 0;
+    throw SampleDeviceException 
+      ("Comedi commands not supported", 
+       QString("The analog input subdevice of ") + device.filename + 
+       " does not support comedi commands (asynchronous acquisition).  Try "
+       "using the rtlab.o kernel module instead.");
+  }
+
+  lsampl = flags & SDF_LSAMPL;
+  bytes_per_sample = (lsampl ? sizeof(lsampl_t) : sizeof(sampl_t));
+  
+  memset(running_mask, 0, sizeof(running_mask));
+  memset(running_chans, 0, sizeof(running_chans));
+  last_read_time.tv_sec = last_read_time.tv_usec = 0;
+
+  initConfig();
+  mapBuffer();
+}
+
+SampleStructComediSource::~SampleStructComediSource()
+{
+  stopCommand();
+  unmapBuffer();
+  if (dev) comedi_close(dev);
+  dev = 0;
+}
+
+/* 
+   Just like ComediCoprocess::init(), we initialize the 'shm' to look like
+   a freshly loaded rtlab.o would.  
+*/
+void
+SampleStructComediSource::initConfig()
+{
+  const ComediSubDevice & ai = device.find(ComediSubDevice::AnalogInput),
+                        & ao = device.find(ComediSubDevice::AnalogOutput);
+
+  config.struct_version = SHD_SHM_STRUCT_VERSION;
+  config.ai_minor = config.ao_minor = device.minor;
+  config.ai_subdev = ai.id;
+  config.ao_subdev = (ao.isNull() ? -1 : ao.id);
+  config.ai_fifo_minor = comedi_fileno(dev); /* cheap hack */
+  config.ao_fifo_minor = config.control_fifo = config.reply_fifo = -1;
+  config.ai_ring_slots = 0;
+  config.n_ai_chans = (ai.n_channels > SHD_MAX_CHANNELS 
+                       ? SHD_MAX_CHANNELS : ai.n_channels);
+  config.n_ao_chans = (ao.isNull() ? 0 : ao.n_channels);
+  config.sampling_rate_hz = INITIAL_SAMPLING_RATE_HZ;
+  config.nanos_per_scan = BILLION / config.sampling_rate_hz;
+  config.scan_index = 0;
+  config.attached_pid = getpid();
+  config.jitter_ns = 0;
+  config.time_ms = config.time_us = 0;
+
+  init_spike_params(&config.spike_params);
+  spike_detect_init(&spikes);
+  spike_clock = 0;
+
+  for (uint i = 0; i < SHD_MAX_CHANNELS; i++) {
+    config.ai_chan[i] = CR_PACK(i, INITIAL_CHANNEL_GAIN, AREF_GROUND);
+    config.ao_chan[i] = CR_PACK(i, 0, AREF_GROUND);
+    set_chan(i, config.ai_chans_in_use, 0);
+    set_chan(i, config.ao_chans_in_use, 0);
+  }
+}
+
+bool
+SampleStructComediSource::configChanged() const
+{
+  if (config.sampling_rate_hz != running_rate) return true;
+  
+  for (uint i = 0; i < CHAN_MASK_BYTES(config.n_ai_chans); i++) 
+    if (config.ai_chans_in_use[i] != running_mask[i]) return true;
+
+  for (uint i = 0; i < config.n_ai_chans; i++)
+    if (config.ai_chan[i] != running_chans[i]) return true;
+
+  return false;
+}
+
+void
+SampleStructComediSource::mapBuffer()
+{
+  int sz = comedi_get_buffer_size(dev, subdev);
+
+  Assert<SampleDeviceException>
+    (sz > 0, "Comedi buffer error", 
+     QString("Could not determine the size of the comedi buffer for ") 
+     + device.filename + ": " + comedi_strerror(comedi_errno()));
+  
+  map_sz = sz;
+  map = reinterpret_cast<char *>(mmap(0, map_sz, PROT_READ, MAP_SHARED, 
+                                      comedi_fileno(dev), 0));
+  if (map == MAP_FAILED) {
+    map = 0;
+    throw SampleDeviceException("Comedi buffer error",
+                                QString("Could not mmap() the comedi buffer "
+                                        "for ") + device.filename + ": " 
+                                + strerror(errno));
+  }
+}
+
+void
+SampleStructComediSource::unmapBuffer()
+{
+  if (map) munmap(map, map_sz);
+  map = 0;
+}
+
+void
+SampleStructComediSource::stopCommand()
+{
+  if (running) comedi_cancel(dev, subdev);
+  running = false;
+}
+
+void
+SampleStructComediSource::startCommand()
+{
+  stopCommand();
+
+  /* remember what we are building the command from, so we can tell 
+     when it goes stale */
+  running_rate = config.sampling_rate_hz;
+  for (uint i = 0; i < CHAN_MASK_BYTES(config.n_ai_chans); i++) 
+    running_mask[i] = config.ai_chans_in_use[i];
+  for (uint i = 0; i < config.n_ai_chans; i++)
+    running_chans[i] = config.ai_chan[i];
+
+  chanlist.clear(); chan_ids.clear(); gain.clear(); offset.clear();
+
+  for (uint i = next_chan_on(0, config.ai_chans_in_use, config.n_ai_chans); 
+       i < config.n_ai_chans; 
+       i = next_chan_on(i + 1, config.ai_chans_in_use, config.n_ai_chans)) {
+    comedi_range *r = comedi_get_range(dev, subdev, i, 
+                                       CR_RANGE(config.ai_chan[i]));
+    lsampl_t maxdata = comedi_get_maxdata(dev, subdev, i);
+
+    Assert<SampleDeviceException>
+      (r && maxdata, "Comedi range error", 
+       QString("Could not get the range/maxdata for channel ") 
+       + QString::number(i) + " of " + device.filename);
+
+    chanlist.push_back(static_cast<uint>(config.ai_chan[i]));
+    chan_ids.push_back(i);
+    gain.push_back((r->max - r->min) / static_cast<double>(maxdata));
+    offset.push_back(r->min);
+  }
+
+  /* nothing to acquire.. */
+  if (!chanlist.size()) return;
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.subdev = subdev;
+  cmd.flags = 0;
+  cmd.start_src = TRIG_NOW;
+  cmd.start_arg = 0;
+  cmd.scan_begin_src = TRIG_TIMER;
+  cmd.scan_begin_arg = BILLION / config.sampling_rate_hz;
+  cmd.convert_src = TRIG_TIMER;
+  cmd.convert_arg = 0; /* as fast as possible, command_test rounds it up */
+  cmd.scan_end_src = TRIG_COUNT;
+  cmd.scan_end_arg = chanlist.size();
+  cmd.stop_src = TRIG_NONE;
+  cmd.stop_arg = 0;
+  cmd.chanlist = &chanlist[0];
+  cmd.chanlist_len = chanlist.size();
+
+  /* comedi_command_test() fixes up the arguments the first time around, so 
+     call it twice, the second one should succeed */
+  int ret = comedi_command_test(dev, &cmd);
+  if (ret >= 0 && ret != 1 && ret != 2) ret = comedi_command_test(dev, &cmd);
+
+  Assert<SampleDeviceException>
+    (ret == 0, "Comedi command rejected", 
+     QString("The driver for ") + device.filename + " rejected a timed "
+     "acquisition command for " + QString::number(chanlist.size()) + 
+     " channels at " + QString::number(config.sampling_rate_hz) + "Hz "
+     "(comedi_command_test() returned " + QString::number(ret) + ").");
+
+  /* the board may not be able to hit our rate exactly.. */
+  if (cmd.scan_begin_arg != BILLION / config.sampling_rate_hz) 
+    running_rate = config.sampling_rate_hz = BILLION / cmd.scan_begin_arg;
+  config.nanos_per_scan = cmd.scan_begin_arg;
+
+  Assert<SampleDeviceException>
+    (comedi_command(dev, &cmd) >= 0, "Comedi command failed",
+     QString("comedi_command() failed on ") + device.filename + ": " 
+     + comedi_strerror(comedi_errno()));
+
+  scan_bytes = chanlist.size() * bytes_per_sample;
+  buf_pos = comedi_get_buffer_offset(dev, subdev) % map_sz;
+  running = true;
+  gettimeofday(&last_read_time, 0);
+}
+
+uint
+SampleStructComediSource::scansReady() const
+{
+  if (!running) return 0;
+
+  comedi_poll(dev, subdev); /* ask the driver to move DMA'd data over */
+  
+  int n = comedi_get_buffer_contents(dev, subdev);
+
+  return (n > 0 ? n / scan_bytes : 0);
+}
+
+size_t 
+SampleStructComediSource::numBytesReady() const
+{
+  return numSamplesReady() * SAMPLE_SOURCE_BLOCK_SZ_BYTES;
+}
+
+int 
+SampleStructComediSource::numSamplesReady() const
+{
+  return scansReady() * chanlist.size();
+}
+
+int
+SampleStructComediSource::suggestPollWaitTime() const
+{
+  if (!running) return DESIRED_FIFO_FEEL_MS;
+
+  /* don't let the comedi buffer get more than 1/4 full */
+  uint buf_ms = 
+    static_cast<uint>((map_sz / scan_bytes) * 1000.0 / config.sampling_rate_hz);
+  uint ret = buf_ms / 4;
+  
+  if (ret > DESIRED_FIFO_FEEL_MS) ret = DESIRED_FIFO_FEEL_MS;
+  if (!ret) ret = 1;
+  return ret;
+}
+
+/* 
+   The conversion kernel.  Walks the ring in contiguous runs (the buffer
+   wraps around at map_sz, but never in the middle of a sample since 
+   map_sz is always a multiple of the page size), with the sampl_t/lsampl_t 
+   test hoisted out of the inner loop.
+*/
+uint
+SampleStructComediSource::convertScans(uint n_scans)
+{
+  const uint n_chans = chanlist.size(), n_samps = n_scans * n_chans,
+             bytes = n_samps * bytes_per_sample;
+  const double *g = &gain[0], *o = &offset[0];
+  uint pos = buf_pos, c = 0, s = 0;
+  scan_index_t si = config.scan_index;
+
+  if (n_samps * sizeof(SampleStruct) > read_memory_sz) {
+    if (read_memory) delete read_memory;
+    read_memory_sz = n_samps * sizeof(SampleStruct);
+    read_memory = (SampleStruct *)new char[read_memory_sz];
+  }
+
+  SampleStruct *out = read_memory;
+  
+  while (s < n_samps) {
+    uint run = (map_sz - pos) / bytes_per_sample;
+
+    if (run > n_samps - s) run = n_samps - s;
+
+    if (lsampl) {
+      const lsampl_t *in = reinterpret_cast<const lsampl_t *>(map + pos);
+      for (uint i = 0; i < run; i++, out++) {
+        out->channel_id = chan_ids[c];
+        out->scan_index = si;
+        out->data = o[c] + g[c] * in[i];
+        out->spike = 0;
+        out->spike_period = 0.0;
+        out->magic_number = SAMPLE_STRUCT_MAGIC;
+        if (++c == n_chans) { c = 0; si++; }
+      }
+    } else {
+      const sampl_t *in = reinterpret_cast<const sampl_t *>(map + pos);
+      for (uint i = 0; i < run; i++, out++) {
+        out->channel_id = chan_ids[c];
+        out->scan_index = si;
+        out->data = o[c] + g[c] * in[i];
+        out->spike = 0;
+        out->spike_period = 0.0;
+        out->magic_number = SAMPLE_STRUCT_MAGIC;
+        if (++c == n_chans) { c = 0; si++; }
+      }
+    }
+
+    s += run;
+    pos = (pos + run * bytes_per_sample) % map_sz;
+  }
+
+  /* spike detection, a scan at a time.  The board's clock is the time 
+     base, so the conversions within a scan are taken as simultaneous */
+  for (out = read_memory; n_scans--; out += n_chans) {
+    spike_detect_scan(&spikes, &config.spike_params, out, n_chans, 
+                      spike_clock, 0, config.nanos_per_scan);
+    spike_clock += config.nanos_per_scan;
+  }
+
+  config.scan_index = si;
+  buf_pos = pos;
+  return bytes;
+}
+
+const SampleStruct *
+SampleStructComediSource::read(int b_time)
+{
+  if (configChanged()) startCommand();
+
+  num_bytes_last_read = 0;
+
+  if (!running) return read_memory;
+
+  uint n_scans = scansReady();
+
+  if (!n_scans && b_time) {
+    struct timeval tv;
+    fd_set rfds;
+    int fd = comedi_fileno(dev);
+
+    tv.tv_sec = b_time; tv.tv_usec = 0;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    select(fd+1, &rfds, 0, 0, (b_time < 0 ? 0 : &tv));
+    n_scans = scansReady();
+  }
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  if (!n_scans) {
+    if (!(comedi_get_subdevice_flags(dev, subdev) & SDF_RUNNING)) {
+      /* The command died, most likely because we were too slow and the
+         comedi buffer overflowed.  Estimate how many scans went by 
+         since our last successful read and skip the scan index ahead
+         accordingly so that SampleStructReader counts them as dropped. */
+      double elapsed = (now.tv_sec - last_read_time.tv_sec) 
+        + (now.tv_usec - last_read_time.tv_usec) / static_cast<double>(MILLION);
+      scan_index_t lost = static_cast<scan_index_t>(elapsed * config.sampling_rate_hz);
+
+      scans_lost += lost;
+      config.scan_index += lost;
+      startCommand();
+    }
+    return read_memory;
+  }
+
+  uint bytes = convertScans(n_scans);
+
+  comedi_mark_buffer_read(dev, subdev, bytes);
+  last_read_time = now;
+  num_bytes_last_read = n_scans * chanlist.size() * sizeof(SampleStruct);
+
+  return read_memory;
+}
+
+void
+SampleStructComediSource::flush()
+{
+  if (configChanged()) startCommand();
+
+  uint n_scans = scansReady();
+
+  if (n_scans) {
+    comedi_mark_buffer_read(dev, subdev, n_scans * scan_bytes);
+    buf_pos = (buf_pos + n_scans * scan_bytes) % map_sz;
+    config.scan_index += n_scans;
+  }
+  num_bytes_last_read = 0;
+}
+
+
+#ifdef TEST_COMEDI_SOURCE
+/* 
+   Standalone throughput test.  Best run against the comedi_test driver:
+
+     comedi_config /dev/comedi0 comedi_test
+     ./comedi_source_test /dev/comedi0 [rate_hz] [n_chans] [seconds]
+*/
+#include <iostream>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include "probe.h"
+#include "shm.h"
+#include "sample_reader.h"
+
+int main (int argc, char *argv[])
+{
+  const char *fname = (argc > 1 ? argv[1] : "/dev/comedi0");
+  uint rate = (argc > 2 ? atoi(argv[2]) : 1000), 
+       n_chans = (argc > 3 ? atoi(argv[3]) : 2),
+       secs = (argc > 4 ? atoi(argv[4]) : 10);
+
+  try {
+    vector<ComediDevice> devs = Probe::probeDevices();
+    ComediDevice d;
+    for (uint i = 0; i < devs.size(); i++) 
+      if (devs[i].filename == fname) d = devs[i];
+    if (d.isNull()) { cerr << fname << ": not found by probe" << endl; return 1; }
+
+    SampleStructComediSource source(d);
+    ShmControllerLocal shmCtl(source.shm());
+    SampleStructReader reader(&source, 0);
+    
+    shmCtl.setSamplingRateHz(rate);
+    for (uint i = 0; i < n_chans && i < shmCtl.numChannels(COMEDI_SUBD_AI); i++) 
+      shmCtl.setChannel(COMEDI_SUBD_AI, i, true);
+
+    struct timeval start, now;
+    gettimeofday(&start, 0);
+    now = start;
+
+    while (static_cast<uint>(now.tv_sec - start.tv_sec) < secs) {
+      reader.readAll();
+      usleep(source.suggestPollWaitTime() * 1000);
+      gettimeofday(&now, 0);
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double elapsed = (now.tv_sec - start.tv_sec) 
+                     + (now.tv_usec - start.tv_usec) / 1e6,
+           cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec 
+                 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+
+    cout << "Rate: " << shmCtl.samplingRateHz() << "Hz, " 
+         << shmCtl.numChannelsInUse(COMEDI_SUBD_AI) << " channels" << endl
+         << "Read: " << reader.numRead() << " samples ("
+         << (reader.numRead() / elapsed) << " samples/s)" << endl
+         << "Dropped: " << reader.numDropped() << " samples, " 
+         << source.numScansLost() << " scans lost to buffer overflow" << endl
+         << "CPU: " << cpu << "s (" << (100.0 * cpu / elapsed) << "%)" << endl;
+  } catch (Exception & e) {
+    e.showConsoleError();
+    return 1;
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,129 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _COMEDI_SOURCE_H
+#define _COMEDI_SOURCE_H
+
+#include <sys/time.h>
+#include <vector>
+#include <comedilib.h>
+#include "sample_source.h"
+#include "comedi_device.h"
+#include "shared_stuff.h"
+#include "spike_detect.h"
+
+/*
+   SampleStructComediSource --
+
+   A SampleStructSource that reads directly from a comedi board in 
+   userspace, without rtlab.o.  Acquisition is hardware-timed via a 
+   comedi command (TRIG_TIMER scan_begin at the sampling rate), and samples
+   are pulled out of comedi's mmap'ed asynchronous buffer in whole blocks
+   using comedi_get_buffer_contents() and comedi_mark_buffer_read(), so 
+   there is no per-sample syscall like there is with the ComediCoprocess.
+
+   This class owns a private SharedMemStruct that acts as its 'control
+   panel'.  Wrap it in a ShmControllerLocal (see shm.h) to turn channels
+   on/off, change ranges, or change the sampling rate.  Changes are noticed
+   on the next read(), at which point the comedi command is cancelled and
+   re-issued with the new channel list.
+
+   Spike detection is the same as rtlab.o's (see spike_detect.h), driven
+   by config.spike_params, with times taken from the board's scan clock.
+*/
+class SampleStructComediSource : public SampleStructSource
+{
+ public:
+  SampleStructComediSource(const ComediDevice & dev); /* throws
+                                                         NoComediDeviceException
+                                                         SampleDeviceException
+                                                      */
+  virtual ~SampleStructComediSource();
+
+  virtual size_t numBytesReady() const; 
+  virtual int numSamplesReady() const; 
+  virtual const SampleStruct * read(int b_time = -1); /* b_time is in 
+                                                         seconds, like 
+                                                         SampleStructFileSource */
+  virtual void flush(); /* discards everything in the comedi buffer */
+
+  virtual int suggestPollWaitTime() const;
+
+  /* the control panel for this source -- wrap it in a ShmControllerLocal */
+  SharedMemStruct *shm() { return &config; }
+
+  /* number of scans we lost because the comedi buffer overflowed 
+     and the command had to be restarted */
+  scan_index_t numScansLost() const { return scans_lost; }
+
+ private:
+  void initConfig();
+  bool configChanged() const;
+  void startCommand(); /* (re)starts acquisition from config, throws */
+  void stopCommand();
+  void mapBuffer();
+  void unmapBuffer();
+  
+  /* number of whole scans sitting in the comedi buffer */
+  uint scansReady() const;
+
+  /* converts n_scans whole scans starting at the current buffer read 
+     offset into read_memory. returns number of bytes consumed from the
+     comedi buffer */
+  uint convertScans(uint n_scans);
+
+  ComediDevice device;
+  comedi_t *dev;
+  int subdev;
+  bool lsampl; /* true if the subdevice uses lsampl_t (SDF_LSAMPL) */
+  uint bytes_per_sample;
+
+  SharedMemStruct config;
+
+  /* copies of the parts of config that were used to build the running 
+     command -- used by configChanged() */
+  char running_mask[CHAN_MASK_SIZE];
+  unsigned int running_chans[SHD_MAX_CHANNELS];
+  uint running_rate;
+  
+  bool running;
+  comedi_cmd cmd;
+  vector<unsigned int> chanlist; /* must outlive cmd */
+  vector<uint> chan_ids; /* chanlist index -> channel id */
+  
+  /* per-chanlist-entry linear conversion: volts = offset + gain * sample,
+     precomputed from the comedi_range and maxdata at command start */
+  vector<double> gain, offset;
+
+  char *map;    /* comedi's async buffer, mmap'ed */
+  uint map_sz;
+  uint buf_pos; /* our read offset into map, always mod map_sz */
+  uint scan_bytes; /* bytes per full scan */
+
+  struct timeval last_read_time;
+  scan_index_t scans_lost;
+
+  struct spike_info spikes; /* spike detector state */
+  int64 spike_clock; /* nanos, advances by nanos_per_scan every scan */
+};
+
+#endif
@@ -346,7 +346,12 @@ ConfigurationWindow::toSettings()
   
   { 
     DAQSettings::InputSource is = DAQSettings::File;
-    if (deviceRadio.isChecked()) {
+    if (deviceRadio.isChecked() 
+        && settings.getInputSource() == DAQSettings::Synthetic) {
+      /* there's no UI for this, it can only be set in the config file,
+         so leave it alone */
+      is = DAQSettings::Synthetic;
+    } else if (deviceRadio.isChecked()) {
       is = ( selectedDevice().find(ComediSubDevice::AnalogInput)
              .used_by_rt_process /* <-- we assume that find() didn't return 
                                     a null comedi subdevice here! */
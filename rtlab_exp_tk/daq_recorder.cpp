@@ -0,0 +1,356 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/* 
+   daq_recorder -- headless (no GUI, no X) recording.
+
+   Sets up the same acquisition pipeline as DAQSystem's ReaderLoop (see
+   source_factory.h), minus the graphs, and just shovels every sample into
+   the sample writer as fast as it comes in.  Periodically prints throughput
+   and drop statistics to stdout.
+
+   Configuration comes from a daq_system settings file (the user's 
+   ~/.daq_system one by default), optionally overridden on the command
+   line.  The settings file is never written to.
+*/
+
+#include <iostream>
+#include <set>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <math.h>
+
+#include "common.h"
+#include "exception.h"
+#include "daq_settings.h"
+#include "probe.h"
+#include "shm.h"
+#include "sample_source.h"
+#include "sample_reader.h"
+#include "sample_writer.h"
+#include "source_factory.h"
+#include "pipeline_stats.h"
+
+static volatile sig_atomic_t please_stop = 0;
+
+static void stopHandler(int sig) { (void)sig; please_stop = 1; }
+
+static void usage(const char *prog)
+{
+  cerr 
+    << "Usage: " << prog << " [options]" << endl << endl
+    << "Records samples to disk without the DAQ System GUI.  Settings are "
+       "taken from the" << endl
+    << "DAQ System config file unless overridden below." << endl << endl
+    << "  -f FILE     read settings from FILE instead of the default" << endl
+    << "  -s SOURCE   input source: comedi, rtprocess, or synthetic" << endl
+    << "  -d DEVICE   comedi device file, eg /dev/comedi0" << endl
+    << "  -r HZ       sampling rate in Hz" << endl
+    << "  -c CHANS    channels to record, eg 0-3,7 (default: the channels" 
+    << endl
+    << "              that were open the last time DAQ System ran)" << endl
+    << "  -g RANGE    comedi range index to use for all channels" << endl
+    << "  -a AREF     analog reference: ground, common, diff or other" << endl
+    << "  -F FORMAT   output format: nds or ascii" << endl
+    << "  -o FILE     output file" << endl
+    << "  -S SPEC     synthetic source spec (see synth_source.h)" << endl
+    << "  -t SECS     stop after SECS seconds (default: until interrupted)" 
+    << endl
+    << "  -i SECS     print statistics every SECS seconds (default: 5)" << endl
+    << "  -L FILE     dump pipeline latency/drop statistics to FILE every" 
+    << endl
+    << "              statistics interval and at exit" << endl
+    << "  -R          print rtlab.o's RT loop timing statistics and exit" 
+    << endl
+    << "  -h          this help" << endl;
+}
+
+/* -R: attaches to rtlab.o's shared memory the same way ShmController
+   does, and prints rtLoopReport().  Returns the exit status */
+static int dumpRTLoopStats()
+{
+  static const ShmController::ShmType types[] = 
+    { ShmController::MBuff, ShmController::RTAI_Shm, ShmController::IPC };
+  
+  for (uint i = 0; i < sizeof(types) / sizeof(*types); i++) {
+    const SharedMemStruct *shm = 0;
+    try {
+      shm = ShmController::attach(types[i]);
+    } catch (ShmException & e) {
+      continue;
+    }
+    cout << rtLoopReport(shm->rt_stats);
+    ShmController::detach(shm, types[i]);
+    return 0;
+  }
+
+  cerr << "Could not attach to rtlab.o's shared memory.  Is it loaded?" 
+       << endl;
+  return 1;
+}
+
+/* parses "0-3,7,9" into a set of channel id's, returns false on error */
+static bool parseChanList(const char *str, set<uint> & chans)
+{
+  char *buf = strdup(str), *save = 0;
+  bool ok = true;
+
+  for (char *tok = strtok_r(buf, ",", &save); tok && ok; 
+       tok = strtok_r(0, ",", &save)) {
+    char *end;
+    long lo = strtol(tok, &end, 10), hi = lo;
+    
+    if (end == tok) ok = false;
+    else if (*end == '-') hi = strtol(end + 1, &end, 10);
+    if (*end || lo < 0 || hi < lo || hi >= SHD_MAX_CHANNELS) ok = false;
+    for (long i = lo; ok && i <= hi; i++) chans.insert(i);
+  }
+  free(buf);
+  return ok && chans.size();
+}
+
+static double secsSince(const struct timeval & tv)
+{
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return (now.tv_sec - tv.tv_sec) + (now.tv_usec - tv.tv_usec) / 1e6;
+}
+
+int 
+main(int argc, char *argv[])
+{
+  const char *settings_file = 0, *source_arg = 0, *device_arg = 0, 
+             *chans_arg = 0, *aref_arg = 0, *format_arg = 0, 
+             *outfile_arg = 0, *spec_arg = 0, *latency_arg = 0;
+  int rate_arg = -1, range_arg = -1;
+  double run_secs = -1.0, stat_secs = 5.0;
+  int opt;
+
+  while ( (opt = getopt(argc, argv, "f:s:d:r:c:g:a:F:o:S:t:i:L:Rh")) != -1 ) {
+    switch (opt) {
+    case 'f': settings_file = optarg; break;
+    case 's': source_arg = optarg; break;
+    case 'd': device_arg = optarg; break;
+    case 'r': rate_arg = atoi(optarg); break;
+    case 'c': chans_arg = optarg; break;
+    case 'g': range_arg = atoi(optarg); break;
+    case 'a': aref_arg = optarg; break;
+    case 'F': format_arg = optarg; break;
+    case 'o': outfile_arg = optarg; break;
+    case 'S': spec_arg = optarg; break;
+    case 't': run_secs = atof(optarg); break;
+    case 'i': stat_secs = atof(optarg); break;
+    case 'L': latency_arg = optarg; break;
+    case 'R': return dumpRTLoopStats();
+    case 'h':
+    default:
+      usage(argv[0]);
+      return (opt == 'h' ? 0 : 1);
+    }
+  }
+
+  if (stat_secs <= 0.0) stat_secs = 5.0;
+
+  ShmController *shmCtl = 0;
+  SampleStructSource *source = 0;
+  SampleStructReader *reader = 0;
+  SampleWriter *writer = 0;
+  int retval = 0;
+
+  try {
+    DAQSettings settings(settings_file);
+
+    /* command line overrides */
+    if (device_arg) settings.setDevice(device_arg);
+    if (spec_arg) settings.setSyntheticSourceSpec(spec_arg);
+    if (rate_arg > 0) settings.setSamplingRateHz(rate_arg);
+    if (outfile_arg) settings.setDataFile(outfile_arg);
+    if (format_arg) {
+      if (!strcmp(format_arg, "nds")) 
+        settings.setDataFileFormat(DAQSettings::Binary);
+      else if (!strcmp(format_arg, "ascii")) 
+        settings.setDataFileFormat(DAQSettings::Ascii);
+      else { usage(argv[0]); return 1; }
+    }
+
+    /* find the board */
+    ComediDevice dev;
+    try {
+      Probe probe;
+      dev = probe.find(settings.getDevice());
+    } catch (NoComediDeviceException & e) {
+      /* fine for the synthetic source, anything else will fail below */
+    }
+
+    if (source_arg) {
+      if (!strcmp(source_arg, "comedi")) 
+        settings.setInputSource(DAQSettings::Comedi);
+      else if (!strcmp(source_arg, "rtprocess")) 
+        settings.setInputSource(DAQSettings::RTProcess);
+      else if (!strcmp(source_arg, "synthetic")) 
+        settings.setInputSource(DAQSettings::Synthetic);
+      else { usage(argv[0]); return 1; }
+    } else if (settings.getInputSource() != DAQSettings::Synthetic 
+               && !dev.isNull()) {
+      /* same logic as ConfigurationWindow::toSettings() */
+      settings.setInputSource(dev.find(ComediSubDevice::AnalogInput)
+                              .used_by_rt_process 
+                              ? DAQSettings::RTProcess
+                              : DAQSettings::Comedi);
+    }
+
+    if (settings.getInputSource() != DAQSettings::Synthetic && dev.isNull())
+      throw NoComediDeviceException("Comedi Device Not Found",
+                                    settings.getDevice() + 
+                                    " is not a usable comedi device.");
+
+    /* figure out which channels to record */
+    set<uint> chans;
+    if (chans_arg) {
+      if (!parseChanList(chans_arg, chans)) { usage(argv[0]); return 1; }
+    } else {
+      chans = settings.windowSettingChannels();
+    }
+
+    source = buildSampleSource(settings, dev, shmCtl);
+
+    /* the whole setup goes to rtlab.o as one batch */
+    shmCtl->beginBatch();
+    shmCtl->clearSpikeSettings();
+    for (uint i = 0; i < shmCtl->numChannels(ComediSubDevice::AnalogInput); i++)
+      shmCtl->setChannel(ComediSubDevice::AnalogInput, i, false);
+
+    shmCtl->setSamplingRateHz(settings.samplingRateHz());
+
+    if (aref_arg) {
+      static const char *arefs[] = { "ground", "common", "diff", "other" };
+      static const int aref_vals[] = 
+        { AREF_GROUND, AREF_COMMON, AREF_DIFF, AREF_OTHER };
+      uint i;
+      for (i = 0; i < 4 && strcmp(aref_arg, arefs[i]); i++) 
+        ;
+      if (i == 4) { usage(argv[0]); throw Exception("Bad AREF", aref_arg); }
+      shmCtl->setAREFAll(ComediSubDevice::AnalogInput, aref_vals[i]);
+    }
+
+    uint n_chans = shmCtl->numChannels(ComediSubDevice::AnalogInput);
+    for (set<uint>::iterator it = chans.begin(); it != chans.end(); it++) {
+      if (*it >= n_chans) {
+        cerr << "Warning: ignoring nonexistant channel " << *it << endl;
+        continue;
+      }
+      const DAQChannelParams & p = settings.getChannelParameters(*it);
+      uint range = (range_arg >= 0 ? range_arg 
+                    : (p.isNull() ? 0 : p.rangeSetting));
+
+      shmCtl->setChannelRange(ComediSubDevice::AnalogInput, *it, range);
+      shmCtl->setChannel(ComediSubDevice::AnalogInput, *it, true);
+    }
+    shmCtl->commitBatch();
+
+    if (!shmCtl->numChannelsInUse(ComediSubDevice::AnalogInput)) 
+      throw Exception("No channels", "No channels to record were specified "
+                      "(use -c), and none were open the last time DAQ System "
+                      "was run.");
+
+    source->flush();
+    reader = new SampleStructReader(source, 0);
+    writer = buildSampleWriter(settings, shmCtl->samplingRateHz());
+    putAcquisitionMetaData(writer, *shmCtl);
+
+    cout << "Recording " 
+         << shmCtl->numChannelsInUse(ComediSubDevice::AnalogInput) 
+         << " channels at " << shmCtl->samplingRateHz() << "Hz to " 
+         << settings.getDataFile().latin1() << endl;
+
+    signal(SIGINT, stopHandler);
+    signal(SIGTERM, stopHandler);
+    signal(SIGHUP, stopHandler);
+
+    struct timeval start, last_stat;
+    gettimeofday(&start, 0);
+    last_stat = start;
+    unsigned long long last_read = 0, last_dropped = 0;
+
+    while (!please_stop) {
+      pipelineScanClock(shmCtl->scanIndex(), shmCtl->samplingRateHz());
+      const SampleStruct *sbuf = reader->readAll();
+      uint n_read = reader->numLastRead();
+
+      for (uint i = 0; i < n_read; i++) {
+        if ( sbuf[i].magic_number != SAMPLE_STRUCT_MAGIC ) 
+          throw SerializationException ("Sample struct magic check failed",
+                                        "The sample struct magic number is "
+                                        "invalid! Argh!");
+        writer->consume(sbuf + i);
+      }
+
+      double since_stat = secsSince(last_stat), 
+             elapsed = secsSince(start);
+
+      if (since_stat >= stat_secs) {
+        unsigned long long rd = reader->numRead(), dr = reader->numDropped();
+        writer->flushBuffer();
+        fprintf(stdout, 
+                "%8.1fs  scan %llu  read %llu (%.0f samples/s)  "
+                "dropped %llu (+%llu)\n",
+                elapsed, static_cast<unsigned long long>(shmCtl->scanIndex()),
+                rd, (rd - last_read) / since_stat, dr, dr - last_dropped);
+        fflush(stdout);
+        last_read = rd; last_dropped = dr;
+        if (latency_arg) pipelineDump(latency_arg);
+        gettimeofday(&last_stat, 0);
+      }
+
+      if (run_secs >= 0.0 && elapsed >= run_secs) break;
+
+      if (!n_read) usleep(source->suggestPollWaitTime() * 1000);
+    }
+
+    writer->flushBuffer();
+    if (latency_arg) pipelineDump(latency_arg);
+
+    double elapsed = secsSince(start);
+    cout << "Done.  Read " << reader->numRead() << " samples in " 
+         << elapsed << "s (" << (reader->numRead() / elapsed) 
+         << " samples/s), dropped " << reader->numDropped() << "." << endl;
+
+  } catch (Exception & e) {
+    e.errorReportingMode() = Exception::Console;
+    e.showError();
+    retval = 1;
+  }
+
+  delete writer;
+  delete reader;
+  delete source;
+  delete shmCtl;
+
+  return retval;
+}
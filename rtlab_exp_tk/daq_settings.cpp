@@ -53,6 +53,7 @@ DAQSettings::DAQMasterDefaults::DAQMasterDefaults()
   me [GLOBAL_SECTION][ KEY_DEVICE ] = DEFAULT_COMEDI_DEVICE; 
   me [GLOBAL_SECTION][ KEY_FILE_SOURCE_FILE_NAME ] = "/dev/null";
   me [GLOBAL_SECTION][ KEY_DEFAULT_INPUT_SOURCE ] = QString::number((int)Comedi);
+  me [GLOBAL_SECTION][ KEY_SYNTHETIC_SOURCE_SPEC ] = "wave=ecg,freq=1.2,noise=0.02";
   me [GLOBAL_SECTION][ KEY_SHOW_CONFIG_ON_STARTUP ] = QString::number((int)true);
   me [GLOBAL_SECTION][ KEY_DATA_FILE ] = 
     QString(DAQ_DATA_PREFIX) + DEFAULT_NDS_FILE; // from rtlab_defaults.h
@@ -151,6 +152,19 @@ DAQSettings::setInputSource(InputSource source)
   dirtySettings[GLOBAL_SECTION].insert(KEY_DEFAULT_INPUT_SOURCE);
 }
 
+const QString &
+DAQSettings::getSyntheticSourceSpec() const
+{
+  return settingsMap.find(GLOBAL_SECTION)->second.find(KEY_SYNTHETIC_SOURCE_SPEC)->second;
+}
+
+void 
+DAQSettings::setSyntheticSourceSpec(const QString & spec)
+{
+  settingsMap[GLOBAL_SECTION][KEY_SYNTHETIC_SOURCE_SPEC] = spec;
+  dirtySettings[GLOBAL_SECTION].insert(KEY_SYNTHETIC_SOURCE_SPEC);
+}
+
 bool
 DAQSettings::getShowConfigOnStartup() const
 {
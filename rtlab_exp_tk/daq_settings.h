@@ -43,6 +43,7 @@ class DAQSettings: public Settings
     Comedi,
     RTProcess,
     File,
+    Synthetic, /* SampleStructSynthSource, for testing/benchmarking */
     invalid_source_high    
   };
 
@@ -82,6 +83,10 @@ class DAQSettings: public Settings
   InputSource getInputSource() const;
   void setInputSource(InputSource source);
 
+  /* see SampleStructSynthSource::applySpec() for the format */
+  const QString & getSyntheticSourceSpec() const;
+  void setSyntheticSourceSpec(const QString & spec);
+
   bool getShowConfigOnStartup() const;
   void setShowConfigOnStartup(bool yesorno);
 
@@ -181,6 +186,7 @@ class DAQSettings: public Settings
     * const KEY_DEVICE = "device",
     * const KEY_FILE_SOURCE_FILE_NAME = "fileSourceFileName",
     * const KEY_DEFAULT_INPUT_SOURCE = "defaultInputSource",
+    * const KEY_SYNTHETIC_SOURCE_SPEC = "syntheticSourceSpec",
     * const KEY_SHOW_CONFIG_ON_STARTUP = "showConfigOnStartup",
     * const KEY_DATA_FILE = "dataFile",
     * const KEY_DATA_FORMAT = "dataFileDefaultFormat",
@@ -51,6 +51,8 @@
 #include <qpixmap.h>
 #include <qtextbrowser.h>
 #include <qwhatsthis.h>
+#include <qspinbox.h>
+#include <qlabel.h>
 
 #include <iostream>
 #include <map>
@@ -58,6 +60,7 @@
 #include <set>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <dlfcn.h>
 
@@ -76,6 +79,10 @@
 #include "simple_text_editor.h"
 #include "plugin.h"
 #include "comedi_coprocess.h"
+#include "source_factory.h"
+#include "pipeline_stats.h"
+#include "pipeline_stats_window.h"
+#include "display_fanout.h"
 #include "daq_images.h"
 #include "daq_graph_controls.h"
 #include "daq_channel_params.h"
@@ -139,6 +146,7 @@ DAQSystem::DAQSystem (ConfigurationWindow  & cw, QWidget * parent,
   tyler(&ws),
   plugin_menu(this, 0, QString(name) + " - Plugin Menu"),
   windowTemplateDlg(0),
+  pipelineStatsWin(0),
   last_secs_vis_they_picked(0),
   last_range_they_picked(0)
 {
@@ -207,11 +215,15 @@ DAQSystem::DAQSystem (ConfigurationWindow  & cw, QWidget * parent,
                             "&Synchronize Channels", this, SLOT(resynch()));
 
     channelsMenu.insertItem("Set Analog Input &Reference Mode...", this, SLOT( changeAREFDialog() ), CTRL + Key_R );
+    channelsMenu.insertItem("Set Analog Input &Oversampling...", this, 
+                            SLOT( changeOversampleDialog() ));
     
     windowMenu.insertItem(QIconSet(QPixmap(DAQImages::wintemplates_img)),
                           "&Window Templates...", 
                           this, 
                           SLOT ( showWindowTemplateDialog() ));
+    windowMenu.insertItem("&Pipeline Statistics...", this,
+                          SLOT ( showPipelineStatsWindow() ));
     windowMenu.insertSeparator(); /* ---- */
     windowMenu.insertItem("&Cascade Channel Windows", &ws, SLOT( cascade() ) );
     windowMenu.insertItem("&Tile Channel Windows", &tyler, SLOT( tyle() ) );
@@ -280,11 +292,13 @@ DAQSystem::DAQSystem (ConfigurationWindow  & cw, QWidget * parent,
      from the last session */
   set<uint> s = settings.windowSettingChannels();
   uint n_chans_this_device = configWindow.selectedDevice().find().n_channels;
+  shmCtl.beginBatch(); /* all of them go on in one go */
   for (set<uint>::iterator i = s.begin(); i != s.end();  i++) 
     if (*i < n_chans_this_device) /* ignore non-existant channels in
                                      case we just changed boards */
       openChannelWindow(*i); /* Open with defaults or stuff from config file
                                 modify this to read other defaults too */
+  shmCtl.commitBatch();
     
   /* KLUDGE -- due to implementation quirks in QWorkspace, a resynch() must
      be called on a non-hidden DAQSystem.. */
@@ -480,6 +494,121 @@ void DAQSystem::changeAREF(ComediChannel::AnalogRef aref)
   setChannelsOn(chanstate);
 }
 
+void DAQSystem::changeOversampleDialog()
+{
+  /* slot here */
+
+  uint o, 
+       order = shmCtl.cicOrder(),
+       n_chans = shmCtl.numChannels(ComediSubDevice::AnalogInput);
+
+  QDialog *d = new QDialog(this, "Analog Input Oversampling Dialog",
+                           TRUE, WDestructiveClose);
+
+  d->setCaption("Analog Input Oversampling");
+
+  QGridLayout *l =  new QGridLayout(d, 1, 1);
+
+  QVBox *vbox = new QVBox(d);
+
+  l->addWidget(vbox, 0, 0);
+
+  QHBox *chan_box = new QHBox(vbox);
+  new QLabel("Oversample channel: ", chan_box);
+  QSpinBox *chan = new QSpinBox(-1, n_chans - 1, 1, chan_box);
+  chan->setSpecialValueText("All Channels");
+  chan->setValue(-1);
+
+  QHBox *factor_box = new QHBox(vbox);
+  new QLabel("Conversions per scan: ", factor_box);
+  QSpinBox *factor = new QSpinBox(1, AI_MAX_OVERSAMPLE, 1, factor_box);
+  factor->setValue(shmCtl.channelOversample(0));
+
+  QWhatsThis::add(factor,
+                  "The board converts the channel this many times per scan, "
+                  "back to back, and the conversions are filtered down to "
+                  "the one sample per scan that gets displayed and saved.  "
+                  "This trades some of the board's conversion rate for "
+                  "less noise.  1 turns oversampling off.  The extra "
+                  "conversions come out of the board's maximum rate, so "
+                  "the sampling rate times the total conversions per scan "
+                  "must stay under it.");
+
+  QVButtonGroup *button_g = 
+    new QVButtonGroup("Filter the conversions (all channels) with: ", vbox);
+
+  button_g->setRadioButtonExclusive(true);
+
+  button_g->setSizePolicy(QSizePolicy(QSizePolicy::MinimumExpanding, 
+                                      QSizePolicy::MinimumExpanding));
+
+  /* indexed by filter order, 0 is unused */
+  vector<QRadioButton *> buttons(AI_MAX_CIC_ORDER + 1, (QRadioButton *)0);
+
+  buttons[1] = new QRadioButton("Boxcar Average", button_g);
+  for (o = 2; o <= AI_MAX_CIC_ORDER; o++) 
+    buttons[o] = new QRadioButton(QString("CIC Filter, Order %1").arg(o),
+                                  button_g);
+
+  QWhatsThis::add(buttons[1],
+                  "The plain average of the scan's conversions.  Adds no "
+                  "delay, but lets more of the noise above half the sampling "
+                  "rate alias back in.");
+  for (o = 2; o <= AI_MAX_CIC_ORDER; o++) 
+    QWhatsThis::add(buttons[o],
+                    "A cascaded integrator-comb filter: the boxcar applied "
+                    "several times over.  It rejects more of the noise that "
+                    "would alias, at the cost of a delay of a scan or so "
+                    "per extra order.  Boards with very fine resolution may "
+                    "get a lower order than the one asked for.");
+
+  if (order < buttons.size() && buttons[order])
+    buttons[order]->setChecked(true);
+
+  QHBox *hbox = new QHBox(vbox);
+
+  QPushButton *ok = new QPushButton("Ok", hbox), 
+              *cancel = new QPushButton("Cancel", hbox);
+              
+  cancel->setAutoDefault(true);
+
+  connect(ok, SIGNAL(clicked()), d, SLOT(accept()));
+  connect(cancel, SIGNAL(clicked()), d, SLOT(reject()));
+
+  ok->setSizePolicy(QSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed));
+  cancel->setSizePolicy(QSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed));
+
+  if (d->exec() == QDialog::Accepted) {
+    for (o = 1; o < buttons.size(); o++) 
+      if (buttons[o]->isChecked()) break;
+    changeOversample(chan->value(), factor->value(), 
+                     o < buttons.size() ? o : order);
+  }
+}
+
+void DAQSystem::changeOversample(int chan, uint factor, uint order)
+{
+  /* rtlab.o rebuilds its scan when it sees the change, so one batch is
+     enough to have it all take effect in the same scan */
+  shmCtl.beginBatch();
+  if (chan < 0) 
+    shmCtl.setOversampleAll(factor);
+  else
+    shmCtl.setOversample(chan, factor);
+  shmCtl.setCICOrder(order);
+  shmCtl.commitBatch();
+
+  if (shmCtl.channelOversample(chan < 0 ? 0 : chan) != factor)
+    QMessageBox::information(this, "Oversampling not available",
+                             "Oversampling is done by " RTLAB_MODULE_NAME 
+                             ", which isn't the input source, or which "
+                             "refused the setting.  The channels are "
+                             "sampled once per scan.");
+
+  /* the data file says how its samples came to be */
+  putAcquisitionMetaData(readerLoop.writer, shmCtl);
+}
+
 /* used solely for below method */
 const QString DAQSystem::helpMenuDestinations[n_help_dests] = 
 {
@@ -559,7 +688,7 @@ DAQSystem::queryOpen(uint & chan, uint & range,
          i++) {
       
       if (i < (uint)subdev.n_channels 
-          && ! readerLoop.producers[i].findByType((ECGGraphContainer *)0)) {
+          && ! readerLoop.display->output(i).findByType((ECGGraphContainer *)0)) {
         /* build channel id combo box inside here */
         id.insertItem("Channel No. " + QString().setNum(i));
         cbox2idMap [ cboxid ] = i;
@@ -644,8 +773,11 @@ DAQSystem::openChannelWindow(uint chan, int range, int n_secs)
   
   gcont -> show(); /* will this help with window setting/geometry? */
 
-  /* add the graph to the readerLoop producers chain.. */
-  readerLoop.producers[chan].add(gcont);
+  /* add the graph to the readerLoop's display fan-out.. */
+  readerLoop.display->output(chan).add(gcont);
+  gcont->setDecimation(readerLoop.display->decimation());
+  connect(readerLoop.display, SIGNAL(decimationChanged(uint)),
+          gcont, SLOT(setDecimation(uint)));
 
   /* see about getting rid of these signal/slots and use natural signalling
      in producer/consumer classes.. -CC */
@@ -1113,16 +1245,20 @@ void DAQSystem::allChannelsOffSaveState (vector<uint> & v)
 
   v = channelsOn();
   
+  shmCtl.beginBatch();
   for (i = 0; i < v.size(); i++) 
     shmCtl.setChannel(ComediSubDevice::AnalogInput, v[i], false);  
+  shmCtl.commitBatch();
 }
 
 void DAQSystem::setChannelsOn (const vector<uint> & chanspec) 
 {
   uint i;
 
+  shmCtl.beginBatch();
   for (i = 0; i < chanspec.size(); i++) 
     shmCtl.setChannel(ComediSubDevice::AnalogInput, chanspec[i], true);  
+  shmCtl.commitBatch();
 }
 
 void DAQSystem::rememberSecondsVisibleThatUserPicked(uint c, uint s)
@@ -1141,50 +1277,30 @@ ReaderLoop(DAQSystem *d) :
   saved_curr_index(0),
   last_sleep_time(1000)
 {
-  switch (d->settings.getInputSource()) {
-  
-  case DAQSettings::RTProcess:
-    shmCtl = new ShmControllerWithFifo(); /* auto-probe a shm_type */
+  source = buildSampleSource(d->settings, d->currentdevice, shmCtl);
 
-    shmCtl->clearSpikeSettings();
-    for (uint i=0; i<shmCtl->numChannels(ComediSubDevice::AnalogInput);i++) {
-      shmCtl->setChannel(ComediSubDevice::AnalogInput, i, false);
-    }
+  shmCtl->beginBatch();
+  shmCtl->clearSpikeSettings();
+  for (uint i=0; i<shmCtl->numChannels(ComediSubDevice::AnalogInput);i++) {
+    shmCtl->setChannel(ComediSubDevice::AnalogInput, i, false);
+  }
+  shmCtl->commitBatch();
 
-    source = new SampleStructFIFOSource(string("/dev/rtf") + shmCtl->aiFifoMinor());
-    source->flush();
-
-    /* build a non-blocking sample reader */
-    reader = new SampleStructReader(source, 0);
-
-    /* build the sample writer */
-    switch(d->settings.getDataFileFormat()) {
-    case DAQSettings::Binary:
-      writer = new SampleBinWriter(shmCtl->samplingRateHz(), 
-                                   d->settings.getDataFile().latin1());
-      break;
-    case DAQSettings::Ascii:
-      writer = new SampleGZWriter(shmCtl->samplingRateHz(), 
-                                  d->settings.getDataFile().latin1());
-      break;
-    default:
-      throw UnimplementedException("INTERNAL ERROR", 
-                                   "Unknown data file format specified in "
-                                   "settings");
-      break;
-    }
+  source->flush();
 
-    // add the writer as a consumer for all channels
-    for (uint i = 0; i < n_channels; i++) producers[i].add(writer);
+  /* build a non-blocking sample reader */
+  reader = new SampleStructReader(source, 0);
 
-    break;
-  default:
-    throw UnimplementedException 
-      ("Unimplemented feature",
-       "The use of non-rt_process input sources is not yet implemented!\n"
-       "Either insmod rtlab.o or give up for now... (Sorry!)");
-    break;
-  }
+  /* build the sample writer */
+  writer = buildSampleWriter(d->settings, shmCtl->samplingRateHz());
+  putAcquisitionMetaData(writer, *shmCtl);
+
+  // add the writer as a consumer for all channels
+  for (uint i = 0; i < n_channels; i++) producers[i].add(writer);
+
+  // and the display fan-out, which the graphs will hang off of
+  display = new DisplayFanout(n_channels, shmCtl->samplingRateHz(), this);
+  for (uint i = 0; i < n_channels; i++) producers[i].add(display->input(i));
 }
 
 
@@ -1201,6 +1317,20 @@ void DAQSystem::showWindowTemplateDialog()
   windowTemplateDlg->raise();
 }
 
+void DAQSystem::showPipelineStatsWindow()
+{
+  if (!pipelineStatsWin) {
+    pipelineStatsWin = new PipelineStatsWindow(this, "Pipeline Statistics",
+                                               WType_TopLevel);
+    pipelineStatsWin->setCaption(pipelineStatsWin->name());
+    pipelineStatsWin->setShmController(&shmCtl);
+  }
+  
+  pipelineStatsWin->show();
+  pipelineStatsWin->setActiveWindow();
+  pipelineStatsWin->raise();
+}
+
 
 ReaderLoop::~ReaderLoop()
 {
@@ -1229,6 +1359,7 @@ ReaderLoop::~ReaderLoop()
   delete reader; reader = 0;
   delete source; source = 0;
   delete writer; writer = 0;
+  delete display; display = 0;
   delete shmCtl; shmCtl = 0;
 }
 
@@ -1241,6 +1372,10 @@ ReaderLoop::loop()
   /* the following readAll()  may (theoretically) block indefinitely which is 
      why eventually we should think about threading this bad boy... :) */
   
+  struct timeval start;
+  gettimeofday(&start, 0);
+
+  pipelineScanClock(shmCtl->scanIndex(), shmCtl->samplingRateHz());
   const SampleStruct *sbuf = reader->readAll(); 
 
   int n_read = reader->numLastRead(), i;
@@ -1257,6 +1392,15 @@ ReaderLoop::loop()
       producers[chan].produce(sbuf + i);
     }
   }
+
+  if (n_read) { /* let the display fan-out know how we're keeping up */
+    struct timeval now;
+    gettimeofday(&now, 0);
+    display->batchDone( (now.tv_sec - start.tv_sec) 
+                        + (now.tv_usec - start.tv_usec) / 1e6,
+                        sbuf[0].scan_index, sbuf[n_read-1].scan_index,
+                        shmCtl->scanIndex() );
+  }
     
   { /* emit scan index update every 1 second */
     if (shmCtl->scanIndex() - saved_curr_index > shmCtl->samplingRateHz()) {
@@ -49,6 +49,7 @@
 #define DAQ_SYSTEM_APPNAME_CSTRING "DAQSystem"
 
 class  WindowTemplateDialog; 
+class  PipelineStatsWindow;
 
 class DAQSystem;
 class Plugin;
@@ -62,6 +63,7 @@ class  SampleStructReader;
 class  SampleWriter;
 class  ShmController;
 class  ShmBase;
+class  DisplayFanout;
 
 class ExperimentLog; /* this extends class SimpleTextEditor, 
                         but it is an opaque type inside daq_system.cpp */
@@ -133,6 +135,10 @@ class ReaderLoop: public QObject
      (ie 'channel_index') */
   vector<Producer<const SampleStruct *> > producers;
 
+  /* the graphs hang off of this rather than producers, so that the 
+     display can be decimated when we fall behind (see display_fanout.h) */
+  DisplayFanout *display;
+
   scan_index_t saved_curr_index;
 
   int last_sleep_time; /* used to indicate about how much we slept on 
@@ -268,6 +274,10 @@ class DAQSystem : public QMainWindow
   void changeAREFDialog();  /* brings up the change aref dialog box */
   void changeAREF(ComediChannel::AnalogRef); /* applies the aref change 
                                                to all channels */
+  void changeOversampleDialog(); /* brings up the AI oversampling dialog */
+  /* applies it -- to all the channels if chan < 0.  order is the 
+     decimating filter's, for all the channels (1 is the boxcar) */
+  void changeOversample(int chan, uint factor, uint order); 
   void openChannelWindow(uint chan, int range = -1, int n_secs = -1);
   /* if graph is null, save them all */
   void saveGraphSettings(const ECGGraphContainer *graph = 0);
@@ -308,6 +318,8 @@ class DAQSystem : public QMainWindow
   void printDialog(); /* brings up various pring dialogs and the like */
 
   void showWindowTemplateDialog();
+  void showPipelineStatsWindow(); /* latency/drop statistics, see 
+                                     pipeline_stats.h */
 
  private slots:
 
@@ -372,6 +384,7 @@ class DAQSystem : public QMainWindow
   PluginMenu plugin_menu;
   
   WindowTemplateDialog *windowTemplateDlg;
+  PipelineStatsWindow *pipelineStatsWin;
 
   enum HelpMenuIds { help1 = 0, help2, helpAbout, n_help_dests };
   static const QString helpMenuDestinations[n_help_dests];
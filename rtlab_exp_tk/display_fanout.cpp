@@ -0,0 +1,154 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+#include "display_fanout.h"
+
+/* above this fraction of the data's own duration spent in the read loop, 
+   or this much backlog, we decimate more */
+static const double HIGH_LOAD = 0.5, MAX_LAG_SECS = 0.25;
+/* below this (and half of MAX_LAG_SECS) for CALM_SECS, we decimate less */
+static const double LOW_LOAD = 0.15, CALM_SECS = 2.0;
+/* don't bump the factor up more often than this, so the load estimate 
+   has a chance to reflect the last change */
+static const double MIN_SECS_BETWEEN_CHANGES = 0.25;
+
+/*----------------------------------------------------------------------------
+  DisplayDecimator method definitions
+-----------------------------------------------------------------------------*/
+DisplayDecimator::DisplayDecimator()
+  : _factor(1), n_in_block(0), block(0), have_spike(false)
+{
+}
+
+void
+DisplayDecimator::consume(const SampleStruct *s)
+{
+  if (_factor <= 1) { 
+    display.produce(s); 
+    return; 
+  }
+
+  scan_index_t b = s->scan_index / _factor;
+
+  if (n_in_block && b != block) emitBlock();
+
+  if (!n_in_block) {
+    block = b;
+    lo = hi = *s;
+  } else if (s->data < lo.data) {
+    lo = *s;
+  } else if (s->data > hi.data) {
+    hi = *s;
+  }
+  if (s->spike && !have_spike) { spike = *s; have_spike = true; }
+
+  /* last scan of the block, no need to wait for the next one */
+  if (++n_in_block >= _factor || s->scan_index % _factor == _factor - 1)
+    emitBlock();
+}
+
+void
+DisplayDecimator::emitBlock()
+{
+  if (!n_in_block) return;
+
+  SampleStruct *first = &lo, *second = &hi;
+  if (hi.scan_index < lo.scan_index) { first = &hi; second = &lo; }
+
+  /* make sure a spike in this block makes it to the display, even if the
+     spike sample itself wasn't an extreme */
+  if (have_spike && !first->spike && !second->spike) {
+    first->spike = spike.spike;
+    first->spike_period = spike.spike_period;
+  }
+
+  display.produce(first);
+  if (second->scan_index != first->scan_index) display.produce(second);
+
+  n_in_block = 0;
+  have_spike = false;
+}
+
+void
+DisplayDecimator::setFactor(uint f)
+{
+  if (!f) f = 1;
+  emitBlock();
+  _factor = f;
+}
+
+/*----------------------------------------------------------------------------
+  DisplayFanout method definitions
+-----------------------------------------------------------------------------*/
+DisplayFanout::DisplayFanout(uint n_channels, sampling_rate_t rate,
+                             QObject *parent, const char *name)
+  : QObject(parent, name), rate(rate ? rate : 1), factor(1), load(0.0),
+    last_change(0), calm_since(0), calm(false)
+{
+  for (uint i = 0; i < n_channels; i++) 
+    decimators.push_back(new DisplayDecimator);
+}
+
+DisplayFanout::~DisplayFanout()
+{
+  for (uint i = 0; i < decimators.size(); i++) delete decimators[i];
+}
+
+void
+DisplayFanout::batchDone(double busy_secs, scan_index_t first, 
+                         scan_index_t last, scan_index_t now)
+{
+  if (last < first) return; 
+
+  double data_secs = (last - first + 1) / static_cast<double>(rate),
+         lag_secs = (now > last ? now - last : 0) / static_cast<double>(rate),
+         since_change = (last - last_change) / static_cast<double>(rate);
+
+  load = 0.75 * load + 0.25 * (busy_secs / data_secs);
+
+  if ( (load > HIGH_LOAD || lag_secs > MAX_LAG_SECS) ) {
+    calm = false;
+    if (factor < MAX_DECIMATION && since_change >= MIN_SECS_BETWEEN_CHANGES) {
+      setDecimation(factor * 2);
+      last_change = last;
+    }
+  } else if (load < LOW_LOAD && lag_secs < MAX_LAG_SECS / 2.0) {
+    if (!calm) { calm = true; calm_since = last; }
+    if (factor > 1 && (last - calm_since) / static_cast<double>(rate) 
+                      >= CALM_SECS) {
+      setDecimation(factor / 2);
+      last_change = calm_since = last;
+    }
+  } else {
+    calm = false;
+  }
+}
+
+void
+DisplayFanout::setDecimation(uint f)
+{
+  if (f == factor) return;
+  factor = f;
+  for (uint i = 0; i < decimators.size(); i++) decimators[i]->setFactor(f);
+  emit decimationChanged(f);
+}
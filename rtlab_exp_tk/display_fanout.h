@@ -0,0 +1,124 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+#ifndef _DISPLAY_FANOUT_H
+#define _DISPLAY_FANOUT_H
+
+#include <qobject.h>
+#include <vector>
+#include "common.h"
+#include "shared_stuff.h"
+#include "producer_consumer.h"
+#include "sample_consumer.h"
+
+/*
+   Display fan-out with automatic min/max decimation
+
+   The graphs don't hang directly off of ReaderLoop's per-channel
+   producers anymore.  Instead each channel's producer feeds one 
+   DisplayDecimator (which is just another SampleConsumer, like the
+   SampleWriter), and the decimator in turn produces for the graph(s).
+
+   Normally the decimator passes everything straight through.  When 
+   ReaderLoop reports (via DisplayFanout::batchDone()) that it is falling
+   behind the data -- either it spends too much of the data's own duration 
+   in its loop, or the source has a backlog of unread scans -- the
+   decimation factor doubles, up to MAX_DECIMATION.  A decimator with 
+   factor N emits only the minimum and maximum sample of every block of N 
+   scans (blocks are aligned on scan_index, so all channels agree), so 
+   extremes and spikes still show up on screen.  When things have been
+   calm for a while the factor halves again.
+
+   The writer, plugins and anything else attached to ReaderLoop's producers 
+   directly are unaffected and always get every sample.
+*/
+
+class DisplayDecimator : public SampleConsumer
+{
+ public:
+  DisplayDecimator();
+
+  /* as per the SampleConsumer 'interface' */
+  void consume(const SampleStruct *);
+
+  /* the graph(s) for this channel should be added to this */
+  Producer<const SampleStruct *> display;
+
+  uint factor() const { return _factor; }
+  /* emits whatever partial block is pending, then switches to f */
+  void setFactor(uint f);
+
+ private:
+  void emitBlock();
+
+  uint _factor;
+  uint n_in_block;
+  scan_index_t block;  /* scan_index / factor of the pending block */
+  SampleStruct lo, hi, spike;
+  bool have_spike;
+};
+
+class DisplayFanout : public QObject
+{
+  Q_OBJECT
+
+ public:
+  DisplayFanout(uint n_channels, sampling_rate_t rate, 
+                QObject *parent = 0, const char *name = 0);
+  ~DisplayFanout();
+
+  /* the input side -- add this to ReaderLoop's producer for chan */
+  SampleConsumer & input(uint chan) { return *decimators[chan]; }
+  /* the output side -- add the graph(s) for chan to this */
+  Producer<const SampleStruct *> & output(uint chan) 
+    { return decimators[chan]->display; }
+
+  uint numChannels() const { return decimators.size(); }
+
+  /* the current decimation factor, 1 means every sample is displayed */
+  uint decimation() const { return factor; }
+
+  /* ReaderLoop calls this after every non-empty read+dispatch:
+     busy_secs is how long the read and dispatch took, 
+     first and last are the scan indices of the first and last samples
+     in the batch, and now is the scan index being acquired now */
+  void batchDone(double busy_secs, scan_index_t first, scan_index_t last,
+                 scan_index_t now);
+
+  static const uint MAX_DECIMATION = 64;
+
+ signals:
+  void decimationChanged(uint factor);
+
+ private:
+  void setDecimation(uint f);
+
+  vector<DisplayDecimator *> decimators;
+  sampling_rate_t rate;
+  uint factor;
+  double load; /* smoothed busy_secs / (duration of the batch's data) */
+  scan_index_t last_change, calm_since;
+  bool calm;
+};
+
+#endif
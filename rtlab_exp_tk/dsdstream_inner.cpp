@@ -75,12 +75,13 @@ void DSDStream::ChannelMask::clear()  { count = 0; mask.fill(false);}
 
 int DSDStream::ChannelMask::compare (const ChannelMask & m) const
 {
-  if (mask.size() > m.mask.size()) return 1;
-  if (mask.size() < m.mask.size()) return -1;
-  int cmp = 0;
-  for (uint i = 0; i < mask.size(); i++)  cmp += (mask[i] * 1) + (m.mask[i]*-1);
+  // a narrower mask is the same as a wider one with the extra channels off
+  uint n = (mask.size() > m.mask.size() ? mask.size() : m.mask.size());
 
-  return cmp;
+  for (uint i = 0; i < n; i++)
+    if (isOn(i) != m.isOn(i)) return (isOn(i) ? 1 : -1);
+
+  return 0;
 }
 
 void DSDStream::StateHistory::computeMaxUniqueChannelsUsed()
@@ -88,7 +89,7 @@ void DSDStream::StateHistory::computeMaxUniqueChannelsUsed()
   set<uint> chans;
 
   for (vector<MaskState>::iterator it = maskStates.begin(); it != maskStates.end(); it++)
-    for (uint i = 0; i < SHD_MAX_CHANNELS; i++)
+    for (uint i = 0; i < it->mask.size(); i++)
       if (it->mask.isOn(i) && chans.find(i) == chans.end())
         chans.insert(i);
   max_unique_channels_used = chans.size();
@@ -100,7 +101,7 @@ void DSDStream::StateHistory::computeMaxUniqueChannelsUsed()
 void DSDStream::MaskState::computeChannelsOn()
 {
   channels_on.clear();
-  for (uint i = 0; i < SHD_MAX_CHANNELS; i++)
+  for (uint i = 0; i < mask.size(); i++)
     if (mask.isOn(i)) channels_on.push_back(i);
 
   id_to_pos_map.clear();
@@ -271,10 +272,10 @@ void DSDStream::MaskState::unserialize(const Settings & settings, const QString
   computeChannelsOn();
 }
 
-/* this value represents that a particular channel id is off (no position) */
+/* channel ids past the end of data are off (no position) */
 void DSDStream::MaskState::Id2PosMap::clear()
 {
-  erase(begin(), end());
+  data.clear();
 }
 
 void DSDStream::MaskState::Id2PosMap::erase(iterator begin, iterator end)
@@ -285,10 +286,10 @@ void DSDStream::MaskState::Id2PosMap::erase(iterator begin, iterator end)
 DSDStream::MaskState::Id2PosMap::iterator 
 DSDStream::MaskState::Id2PosMap::find(Pos chan)
 {
-  if (chan >= SHD_MAX_CHANNELS || data[chan] == Off)
+  if (chan >= data.size() || data[chan] == Off)
     return end();
   
-  return data + chan;
+  return data.begin() + chan;
 }
 
 
@@ -31,8 +31,12 @@ struct Serializeable {
     virtual void unserialize (const Settings & settings, const QString & section_name) = 0;
 };
 
+/* Masks start out as wide as the 256 channels they always used to be, and
+   grow to fit any channel that gets turned on past that, so files that 
+   don't go over 256 channels look just like they always have. */
 struct ChannelMask : public Serializeable {
-    ChannelMask(uint size = SHD_MAX_CHANNELS) { mask.resize(size); clear(); };
+    enum { MinSize = 256 };
+    ChannelMask(uint size = MinSize) { mask.resize(size); clear(); };
     ChannelMask(const ChannelMask & m) : Serializeable() { *this = m; };
     void clear();
     ChannelMask & operator= ( const ChannelMask & m ) { count = m.count; mask = m.mask.copy(); return *this; };
@@ -43,15 +47,17 @@ struct ChannelMask : public Serializeable {
     size_t serialize(DSDStream & s) const ;//throw (Exception);
     size_t unserialize(DSDStream &s) ;//throw (Exception);
 
-    bool isOn(uint chan) const      { return mask[chan]; };
+    bool isOn(uint chan) const      { return chan < mask.size() && mask.testBit(chan); };
 
     void setOn(uint chan, bool onoroff) {
       if ( isOn(chan) == onoroff ) return;
+      if ( chan >= mask.size() ) mask.resize((chan | (MinSize - 1)) + 1); // new bits are 0
       count += -1 + 2*onoroff;
       mask.setBit(chan, onoroff);
     };
 
     uint numOn() const      { return count; };
+    uint size() const       { return mask.size(); }; // channel ids past this are all off
 
 
 /*
@@ -73,7 +79,7 @@ struct ChannelMask : public Serializeable {
    __CM_OP_TEMPL(>=);
 #undef __CM_OP_TEMPL
 
-   int compare (const ChannelMask & m) const;
+   int compare (const ChannelMask & m) const; // 0 if the same channels are on
    bool equals (const ChannelMask &m) const    { return !compare(m); };
 
   private:
@@ -85,38 +91,24 @@ struct ChannelMask : public Serializeable {
 
 struct MaskState : public Serializeable {
 
-  /* Inner Class for mapping id's to positions in channel mask */
+  /* Inner Class for mapping id's to positions in channel mask.  Only as 
+     big as the highest channel id that was ever on. */
   struct Id2PosMap {
-    /* Ugly but ultra-anal and way to figure out what will do as our position
-       variable, and what the 'Off' variable's value will be */
-#    if UCHAR_MAX > SHD_MAX_CHANNELS
-       typedef unsigned char  Pos; /* pos need not be a short, int will do */
-       enum OffVals { Off = UCHAR_MAX };
-#    elif USHRT_MAX > SHD_MAX_CHANNELS
-       typedef unsigned short Pos; /* pos need not be an int, short will do */
-       enum OffVals { Off = USHRT_MAX };
-#    elif UINT_MAX > SHD_MAX_CHANNELS
-       typedef uint Pos;
-       enum OffVals { Off = UINT_MAX };
-#    elif ULONG_MAX > SHD_MAX_CHANNELS
-       typedef unsigned long Pos;
-       enum OffVals { Off = ULONG_MAX };
-#    elif ULLONG_MAX > SHD_MAX_CHANNELS
-       typedef unsigned long long Pos;
-       enum OffVals { Off = ULLONG_MAX };
-#    else
-#      error 'UCHAR_MAX', 'USHRT_MAX', 'UINT_MAX' and/or 'ULONG_MAX' not defined or they are smaller than 'SHD_MAX_CHANNELS'
-#    endif
-     typedef Pos * iterator;
+     typedef uint Pos;
+     enum OffVals { Off = UINT_MAX };
+     typedef vector<Pos>::iterator iterator;
      Id2PosMap() { clear(); }
      void clear();
-     void erase(iterator begin, iterator end); // sets -1 on begin to end
+     void erase(iterator begin, iterator end); // sets Off on begin to end
      iterator find(Pos channel_id);
-     iterator begin() { return data; }
-     iterator end() { return data + SHD_MAX_CHANNELS; }
-     Pos & operator[](uint chan) { return data[chan]; }
+     iterator begin() { return data.begin(); }
+     iterator end() { return data.end(); }
+     Pos & operator[](uint chan) { // grows to fit chan
+       if (chan >= data.size()) data.resize(chan + 1, Pos(Off));
+       return data[chan];
+     }
     private:
-     Pos data[SHD_MAX_CHANNELS];
+     vector<Pos> data;
   };
 
 
@@ -40,6 +40,7 @@
 #endif
 
 #include "ecggraph.h"
+#include "pipeline_stats.h"
 
  
 ECGGraph::ECGGraph (int sampleRateHz,
@@ -197,6 +198,11 @@ void ECGGraph::plot (double amplitude, uint64 sample_index) {
   plot(amplitude);
 }
 
+void ECGGraph::plot (double amplitude, uint64 sample_index, uint span) {
+  for (uint i = span; i > 1; i--) plot(amplitude, sample_index - (i - 1));
+  plot(amplitude, sample_index);
+}
+
 void ECGGraph::plot (double amplitude) {
 
   if ((!blockFactor()) ||
@@ -213,6 +219,7 @@ void ECGGraph::plot (double amplitude) {
 
     /* plot the lines */
     plotPoints (currentSampleIndex - blockFactor(), currentSampleIndex);  
+    pipelineNote(PIPELINE_PAINT, outside_concept_of_a_sample_index);
 
     /* now draw the little blip */
     drawLittleBlip();
@@ -135,6 +135,10 @@ class ECGGraph : public QWidget {
       emitting spikeDetected() */
   void plot (double amplitude, uint64 fyi);
   void plot (double amplitude);
+  /** same as above, but holds amplitude over the next span positions,
+      ending at fyi.  Used when the data is decimated (see 
+      display_fanout.h), so that the x-axis still means scans */
+  void plot (double amplitude, uint64 fyi, uint span);
   
   void paintEvent (QPaintEvent *);
   
@@ -44,7 +44,7 @@ struct FMT
 {
 
   
-  static const int n_formats = 5;
+  static const int n_formats = 6;
   static const int max_n_fields = 6;
   static const FMT formats[n_formats];
   static const FMT *find(const char *name)
@@ -94,6 +94,12 @@ const FMT FMT::formats[n_formats] = {
     format      : "Spike Freq: %1 BPM (%2 hz or %3 ms/spike)",
     types       : "ddd",
     fieldWidths : { 7, 2, 6, 2, 8, 2 }
+  },
+  {
+    name        : "DECIMATION_FORMAT",
+    format      : "Display: min/max 1:%1",
+    types       : "u",
+    fieldWidths : { 2 }
   }
 };
 
@@ -175,7 +181,11 @@ ECGGraphContainer::ECGGraphContainer(ECGGraph *graph,
     channelId(channelId),
     scan_index_threshold(scanIndexStatusIncrement), 
     last_scan_index((scan_index_t)-scan_index_threshold),
-    last_spike_index(0)
+    last_spike_index(0),
+    decimation(1),
+    base_block_factor(graph->blockFactor()),
+    last_plotted_index(0),
+    plotted_once(false)
     
 {  
   static const QString yAxisLabelFormat( "%1 V" );
@@ -265,6 +275,7 @@ ECGGraphContainer::ECGGraphContainer(ECGGraph *graph,
     lastSpike = new QLabel(FMT::getEmpty("LAST_SPIKE_FORMAT"), statusBar);
     spikeFrequency = new QLabel(FMT::getEmpty("SPIKE_FREQUENCY_FORMAT"), 
                                 statusBar);
+    decimationLabel = new QLabel("Display: all samples", statusBar);
 
   
     if ( graph->spikeMode() ) {
@@ -276,6 +287,7 @@ ECGGraphContainer::ECGGraphContainer(ECGGraph *graph,
     statusBar->addWidget(spikeThreshold);
     statusBar->addWidget(lastSpike);
     statusBar->addWidget(spikeFrequency);
+    statusBar->addWidget(decimationLabel);
     
     connect(graph, SIGNAL(spikeThresholdSet(double)),
             this, SLOT(setSpikeThresholdStatus(double)));      
@@ -296,7 +308,20 @@ consume(const SampleStruct *sample)
     /* bump it forward to maintain even second boundaries */
     graph->ffwd(sample->scan_index % graph->sampleRateHz());
   }
-  graph->plot(sample->data, sample->scan_index);
+
+  /* when decimated, fill in the scans that were decimated away, but
+     never more than that (dropped samples are just squeezed out, as 
+     always) */
+  uint span = 1;
+  if (decimation > 1 && plotted_once 
+      && sample->scan_index > last_plotted_index
+      && graph->currentPosition() != 0)
+    span = (sample->scan_index - last_plotted_index < decimation 
+            ? sample->scan_index - last_plotted_index : decimation);
+  graph->plot(sample->data, sample->scan_index, span);
+  last_plotted_index = sample->scan_index;
+  plotted_once = true;
+
   detectSpike(sample);
   setCurrentIndexStatus(sample->scan_index);  
 }
@@ -351,6 +376,26 @@ setCurrentIndexStatus(scan_index_t index)
   }
 }
 
+void
+ECGGraphContainer::
+setDecimation(uint factor)
+{
+  decimation = (factor ? factor : 1);
+
+  /* commit to the screen proportionally less often, that's where most of
+     the time goes.  The block factor must still divide a second's worth
+     of samples, otherwise the graph's redraws drift off the gridlines */
+  uint bf = base_block_factor * decimation;
+  while (bf > base_block_factor && graph->sampleRateHz() % bf) 
+    bf -= base_block_factor;
+  graph->setBlockFactor(bf);
+
+  if (decimation > 1)
+    decimationLabel->setText(FMT::get("DECIMATION_FORMAT", decimation));
+  else
+    decimationLabel->setText("Display: all samples");
+}
+
 void
 ECGGraphContainer::
 setSpikeThresholdStatus(double voltage)
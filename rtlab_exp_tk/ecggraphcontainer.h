@@ -98,6 +98,10 @@ public slots:
   void pauseUnpause(); /* pauses the graph 
                           -- 'disables' it as a consumer */
 
+  /* tells us the display feed is now min/max decimated by factor 
+     (1 == every sample), see display_fanout.h */
+  void setDecimation(uint factor);
+
   void setXAxis(bool on);
   void setYAxis(bool on);
   void setStatusBar(bool on);
@@ -127,8 +131,11 @@ public slots:
   vector<QLabel *> xaxis_labels;
   vector<uint64> saved_sample_indices;
   
-  QLabel *spikeThreshold, *lastSpike, *spikeFrequency;
+  QLabel *spikeThreshold, *lastSpike, *spikeFrequency, *decimationLabel;
   
+  uint decimation, base_block_factor;
+  scan_index_t last_plotted_index;
+  bool plotted_once;
   
   const scan_index_t scan_index_threshold; // internal
   scan_index_t last_scan_index, 
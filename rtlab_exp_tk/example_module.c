@@ -85,8 +85,11 @@ int mod_init (void)
   int retval = 0;
 
   if (
+      /* our callback does floating point, which a fixed point rtlab.o
+         only allows when loaded with task_fp=1 */
+      (retval = rtp_require_fp("example_module"))
       /* register our per-scan callback */
-      (retval = rtp_register_function(recompute_voltage_average))
+      || (retval = rtp_register_function(recompute_voltage_average))
       /* find a non-reserved rtf (realtime fifo) and put its value
          in realtime_fifo */
        || (retval = rtp_find_free_rtf(&realtime_fifo, FIFO_SZ))
@@ -44,7 +44,7 @@ extern "C" {
 }
 #endif
 
-#else
+#elif !defined(RTOS_POSIX) /* which gets these from <math.h> */
 #warning kmath.h should only be used in the kernel!
 #endif /* __KERNEL__ */
 
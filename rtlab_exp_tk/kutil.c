@@ -20,12 +20,16 @@
  * http://www.gnu.org.
  */
 #define EXPORT_SYMTAB 1
+#ifdef __KERNEL__
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/version.h>
 #include <linux/string.h>
 #include <linux/errno.h>
 #include <asm/div64.h>
+#else
+#include "rtos_middleman.h"
+#endif
 #include "kutil.h"
 
 
@@ -19,7 +19,7 @@
  * Boston, MA 02111-1307, USA, or go to their website at
  * http://www.gnu.org.
  */
-#ifndef __KERNEL__
+#if !defined(__KERNEL__) && !defined(RTOS_POSIX)
 #error kutil.h is to be used only inside the kernel!
 #endif
 #ifndef _KUTIL_H
@@ -0,0 +1,787 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  A fake libcomedi, for running the userspace acquisition code without
+  hardware.  See mock_comedi.h for what it emulates and how to configure 
+  it.  Link this instead of -lcomedi.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <comedi.h>
+#include <comedilib.h>
+
+#include "mock_comedi.h"
+
+#define MOCK_MAX_BOARDS 16
+#define MOCK_MAX_CHANS  1024
+#define MOCK_AI_SUBDEV  0
+#define MOCK_AO_SUBDEV  1
+#define MOCK_BILLION    1000000000ULL
+#define SINE_BITS       12
+#define SINE_LEN        (1 << SINE_BITS)
+
+typedef unsigned long long u64;
+typedef unsigned int u32;
+
+struct mock_config {
+  int boards, ai, ao, bits, max_rate, buf, insn_ns, loopback;
+  double freq, amp, noise, drift;
+};
+
+static const struct mock_config default_config = 
+  { 1, 16, 2, 16, 250000, 1048576, 2000, 0, 1.0, 1.0, 0.01, 0.0 };
+
+static struct mock_config config;
+static int config_loaded = 0;
+
+static const comedi_range ai_range_table[] = {
+  { -10.0, 10.0, UNIT_volt },
+  {  -5.0,  5.0, UNIT_volt },
+  {  -1.0,  1.0, UNIT_volt },
+  {   0.0, 10.0, UNIT_volt }
+};
+#define N_AI_RANGES (sizeof(ai_range_table) / sizeof(comedi_range))
+
+static const comedi_range ao_range_table[] = {
+  { -10.0, 10.0, UNIT_volt },
+  {   0.0, 10.0, UNIT_volt }
+};
+#define N_AO_RANGES (sizeof(ao_range_table) / sizeof(comedi_range))
+
+static float sine_table[SINE_LEN];
+static int sine_table_ready = 0; /* apart from config_loaded, since
+                                    mock_comedi_configure() sets that */
+
+/* state that is per board rather than per comedi_open(), protected by
+   board_lock (except ao_volts, where a torn read is harmless) */
+static pthread_mutex_t board_lock = PTHREAD_MUTEX_INITIALIZER;
+static comedi_t *lock_owner[MOCK_MAX_BOARDS][2];
+static volatile double ao_volts[MOCK_MAX_BOARDS][MOCK_MAX_CHANS];
+
+/* the external scan clock is board 0's scan timer, when it's running.  
+   Written under board_lock, read without it like ao_volts */
+static volatile struct {
+  int running;
+  u64 start_ns;
+  double period_ns;
+} ext_clock;
+
+static int mock_errno = 0;
+
+struct comedi_t_struct {
+  int board;
+  struct mock_config cfg;
+  char board_name[64];
+
+  comedi_range ai_ranges[N_AI_RANGES], ao_ranges[N_AO_RANGES];
+  lsampl_t maxdata;
+  unsigned bytes_per_sample;
+  u32 rng;
+
+  /* the AI command buffer: an unlinked temp file, so that the client can
+     mmap() comedi_fileno() just like it would the real thing */
+  int fd;
+  char *buf;
+  unsigned buf_sz;
+  
+  /* the running command, if any */
+  int running;
+  comedi_cmd cmd;
+  unsigned *chanlist;
+  u32 *phase_inc;      /* per chanlist entry, sine phase step per scan */
+  struct timespec start;
+  double period_ns;    /* scan period, by the wall clock */
+  u64 scans_done, written, read;
+};
+
+/*---------------------------------------------------------------------------
+  Configuration
+---------------------------------------------------------------------------*/
+
+static int parse_spec(const char *spec, struct mock_config *c)
+{
+  char *buf = strdup(spec ? spec : ""), *save = 0, *tok, *val, *end;
+  int bad = 0;
+  double d;
+
+  for (tok = strtok_r(buf, ", \t", &save); tok && !bad; 
+       tok = strtok_r(0, ", \t", &save)) {
+    if (!(val = strchr(tok, '='))) { bad = 1; break; }
+    *val++ = 0;
+    d = strtod(val, &end);
+    if (end == val || *end) { bad = 1; break; }
+
+    if      (!strcmp(tok, "boards"))   c->boards   = (int)d;
+    else if (!strcmp(tok, "ai"))       c->ai       = (int)d;
+    else if (!strcmp(tok, "ao"))       c->ao       = (int)d;
+    else if (!strcmp(tok, "bits"))     c->bits     = (int)d;
+    else if (!strcmp(tok, "max_rate")) c->max_rate = (int)d;
+    else if (!strcmp(tok, "buf"))      c->buf      = (int)d;
+    else if (!strcmp(tok, "insn_ns"))  c->insn_ns  = (int)d;
+    else if (!strcmp(tok, "loopback")) c->loopback = (int)d;
+    else if (!strcmp(tok, "freq"))     c->freq     = d;
+    else if (!strcmp(tok, "amp"))      c->amp      = d;
+    else if (!strcmp(tok, "noise"))    c->noise    = d;
+    else if (!strcmp(tok, "drift"))    c->drift    = d;
+    else bad = 1;
+  }
+  free(buf);
+
+  if (c->boards < 1 || c->boards > MOCK_MAX_BOARDS
+      || c->ai < 1 || c->ai > MOCK_MAX_CHANS
+      || c->ao < 0 || c->ao > MOCK_MAX_CHANS
+      || c->bits < 8 || c->bits > 24
+      || c->max_rate < 1 || c->buf < 4096 || c->insn_ns < 0
+      || c->drift <= -1e6 / MOCK_MAX_BOARDS) 
+    bad = 1;
+
+  return bad ? -1 : 0;
+}
+
+int mock_comedi_configure(const char *spec)
+{
+  struct mock_config c = default_config;
+
+  if (parse_spec(spec, &c)) return -1;
+
+  pthread_mutex_lock(&board_lock);
+  config = c;
+  config_loaded = 1;
+  pthread_mutex_unlock(&board_lock);
+  return 0;
+}
+
+/* called with board_lock held */
+static void load_config(void)
+{
+  int i;
+  const char *env = getenv("MOCK_COMEDI");
+
+  if (!sine_table_ready) {
+    for (i = 0; i < SINE_LEN; i++) 
+      sine_table[i] = sin(2.0 * M_PI * i / SINE_LEN);
+    sine_table_ready = 1;
+  }
+
+  if (config_loaded) return;
+
+  config = default_config;
+  if (env && parse_spec(env, &config)) {
+    fprintf(stderr, "mock_comedi: could not parse MOCK_COMEDI=\"%s\", "
+            "using the defaults.\n", env);
+    config = default_config;
+  }
+
+  config_loaded = 1;
+}
+
+/*---------------------------------------------------------------------------
+  Helpers
+---------------------------------------------------------------------------*/
+
+static inline u64 ts_ns(const struct timespec *ts)
+{
+  return (u64)ts->tv_sec * MOCK_BILLION + ts->tv_nsec;
+}
+
+static inline u64 now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts_ns(&ts);
+}
+
+/* what an instruction costs on the bus -- burn it, don't sleep it */
+static inline void spin_ns(int ns)
+{
+  u64 until;
+  if (ns <= 0) return;
+  until = now_ns() + ns;
+  while (now_ns() < until) 
+    ;
+}
+
+static inline int fail(int err) { mock_errno = err; return -1; }
+
+static inline double chan_freq(const comedi_t *it, unsigned chan)
+{
+  return it->cfg.freq * (1.0 + chan / 4.0);
+}
+
+/* uniform in [-noise, noise) */
+static inline double noise(comedi_t *it)
+{
+  it->rng = it->rng * 1664525 + 1013904223;
+  return it->cfg.noise * ((int)it->rng / 2147483648.0);
+}
+
+/* AI channel chan at sine phase 'phase' (0..2^32 is one cycle) */
+static inline double ai_volts(comedi_t *it, unsigned chan, u32 phase)
+{
+  if (it->cfg.loopback && it->cfg.ao) 
+    return ao_volts[it->board][chan % it->cfg.ao] + noise(it);
+
+  return it->cfg.amp * sine_table[phase >> (32 - SINE_BITS)] + noise(it);
+}
+
+static inline lsampl_t to_sample(comedi_t *it, double v, unsigned chanspec)
+{
+  unsigned r = CR_RANGE(chanspec);
+  if (r >= N_AI_RANGES) r = 0;
+  return comedi_from_phys(v, &it->ai_ranges[r], it->maxdata);
+}
+
+static int valid_subdev(const comedi_t *it, unsigned subdev)
+{
+  return it && (subdev == MOCK_AI_SUBDEV 
+                || (subdev == MOCK_AO_SUBDEV && it->cfg.ao));
+}
+
+/* the command is done, one way or another */
+static void stopped(comedi_t *it)
+{
+  it->running = 0;
+  if (it->board == 0 && it->cmd.scan_begin_src == TRIG_TIMER) {
+    pthread_mutex_lock(&board_lock);
+    ext_clock.running = 0;
+    pthread_mutex_unlock(&board_lock);
+  }
+}
+
+/* 
+   Produces however many scans the running command should have produced 
+   by now.  We do this lazily, whenever the client looks at the buffer, 
+   rather than from a thread -- the client can't tell the difference.  If
+   the scans don't fit the command dies, as with a real buffer overflow.
+*/
+static void generate(comedi_t *it)
+{
+  u64 target, n, fit, s;
+  unsigned c, n_chans, scan_bytes;
+  lsampl_t v;
+
+  if (!it->running) return;
+
+  n_chans = it->cmd.chanlist_len;
+  scan_bytes = n_chans * it->bytes_per_sample;
+  if (it->cmd.scan_begin_src == TRIG_EXT) {
+    u64 now = now_ns(), armed = ts_ns(&it->start), base = 0;
+
+    /* scan k is on board 0's first scan after we were armed, plus k */
+    if (!ext_clock.running || now < ext_clock.start_ns) return;
+    if (armed > ext_clock.start_ns) 
+      base = (u64)((armed - ext_clock.start_ns) / ext_clock.period_ns);
+    target = (u64)((now - ext_clock.start_ns) / ext_clock.period_ns);
+    target = target > base ? target - base : 0;
+  } else 
+    target = (u64)((now_ns() - ts_ns(&it->start)) / it->period_ns);
+  if (it->cmd.stop_src == TRIG_COUNT && target > it->cmd.stop_arg)
+    target = it->cmd.stop_arg;
+  if (target <= it->scans_done) return;
+
+  n = target - it->scans_done;
+  fit = (it->buf_sz - (it->written - it->read)) / scan_bytes;
+  if (n > fit) n = fit;
+
+  for (s = it->scans_done; s < it->scans_done + n; s++) 
+    for (c = 0; c < n_chans; c++) {
+      unsigned pos = it->written % it->buf_sz;
+      
+      v = to_sample(it, ai_volts(it, CR_CHAN(it->chanlist[c]), 
+                                 (u32)(s * it->phase_inc[c])),
+                    it->chanlist[c]);
+      if (it->bytes_per_sample == sizeof(sampl_t))
+        *(sampl_t *)(it->buf + pos) = v;
+      else
+        *(lsampl_t *)(it->buf + pos) = v;
+      it->written += it->bytes_per_sample;
+    }
+  it->scans_done += n;
+
+  if (it->scans_done < target) {
+    /* overflowed */
+    stopped(it);
+    mock_errno = EPIPE;
+  } else if (it->cmd.stop_src == TRIG_COUNT 
+             && it->scans_done >= it->cmd.stop_arg)
+    stopped(it);
+}
+
+/*---------------------------------------------------------------------------
+  The libcomedi API
+---------------------------------------------------------------------------*/
+
+comedi_t *comedi_open(const char *fn)
+{
+  comedi_t *it;
+  const char *p;
+  char tmpl[] = "/tmp/mock_comediXXXXXX";
+  unsigned i;
+  int board, pagesz = getpagesize();
+
+  pthread_mutex_lock(&board_lock);
+  load_config();
+  pthread_mutex_unlock(&board_lock);
+
+  /* /dev/comediN, or anything else ending in N, is board N */
+  for (p = fn + strlen(fn); p > fn && p[-1] >= '0' && p[-1] <= '9'; p--)
+    ;
+  if (!*p || (board = atoi(p)) >= config.boards) { 
+    mock_errno = ENODEV; 
+    return 0; 
+  }
+
+  if (!(it = (comedi_t *)calloc(1, sizeof(*it)))) { 
+    mock_errno = ENOMEM; 
+    return 0; 
+  }
+
+  it->board = board;
+  it->cfg = config;
+  it->rng = 12345 + board;
+  it->maxdata = (1U << it->cfg.bits) - 1;
+  it->bytes_per_sample = (it->cfg.bits > 16 ? sizeof(lsampl_t) 
+                                            : sizeof(sampl_t));
+  for (i = 0; i < N_AI_RANGES; i++) it->ai_ranges[i] = ai_range_table[i];
+  for (i = 0; i < N_AO_RANGES; i++) it->ao_ranges[i] = ao_range_table[i];
+  snprintf(it->board_name, sizeof(it->board_name), "mock-%dai-%dao", 
+           it->cfg.ai, it->cfg.ao);
+
+  /* round up to whole pages, like comedi's buffers */
+  it->buf_sz = (it->cfg.buf + pagesz - 1) / pagesz * pagesz;
+  it->fd = mkstemp(tmpl);
+  if (it->fd < 0) { free(it); mock_errno = errno; return 0; }
+  unlink(tmpl);
+  if (ftruncate(it->fd, it->buf_sz) 
+      || (it->buf = (char *)mmap(0, it->buf_sz, PROT_READ | PROT_WRITE, 
+                                 MAP_SHARED, it->fd, 0)) == MAP_FAILED) {
+    mock_errno = errno;
+    close(it->fd);
+    free(it);
+    return 0;
+  }
+
+  return it;
+}
+
+int comedi_close(comedi_t *it)
+{
+  int i;
+
+  if (!it) return fail(EINVAL);
+  if (it->running) stopped(it);
+
+  pthread_mutex_lock(&board_lock);
+  for (i = 0; i < 2; i++) 
+    if (lock_owner[it->board][i] == it) lock_owner[it->board][i] = 0;
+  pthread_mutex_unlock(&board_lock);
+
+  munmap(it->buf, it->buf_sz);
+  close(it->fd);
+  free(it->chanlist);
+  free(it->phase_inc);
+  free(it);
+  return 0;
+}
+
+int comedi_errno(void) { return mock_errno; }
+char *comedi_strerror(int err) { return strerror(err); }
+int comedi_fileno(comedi_t *it) { return it ? it->fd : fail(EINVAL); }
+
+const char *comedi_get_driver_name(comedi_t *it) 
+{ 
+  (void)it; 
+  return "mock_comedi"; 
+}
+
+const char *comedi_get_board_name(comedi_t *it) 
+{ 
+  return it ? it->board_name : 0; 
+}
+
+int comedi_get_n_subdevices(comedi_t *it) 
+{ 
+  return it ? (it->cfg.ao ? 2 : 1) : fail(EINVAL); 
+}
+
+int comedi_get_subdevice_type(comedi_t *it, unsigned subdev)
+{
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+  return subdev == MOCK_AI_SUBDEV ? COMEDI_SUBD_AI : COMEDI_SUBD_AO;
+}
+
+int comedi_find_subdevice_by_type(comedi_t *it, int type, unsigned start)
+{
+  if (!it) return fail(EINVAL);
+  if (type == COMEDI_SUBD_AI && start <= MOCK_AI_SUBDEV) return MOCK_AI_SUBDEV;
+  if (type == COMEDI_SUBD_AO && it->cfg.ao && start <= MOCK_AO_SUBDEV) 
+    return MOCK_AO_SUBDEV;
+  return fail(ENODEV);
+}
+
+int comedi_get_read_subdevice(comedi_t *it) 
+{ 
+  return it ? MOCK_AI_SUBDEV : fail(EINVAL); 
+}
+
+int comedi_get_write_subdevice(comedi_t *it)
+{
+  (void)it;
+  return fail(ENODEV); /* no AO commands */
+}
+
+int comedi_get_subdevice_flags(comedi_t *it, unsigned subdev)
+{
+  int flags;
+
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+  if (subdev != MOCK_AI_SUBDEV) return 0;
+
+  generate(it); /* so that an overflow shows up as !SDF_RUNNING */
+  flags = SDF_CMD;
+  if (it->running) flags |= SDF_RUNNING | SDF_BUSY;
+  if (it->bytes_per_sample == sizeof(lsampl_t)) flags |= SDF_LSAMPL;
+  return flags;
+}
+
+int comedi_get_n_channels(comedi_t *it, unsigned subdev)
+{
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+  return subdev == MOCK_AI_SUBDEV ? it->cfg.ai : it->cfg.ao;
+}
+
+int comedi_get_n_ranges(comedi_t *it, unsigned subdev, unsigned chan)
+{
+  (void)chan;
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+  return subdev == MOCK_AI_SUBDEV ? N_AI_RANGES : N_AO_RANGES;
+}
+
+comedi_range *comedi_get_range(comedi_t *it, unsigned subdev, unsigned chan,
+                               unsigned range)
+{
+  (void)chan;
+  if (!valid_subdev(it, subdev)) { mock_errno = EINVAL; return 0; }
+  if (subdev == MOCK_AI_SUBDEV && range < N_AI_RANGES) 
+    return &it->ai_ranges[range];
+  if (subdev == MOCK_AO_SUBDEV && range < N_AO_RANGES) 
+    return &it->ao_ranges[range];
+  mock_errno = EINVAL;
+  return 0;
+}
+
+lsampl_t comedi_get_maxdata(comedi_t *it, unsigned subdev, unsigned chan)
+{
+  (void)chan;
+  return valid_subdev(it, subdev) ? it->maxdata : 0;
+}
+
+int comedi_lock(comedi_t *it, unsigned subdev)
+{
+  int ret = 0;
+
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+
+  pthread_mutex_lock(&board_lock);
+  if (lock_owner[it->board][subdev] && lock_owner[it->board][subdev] != it) 
+    ret = fail(EBUSY);
+  else 
+    lock_owner[it->board][subdev] = it;
+  pthread_mutex_unlock(&board_lock);
+  return ret;
+}
+
+int comedi_unlock(comedi_t *it, unsigned subdev)
+{
+  int ret = 0;
+
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+
+  pthread_mutex_lock(&board_lock);
+  if (lock_owner[it->board][subdev] == it) lock_owner[it->board][subdev] = 0;
+  else if (lock_owner[it->board][subdev]) ret = fail(EBUSY);
+  pthread_mutex_unlock(&board_lock);
+  return ret;
+}
+
+double comedi_to_phys(lsampl_t data, comedi_range *r, lsampl_t maxdata)
+{
+  return r->min + (r->max - r->min) * data / maxdata;
+}
+
+lsampl_t comedi_from_phys(double v, comedi_range *r, lsampl_t maxdata)
+{
+  double d = (v - r->min) / (r->max - r->min) * maxdata + 0.5;
+  if (d < 0.0) return 0;
+  if (d > maxdata) return maxdata;
+  return (lsampl_t)d;
+}
+
+/* Instructions */
+
+int comedi_do_insn(comedi_t *it, comedi_insn *insn)
+{
+  unsigned i, chan = CR_CHAN(insn->chanspec), r = CR_RANGE(insn->chanspec);
+  struct timespec ts;
+  double t;
+
+  if (insn->insn == INSN_WAIT) { /* data[0] is in ns, any subdevice */
+    if (insn->n < 1) return fail(EINVAL);
+    spin_ns(insn->data[0]);
+    return 1;
+  }
+  if (!valid_subdev(it, insn->subdev)) return fail(EINVAL);
+
+  if (insn->subdev == MOCK_AI_SUBDEV) {
+    if (insn->insn != INSN_READ || chan >= (unsigned)it->cfg.ai) 
+      return fail(EINVAL);
+    generate(it);
+    if (it->running) return fail(EBUSY);
+
+    for (i = 0; i < insn->n; i++) {
+      spin_ns(it->cfg.insn_ns);
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      t = ts.tv_sec + ts.tv_nsec / (double)MOCK_BILLION;
+      t *= chan_freq(it, chan);
+      insn->data[i] = 
+        to_sample(it, ai_volts(it, chan, (u32)((t - floor(t)) * 4294967296.0)),
+                  insn->chanspec);
+    }
+    return insn->n;
+  }
+
+  /* AO */
+  if (insn->insn != INSN_WRITE || chan >= (unsigned)it->cfg.ao 
+      || r >= N_AO_RANGES) 
+    return fail(EINVAL);
+  for (i = 0; i < insn->n; i++) {
+    spin_ns(it->cfg.insn_ns);
+    ao_volts[it->board][chan] = 
+      comedi_to_phys(insn->data[i], &it->ao_ranges[r], it->maxdata);
+  }
+  return insn->n;
+}
+
+int comedi_do_insnlist(comedi_t *it, comedi_insnlist *il)
+{
+  unsigned i;
+
+  for (i = 0; i < il->n_insns; i++)
+    if (comedi_do_insn(it, &il->insns[i]) < 0) 
+      return i ? (int)i : -1;
+  return il->n_insns;
+}
+
+int comedi_data_read(comedi_t *it, unsigned subdev, unsigned chan, 
+                     unsigned range, unsigned aref, lsampl_t *data)
+{
+  comedi_insn insn;
+
+  memset(&insn, 0, sizeof(insn));
+  insn.insn = INSN_READ;
+  insn.n = 1;
+  insn.data = data;
+  insn.subdev = subdev;
+  insn.chanspec = CR_PACK(chan, range, aref);
+  return comedi_do_insn(it, &insn) < 0 ? -1 : 1;
+}
+
+int comedi_data_write(comedi_t *it, unsigned subdev, unsigned chan, 
+                      unsigned range, unsigned aref, lsampl_t data)
+{
+  comedi_insn insn;
+
+  memset(&insn, 0, sizeof(insn));
+  insn.insn = INSN_WRITE;
+  insn.n = 1;
+  insn.data = &data;
+  insn.subdev = subdev;
+  insn.chanspec = CR_PACK(chan, range, aref);
+  return comedi_do_insn(it, &insn) < 0 ? -1 : 1;
+}
+
+/* Commands */
+
+static inline int single_src(unsigned src) { return src && !(src & (src-1)); }
+
+/* returns 0 if ok, or the comedi step number that failed (1-5), like 
+   the driver's do_cmdtest */
+int comedi_command_test(comedi_t *it, comedi_cmd *cmd)
+{
+  unsigned min_convert, min_scan, i, err = 0, tmp;
+
+  if (!it || cmd->subdev != MOCK_AI_SUBDEV) return fail(EINVAL);
+
+  /* step 1: trigger sources we support at all */
+  tmp = cmd->start_src;      cmd->start_src &= TRIG_NOW;        
+  err |= !cmd->start_src || tmp != cmd->start_src;
+  tmp = cmd->scan_begin_src; cmd->scan_begin_src &= TRIG_TIMER | TRIG_EXT; 
+  err |= !cmd->scan_begin_src || tmp != cmd->scan_begin_src;
+  tmp = cmd->convert_src;    cmd->convert_src &= TRIG_TIMER | TRIG_NOW;
+  err |= !cmd->convert_src || tmp != cmd->convert_src;
+  tmp = cmd->scan_end_src;   cmd->scan_end_src &= TRIG_COUNT;
+  err |= !cmd->scan_end_src || tmp != cmd->scan_end_src;
+  tmp = cmd->stop_src;       cmd->stop_src &= TRIG_COUNT | TRIG_NONE;
+  err |= !cmd->stop_src || tmp != cmd->stop_src;
+  if (err) return 1;
+
+  /* step 2: one of each */
+  if (!single_src(cmd->scan_begin_src) || !single_src(cmd->convert_src) 
+      || !single_src(cmd->stop_src)) 
+    return 2;
+
+  /* step 3: arguments */
+  min_convert = MOCK_BILLION / it->cfg.max_rate;
+  if (!min_convert) min_convert = 1;
+  if (cmd->start_arg) cmd->start_arg = 0, err++;
+  if (cmd->convert_src == TRIG_TIMER && cmd->convert_arg < min_convert) 
+    cmd->convert_arg = min_convert, err++;
+  if (cmd->convert_src == TRIG_NOW && cmd->convert_arg) 
+    cmd->convert_arg = 0, err++;
+  if (!cmd->chanlist_len) cmd->chanlist_len = 1, err++;
+  if (cmd->scan_end_arg != cmd->chanlist_len) 
+    cmd->scan_end_arg = cmd->chanlist_len, err++;
+  min_scan = cmd->chanlist_len 
+    * (cmd->convert_src == TRIG_TIMER ? cmd->convert_arg : min_convert);
+  if (cmd->scan_begin_src == TRIG_TIMER && cmd->scan_begin_arg < min_scan) 
+    cmd->scan_begin_arg = min_scan, err++;
+  if (cmd->stop_src == TRIG_NONE && cmd->stop_arg) cmd->stop_arg = 0, err++;
+  if (err) return 3;
+
+  /* step 4: convert timing has to fit inside the scan */
+  if (cmd->convert_src == TRIG_TIMER && cmd->scan_begin_src == TRIG_TIMER
+      && cmd->convert_arg * cmd->chanlist_len > cmd->scan_begin_arg) {
+    cmd->convert_arg = cmd->scan_begin_arg / cmd->chanlist_len;
+    return 4;
+  }
+
+  /* step 5: the channel list */
+  if (!cmd->chanlist) return 5;
+  for (i = 0; i < cmd->chanlist_len; i++)
+    if (CR_CHAN(cmd->chanlist[i]) >= (unsigned)it->cfg.ai 
+        || CR_RANGE(cmd->chanlist[i]) >= N_AI_RANGES)
+      return 5;
+
+  return 0;
+}
+
+int comedi_command(comedi_t *it, comedi_cmd *cmd)
+{
+  unsigned i;
+  double rate;
+
+  if (!it) return fail(EINVAL);
+  if (comedi_command_test(it, cmd)) return fail(EINVAL);
+  generate(it);
+  if (it->running) return fail(EBUSY);
+
+  it->cmd = *cmd;
+  free(it->chanlist);
+  free(it->phase_inc);
+  it->chanlist = (unsigned *)malloc(cmd->chanlist_len * sizeof(unsigned));
+  it->phase_inc = (u32 *)malloc(cmd->chanlist_len * sizeof(u32));
+  if (!it->chanlist || !it->phase_inc) return fail(ENOMEM);
+  memcpy(it->chanlist, cmd->chanlist, cmd->chanlist_len * sizeof(unsigned));
+  it->cmd.chanlist = it->chanlist;
+
+  if (cmd->scan_begin_src == TRIG_EXT) 
+    it->period_ns = ext_clock.running ? ext_clock.period_ns : 1e6;
+  else
+    it->period_ns = cmd->scan_begin_arg 
+                    * (1.0 + it->board * it->cfg.drift * 1e-6);
+  rate = (double)MOCK_BILLION / it->period_ns;
+  for (i = 0; i < cmd->chanlist_len; i++)
+    it->phase_inc[i] = 
+      (u32)(fmod(chan_freq(it, CR_CHAN(cmd->chanlist[i])) / rate, 1.0) 
+            * 4294967296.0);
+
+  it->scans_done = it->written = it->read = 0;
+  clock_gettime(CLOCK_MONOTONIC, &it->start);
+  it->running = 1;
+  if (it->board == 0 && cmd->scan_begin_src == TRIG_TIMER) {
+    pthread_mutex_lock(&board_lock);
+    ext_clock.start_ns = ts_ns(&it->start);
+    ext_clock.period_ns = it->period_ns;
+    ext_clock.running = 1;
+    pthread_mutex_unlock(&board_lock);
+  }
+  return 0;
+}
+
+int comedi_cancel(comedi_t *it, unsigned subdev)
+{
+  if (!valid_subdev(it, subdev)) return fail(EINVAL);
+  if (subdev == MOCK_AI_SUBDEV) {
+    if (it->running) stopped(it);
+    it->read = it->written;
+  }
+  return 0;
+}
+
+int comedi_poll(comedi_t *it, unsigned subdev)
+{
+  if (!valid_subdev(it, subdev) || subdev != MOCK_AI_SUBDEV) 
+    return fail(EINVAL);
+  generate(it);
+  return (int)(it->written - it->read);
+}
+
+int comedi_get_buffer_size(comedi_t *it, unsigned subdev)
+{
+  if (!valid_subdev(it, subdev) || subdev != MOCK_AI_SUBDEV) 
+    return fail(EINVAL);
+  return it->buf_sz;
+}
+
+int comedi_get_buffer_contents(comedi_t *it, unsigned subdev)
+{
+  return comedi_poll(it, subdev);
+}
+
+int comedi_get_buffer_offset(comedi_t *it, unsigned subdev)
+{
+  if (!valid_subdev(it, subdev) || subdev != MOCK_AI_SUBDEV) 
+    return fail(EINVAL);
+  return (int)(it->read % it->buf_sz);
+}
+
+int comedi_mark_buffer_read(comedi_t *it, unsigned subdev, unsigned bytes)
+{
+  if (!valid_subdev(it, subdev) || subdev != MOCK_AI_SUBDEV) 
+    return fail(EINVAL);
+  if (bytes > it->written - it->read) bytes = it->written - it->read;
+  it->read += bytes;
+  return bytes;
+}
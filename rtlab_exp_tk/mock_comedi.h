@@ -0,0 +1,86 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _MOCK_COMEDI_H
+#define _MOCK_COMEDI_H
+
+/*
+  Mock Comedi dot h
+  -----------------
+  mock_comedi.c is a stand-in for libcomedi: link it in place of -lcomedi
+  and Probe, ComediDevice, ComediCoprocess, SampleStructComediSource and
+  daq_recorder all run without a board or the comedi kernel modules.  It
+  only implements the part of the library that we use.
+
+  Each /dev/comediN (N < boards) is a fake board with an AI subdevice (0)
+  that can do commands, and an AO subdevice (1).  AI data comes from 
+  table-driven sine waves plus noise, and with loopback on, AI channel i 
+  reads back whatever was last written to AO channel i % n_ao.  Timing 
+  is realistic enough to benchmark against: commands produce samples at 
+  the commanded rate (by the wall clock) and overflow the buffer if 
+  nobody reads them, and every instruction costs insn_ns of busy waiting,
+  like a register access over the bus would.
+
+  A command's scans are either timed by the board's own timer 
+  (TRIG_TIMER) or by an external scan clock (TRIG_EXT, any input), which
+  is always board 0's timer, as if it were routed to every board over 
+  RTSI.  A board armed on the external clock before board 0's command 
+  starts takes its first scan on board 0's first scan.  With drift, each 
+  board's timer is off from board 0's by a fixed amount, like real 
+  crystals are.
+
+  Boards are configured from the MOCK_COMEDI environment variable, or by
+  calling mock_comedi_configure() before the first comedi_open().  The 
+  spec is a comma-separated list of key=value pairs:
+
+    boards=N     number of boards                              (1)
+    ai=N         AI channels                                   (16)
+    ao=N         AO channels                                   (2)
+    bits=N       resolution; > 16 makes the AI subdev SDF_LSAMPL (16)
+    max_rate=HZ  fastest conversion rate the AI subdevice does  (250000)
+    buf=BYTES    size of the AI command buffer                 (1048576)
+    insn_ns=NS   cost of each instruction in an insn list      (2000)
+    freq=HZ      sine frequency of AI channel 0; channel c 
+                 gets freq * (1 + c/4)                         (1)
+    amp=V        sine amplitude                                (1)
+    noise=V      peak uniform noise added to every AI sample   (0.01)
+    loopback=0|1 AI channel i follows AO channel i % ao        (0)
+    drift=PPM    board N's timer runs N * drift ppm slow        (0)
+
+  eg: MOCK_COMEDI=boards=2,ai=64,max_rate=1000000,loopback=1
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /* Replaces the configuration (from the environment or a previous call)
+     with spec.  Boards already open keep their old configuration.  
+     Returns 0 on success, -1 if spec had an unknown key or bad value, 
+     in which case nothing is changed. */
+  extern int mock_comedi_configure(const char *spec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
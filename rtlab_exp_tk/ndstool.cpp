@@ -589,6 +589,14 @@ int InfoOp::doIt()
        << (hasDroppedScans ? " (file has holes/dropped scans)" : "") << endl
        << "Sampling rate:           " << samplingRate.c_str() << " Hz" << endl
        << "Time-length:             " << fileTime << " seconds" << endl;
+
+  /* files from before oversampling existed just don't have these */
+  QString oversample = in.getUserMetaData("ai_oversample"),
+          decimation = in.getUserMetaData("ai_decimation");
+
+  if (!oversample.isEmpty())
+    cout << "AI oversampling:         " << oversample.latin1() 
+         << " (" << decimation.latin1() << ")" << endl;
   
   
   return 0; /* success */
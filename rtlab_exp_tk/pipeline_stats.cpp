@@ -0,0 +1,342 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <string>
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "common.h"
+#include "pipeline_stats.h"
+
+static LatencyHistogram histograms[N_PIPELINE_STAGES];
+static scan_index_t dropped[SHD_MAX_CHANNELS];
+
+/* the scan clock: scan clock_scan was being acquired at clock_us */
+static scan_index_t clock_scan = 0;
+static uint64 clock_us = 0;
+static sampling_rate_t clock_rate = 0;
+
+static const char * const stage_names[N_PIPELINE_STAGES] = 
+  { "Read", "Write", "Paint" };
+
+static inline uint64 now_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return static_cast<uint64>(tv.tv_sec) * MILLION + tv.tv_usec;
+}
+
+/*----------------------------------------------------------------------------
+  LatencyHistogram
+----------------------------------------------------------------------------*/
+
+void
+LatencyHistogram::reset()
+{
+  for (uint i = 0; i < N_BUCKETS; i++) buckets[i] = 0;
+  n = sum_us = max_us = 0;
+  min_us = ~0ULL;
+}
+
+/* values < 8 get their own bucket, after that each power of two is split
+   into 8 buckets using the 3 bits under the most significant bit */
+uint
+LatencyHistogram::bucketOf(uint64 us)
+{
+  if (us < 8) return us;
+
+  uint msb = 63;
+  while (!(us & (1ULL << msb))) msb--;
+
+  uint b = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+  return (b < N_BUCKETS ? b : N_BUCKETS - 1);
+}
+
+uint64
+LatencyHistogram::bucketTop(uint b)
+{
+  if (b < 8) return b;
+  
+  uint msb = b / 8 + 2, sub = b % 8;
+  return ((8ULL + sub + 1) << (msb - 3)) - 1;
+}
+
+void
+LatencyHistogram::add(uint64 us)
+{
+  buckets[bucketOf(us)]++;
+  n++;
+  sum_us += us;
+  if (us > max_us) max_us = us;
+  if (us < min_us) min_us = us;
+}
+
+uint64
+LatencyHistogram::percentile(double p) const
+{
+  if (!n) return 0;
+
+  uint64 want = static_cast<uint64>(p * n), seen = 0;
+  if (want >= n) want = n - 1;
+
+  for (uint b = 0; b < N_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen > want) {
+      uint64 top = bucketTop(b);
+      return (top > max_us ? max_us : top);
+    }
+  }
+  return max_us;
+}
+
+/*----------------------------------------------------------------------------
+  pipeline* functions
+----------------------------------------------------------------------------*/
+
+void 
+pipelineScanClock(scan_index_t current, sampling_rate_t rate)
+{
+  clock_scan = current;
+  clock_rate = rate;
+  clock_us = now_us();
+}
+
+void 
+pipelineNote(PipelineStage stage, scan_index_t scan)
+{
+  if (!clock_rate || stage >= N_PIPELINE_STAGES) return;
+
+  uint64 now = now_us();
+  /* when scan was acquired, according to the scan clock */
+  int64 scans_ago = static_cast<int64>(clock_scan) - static_cast<int64>(scan);
+  int64 acq_us = static_cast<int64>(clock_us) 
+                 - scans_ago * MILLION / static_cast<int64>(clock_rate);
+  int64 age = static_cast<int64>(now) - acq_us;
+
+  histograms[stage].add(age > 0 ? age : 0);
+}
+
+void 
+pipelineDrops(uint chan, scan_index_t n)
+{
+  if (chan < SHD_MAX_CHANNELS) dropped[chan] += n;
+}
+
+const LatencyHistogram & 
+pipelineHistogram(PipelineStage stage)
+{
+  return histograms[stage < N_PIPELINE_STAGES ? stage : 0];
+}
+
+scan_index_t 
+pipelineDropped(uint chan)
+{
+  return (chan < SHD_MAX_CHANNELS ? dropped[chan] : 0);
+}
+
+const char *
+pipelineStageName(PipelineStage stage)
+{
+  return (stage < N_PIPELINE_STAGES ? stage_names[stage] : "");
+}
+
+void 
+pipelineReset()
+{
+  for (uint i = 0; i < N_PIPELINE_STAGES; i++) histograms[i].reset();
+  for (uint i = 0; i < SHD_MAX_CHANNELS; i++) dropped[i] = 0;
+}
+
+string 
+pipelineReport()
+{
+  char buf[256];
+  string ret;
+
+  ret += "Latency since acquisition, in milliseconds:\n\n";
+  snprintf(buf, sizeof(buf), "  %-8s %12s %10s %10s %10s %10s\n",
+           "Stage", "Count", "Mean", "p50", "p99", "Max");
+  ret += buf;
+
+  for (uint i = 0; i < N_PIPELINE_STAGES; i++) {
+    const LatencyHistogram & h = histograms[i];
+    snprintf(buf, sizeof(buf), 
+             "  %-8s %12llu %10.2f %10.2f %10.2f %10.2f\n",
+             stage_names[i], static_cast<unsigned long long>(h.count()),
+             h.mean() / 1000.0, h.percentile(0.5) / 1000.0, 
+             h.percentile(0.99) / 1000.0, h.max() / 1000.0);
+    ret += buf;
+  }
+
+  ret += "\nDropped samples per channel:\n\n";
+
+  uint n_lines = 0;
+  for (uint c = 0; c < SHD_MAX_CHANNELS; c++) {
+    if (!dropped[c]) continue;
+    snprintf(buf, sizeof(buf), "  Channel %3u: %llu\n", c, 
+             static_cast<unsigned long long>(dropped[c]));
+    ret += buf;
+    n_lines++;
+  }
+  if (!n_lines) ret += "  (none)\n";
+
+  return ret;
+}
+
+bool 
+pipelineDump(const char *filename)
+{
+  FILE *f = fopen(filename, "w");
+
+  if (!f) return false;
+
+  string r = pipelineReport();
+  bool ok = fwrite(r.c_str(), 1, r.length(), f) == r.length();
+  return fclose(f) == 0 && ok;
+}
+
+/*----------------------------------------------------------------------------
+  rtlab.o RT loop stats
+----------------------------------------------------------------------------*/
+
+/* subtracts since from now, histogram-wise.  max_ns is left alone, since 
+   there's no telling what it was in between */
+static void
+rtHistSince(RTHistogram & h, const RTHistogram & since)
+{
+  h.count -= since.count;
+  h.sum_ns -= since.sum_ns;
+  for (uint b = 0; b < RT_HIST_BUCKETS; b++) h.buckets[b] -= since.buckets[b];
+}
+
+/* upper bound of the bucket that percentile p falls in, in ns, capped at 
+   max_ns */
+static uint64
+rtHistPercentile(const RTHistogram & h, double p)
+{
+  if (!h.count) return 0;
+
+  uint64 want = static_cast<uint64>(p * h.count), seen = 0;
+  if (want >= h.count) want = h.count - 1;
+
+  for (uint b = 0; b < RT_HIST_BUCKETS; b++) {
+    seen += h.buckets[b];
+    if (seen > want) {
+      uint64 top = rt_hist_bucket_top(b);
+      return (top > h.max_ns ? h.max_ns : top);
+    }
+  }
+  return h.max_ns;
+}
+
+static string
+rtHistLine(const char *name, const RTHistogram & h)
+{
+  char buf[256];
+
+  snprintf(buf, sizeof(buf), 
+           "  %-24s %10u %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+           name, h.count, 
+           (h.count ? static_cast<double>(h.sum_ns) / h.count / 1000.0 : 0.0),
+           rtHistPercentile(h, 0.5) / 1000.0, 
+           rtHistPercentile(h, 0.99) / 1000.0, 
+           rtHistPercentile(h, 0.999) / 1000.0, h.max_ns / 1000.0);
+  return buf;
+}
+
+/* the kernel's symbol table, address -> name.  Read once, it doesn't 
+   change for the functions we care about while rtlab.o is loaded */
+static const char *
+kernelSymbol(uint64 addr)
+{
+  static map<uint64, string> syms;
+  static bool loaded = false;
+
+  if (!loaded) {
+    static const char * const files[] = { "/proc/kallsyms", "/proc/ksyms" };
+    char line[512], name[256], type;
+    unsigned long long a;
+
+    loaded = true;
+    for (uint i = 0; i < 2 && syms.empty(); i++) {
+      FILE *f = fopen(files[i], "r");
+      if (!f) continue;
+      while (fgets(line, sizeof(line), f)) {
+        /* kallsyms is 'addr type name [module]', ksyms is 'addr name' */
+        if (sscanf(line, "%llx %c %255s", &a, &type, name) == 3 
+            || sscanf(line, "%llx %255s", &a, name) == 2)
+          syms[a] = name;
+      }
+      fclose(f);
+    }
+  }
+
+  map<uint64, string>::const_iterator it = syms.find(addr);
+  return (it != syms.end() ? it->second.c_str() : 0);
+}
+
+string 
+rtLoopReport(const RTLoopStats & now, const RTLoopStats *since)
+{
+  /* one consistent-enough copy, since rtlab.o keeps writing to now */
+  RTLoopStats s;
+  memcpy(&s, &now, sizeof(s));
+
+  if (since) {
+    s.overruns -= since->overruns;
+    rtHistSince(s.jitter, since->jitter);
+    rtHistSince(s.tick, since->tick);
+    for (uint i = 0; i < RT_STATS_MAX_CALLBACKS; i++)
+      if (s.callbacks[i].function == since->callbacks[i].function)
+        rtHistSince(s.callbacks[i].cost, since->callbacks[i].cost);
+  }
+
+  char buf[256];
+  string ret;
+
+  ret += "RT loop timing, in microseconds:\n\n";
+  snprintf(buf, sizeof(buf), "  %-24s %10s %9s %9s %9s %9s %9s\n",
+           "", "Count", "Mean", "p50", "p99", "p99.9", "Max");
+  ret += buf;
+  ret += rtHistLine("Wakeup jitter", s.jitter);
+  ret += rtHistLine("Tick (total)", s.tick);
+
+  for (uint i = 0; i < RT_STATS_MAX_CALLBACKS; i++) {
+    if (!s.callbacks[i].function) continue;
+    const char *name = kernelSymbol(s.callbacks[i].function);
+    if (!name) {
+      snprintf(buf, sizeof(buf), "0x%llx", 
+               static_cast<unsigned long long>(s.callbacks[i].function));
+      name = buf;
+    }
+    ret += rtHistLine((string("  ") + name).c_str(), s.callbacks[i].cost);
+  }
+
+  snprintf(buf, sizeof(buf), 
+           "\nOverruns (tick not done when the next was due): %u\n",
+           s.overruns);
+  ret += buf;
+
+  return ret;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _PIPELINE_STATS_H
+#define _PIPELINE_STATS_H
+
+#include <string>
+#include "common.h"
+#include "shared_stuff.h"
+
+/*
+   Pipeline statistics -- where does the latency (and the data) go?
+
+   Every stage of the acquisition pipeline reports the scan index of 
+   data it just finished with.  Since we know which scan is being 
+   acquired 'right now' (pipelineScanClock(), usually fed from
+   ShmController::scanIndex()) and the sampling rate, the age of that data
+   since it was acquired is easy to compute, and goes into a per-stage
+   latency histogram.  Comparing the stages tells you where the time goes:
+
+     Read   -- SampleStructReader pulled it out of the source (FIFO, comedi
+               buffer, etc).  Recorded for the oldest sample of each read.
+     Write  -- a SampleWriter committed it to the file (or the file's 
+               buffer, in the case of SampleBinWriter).
+     Paint  -- an ECGGraph drew it on the screen.
+
+   Additionally, SampleStructReader reports per-channel drop counts here.
+
+   All of this is single-threaded (the GUI thread) and cheap: one 
+   gettimeofday() and a couple of integer ops per note, and the callers
+   only note once per read/flush/screen update.  Nothing is recorded 
+   until pipelineScanClock() has been called at least once.
+*/
+
+enum PipelineStage {
+  PIPELINE_READ = 0,
+  PIPELINE_WRITE,
+  PIPELINE_PAINT,
+  N_PIPELINE_STAGES
+};
+
+/* Log-linear histogram of latencies in microseconds: 8 buckets per 
+   power of two, so any percentile is accurate to within 12.5%. */
+class LatencyHistogram
+{
+ public:
+  LatencyHistogram() { reset(); }
+
+  void reset();
+  void add(uint64 us);
+
+  uint64 count() const { return n; }
+  uint64 max() const { return max_us; }
+  uint64 min() const { return (n ? min_us : 0); }
+  double mean() const { return (n ? static_cast<double>(sum_us) / n : 0.0); }
+  /* p is in [0, 1].  Returns the upper bound of the bucket p falls in */
+  uint64 percentile(double p) const;
+
+  static const uint N_BUCKETS = 240;
+
+ private:
+  static uint bucketOf(uint64 us);
+  static uint64 bucketTop(uint b);
+
+  uint64 buckets[N_BUCKETS];
+  uint64 n, sum_us, min_us, max_us;
+};
+
+/* Tell the stats that scan 'current' is being acquired right now, at 
+   'rate' scans per second */
+void pipelineScanClock(scan_index_t current, sampling_rate_t rate);
+
+/* Records that scan 'scan' just made it through 'stage' */
+void pipelineNote(PipelineStage stage, scan_index_t scan);
+
+/* Records n dropped samples on channel chan */
+void pipelineDrops(uint chan, scan_index_t n);
+
+const LatencyHistogram & pipelineHistogram(PipelineStage stage);
+scan_index_t pipelineDropped(uint chan);
+const char *pipelineStageName(PipelineStage stage);
+
+void pipelineReset();
+
+/* a multi-line human readable summary of all of the above */
+string pipelineReport();
+
+/* writes pipelineReport() to file, returns false on error (see errno) */
+bool pipelineDump(const char *filename);
+
+/* rtlab.o's RT loop statistics (see RTLoopStats in shared_stuff.h) as a
+   multi-line human readable report.  If since is non-NULL, only what 
+   happened after that earlier copy was taken is reported (except for 
+   maxima, which are since rtlab.o was loaded).  Callbacks are named from
+   /proc/kallsyms (or /proc/ksyms) if they can be found there. */
+string rtLoopReport(const RTLoopStats & now, const RTLoopStats *since = 0);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+#include <qlayout.h>
+#include <qtextedit.h>
+#include <qpushbutton.h>
+#include <qhbuttongroup.h>
+#include <qvgroupbox.h>
+#include <qtimer.h>
+#include <qfont.h>
+#include <qfiledialog.h>
+#include <qmessagebox.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pipeline_stats.h"
+#include "pipeline_stats_window.h"
+#include "shm.h"
+
+PipelineStatsWindow::PipelineStatsWindow(QWidget *parent, const char *name,
+                                         WFlags f)
+  : QWidget (parent, name, f), shmCtl(0)
+{
+  memset(&rt_baseline, 0, sizeof(rt_baseline));
+
+  QGridLayout *layout = new QGridLayout(this);
+
+  report = new QTextEdit(new QVGroupBox("Latency Since Acquisition", this));
+  report->setReadOnly(true);
+  report->setTextFormat(Qt::PlainText);
+  report->setWordWrap(QTextEdit::NoWrap);
+
+  QFont fixed("Courier");
+  fixed.setStyleHint(QFont::TypeWriter);
+  report->setFont(fixed);
+
+  layout->addWidget(report->parentWidget(), 0, 0);
+  layout->setRowStretch(0, 1);
+
+  rt_report = new QTextEdit(new QVGroupBox("RT Loop (rtlab.o)", this));
+  rt_report->setReadOnly(true);
+  rt_report->setTextFormat(Qt::PlainText);
+  rt_report->setWordWrap(QTextEdit::NoWrap);
+  rt_report->setFont(fixed);
+
+  layout->addWidget(rt_report->parentWidget(), 1, 0);
+  layout->setRowStretch(1, 1);
+  rt_report->parentWidget()->hide(); /* until setShmController() */
+
+  QHButtonGroup * hbg = new QHButtonGroup ("Operations", this, "Operations");
+  layout->addWidget(hbg, 2, 0);
+
+  QPushButton 
+    *resetBut = new QPushButton("Reset", hbg, "Reset Button"),
+    *saveBut = new QPushButton("Save...", hbg, "Save Button"),
+    *closeBut = new QPushButton("Close", hbg, "Close Button");
+
+  connect(resetBut, SIGNAL(clicked()), this, SLOT(resetStats()));
+  connect(saveBut, SIGNAL(clicked()), this, SLOT(saveAs()));
+  connect(closeBut, SIGNAL(clicked()), this, SLOT(close()));
+
+  timer = new QTimer(this);
+  connect(timer, SIGNAL(timeout()), this, SLOT(refresh()));
+
+  resize(520, 360);
+  refresh();
+}
+
+void PipelineStatsWindow::refresh()
+{
+  /* preserve the scroll position, otherwise this is unreadable if the 
+     report is longer than the window */
+  int x = report->contentsX(), y = report->contentsY();
+  report->setText(pipelineReport().c_str());
+  report->setContentsPos(x, y);
+
+  if (shmCtl) {
+    x = rt_report->contentsX(), y = rt_report->contentsY();
+    rt_report->setText(rtReport());
+    rt_report->setContentsPos(x, y);
+  }
+}
+
+void PipelineStatsWindow::setShmController(const ShmController *s)
+{
+  /* report everything since rtlab.o was loaded, until Reset is pressed */
+  shmCtl = s;
+  memset(&rt_baseline, 0, sizeof(rt_baseline));
+  if (shmCtl) rt_report->parentWidget()->show();
+  else rt_report->parentWidget()->hide();
+  refresh();
+}
+
+QString PipelineStatsWindow::rtReport() const
+{
+  if (!shmCtl) return QString::null;
+  if (!shmCtl->rtLoopStats().tick.count) 
+    return "No RT loop statistics -- the input source is not rtlab.o.";
+  return rtLoopReport(shmCtl->rtLoopStats(), &rt_baseline).c_str();
+}
+
+void PipelineStatsWindow::resetStats()
+{
+  pipelineReset();
+  if (shmCtl) memcpy(&rt_baseline, &shmCtl->rtLoopStats(), sizeof(rt_baseline));
+  refresh();
+}
+
+void PipelineStatsWindow::saveAs()
+{
+  QString f = QFileDialog::getSaveFileName(QString::null, QString::null, 
+                                           this, "Save Pipeline Statistics",
+                                           "Save Pipeline Statistics");
+  if (f.isNull()) return;
+
+  bool ok = pipelineDump(f.latin1());
+
+  if (ok && shmCtl) {
+    /* tack the RT loop report on the end */
+    FILE *fp = fopen(f.latin1(), "a");
+    QCString r = QCString("\n") + rtReport().latin1();
+    ok = fp && fwrite(r.data(), 1, r.length(), fp) == r.length();
+    if (fp && fclose(fp)) ok = false;
+  }
+
+  if (!ok) 
+    QMessageBox::warning(this, "Save Failed", 
+                         QString("Could not write to ") + f + ":\n" 
+                         + strerror(errno));
+}
+
+void PipelineStatsWindow::showEvent(QShowEvent *e)
+{
+  refresh();
+  timer->start(1000);
+  QWidget::showEvent(e);
+}
+
+void PipelineStatsWindow::hideEvent(QHideEvent *e)
+{
+  timer->stop();
+  QWidget::hideEvent(e);
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+#ifndef _PIPELINE_STATS_WINDOW_H
+#define _PIPELINE_STATS_WINDOW_H
+
+#include <qwidget.h>
+#include "shared_stuff.h"
+
+class QTextEdit;
+class QTimer;
+class ShmController;
+
+/* A little top-level window that shows pipelineReport() (see 
+   pipeline_stats.h), refreshed once a second while it's visible. 
+   If given a ShmController with setShmController(), it also shows 
+   rtLoopReport() for rtlab.o's RT loop. */
+class PipelineStatsWindow: public QWidget
+{
+  Q_OBJECT
+
+ public:
+  PipelineStatsWindow(QWidget *parent = 0, const char *name = 0, 
+                      WFlags f = 0);
+  ~PipelineStatsWindow() {};
+
+  void setShmController(const ShmController *s);
+
+ public slots:
+  void refresh();
+
+ private slots:
+  void resetStats();
+  void saveAs();
+
+ protected:
+  virtual void showEvent(QShowEvent *); /* from QWidget */
+  virtual void hideEvent(QHideEvent *); /* from QWidget */
+
+ private:
+  QString rtReport() const;
+
+  QTextEdit *report, *rt_report;
+  QTimer *timer;
+
+  const ShmController *shmCtl;
+  RTLoopStats rt_baseline; /* what Reset saw, we report the difference */
+};
+
+#endif
@@ -178,8 +178,22 @@ Probe::do_probe(const QString & filename)
       continue;
     }
     sdev.type = ComediSubDevice::int2sd(types_to_probe[i]);
+
+    /* boards rtlab.o folds into its AI scan are only reachable through
+       the first one, whose channel space covers all of them */
+    bool aggregated = false;
+    if (have_rt_process && i == 0 && shm->n_ai_boards > 1) {
+      if (shm->ai_minor == dev.minor) aggregated = true;
+      else {
+	uint b;
+	for (b = 1; b < shm->n_ai_boards; b++)
+	  if (shm->ai_boards[b].minor == dev.minor) break;
+	if (b < shm->n_ai_boards) continue;
+      }
+    }
     
-    sdev.n_channels = comedi_get_n_channels(it, sdev.id);
+    sdev.n_channels = aggregated ? shm->n_ai_chans 
+                                 : comedi_get_n_channels(it, sdev.id);
     if (sdev.n_channels) {
       sdev.ranges().resize(comedi_get_n_ranges(it, sdev.id, 0));
       for (uint j = 0; j < sdev.ranges().size(); j++) {
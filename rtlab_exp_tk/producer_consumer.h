@@ -53,8 +53,10 @@ class TwoWayNode
     { r->_l.erase(this); _l.erase(r); return _l.size(); };
   uint remove(TwoWayNode &r) { return(remove(&r)); };
 
+  /* iterates over a copy since Remover erases from _l as it goes */
   uint removeAll() 
-    { for_each(_l.begin(), _l.end(), Remover(this)); return _l.size(); };
+    { set<TwoWayNode *> l(_l); 
+      for_each(l.begin(), l.end(), Remover(this)); return _l.size(); };
   
   bool connected(TwoWayNode * r) const 
     { return (_l.find(r) != _l.end()); };
@@ -0,0 +1,282 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <qobject.h>
+#include "ring_source.h"
+#include "exception.h"
+
+SampleStructRingSource::SampleStructRingSource(SampleRing *r)
+  : ring(r), shm_type(ShmController::NotSharedOrUnknown)
+{
+  init();
+}
+
+SampleStructRingSource::SampleStructRingSource(ShmController::ShmType t, 
+                                               uint n_slots) 
+  throw (ShmException)
+  : shm_type(t)
+{
+  ring = reinterpret_cast<SampleRing *>
+    (ShmController::attachRegion(t, SAMPLE_RING_NAME, 
+                                 SAMPLE_RING_BYTES(n_slots)));
+
+  if (!ring || ring->magic != SAMPLE_RING_MAGIC || ring->n_slots != n_slots) {
+    ShmController::detachRegion(t, SAMPLE_RING_NAME, ring);
+    throw ShmException(QObject::tr("Could not attach to ") + SAMPLE_RING_NAME,
+                       QObject::tr("The AI sample ring exported by " 
+                                   RTLAB_MODULE_NAME " could not be attached "
+                                   "to, or it does not look like a sample "
+                                   "ring of the size advertised in the "
+                                   "shared memory struct."));
+  }
+
+  init();
+}
+
+void
+SampleStructRingSource::init()
+{
+  mask = ring->n_slots - 1;
+  slack = ring->n_slots / 4;
+  n_lost = 0;
+
+  /* grab a free tail slot.  Readers come and go rarely enough that 
+     a compare-and-swap is all the locking this needs. */
+  for (tail = 0; tail < SAMPLE_RING_MAX_READERS; tail++)
+    if (__sync_bool_compare_and_swap(&ring->tails[tail].in_use, 0, 1)) break;
+  if (tail >= SAMPLE_RING_MAX_READERS) tail = -1;
+
+  /* like a freshly flushed fifo, we start out with nothing to read */
+  pos = ring->head;
+  publish(pos);
+}
+
+SampleStructRingSource::~SampleStructRingSource()
+{
+  if (tail > -1) ring->tails[tail].in_use = 0;
+  if (shm_type != ShmController::NotSharedOrUnknown)
+    ShmController::detachRegion(shm_type, SAMPLE_RING_NAME, ring);
+}
+
+void
+SampleStructRingSource::publish(uint p)
+{
+  if (tail > -1) ring->tails[tail].pos = p;
+}
+
+int
+SampleStructRingSource::numSamplesReady() const
+{
+  uint n = ring->head - pos;
+  return (n > ring->n_slots ? ring->n_slots : n);
+}
+
+size_t
+SampleStructRingSource::numBytesReady() const
+{
+  return numSamplesReady() * SAMPLE_SOURCE_BLOCK_SZ_BYTES;
+}
+
+const SampleStruct *
+SampleStructRingSource::read(int b_time)
+{
+  uint head = ring->head, n;
+  struct timeval start, now;
+  
+  if (head == pos && b_time) {
+    /* nothing there yet: nap until there is, or b_time seconds are up */
+    gettimeofday(&start, 0);
+    do {
+      usleep(suggestPollWaitTime() * 1000);
+      head = ring->head;
+      gettimeofday(&now, 0);
+    } while (head == pos 
+             && (b_time < 0 || now.tv_sec - start.tv_sec < b_time));
+  }
+
+  /* don't look at the slots before we've seen the head that covers them */
+  SAMPLE_RING_RMB();
+
+  n = head - pos;
+  
+  if (n > ring->n_slots - slack) {
+    /* about to be (or already) lapped -- jump to the middle of the ring so
+       that we have some room again */
+    uint new_pos = head - ring->n_slots / 2;
+    n_lost += new_pos - pos;
+    pos = new_pos;
+    n = head - pos;
+  }
+
+  /* copy out one contiguous run, the rest is for the next read() */
+  if (n > ring->n_slots - (pos & mask)) n = ring->n_slots - (pos & mask);
+
+  if (n * SAMPLE_SOURCE_BLOCK_SZ_BYTES > read_memory_sz) {
+    if (read_memory) delete read_memory;
+    read_memory_sz = n * SAMPLE_SOURCE_BLOCK_SZ_BYTES;
+    read_memory = (SampleStruct *)new char[read_memory_sz];
+  }
+  publish(pos);
+  memcpy(read_memory, ring->buf + (pos & mask), 
+         n * SAMPLE_SOURCE_BLOCK_SZ_BYTES);
+
+  /* the producer may have come around while we were copying: whatever it
+     got to is garbage now, so drop it and call it lost */
+  uint n_bad = sample_ring_overwritten(ring, pos, n);
+  
+  n_lost += n_bad;
+  pos += n;
+  publish(pos);
+  num_bytes_last_read = (n - n_bad) * SAMPLE_SOURCE_BLOCK_SZ_BYTES;
+
+  return read_memory + n_bad;
+}
+
+void
+SampleStructRingSource::flush()
+{
+  pos = ring->head;
+  publish(pos);
+  num_bytes_last_read = 0;
+}
+
+#ifdef TEST_SAMPLE_RING
+/* 
+   Userspace producer/consumer pair, no rtlab.o or board required:
+   a thread puts n_chans-channel scans into a ring at rate_hz while main()
+   reads them back and checks that scan indices and channels come out in
+   order, with any gaps accounted for by numSamplesLost().  Once a second
+   the reader dawdles for two ring's worth of samples between read() and
+   looking at what it got, so it does get lapped; every sample is checked
+   against what the producer wrote for that scan and channel, so anything
+   torn or overwritten under the reader shows up.
+
+   usage: test_sample_ring [rate_hz [n_chans [n_slots [secs]]]]
+*/
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <qstring.h>
+
+static SampleRing *test_ring;
+static uint test_rate = 10000, test_chans = 16;
+static volatile bool test_stop = false;
+
+static void *producer(void *)
+{
+  SampleStruct scan[SHD_MAX_CHANNELS];
+  struct timeval start, now;
+  scan_index_t si = 0, due;
+
+  memset(scan, 0, sizeof(scan));
+  gettimeofday(&start, 0);
+  while (!test_stop) {
+    gettimeofday(&now, 0);
+    due = ( static_cast<scan_index_t>(now.tv_sec - start.tv_sec) * MILLION
+            + now.tv_usec - start.tv_usec ) * test_rate / MILLION;
+    for ( ; si < due; si++) {
+      for (uint c = 0; c < test_chans; c++) {
+        scan[c].scan_index = si;
+        scan[c].channel_id = c;
+        scan[c].data = c + si * 1e-6;
+      }
+      sample_ring_put(test_ring, scan, test_chans);
+    }
+    usleep(1000);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  uint n_slots = 1 << 16, secs = 5;
+  
+  if (argc > 1) test_rate = QString(argv[1]).toUInt();
+  if (argc > 2) test_chans = QString(argv[2]).toUInt();
+  if (argc > 3) n_slots = sample_ring_pow2_floor(QString(argv[3]).toUInt());
+  if (argc > 4) secs = QString(argv[4]).toUInt();
+  if (test_chans < 1 || test_chans > SHD_MAX_CHANNELS) test_chans = 16;
+
+  test_ring = reinterpret_cast<SampleRing *>(malloc(SAMPLE_RING_BYTES(n_slots)));
+  sample_ring_init(test_ring, n_slots);
+
+  SampleStructRingSource *src = new SampleStructRingSource(test_ring);
+  pthread_t thr;
+  pthread_create(&thr, 0, producer, 0);
+
+  struct timeval start, now;
+  uint64 n_read = 0, n_bad = 0, n_torn = 0;
+  scan_index_t expect_si = 0; 
+  uint expect_chan = 0, lap_us, last_lap = 0;
+  bool first = true;
+
+  /* long enough for the producer to go around twice */
+  lap_us = static_cast<uint>(2ULL * n_slots * MILLION / test_chans / test_rate);
+
+  gettimeofday(&start, 0);
+  do {
+    const SampleStruct *s = src->read(1);
+    uint n = src->numSamplesLastRead();
+
+    gettimeofday(&now, 0);
+    if (n && static_cast<uint>(now.tv_sec - start.tv_sec) != last_lap) {
+      last_lap = now.tv_sec - start.tv_sec;
+      usleep(lap_us); 
+    }
+
+    for (uint i = 0; i < n; i++, n_read++) {
+      if (s[i].channel_id >= test_chans 
+          || s[i].data != s[i].channel_id + s[i].scan_index * 1e-6)
+        n_torn++; /* not what the producer put there */
+      if (!first && (s[i].scan_index != expect_si 
+                     || s[i].channel_id != expect_chan)
+          && s[i].scan_index * test_chans + s[i].channel_id 
+             < expect_si * test_chans + expect_chan)
+        n_bad++; /* went backwards -- ring is broken */
+      first = false;
+      expect_chan = s[i].channel_id + 1;
+      expect_si = s[i].scan_index;
+      if (expect_chan >= test_chans) expect_chan = 0, expect_si++;
+    }
+    gettimeofday(&now, 0);
+  } while (static_cast<uint>(now.tv_sec - start.tv_sec) < secs);
+
+  test_stop = true;
+  pthread_join(thr, 0);
+
+  cerr << "Read " << uint64_to_cstr(n_read) << " samples ("
+       << test_chans << " chans at " << test_rate << "Hz, " << n_slots 
+       << " slots), lost " << uint64_to_cstr(src->numSamplesLost()) 
+       << ", out of order " << uint64_to_cstr(n_bad) 
+       << ", bad contents " << uint64_to_cstr(n_torn) << endl;
+
+  /* we made sure to get lapped, so there had better be losses */
+  bool ok = !n_bad && !n_torn && src->numSamplesLost();
+
+  delete src; /* it touches the ring on the way out */
+  free(test_ring);
+  return ok ? 0 : 1;
+}
+#endif
@@ -0,0 +1,83 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _RING_SOURCE_H
+#define _RING_SOURCE_H
+
+#include "sample_source.h"
+#include "sample_ring.h"
+#include "shm.h"
+
+/*
+   SampleStructRingSource --
+
+   Reads SampleStructs out of a SampleRing (see sample_ring.h), which is 
+   how rtlab.o and the ComediCoprocess hand us samples now.  read() does
+   no syscall: it memcpy's one contiguous run out of the ring and then 
+   checks that the producer didn't lap us while it was at it, throwing 
+   away whatever got overwritten.  A reader that gets within a quarter 
+   of the ring of being lapped is moved forward before it reads, so that
+   should be rare.  The samples skipped over either way are counted in 
+   numSamplesLost(), and also show up as dropped samples in 
+   SampleStructReader, like they would if an RT-FIFO had overflowed.
+
+   Each instance registers itself in one of the ring's tails[] so 
+   several readers (daq_system, daq_recorder, a plugin..) can follow the
+   same ring independently.  If all of them are taken we still work, we
+   just don't publish our position.
+*/
+class SampleStructRingSource : public SampleStructSource
+{
+ public:
+  /* read from a ring we already have mapped, for instance 
+     ComediCoprocess::ring().  The ring is not detached on destruction. */
+  SampleStructRingSource(SampleRing *ring);
+
+  /* attach to rtlab.o's AI ring via shm mechanism t (use 
+     ShmController::type() and ShmController::aiRingSlots()) */
+  SampleStructRingSource(ShmController::ShmType t, uint n_slots)
+    throw (ShmException);
+
+  virtual ~SampleStructRingSource();
+
+  virtual size_t numBytesReady() const; 
+  virtual int numSamplesReady() const; 
+  virtual const SampleStruct * read(int b_time = -1);
+  virtual void flush(); /* skip to the producer's current position */
+  virtual int suggestPollWaitTime() const { return DESIRED_FIFO_FEEL_MS; }
+
+  /* samples we skipped over because the producer lapped us */
+  uint64 numSamplesLost() const { return n_lost; }
+
+ private:
+  void init();
+  void publish(uint p);
+
+  SampleRing *ring;
+  ShmController::ShmType shm_type; /* NotSharedOrUnknown if not ours */
+  uint mask, slack;
+  uint pos;  /* next sample to hand out, in the same units as ring->head */
+  int tail;  /* our index into ring->tails, or -1 */
+  uint64 n_lost;
+};
+
+#endif
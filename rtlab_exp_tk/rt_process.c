@@ -22,6 +22,7 @@
  */
 
 #define EXPORT_SYMTAB 1 /* <--- for annoying kernels that need this */
+#ifdef __KERNEL__
 #include <linux/module.h> 
 #include <linux/kernel.h>
 #include <linux/version.h>
@@ -35,6 +36,9 @@
 #include <linux/fs.h> /* for the determine_minor() functionality       */
 #include <linux/proc_fs.h>
 #include <asm/div64.h> /* for do_div 64-bit division mavro             */
+#include <asm/system.h> /* mb() for publishing the callback table        */
+#include <linux/sched.h> /* schedule_timeout()                             */
+#endif /* otherwise RTOS_POSIX, and rtos_middleman.h stands in for these */
 
 #define RTLAB_INTERNAL
 
@@ -50,10 +54,13 @@
          (!( ((uint)rtp_shm->scan_index) % 10000))
 #endif
 
-#include <linux/comedilib.h>
 #include "shared_stuff.h"     /* header file that is shared between user/kernel
 				 in this system */
 #include "rt_process.h"       /* header file specific to this program */
+#include "sample_ring.h"      /* shm ring for ai samples                  */
+#include "ao_ring.h"          /* shm ring for ao playback                 */
+#include "ai_convert.h"       /* precomputed code to volts conversion     */
+#include "ai_decimate.h"      /* oversampled codes down to one per scan   */
 
 
 #include "proc_macros.h"
@@ -70,13 +77,15 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("David J. Christini and Calin A. Culianu");
 MODULE_DESCRIPTION(MODULE_NAME ": A Real-Time Sampling Task for use with kcomedilib and the daq_system user program");
 
-MODULE_PARM(ai_device,"s");
-MODULE_PARM_DESC(ai_device, "The comedi device file to use for analog input. Defaults to device file " DEFAULT_COMEDI_DEVICE ".");
+#define STR1(x) #x
+#define STR(x) STR1(x)
+MODULE_PARM(ai_device,"1-" STR(SHD_MAX_AI_BOARDS) "s");
+MODULE_PARM_DESC(ai_device, "The comedi device file to use for analog input.  Give up to " STR(SHD_MAX_AI_BOARDS) " of them, separated by commas, to acquire from several boards at once as if they were one: their channels are numbered one board after the other, in the order given, and each tick reads one scan from every board.  Defaults to device file " DEFAULT_COMEDI_DEVICE ".");
+MODULE_PARM(ai_clock, "1-" STR(SHD_MAX_AI_BOARDS) "i");
+MODULE_PARM_DESC(ai_clock, "For each ai_device, -1 (the default) if its hardware-timed scans run off its own timer, or the number of the external trigger input its scan clock comes in on.  The first board always uses its own timer.  Routing the clock there (normally the first board's scan clock, over RTSI) is up to you.");
 MODULE_PARM(ao_device, "s");
 MODULE_PARM_DESC(ao_device, "The comedi device file to use for analog output. Defaults to device file " DEFAULT_COMEDI_DEVICE ".");
 MODULE_PARM(sampling_rate, "i");
-#define STR1(x) #x
-#define STR(x) STR1(x)
 MODULE_PARM_DESC(sampling_rate, "The sampling rate to run the acquisition at, in Hz.  Defaults to " STR(INITIAL_SAMPLING_RATE_HZ) "Hz.");
 MODULE_PARM(settling_time, "i");
 MODULE_PARM_DESC(settling_time, "The time in nanoseconds it takes the board's AI multiplexer to settle.  See your board's specifications for an appropriate settling time.  The default value is " STR(DEFAULT_SETTLING_TIME_ns) " nanoseconds.");
@@ -84,6 +93,25 @@ MODULE_PARM(fifo_secs, "i");
 MODULE_PARM_DESC(fifo_secs, "This parameter determines the amount of time (and thus size) that the AI and AO RT-FIFO can queue up.  This time parameter should be sufficient as to avoid buffer overflows which could lead to dropped samples in userland.  The time/size is specified in terms of 'seconds' which translates to the number of seconds of scans the RT-FIFO can queue up before you get dropped samples.  This means that userland can be suspended for this long, if all channels were turned on, and there would still not be a problem with dropped scans.  The default value is " STR(DEFAULT_FIFO_SECS) " seconds.");
 MODULE_PARM(max_fifo, "i");
 MODULE_PARM_DESC(max_fifo, "This parameter determines the maximum amount of kernel memory each AI and AO fifo can take up.  The default value is " STR(DEFAULT_MAX_FIFO) " bytes.");
+MODULE_PARM(ai_ring, "i");
+MODULE_PARM_DESC(ai_ring, "If nonzero (the default), analog input samples are handed to userland through a shared memory ring buffer (named '" SAMPLE_RING_NAME "') instead of through the AI RT-FIFO.  This avoids a syscall and a copy per read in userland.  The ring holds fifo_secs seconds of samples (rounded down to a power of 2), subject to max_ring.  Set to 0 to use the RT-FIFO like older versions did.");
+MODULE_PARM(max_ring, "i");
+MODULE_PARM_DESC(max_ring, "The maximum size of the analog input shared memory ring, in bytes.  The default value is " STR(DEFAULT_MAX_RING) " bytes.");
+MODULE_PARM(ao_ring, "i");
+MODULE_PARM_DESC(ao_ring, "If nonzero (the default), a shared memory ring buffer (named '" AO_RING_NAME "') is set up for userland to stream analog output waveforms through, one scan per tick.  The ring holds fifo_secs seconds of scans (rounded down to a power of 2), subject to max_ring.  Set to 0 to do without.");
+MODULE_PARM(ai_command, "i");
+MODULE_PARM_DESC(ai_command, "If nonzero (the default), and the analog input subdevice supports comedi commands, scans are hardware-timed by the board and read out of its buffer each tick, instead of polling each channel with a settling_time delay.  Set to 0 to always poll like older versions did.");
+
+MODULE_PARM(cmd_quota, "i");
+MODULE_PARM_DESC(cmd_quota, "The most commands from userland that get dealt with per RT tick.  Commands come in through a mailbox in the shared memory struct, and when it is empty checking it costs next to nothing, but a lot of commands at once could otherwise make for a long tick.  A batch of commands is always dealt with in one tick, however big it is.  The default value is " STR(DEFAULT_CMD_QUOTA) ".");
+MODULE_PARM(cmd_fifos, "i");
+MODULE_PARM_DESC(cmd_fifos, "If nonzero, also create the control and reply RT-FIFOs that commands from userland used to go through, and check them every tick like older versions did.  Only for older userland programs.  The default is 0.");
+MODULE_PARM(burst_ns, "i");
+MODULE_PARM_DESC(burst_ns, "If nonzero, the RT loop ticks only about every burst_ns nanoseconds (a whole number of scan periods) instead of once per scan, and each tick deals with all the scans the boards took since the last one as a block.  That spreads the cost of a tick (fifo writes, callbacks, commands) over many scans, so much higher sampling rates can be kept up with.  It needs hardware-timed scans (see ai_command) -- polled, a tick still only reads one scan, and the rest are counted as skipped in /proc/rtlab.  Stimulators and ao ring playback are software-timed, so they only change the outputs once per tick (to the value for the tick's first scan) and keep time by skipping ahead.  Rates above " STR(MAX_TICK_RATE_HZ) "Hz always go in bursts, whatever this is.  The default is 0, one scan per tick.");
+#ifdef RTLAB_FIXED_POINT
+MODULE_PARM(task_fp, "i");
+MODULE_PARM_DESC(task_fp, "This " RT_PROCESS_MODULE_NAME " was built with RTLAB_FIXED_POINT, so its RT loop does no floating point, and the RT task is created without an FPU context: the FPU state is not saved and restored every time it runs.  Plugins that do floating point in their callbacks (apd_control, avn_stim, or anything calling voltage_at()) need one though, so load with task_fp=1 to use them (they refuse to load otherwise, see rtp_require_fp()).  The default is 0.");
+#endif
 
 #undef STR
 #undef STR1
@@ -94,6 +122,8 @@ EXPORT_SYMBOL_NOVERS(rtp_deactivate_function);
 EXPORT_SYMBOL_NOVERS(rtp_activate_function);
 EXPORT_SYMBOL_NOVERS(rtp_set_callback_frequency);
 EXPORT_SYMBOL_NOVERS(rtp_get_callback_frequency);
+EXPORT_SYMBOL_NOVERS(rtp_set_callback_blocks);
+EXPORT_SYMBOL_NOVERS(rtp_require_fp);
 EXPORT_SYMBOL_NOVERS(rtp_find_free_rtf);
 EXPORT_SYMBOL_NOVERS(rtlab_set_sampling_rate);
 EXPORT_SYMBOL_NOVERS(rtp_shm);
@@ -114,6 +144,14 @@ void cleanup_module(void);    /* clean up RT stuff */
 static int init_comedi(void);
 /* sets up RT shared memory */
 static int init_shared_mem(void);   
+static void init_ai_ring(void);
+static void init_ao_ring(void);
+/* sets up/tears down hardware-timed ai scans, see grabScanOffBoard() */
+static void init_ai_command(void);
+static void cleanup_ai_command(void);
+/* opens/closes the ai boards after the first one, see AIBoardInfo */
+static int init_ai_boards(void);
+static void cleanup_ai_boards(void);
 /* sets up the krange cache */
 static int build_krange_cache(void);
 
@@ -134,6 +172,8 @@ static inline void update_wall_clock_times(rtos_time_t current_time);
 static sampling_rate_t normalizeSamplingRate(sampling_rate_t rate);
 /* Computes the number of nanos per scan */
 static void computeNanosPerScan(void);
+/* Computes rtp_shm->scans_per_tick, see the burst_ns module param */
+static void computeScansPerTick(void);
 static void cleanup_krange_cache(void);
 static void cleanup_fifos(void);
 static void cleanup_comedi_stuff(void);
@@ -142,8 +182,11 @@ static void rtlab_proc_cleanup(void);
 static void grabScanOffBoard (MultiSampleStruct *m);  
 static void putFullScanIntoAIFifo (MultiSampleStruct *m); 
 static void detectSpikes (MultiSampleStruct *m); 
+static void init_spike_tholds(void); /* detectSpikes()'s, fixed point only */
+static void playAORing (MultiSampleStruct *m); 
 /* /RTP Registered */
 static int __rtp_set_f_active(rtfunction_t f, char v); /* internal */
+static int __rtp_set_f_blocks(rtfunction_t f, char v); /* internal */
 static int __rtp_register_function(rtfunction_t function); /* internal */
 static int __rtp_unregister_function(rtfunction_t function); /* internal */
 typedef enum SubDevT {
@@ -165,6 +208,9 @@ static int rtlab_proc_read (char *, char **, off_t, int, int *, void *data);
 inline double sampl_to_volts(SubDevT t, uint chan, uint range, lsampl_t data);
 /* operates on krange_cache below to determine the sample for a voltage */
 inline lsampl_t volts_to_sampl(SubDevT t, uint chan, uint range, double data);
+/* works out the ai conversion for chanspec into slot of c, from 
+   krange_cache below, so it matches sampl_to_volts() */
+static void set_ai_convert(struct ai_convert *c, uint slot, uint chanspec);
 /* Helper function that retrieves a particular krange from the cache 
    returns 0 on error */
 inline comedi_krange *get_krange(SubDevT t, uint chan, uint range);
@@ -189,34 +235,148 @@ struct krange_cache {
 
 static struct krange_cache krange_cache;
 
-/* functions to be run at the end of the real-time daq loop
-   they are chained on, one after the other */
-struct rt_function_list {
+/* the polled reads' conversions, indexed by channel id */
+static struct ai_convert polled_convert;
+/* ..and their oversampling, ditto, with the config it was set up for */
+static struct ai_decimate polled_decimate;
+static unsigned char polled_oversample[SHD_MAX_CHANNELS], 
+                     polled_cic_order[SHD_MAX_CHANNELS];
+#ifdef RTLAB_FIXED_POINT
+/* voltage_at()'s conversions, indexed by channel id, since the samples 
+   have no volts in them */
+static struct ai_convert voltage_at_convert;
+#endif
+
+/* the most conversions a hardware-timed scan can have, over all the 
+   boards and counting every one of an oversampled channel's */
+#define RT_MAX_CHANLIST 4096
+
+/* The ai boards, see AIBoardInfo in shared_stuff.h.  Board 0 is the one
+   in rtp_comedi_ai_dev_handle and ai_subdev. */
+static struct ai_board {
+  COMEDI_T dev;
+  int  minor, subdev;
+  int  locked;
+  uint first_chan, n_chans;      /* its part of the global channel space   */
+  /* its share of the hardware-timed scan, see grabScanOffBoard() */
+  void *buf;                     /* the board's async buffer, 0 if unusable*/
+  uint buf_size, sample_size, scan_size;
+  uint first, n;                 /* its part of the scan's conversions, 
+                                    see aicmd.raw                          */
+  uint *chanlist;                /* same, with the board's own numbers, 
+                                    points into aicmd.hw_chanlist          */
+  uint avail;                    /* complete scans it had, this tick       */
+  hrtime_t started;              /* when its command was started, or when 
+                                    its first channel was polled          */
+} ai_boards[SHD_MAX_AI_BOARDS];
+static uint n_ai_boards = 0;
+/* which board each global channel is on */
+static unsigned char ai_chan_board[SHD_MAX_CHANNELS];
+
+/* state of the hardware-timed ai scan, over all the boards, see 
+   grabScanOffBoard() */
+static struct ai_command_state {
+  int  usable;                   /* every board can do commands into a
+                                    buffer we can get at                   */
+  int  running;                  /* the commands are going                 */
+  int  failed;                   /* couldn't set it up for this config, so
+                                    poll until the config changes          */
+  char mask[CHAN_MASK_SIZE];     /* the config the command was built for.. */
+  uint chanlist[SHD_MAX_CHANNELS];
+  uint chan_ids[SHD_MAX_CHANNELS];
+  uint codes[RT_MAX_BLOCK_SAMPLES]; /* this tick's scan(s), as raw codes  */
+  struct ai_convert convert;     /* indexed by position in chanlist        */
+  uint n_chans;
+  /* oversampling, see ai_decimate.h: each channel is in the boards' 
+     chanlists as many times as it is oversampled, so a scan has n_raw 
+     conversions.  Without any, n_raw == n_chans and raw[] isn't used.    */
+  unsigned char oversample[SHD_MAX_CHANNELS]; /* the config, by position  */
+  uint cic_order;                               /* ..and the filter's order*/
+  int  oversampling;
+  uint n_raw;
+  uint hw_chanlist[RT_MAX_CHANLIST];  /* what the boards' commands scan    */
+  unsigned short raw_slot[RT_MAX_CHANLIST]; /* position each one goes to  */
+  uint raw[RT_MAX_CHANLIST];          /* a scan's conversions              */
+  struct ai_decimate decimate;        /* indexed by position in chanlist   */
+  uint nanos_per_scan;
+  uint n_skipped, n_restarts;    /* for /proc and TIME_RT_LOOP             */
+} aicmd;
+
+/* functions to be run at the end of the real-time daq loop, in order.
+
+   The RT loop never takes a lock to walk these.  There are two tables:
+   rt_functions points at the published one, which the RT loop reads, and
+   the other one is scratch space for the next version.  Writers (always
+   holding rt_functions_sem) copy the published table into the spare, 
+   change the copy, then publish it with a single pointer store.  Before 
+   the old table can be reused as scratch, the writer waits for the RT 
+   loop to be done with it -- the RT loop says which table it's walking 
+   in rt_functions_reader.  So each tick sees one consistent table and no
+   tick is ever skipped because someone was (un)registering a function. */
+#define RT_MAX_FUNCTIONS 32
+
+struct rt_function_entry {
   char active_flag;
+  char takes_blocks; /* see rtp_set_callback_blocks()                   */
   rtfunction_t function;
   uint   time_between_callbacks_us;
   scan_index_t next_index_for_cb;
-  struct rt_function_list *next;
+  int stats_slot; /* index into rtp_shm->rt_stats.callbacks, or -1 */
+};
+
+struct rt_function_table {
+  uint n_functions;
+  struct rt_function_entry functions[RT_MAX_FUNCTIONS];
 };
 
+/* which function owns each rtp_shm->rt_stats.callbacks slot -- kept here
+   too since functions get registered before rtp_shm exists */
+static rtfunction_t cb_stats_owner[RT_STATS_MAX_CALLBACKS];
+static int  cb_stats_slot_alloc(rtfunction_t function);
+static void cb_stats_slot_free(int slot);
+static inline void rt_hist_add(RTHistogram *h, hrtime_t ns);
+
 /* Internal helper function that determines if it's time to call
    this particular function.  Called from withing daq_task */
-static inline void possibly_call_cb (struct rt_function_list *, 
+static inline void possibly_call_cb (struct rt_function_entry *, 
                                      MultiSampleStruct *);
-static struct rt_function_list 
-             *rt_functions, /* circularly linked-list of functions to run
-			       from main rt loop */
-             __end_of_func_list = {0}; /* circular linked list terminator */
+/* Calls it on the whole block, or once per scan in it if it can't take 
+   blocks, see rtp_set_callback_blocks() */
+static inline void run_function (struct rt_function_entry *it, 
+                                 MultiSampleStruct *m, scan_index_t base);
+
+static struct rt_function_table rt_function_tables[2];
+static struct rt_function_table 
+  * volatile rt_functions = &rt_function_tables[0], /* published table  */
+  * volatile rt_functions_reader = 0; /* the table the RT loop is walking 
+                                         right now, if any              */
 
+static struct rt_function_table *begin_rt_functions_update(void);
+static void commit_rt_functions_update(struct rt_function_table *t);
+
+/* serializes the writers only -- the RT loop never touches it */
 DECLARE_MUTEX(rt_functions_sem);
 
 /* module parameters */
-char *ai_device = DEFAULT_COMEDI_DEVICE,
+char *ai_device[SHD_MAX_AI_BOARDS] = { DEFAULT_COMEDI_DEVICE },
      *ao_device = DEFAULT_COMEDI_DEVICE;
+int  ai_clock[SHD_MAX_AI_BOARDS] = { [0 ... SHD_MAX_AI_BOARDS - 1] = -1 };
 int  sampling_rate = INITIAL_SAMPLING_RATE_HZ;
 int  settling_time = DEFAULT_SETTLING_TIME_ns;
 int  fifo_secs    = DEFAULT_FIFO_SECS;
 int  max_fifo     = DEFAULT_MAX_FIFO;
+int  ai_ring      = 1;
+int  max_ring     = DEFAULT_MAX_RING;
+int  ai_command   = 1;
+int  ao_ring      = 1;
+int  cmd_quota    = DEFAULT_CMD_QUOTA;
+int  cmd_fifos    = 0;
+int  burst_ns     = 0;
+#ifdef RTLAB_FIXED_POINT
+int  task_fp      = 0;
+#else
+static const int task_fp = 1;
+#endif
 
 /* exported handles to be used with comedi functions.  This abstraction of
    comedi types is needed due to different treatments of the first parameter
@@ -231,6 +391,9 @@ static int ai_minor = -1, ao_minor = -1, ai_subdev = -1, ao_subdev = -1;
 
 /* Exported globals below.. */
 SharedMemStruct *rtp_shm = 0;            /* (exported) mbuff shared memory */
+static struct SampleRing *rtp_ai_ring = 0; /* if non-null, ai goes here 
+                                              instead of the ai fifo     */
+static struct AORing *rtp_ao_ring = 0;     /* ao playback, see ao_ring.h */
 struct spike_info spike_info;            /* Exported spike information     */
 
 /* some vars to keep track of the rt task period/rate */
@@ -246,6 +409,10 @@ inline void readjust_rt_task_wakeup(void);
 static MultiSampleStruct one_full_scan; /* Used to pass off samples to other
                                            modules -- not exported so as
                                            to keep the interface clean...*/
+static SampleStruct scan_block[RT_MAX_BLOCK_SAMPLES]; /* its samples */
+/* how many scan periods this tick accounts for, as far as scan_index is 
+   concerned -- always 1 unless in burst mode.  Set by grabScanOffBoard() */
+static uint scans_this_tick = 1;
 
 /* Our proc fs dir entry -- should be exported? */
 struct proc_dir_entry *rtlab_proc_root = 0;
@@ -255,11 +422,12 @@ static int error;
 static const char *errorMessage = "Success";
 
 /* this task reads data from the DAQ board, then calls 
-   all of the functions registered in rt_functions linked list */
+   all of the functions registered in the rt_functions table */
 static void *daq_rt_task (void *arg) 
 {
-  /* below is used to put upper limit on the array in one_full_scan */
-  struct rt_function_list *curr;
+  struct rt_function_table *funcs;
+  uint f;
+  scan_index_t base;
   rtos_time_t   loopstart = 0,     /* used to calibrate timing on
                                       sampling rate changes            */
                 lastloopstart = 0,
@@ -270,14 +438,17 @@ static void *daq_rt_task (void *arg)
 #ifdef TIME_RT_LOOP
   register hrtime_t looptime = 0, max = 0, min = HRTIME_INFINITY;
   uint avg_total_time = 0;
+  hrtime_t acqtime = 0, acq_max = 0, acq_min = HRTIME_INFINITY;
+  uint avg_acq_time = 0;
 #endif
   
   { /* initialize the one_full_scan struct */
     uint i;
 
-    one_full_scan.n_samples = 0;
+    one_full_scan.n_samples = one_full_scan.n_scans = 0;
+    one_full_scan.samples = scan_block;
     
-    for (i = 0; i < SHD_MAX_CHANNELS; i++) 
+    for (i = 0; i < RT_MAX_BLOCK_SAMPLES; i++) 
       one_full_scan.samples[i].magic_number = SAMPLE_STRUCT_MAGIC;      
     
   }
@@ -295,34 +466,39 @@ static void *daq_rt_task (void *arg)
       if (jitter_diff < 0) jitter_diff = -jitter_diff;
       if (((uint)jitter_diff) > rtp_shm->jitter_ns) 
         rtp_shm->jitter_ns = jitter_diff;     
+      rt_hist_add(&rtp_shm->rt_stats.jitter, jitter_diff);
     }
 
     update_wall_clock_times(loopstart); /* update rtp_shm->time_ms */
 
-#ifdef TIME_RT_LOOP
-    if ( I_SHOULD_PRINT_TIME )
-      rtl_printf("Just scanning the channels took %ld nanoseconds\n",(long int)(one_full_scan.acq_end - one_full_scan.acq_start));
-#endif
-      
-    /* Is the rt_functions list safe to read (semaphore not busy)? 
-       If not we won't run our functions this time through.. which I hope is OK
-       for most people... but kind of breaks the whole rt-nature of things
-       As long as you don't register and unregister functions during a critical
-       time, then we are ok here */
-    if (atomic_read(&rt_functions_sem.count) > 0) {
-      /* iterate through all custom functions and run them now... 
-         two functions are always present as they are 'hard coded':
-         1) grabScanOffBoard()
-         2) putFullScanIntoAIFifo()
-      */
-      for (curr = rt_functions; curr != &__end_of_func_list; curr=curr->next) 
-        possibly_call_cb(curr, &one_full_scan);
-      
-    }
+    /* Pick up the published function table and announce that we're in it.
+       The re-check catches a writer that published a new table between
+       our read and our announcement -- that writer may already have 
+       decided the old table is free, so we must not walk it. */
+    do {
+      funcs = rt_functions;
+      rt_functions_reader = funcs;
+      mb();
+    } while (funcs != rt_functions);
+
+    /* iterate through all custom functions and run them now... 
+       three functions are always present as they are 'hard coded':
+       1) grabScanOffBoard()
+       2) detectSpikes()
+       3) putFullScanIntoAIFifo()
+    */
+    base = rtp_shm->scan_index;
+    for (f = 0; f < funcs->n_functions; f++)
+      run_function(&funcs->functions[f], &one_full_scan, base);
+
+    mb();
+    rt_functions_reader = 0;
     
     /* now call the commands infrastructure to process pending commands.. */
-    /* broken so commented out.. 
-       rtlab_cmd_process(); */
+    rtlab_cmd_process();
+
+    /* ..and step the stimulators' waveforms by the scans this tick was */
+    stim_process(scans_this_tick);
     
 
 #ifdef TIME_RT_LOOP
@@ -337,6 +513,16 @@ static void *daq_rt_task (void *arg)
       ((uint)(avg_total_time - looptime)) 
       / ((uint)(rtp_shm->scan_index + 1));
 
+    /* same again for just the acquisition part */
+    acqtime = one_full_scan.acq_end - one_full_scan.acq_start;
+    if ( acq_min > acqtime )
+      acq_min = acqtime;
+    if ( acq_max < acqtime )
+      acq_max = acqtime;
+    avg_acq_time -= 
+      ((uint)(avg_acq_time - acqtime)) 
+      / ((uint)(rtp_shm->scan_index + 1));
+
 
     if ( I_SHOULD_PRINT_TIME ) {
       rtl_printf("Scan %ld: "
@@ -347,20 +533,42 @@ static void *daq_rt_task (void *arg)
 		 (long int)avg_total_time,
 		 (long int)min,
 		 (long int)max);
+      rtl_printf("Scan %ld: "
+		 "Acquiring the scan (%s) took %ld nanoseconds\n"
+		 "( %ld avg / %ld min / %ld max, %u scans skipped, "
+		 "%u restarts ).\n", 
+		 (long int)rtp_shm->scan_index,
+		 aicmd.running ? "hardware-timed" : "polled",
+		 (long int)acqtime, 
+		 (long int)avg_acq_time,
+		 (long int)acq_min,
+		 (long int)acq_max,
+		 aicmd.n_skipped, aicmd.n_restarts);
     }
     /*---- end time code */
 #endif
 
-    /* increment scan_index counter */
-    ++rtp_shm->scan_index; 
+    /* increment scan_index counter, by however many scans this tick was */
+    rtp_shm->scan_index = base + scans_this_tick; 
 
-    /* reads the control FIFO and possibly modifies rtp_shm */
-    do_user_commands(rtp_shm); 
+    /* checks the command mailbox and possibly modifies rtp_shm */
+    do_user_commands(rtp_shm, cmd_quota); 
 
     /* set next_task_wakeup wakeup time to be a multiple of task_period, 
        also recomputes task_period in case sampling_rate changed */
     readjust_rt_task_wakeup();
 
+    { /* RT loop stats: how long this tick took, and did we overrun? */
+      struct timespec now;
+
+      rt_hist_add(&rtp_shm->rt_stats.tick, gethrtime() - loopstart);
+      clock_gettime(CLOCK_REALTIME, &now);
+      if (now.tv_sec > next_task_wakeup.tv_sec 
+          || (now.tv_sec == next_task_wakeup.tv_sec 
+              && now.tv_nsec > next_task_wakeup.tv_nsec))
+        rtp_shm->rt_stats.overruns++;
+    }
+
     last_task_period = task_period;
     lastloopstart = loopstart;
 
@@ -372,26 +580,16 @@ static void *daq_rt_task (void *arg)
 
 int init_module(void) 
 {
-  int i;
-
   error = -EBUSY;
  
-  /* initialize the array of last spikes encountered */
-  for (i = 0; i < SHD_MAX_CHANNELS; i++)  {
-    spike_info.last_spike_time[i] = 0;
-    spike_info.period[i] = 0xffffffff;
-    /* clear info for spike end */
-    spike_info.last_spike_ended_time[i] = 0;
-    spike_info.saved_thold[i] = 0.0;
-  }
-  memset(spike_info.spikes_this_scan, 0x0, CHAN_MASK_SIZE);
-  /* clear spike state info */
-  memset(spike_info.saved_polarity, 0x0, CHAN_MASK_SIZE);
-  memset(spike_info.in_spike, 0x0, CHAN_MASK_SIZE);
+  /* clear the last spikes encountered and the spike state info */
+  spike_detect_init(&spike_info);
+  init_spike_tholds();
 
 
-  /* initialize the function linked list */
-  rt_functions = __end_of_func_list.next = &__end_of_func_list;
+  /* start with an empty function table */
+  rt_functions = &rt_function_tables[0];
+  rt_functions->n_functions = 0;
 
   /* note that order of registrations is important.. the function list is 
      FIFO ordered */
@@ -405,6 +603,10 @@ int init_module(void)
   __rtp_set_f_active(grabScanOffBoard, 1);
   __rtp_set_f_active(putFullScanIntoAIFifo, 1);
   __rtp_set_f_active(detectSpikes, 1);
+  /* these all just work through m->samples, so a block is fine */
+  __rtp_set_f_blocks(grabScanOffBoard, 1);
+  __rtp_set_f_blocks(putFullScanIntoAIFifo, 1);
+  __rtp_set_f_blocks(detectSpikes, 1);
 
   if ( init_comedi() ) goto init_error;
 
@@ -416,6 +618,15 @@ int init_module(void)
     goto init_error;
   }
 
+  /* non-fatal, we fall back to the ai fifo if it fails */
+  init_ai_ring();
+
+  /* also non-fatal, there's just no ao playback without it */
+  init_ao_ring();
+
+  /* also non-fatal, we fall back to polling each channel */
+  init_ai_command();
+
   /* cache the krange list... */
   if (build_krange_cache()) {
     /* cannot allocate memory for krange cache */
@@ -423,15 +634,23 @@ int init_module(void)
                    "Are we low on memory?";
     error = -ENOMEM;
   }
+  ai_convert_init(&polled_convert);
+#ifdef RTLAB_FIXED_POINT
+  ai_convert_init(&voltage_at_convert);
+#endif
   
-  if ((error = rtp_find_free_rtf(&rtp_shm->control_fifo, 
-				 SHD_MAX_CHANNELS * sizeof(struct rtfifo_cmd)))) {
+  /* room for one full batch of commands, and for its reply */
+  if (cmd_fifos 
+      && (error = rtp_find_free_rtf(&rtp_shm->control_fifo, 
+                                    (RTLAB_MAX_BATCH + 1) 
+                                    * sizeof(struct rtfifo_cmd)))) {
     errorMessage = "Cannot create fifo for user to kernel communication!";     
     goto init_error;
   }
 
-  if ((error = rtp_find_free_rtf(&rtp_shm->reply_fifo, 
-				 SHD_MAX_CHANNELS * sizeof(char)))) {
+  if (cmd_fifos
+      && (error = rtp_find_free_rtf(&rtp_shm->reply_fifo, 
+                                    sizeof(struct rtfifo_batch_reply)))) {
     errorMessage = "Cannot create fifo for kernel to user communication!";     
     goto init_error;
   }
@@ -450,19 +669,15 @@ int init_module(void)
     goto init_error;
   }
 
-  /* command subsystem broken so commented out.. 
   if ( ( error = init_cmd_engine() ) ) {
     errorMessage = "Cannot initialize RTLab command subsystem!";
     goto init_error;
   }
-  */
 
-  /* broken..
   if ( ( error = init_stim_engine() ) ) {
     errorMessage = "Cannot initialize RTLab stimulator subsystem!";
     goto init_error;
   }
-  */
 
   if ( !(daq_task_stack = kmalloc(RTL_PTHREAD_STACK_MIN, GFP_KERNEL)) ) {
     error = -ENOMEM;
@@ -501,13 +716,17 @@ int init_module(void)
 
     /* create the realtime task */
     pthread_attr_init(&attr);
-    pthread_attr_setfp_np(&attr, 1);
+    pthread_attr_setfp_np(&attr, task_fp);
     pthread_attr_setstackaddr(&attr, daq_task_stack);
     pthread_attr_setstacksize(&attr, RTL_PTHREAD_STACK_MIN);
     sched_param.sched_priority = SCHED_FIFO;
     pthread_attr_setschedparam(&attr, &sched_param);  
+    start_cmd_engine();
+    start_stim_engine();
     if ( (error = pthread_create(&daq_task, &attr, 
                                  daq_rt_task, (void *)0) ) ) {
+      stop_cmd_engine();
+      stop_stim_engine();
       errorMessage = "Cannot create the daq pthread";
       goto init_error;
     }
@@ -565,6 +784,20 @@ static void *calibrate_jitter(void *arg)
   return (void *)rtp_shm->jitter_ns;
 }
 
+#ifdef RTOS_POSIX
+/* No path_walk() out here, and mock_comedi.o has no device nodes anyway,
+   so the minor is just whatever number the name ends in */
+static int determine_comedi_minor(const char *file)
+{
+  const char *p;
+
+  if (!file || !*file) return -EINVAL;
+  for (p = file + strlen(file); p > file && p[-1] >= '0' && p[-1] <= '9'; p--)
+    ;
+  if (!*p) return -ENODEV;
+  return atoi(p);
+}
+#else
 /* returns error if file is not a (configured) comedi device */
 static int determine_comedi_minor(const char *file)
 {
@@ -586,11 +819,12 @@ static int determine_comedi_minor(const char *file)
   path_release(&nd);
   return ret;
 }
+#endif
 
 static int
 init_comedi(void)
 {
-  ai_minor = determine_comedi_minor(ai_device);
+  ai_minor = determine_comedi_minor(ai_device[0]);
   if (ai_minor < 0) {
     error = ai_minor;
     errorMessage = "Error opening the ANALOG INPUT device.  Please verify "
@@ -714,9 +948,95 @@ init_comedi(void)
   rtp_comedi_ao_dev_handle = ao_minor;  
 #endif
 
+  return init_ai_boards();
+}
+
+static int init_ai_boards(void)
+{
+  struct ai_board *b;
+  uint i, j;
+
+  /* init_comedi() did the first one */
+  memset(ai_boards, 0, sizeof(ai_boards));
+  ai_boards[0].dev = rtp_comedi_ai_dev_handle;
+  ai_boards[0].minor = ai_minor;
+  ai_boards[0].subdev = ai_subdev;
+  n_ai_boards = 1;
+
+  if (ai_clock[0] >= 0) {
+    errorMessage = "The first ai_device always scans on its own timer, its "
+                   "ai_clock has to be -1";
+    return error = -EINVAL;
+  }
+
+  for (i = 1; i < SHD_MAX_AI_BOARDS && ai_device[i] && *ai_device[i]; i++) {
+    b = &ai_boards[i];
+    b->dev = (COMEDI_T)-1;
+    b->subdev = -1;
+
+    if ( (b->minor = determine_comedi_minor(ai_device[i])) < 0 ) {
+      errorMessage = "Error opening one of the ANALOG INPUT devices.  Please "
+        "verify the ai_device module parameter you passed to rt_process.o!";
+      return error = b->minor;
+    }
+    for (j = 0; j < i; j++) 
+      if (ai_boards[j].minor == b->minor) {
+        errorMessage = "The same device is in ai_device more than once";
+        return error = -EINVAL;
+      }
+
+#ifdef NEW_STYLE_KCOMEDILIB
+    {
+      char tempbuf[32];
+
+      sprintf(tempbuf, "/dev/comedi%d", b->minor);
+      if ( !(b->dev = comedi_open(tempbuf)) ) {
+        b->dev = (COMEDI_T)-1;
+        errorMessage = "Error opening comedi device for analog input";
+        return error = -ENOMSG;
+      }
+    }
+#else
+    if ( (error = comedi_open(b->minor)) < 0 ) {
+      errorMessage = "Error opening comedi device for analog input";
+      return error;
+    }
+    b->dev = b->minor;
+#endif
+    n_ai_boards++; /* from here on cleanup_ai_boards() closes it */
+
+    if ( (b->subdev = 
+          comedi_find_subdevice_by_type(b->dev, COMEDI_SUBD_AI, 0)) < 0 ) {
+      errorMessage = "Cannot find an analog input subdevice on one of the "
+                     "ai_device boards";
+      return error = b->subdev;
+    }
+    if ( (error = comedi_lock(b->dev, b->subdev)) < 0 ) {
+      errorMessage = "Cannot lock the analog input subdevice of one of the "
+                     "ai_device boards";
+      return error;
+    }
+    b->locked = 1;
+  }
+
   return 0;
 }
 
+static void cleanup_ai_boards(void)
+{
+  struct ai_board *b;
+
+  /* board 0 is cleaned up along with the ao device */
+  for (b = ai_boards + 1; b < ai_boards + n_ai_boards; b++) {
+    if (b->locked) {
+      comedi_cancel(b->dev, b->subdev);
+      comedi_unlock(b->dev, b->subdev);
+    }
+    comedi_close(b->dev);
+  }
+  n_ai_boards = 0;
+}
+
 /*  Initializes the rtlinux shared memory 
     returns 1 on success, 0 on failure */
 static int 
@@ -742,12 +1062,38 @@ init_shared_mem(void)
   rtp_shm->ai_fifo_minor = -1;
   rtp_shm->ao_fifo_minor = -1;
   rtp_shm->control_fifo  = -1;
-  /* num AI channels in use */
-  rtp_shm->n_ai_chans = comedi_get_n_channels(rtp_comedi_ai_dev_handle, ai_subdev); 
+  rtp_shm->reply_fifo    = -1;
+  reset_user_commands(rtp_shm);
+  /* num AI channels in use, all the boards' one after the other */
+  rtp_shm->n_ai_chans = 0;
+  rtp_shm->n_ai_boards = n_ai_boards;
+  for (i = 0; i < n_ai_boards; i++) {
+    struct ai_board *b = &ai_boards[i];
+    AIBoardInfo *info = &rtp_shm->ai_boards[i];
+    int n = comedi_get_n_channels(b->dev, b->subdev);
+
+    /* whatever doesn't fit in the channel arrays is left out */
+    if (n < 0) n = 0;
+    if (n > SHD_MAX_CHANNELS - (int)rtp_shm->n_ai_chans) 
+      n = SHD_MAX_CHANNELS - rtp_shm->n_ai_chans;
+    b->first_chan = rtp_shm->n_ai_chans;
+    b->n_chans = n;
+    memset(ai_chan_board + b->first_chan, i, n);
+    rtp_shm->n_ai_chans += n;
+
+    memset(info, 0, sizeof(*info));
+    info->minor = b->minor;
+    info->subdev = b->subdev;
+    info->first_chan = b->first_chan;
+    info->n_chans = b->n_chans;
+    info->ext_clock = ai_clock[i] < 0 ? -1 : ai_clock[i];
+  }
   rtp_shm->n_ao_chans = comedi_get_n_channels(rtp_comedi_ao_dev_handle, ao_subdev);
   rtp_shm->sampling_rate_hz = normalizeSamplingRate(sampling_rate);
+  rtp_shm->scans_per_tick = 1;
   rtp_shm->scan_index = 0;
   rtp_shm->attached_pid = 0;
+  cmd_quota = ( cmd_quota > 0 ? cmd_quota : 1);
   /* normalize max_fifo */
   max_fifo = ( max_fifo > 0 ? max_fifo : 1);
   /* normalize fifo_secs */
@@ -772,16 +1118,37 @@ init_shared_mem(void)
   if(!rtp_shm->ao_fifo_sz_blocks) rtp_shm->ao_fifo_sz_blocks = 1;
 
 
+  rtp_shm->ai_ring_slots = 0; /* see init_ai_ring() */
+  rtp_shm->ao_ring_slots = rtp_shm->ao_ring_stride = 0; /* init_ao_ring() */
+  rtp_shm->ai_fifo_scans_dropped = 0;
+
+  /* RT loop stats start from scratch, apart from the functions that are
+     already registered */
+  memset(&rtp_shm->rt_stats, 0, sizeof(rtp_shm->rt_stats));
+  for (i = 0; i < RT_STATS_MAX_CALLBACKS; i++) 
+    rtp_shm->rt_stats.callbacks[i].function = 
+      (unsigned long)cb_stats_owner[i];
+
   /* initialize our time_ms variable */
   rtp_shm->time_ms = 0;
 
   /* initialize the spike_params member */
   init_spike_params(&rtp_shm->spike_params);
+
+  /* no oversampling until asked for, see ai_decimate.h */
+  rtp_shm->ai_cic_order = 1;
+
+#ifdef RTLAB_FIXED_POINT
+  rtp_shm->ai_fixed_point = 1;
+#else
+  rtp_shm->ai_fixed_point = 0;
+#endif
   
   for (i = 0; i < rtp_shm->n_ai_chans || i < rtp_shm->n_ao_chans; i++) { 
     /* set channel parameters */   
     if (i < rtp_shm->n_ai_chans) {
       rtp_shm->ai_chan[i] = CR_PACK(i,INITIAL_CHANNEL_GAIN,AREF_GROUND);
+      rtp_shm->ai_oversample[i] = 1;
       set_chan(i, rtp_shm->ai_chans_in_use, 0);
     }
     if (i < rtp_shm->n_ao_chans) {
@@ -809,14 +1176,17 @@ int  build_krange_cache(void)
         kmalloc(sizeof(lsampl_t) * rtp_shm->n_ao_chans, GFP_KERNEL)) )
     goto end;
   
-  /* record the number of ranges for each channel */
+  /* record the number of ranges for each channel, on whichever board 
+     it's on */
   for (i = 0; i < rtp_shm->n_ai_chans; i++) {
+    const struct ai_board *b = &ai_boards[ai_chan_board[i]];
+
     if ( (krange_cache.ai_n_ranges[i] = 
-       comedi_get_n_ranges(rtp_comedi_ai_dev_handle, rtp_shm->ai_subdev, i)) 
+          comedi_get_n_ranges(b->dev, b->subdev, i - b->first_chan)) 
 	 > krange_cache.ai_max_n_ranges )
       krange_cache.ai_max_n_ranges = krange_cache.ai_n_ranges[i];
     krange_cache.ai_maxdatas[i] = 
-      comedi_get_maxdata(rtp_comedi_ai_dev_handle, rtp_shm->ai_subdev, i);
+      comedi_get_maxdata(b->dev, b->subdev, i - b->first_chan);
   }
   for (i = 0; i < rtp_shm->n_ao_chans; i++) {
       if ( (krange_cache.ao_n_ranges[i] =
@@ -836,8 +1206,10 @@ int  build_krange_cache(void)
     goto end;
  
   for (i = 0; i < rtp_shm->n_ai_chans; i++) {
+    const struct ai_board *b = &ai_boards[ai_chan_board[i]];
+
     for (j = 0; j < krange_cache.ai_n_ranges[i]; j++)
-      comedi_get_krange(rtp_comedi_ai_dev_handle, rtp_shm->ai_subdev, i, j, 
+      comedi_get_krange(b->dev, b->subdev, i - b->first_chan, j, 
 			krange_cache.ai_ranges + i * krange_cache.ai_max_n_ranges + j);
   }
   for (i = 0; i < rtp_shm->n_ao_chans; i++) {
@@ -877,6 +1249,18 @@ static void computeNanosPerScan(void)
   rtp_shm->nanos_per_scan = BILLION / (unsigned int)rtp_shm->sampling_rate_hz;
 }
 
+static void computeScansPerTick(void)
+{
+  uint n = burst_ns > 0 ? (uint)burst_ns / rtp_shm->nanos_per_scan : 1,
+       min = ( rtp_shm->sampling_rate_hz + MAX_TICK_RATE_HZ - 1 ) 
+             / MAX_TICK_RATE_HZ;
+
+  if (n < min) n = min;
+  if (n < 1) n = 1;
+  if (n > RT_MAX_BLOCK_SAMPLES) n = RT_MAX_BLOCK_SAMPLES;
+  rtp_shm->scans_per_tick = n;
+}
+
 static void rtlab_proc_cleanup(void)
 {
   if (rtlab_proc_root) {
@@ -908,6 +1292,11 @@ void cleanup_module(void)
               ui64str((rtp_shm ? rtp_shm->scan_index : 0)),
               (rtp_shm ? rtp_shm->jitter_ns  : 0));    
     
+    /* it may have been cancelled in the middle of a tick, and the
+       __rtp_unregister_function() calls below would wait on it forever */
+    rt_functions_reader = 0;
+    stop_cmd_engine(); /* same deal for rtlab_cmd_handle_free() */
+    stop_stim_engine(); /* and rtlab_stim_free() */
   }
 
   /* delete the daq_task's stack */
@@ -919,17 +1308,15 @@ void cleanup_module(void)
   __rtp_unregister_function(detectSpikes);
   __rtp_unregister_function(putFullScanIntoAIFifo);
   __rtp_unregister_function(grabScanOffBoard);
+  if (rtp_ao_ring) __rtp_unregister_function(playAORing);
 
   /* NB: clearing out of all of the other functions from the function linked 
      list is not required since if we were called here the function linked list
-     must be empty since our module use count is now 0 
+     must be empty since our module use count is now 0 */
 
-     commented out becuase broken.. 
   cleanup_stim_engine();
   cleanup_cmd_engine();
 
- */
-
   /* close all successfully opened fifos */
   cleanup_fifos();
 
@@ -939,9 +1326,22 @@ void cleanup_module(void)
   /* release memory for the krange */
   cleanup_krange_cache();
 
+  if (rtp_ai_ring) {
+    if (rtp_shm) rtp_shm->ai_ring_slots = 0;
+    rtos_shm_detach((void *)rtp_ai_ring);
+    rtp_ai_ring = 0;
+  }
+
+  if (rtp_ao_ring) {
+    if (rtp_shm) rtp_shm->ao_ring_slots = rtp_shm->ao_ring_stride = 0;
+    rtos_shm_detach((void *)rtp_ao_ring);
+    rtp_ao_ring = 0;
+  }
+
   if (rtp_shm) 
     /* free up shared memory */
     rtos_shm_detach((void *)rtp_shm);
+  rtp_shm = 0; /* cb_stats_slot_free() checks this */
 }
 
 static void cleanup_fifos (void) 
@@ -949,14 +1349,19 @@ static void cleanup_fifos (void)
   if (! rtp_shm) return;
 
   if (rtp_shm->control_fifo  >= 0) rtf_destroy(rtp_shm->control_fifo);
+  if (rtp_shm->reply_fifo    >= 0) rtf_destroy(rtp_shm->reply_fifo);
   if (rtp_shm->ai_fifo_minor >= 0) rtf_destroy(rtp_shm->ai_fifo_minor);
   if (rtp_shm->ao_fifo_minor >= 0) rtf_destroy(rtp_shm->ao_fifo_minor);    
 
-  rtp_shm->control_fifo = rtp_shm->ai_fifo_minor = rtp_shm->ao_fifo_minor = -1;
+  rtp_shm->control_fifo = rtp_shm->reply_fifo = -1;
+  rtp_shm->ai_fifo_minor = rtp_shm->ao_fifo_minor = -1;
 }
 
 static void cleanup_comedi_stuff (void) 
 {
+  cleanup_ai_command();
+  cleanup_ai_boards();
+
   if (((int)rtp_comedi_ai_dev_handle) != -1 && ai_subdev >= 0) {
     /*  cancel any pending ai operation */
     comedi_cancel(rtp_comedi_ai_dev_handle, ai_subdev);
@@ -998,156 +1403,727 @@ void cleanup_krange_cache (void)
   memset(&krange_cache, 0, sizeof(krange_cache));
 }
 
+/* one more skew measurement for board info, see AIBoardInfo */
+static inline void note_ai_skew(AIBoardInfo *info, int skew)
+{
+  int d = (skew - info->skew_ns) / 16;
+
+  info->skew_ns += d ? d : skew - info->skew_ns;
+  skew = info->skew_ns < 0 ? -info->skew_ns : info->skew_ns;
+  if (skew > info->max_skew_ns) info->max_skew_ns = skew;
+}
+
+/*---------------------------------------------------------------------------
+  Hardware-timed acquisition
+  --------------------------
+  Instead of polling every channel with an INSN_READ (which busy-waits 
+  settling_time per channel, every scan), we give the board a comedi 
+  command that scans the channels that are on, at our sampling rate, into 
+  its async buffer.  Each tick of the rt loop then just copies the oldest
+  complete scan out of the buffer.  The command is rebuilt whenever the 
+  channel mask, a chanspec or the sampling rate changes.
+
+  The board's clock and ours are never exactly in phase.  If a tick finds
+  no complete scan it waits for one and pushes all later ticks back by
+  however long that took, so from then on our ticks trail the board's
+  scans.  If the board gets ahead of us (clock drift, or a late tick),
+  the older scans are skipped so that we stay at most one scan behind.
+  A board that hasn't produced a scan in two periods is assumed stuck, and
+  its command is restarted on the next tick.
+
+  In burst mode (scans_per_tick > 1, see the burst_ns module param) a tick
+  takes every complete scan there is instead, as one block, and scans are
+  only skipped if more piled up than RT_MAX_BLOCK_SAMPLES can hold.
+
+  With several boards, each one that has channels on gets its own command
+  (so they all scan in parallel) and a tick takes one scan from each.  
+  They are all started, stopped and restarted together, so that they stay
+  in step: externally clocked boards are armed first and then start on 
+  board 0's first scan.  Boards on their own timers drift apart, which a 
+  tick sees as one board having more scans buffered than another -- the 
+  one that is ahead has its oldest scans thrown away until they are at 
+  most one scan apart again (see AIBoardInfo.n_slipped).
+
+  Boards that can't do commands, or can't do them at exactly our scan 
+  period, get the old polled reads -- and if one board can't, they all do.
+---------------------------------------------------------------------------*/
+
+#ifdef NEW_STYLE_KCOMEDILIB
+
+static void init_ai_command(void)
+{
+  struct ai_board *b;
+  int flags, size;
+
+  memset(&aicmd, 0, sizeof(aicmd));
+  if (!ai_command) return;
+
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) {
+    flags = comedi_get_subdevice_flags(b->dev, b->subdev);
+    if (flags < 0 || !(flags & SDF_CMD)) {
+      printk(RT_PROCESS_MODULE_NAME": ai subdevice of /dev/comedi%d can't "
+             "do commands, scans will be polled\n", b->minor);
+      cleanup_ai_command();
+      return;
+    }
+    size = comedi_get_buffer_size(b->dev, b->subdev);
+    if (size <= 0 || comedi_map(b->dev, b->subdev, &b->buf) || !b->buf) {
+      printk(RT_PROCESS_MODULE_NAME": can't get at the ai subdevice's buffer"
+             " on /dev/comedi%d, scans will be polled\n", b->minor);
+      b->buf = 0;
+      cleanup_ai_command();
+      return;
+    }
+    b->buf_size = size;
+    b->sample_size = (flags & SDF_LSAMPL) ? sizeof(lsampl_t) : sizeof(sampl_t);
+  }
+  aicmd.usable = 1;
+}
+
+static void stop_ai_command(void)
+{
+  struct ai_board *b;
+
+  if (aicmd.running) 
+    for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+      if (b->n) comedi_cancel(b->dev, b->subdev);
+  aicmd.running = 0;
+}
+
+static void cleanup_ai_command(void)
+{
+  struct ai_board *b;
+
+  stop_ai_command();
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+    if (b->buf) {
+      comedi_unmap(b->dev, b->subdev);
+      b->buf = 0;
+    }
+  aicmd.usable = 0;
+}
+
+/* starts b's part of the scan, returns nonzero if it wouldn't go */
+static int start_board_command(struct ai_board *b, int ext_clock)
+{
+  comedi_cmd cmd;
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.subdev = b->subdev;
+  cmd.flags = TRIG_WAKE_EOS;
+  cmd.start_src = TRIG_NOW;
+  if (ext_clock < 0) {
+    cmd.scan_begin_src = TRIG_TIMER;
+    cmd.scan_begin_arg = aicmd.nanos_per_scan;
+  } else {
+    cmd.scan_begin_src = TRIG_EXT;
+    cmd.scan_begin_arg = ext_clock;
+  }
+  cmd.convert_src = TRIG_TIMER;
+  /* spread the conversions over at most the whole scan, but no faster 
+     than the mux can settle -- the board rounds this up to what it can do*/
+  cmd.convert_arg = aicmd.nanos_per_scan / b->n;
+  if (cmd.convert_arg > (uint)settling_time) cmd.convert_arg = settling_time;
+  cmd.scan_end_src = TRIG_COUNT;
+  cmd.scan_end_arg = b->n;
+  cmd.stop_src = TRIG_NONE;
+  cmd.chanlist = b->chanlist;
+  cmd.chanlist_len = b->n;
+
+  /* the first test usually just fixes up the args, the second should pass*/
+  comedi_command_test(b->dev, &cmd);
+  if (comedi_command_test(b->dev, &cmd)
+      /* no good if the board can't do our period exactly */
+      || (ext_clock < 0 && cmd.scan_begin_arg != aicmd.nanos_per_scan)
+      || comedi_command(b->dev, &cmd) < 0) 
+    return -1;
+  b->started = gethrtime();
+  return 0;
+}
+
+/* returns 0 if the command is running for the config in mask/rtp_shm */
+static int sync_ai_command(const char *mask)
+{
+  struct ai_board *b;
+  uint i, j, n, n_slot, r, max_factor;
+
+  /* has anything changed since we built the command? */
+  if (aicmd.nanos_per_scan != rtp_shm->nanos_per_scan 
+      || aicmd.cic_order != rtp_shm->ai_cic_order
+      || memcmp(aicmd.mask, mask, CHAN_MASK_BYTES(rtp_shm->n_ai_chans))) 
+    goto rebuild;
+  for (i = 0; i < aicmd.n_chans; i++)
+    if (aicmd.chanlist[i] != rtp_shm->ai_chan[aicmd.chan_ids[i]]
+        || aicmd.oversample[i] != rtp_shm->ai_oversample[aicmd.chan_ids[i]]) 
+      goto rebuild;
+
+  if (aicmd.running) return 0;
+  if (aicmd.failed) return -1;
+  aicmd.n_restarts++; /* it stopped on its own, most likely an overrun */
+  goto start;
+
+ rebuild:
+  stop_ai_command();
+  aicmd.failed = 0;
+  memcpy(aicmd.mask, mask, CHAN_MASK_BYTES(rtp_shm->n_ai_chans));
+  aicmd.nanos_per_scan = rtp_shm->nanos_per_scan;
+  aicmd.cic_order = rtp_shm->ai_cic_order;
+  aicmd.oversampling = 0;
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) b->n = 0;
+  for (i = next_chan_on(0, mask, rtp_shm->n_ai_chans), n = 0; 
+       i < rtp_shm->n_ai_chans; 
+       i = next_chan_on(i + 1, mask, rtp_shm->n_ai_chans)) {
+    aicmd.chanlist[n] = rtp_shm->ai_chan[i];
+    aicmd.oversample[n] = rtp_shm->ai_oversample[i];
+#ifndef RTLAB_FIXED_POINT
+    set_ai_convert(&aicmd.convert, n, aicmd.chanlist[n]);
+#endif
+    ai_decimate_set(&aicmd.decimate, n, aicmd.oversample[n], aicmd.cic_order,
+                    krange_cache.ai_maxdatas[i]);
+    if (aicmd.decimate.slot[n].factor > 1) aicmd.oversampling = 1;
+    aicmd.chan_ids[n++] = i;
+  }
+  aicmd.n_chans = n;
+#ifndef RTLAB_FIXED_POINT
+  /* the filter's gain comes back out in the conversion to volts */
+  if (aicmd.oversampling) 
+    for (i = 0; i < aicmd.n_chans; i++) 
+      aicmd.convert.gain[i] /= ai_decimate_gain(&aicmd.decimate, i);
+#endif
+
+  /* The global channels are in board order, so each board's share of 
+     the scan is contiguous.  A board's chanlist goes round its channels 
+     once per round, and an oversampled channel is in the first factor 
+     rounds, so that its conversions are spread out over the scan. */
+  for (i = 0, n = 0; i < aicmd.n_chans; i = j) {
+    b = &ai_boards[ai_chan_board[aicmd.chan_ids[i]]];
+    for (j = i, max_factor = 1; 
+         j < aicmd.n_chans && &ai_boards[ai_chan_board[aicmd.chan_ids[j]]] == b;
+         j++)
+      if (aicmd.decimate.slot[j].factor > max_factor) 
+        max_factor = aicmd.decimate.slot[j].factor;
+    b->first = n;
+    b->chanlist = aicmd.hw_chanlist + n;
+    for (r = 0; r < max_factor; r++)
+      for (n_slot = i; n_slot < j; n_slot++) {
+        if (aicmd.decimate.slot[n_slot].factor <= r) continue;
+        if (n >= RT_MAX_CHANLIST) goto failed;
+        aicmd.hw_chanlist[n] = 
+          CR_PACK(aicmd.chan_ids[n_slot] - b->first_chan, 
+                  CR_RANGE(aicmd.chanlist[n_slot]),
+                  CR_AREF(aicmd.chanlist[n_slot]));
+        aicmd.raw_slot[n++] = n_slot;
+      }
+    b->n = n - b->first;
+  }
+  aicmd.n_raw = n;
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+    b->scan_size = b->n * b->sample_size;
+
+ start:
+  /* whatever the filters had is from before the gap */
+  for (i = 0; i < aicmd.n_chans; i++) ai_decimate_reset(&aicmd.decimate, i);
+
+  /* a scan has to fit in the buffer several times over to be any use, 
+     and externally clocked boards need board 0 to make the clock */
+  if (!aicmd.n_chans) goto failed;
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+    if (b->scan_size * 4 > b->buf_size
+        || (b->n && !ai_boards[0].n 
+            && rtp_shm->ai_boards[b - ai_boards].ext_clock >= 0))
+      goto failed;
+
+  /* armed first, so that they all start on board 0's first scan */
+  for (b = ai_boards + 1; b < ai_boards + n_ai_boards; b++) 
+    if (b->n && rtp_shm->ai_boards[b - ai_boards].ext_clock >= 0
+        && start_board_command(b, rtp_shm->ai_boards[b - ai_boards].ext_clock))
+      goto failed_started;
+  /* then the ones on their own timers, as close together as we can */
+  for (b = ai_boards + n_ai_boards - 1; b >= ai_boards; b--)
+    if (b->n && rtp_shm->ai_boards[b - ai_boards].ext_clock < 0
+        && start_board_command(b, -1))
+      goto failed_started;
+
+  aicmd.running = 1;
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) {
+    AIBoardInfo *info = &rtp_shm->ai_boards[b - ai_boards];
+
+    info->start_offset_ns = (b->n && ai_boards[0].n && info->ext_clock < 0)
+                            ? (int)(b->started - ai_boards[0].started) : 0;
+    info->skew_ns = info->max_skew_ns = 0;
+  }
+  return 0;
+
+ failed_started:
+  /* cancel the ones that did start */
+  aicmd.running = 1;
+  stop_ai_command();
+ failed:
+  aicmd.failed = 1;
+  return -1;
+}
+
+/* throws away the scans that put the boards more than one apart or leave
+   more than keep buffered, and measures their skew, see AIBoardInfo.  
+   Returns how many scans all the boards lost to the latter. */
+static uint align_ai_boards(uint keep)
+{
+  struct ai_board *b;
+  uint min = ~0U, drop;
+
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+    if (b->n && b->avail < min) min = b->avail;
+
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) {
+    AIBoardInfo *info = &rtp_shm->ai_boards[b - ai_boards];
+
+    if (!b->n) continue;
+    /* we fell behind, skip ahead so the tick that catches up still has 
+       some to read */
+    drop = min > keep ? min - keep : 0;
+    if (b->avail - min > 1) {
+      /* this board is ahead of the slowest */
+      drop += b->avail - min - 1;
+      info->n_slipped += b->avail - min - 1;
+    }
+    if (drop) 
+      comedi_mark_buffer_read(b->dev, b->subdev, drop * b->scan_size);
+
+    if (b != ai_boards && ai_boards[0].n) 
+      note_ai_skew(info, ((int)ai_boards[0].avail - (int)b->avail) 
+                         * (int)aicmd.nanos_per_scan);
+  }
+  if (min == ~0U || min <= keep) return 0;
+  aicmd.n_skipped += min - keep;
+  return min - keep;
+}
+
+/* copies the oldest complete scan out of every board's buffer -- in burst
+   mode, all the complete scans, up to a block's worth.  Returns nonzero if
+   there isn't one (and stops the command in that case) */
+static int grab_scan_from_buffer(MultiSampleStruct *m)
+{
+  const hrtime_t deadline = m->acq_start + 2 * (hrtime_t)aicmd.nanos_per_scan;
+  const scan_index_t base = rtp_shm->scan_index;
+  struct ai_board *b;
+  int avail;
+  uint i, k, n, n_scans, dropped, start[SHD_MAX_AI_BOARDS], off, run, 
+       max_scans = RT_MAX_BLOCK_SAMPLES / (aicmd.n_chans ? aicmd.n_chans : 1);
+  SampleStruct *out;
+  hrtime_t waited;
+
+  /* wait until they all have one */
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) {
+    if (!b->n) continue;
+    for (;;) {
+      comedi_poll(b->dev, b->subdev);
+      avail = comedi_get_buffer_contents(b->dev, b->subdev);
+      if (avail < 0) break;
+      if ((uint)avail >= b->scan_size) break;
+      if (!(comedi_get_subdevice_flags(b->dev, b->subdev) & SDF_RUNNING) 
+          || gethrtime() > deadline) { 
+        avail = -1; 
+        break; 
+      }
+    }
+    if (avail < 0) { stop_ai_command(); return -1; }
+    b->avail = avail / b->scan_size;
+  }
+
+  if ( (waited = gethrtime() - m->acq_start) > (hrtime_t)aicmd.nanos_per_scan / 100 ) 
+    /* trail the board's scans from now on, see above */
+    timespec_add_ns(&next_task_wakeup, (long)waited);
+
+  if (n_ai_boards > 1) {
+    /* count them again, all as close together in time as we can, so 
+       that the counts can be compared */
+    for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+      if (b->n) {
+        comedi_poll(b->dev, b->subdev);
+        avail = comedi_get_buffer_contents(b->dev, b->subdev);
+        if (avail >= 0) b->avail = avail / b->scan_size;
+      }
+  }
+
+  if (rtp_shm->scans_per_tick <= 1) {
+    /* one scan per tick, stay at most one behind */
+    align_ai_boards(2);
+    n_scans = 1;
+    dropped = 0;
+  } else {
+    /* burst mode: take everything that's there, so a late tick just 
+       makes for a bigger block, as long as it fits */
+    k = max_scans;
+    dropped = align_ai_boards(k);
+    for (n_scans = k, b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+      if (b->n && b->avail - dropped < n_scans) n_scans = b->avail - dropped;
+  }
+
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+    if (b->n) 
+      start[b - ai_boards] = comedi_get_buffer_offset(b->dev, b->subdev);
+
+  for (k = 0; k < n_scans; k++) {
+    /* oversampled, the scan's conversions go through the filters first */
+    uint *codes = aicmd.codes + k * aicmd.n_chans,
+         *dst = aicmd.oversampling ? aicmd.raw : codes;
+
+    for (b = ai_boards; b < ai_boards + n_ai_boards; b++) {
+      if (!b->n) continue;
+      off = (start[b - ai_boards] + k * b->scan_size) % b->buf_size;
+
+      /* the scan wraps around the end of the buffer at most once (never 
+         in the middle of a sample), so it's at most two contiguous runs, 
+         and the sample size test is hoisted out of the copies */
+      for (i = b->first; i < b->first + b->n; i += run, off = 0) {
+        run = (b->buf_size - off) / b->sample_size;
+        if (run > b->first + b->n - i) run = b->first + b->n - i;
+        if (b->sample_size == sizeof(lsampl_t)) {
+          const lsampl_t *in = (const lsampl_t *)((char *)b->buf + off);
+          for (n = 0; n < run; n++) dst[i + n] = in[n];
+        } else {
+          const sampl_t *in = (const sampl_t *)((char *)b->buf + off);
+          for (n = 0; n < run; n++) dst[i + n] = in[n];
+        }
+      }
+    }
+
+    if (aicmd.oversampling) {
+      for (i = 0; i < aicmd.n_raw; i++) 
+        ai_decimate_put(&aicmd.decimate, aicmd.raw_slot[i], aicmd.raw[i]);
+      for (i = 0; i < aicmd.n_chans; i++) 
+        codes[i] = ai_decimate_get(&aicmd.decimate, i);
+    }
+  }
+
+  for (b = ai_boards; b < ai_boards + n_ai_boards; b++) 
+    if (b->n) 
+      comedi_mark_buffer_read(b->dev, b->subdev, n_scans * b->scan_size);
+
+  /* every scan gets the index it would have had if no scan was ever 
+     skipped in between, so the ones that were are a gap in scan_index */
+  for (k = 0, out = m->samples; k < n_scans; k++, out += aicmd.n_chans) {
+#ifndef RTLAB_FIXED_POINT
+    ai_convert_scan(&aicmd.convert, aicmd.codes + k * aicmd.n_chans, out, 
+                    aicmd.n_chans);
+#endif
+    for (i = 0; i < aicmd.n_chans; i++) {
+      out[i].code = aicmd.codes[k * aicmd.n_chans + i];
+      out[i].code_gain = ai_decimate_gain(&aicmd.decimate, i);
+      out[i].range = CR_RANGE(aicmd.chanlist[i]);
+      out[i].scan_index = base + dropped + k;
+      out[i].channel_id = aicmd.chan_ids[i];
+      out[i].spike = 0;
+    }
+  }
+  m->n_samples = n_scans * aicmd.n_chans;
+  m->n_scans = n_scans;
+  scans_this_tick = dropped + n_scans;
+
+  return 0;
+}
+
+#else /* OLD_STYLE_KCOMEDILIB -- always polled */
+
+static void init_ai_command(void) { memset(&aicmd, 0, sizeof(aicmd)); }
+static void cleanup_ai_command(void) { }
+static inline int sync_ai_command(const char *mask) { return -1; }
+static inline int grab_scan_from_buffer(MultiSampleStruct *m) { return -1; }
+
+#endif
+
 static void grabScanOffBoard (MultiSampleStruct *m)
 {
-  register uint i, packed_param;
+  register uint i, k, packed_param;
+  const struct ai_board *b = 0;
+  SampleStruct *s;
   lsampl_t samp;
 
+  /* bits past n_ai_chans are never on, so they needn't be copied */
+  memcpy(m->channel_mask, (const char *)rtp_shm->ai_chans_in_use, 
+         CHAN_MASK_BYTES(rtp_shm->n_ai_chans));
+  m->acq_start = gethrtime();
+
+  /* the hardware-timed path, see above */
+  if (aicmd.usable && !sync_ai_command(m->channel_mask) 
+      && !grab_scan_from_buffer(m)) {
+    m->acq_end = gethrtime();
+    return;
+  }
+
 /*---------------------------------------------------------------------------
-  Data Acquisition below...
-  -------------------------
-  Cheap hack to get acquisition working with new comedi.. 
+  Polled data acquisition below...
+  --------------------------------
   This loop is SLOW and may break timing! It takes over .5 ms to run just
-  this loop! 
-  (the rest of this takes circa 20-40 microseconds, so
-  this by far is the bottleneck of our rt-task)
-  TODO: NEED TO REWRITE THIS!! Possibly to use comedi commands, with a 
-  realtime callback or somesuch.  Problem is that it's tough to get commands
-  working in a really board-independent fashion. 
-  (Note to self: Ok, it's not tough, but requires some probing in 
-  init_module to determine some minimum values for the comedi_cmd struct)
+  this loop with a handful of channels, since every channel costs a 
+  settling_time busy-wait.  It's only used for boards that can't do 
+  commands (or when the ai_command module parameter is 0).  The boards 
+  are read one after the other.  In burst mode there is still just the one
+  scan per tick, and the other scans_per_tick - 1 scan periods the tick 
+  covers are never acquired: they are a gap in scan_index, and are counted
+  in aicmd.n_skipped (Scans Skipped in /proc) like any others.
 ---------------------------------------------------------------------------*/
-  memcpy(m->channel_mask, (const char *)rtp_shm->ai_chans_in_use, CHAN_MASK_SIZE);
-  m->acq_start = gethrtime();
-  for (i = 0, m->n_samples = 0; i < rtp_shm->n_ai_chans; i++) {
-    if (is_chan_on(i, m->channel_mask)) {
-      packed_param = rtp_shm->ai_chan[i]; /* for shorter line length  below */
-      internal_data_read_delayed(rtp_comedi_ai_dev_handle, rtp_shm->ai_subdev, 
-                                 CR_CHAN(packed_param),CR_RANGE(packed_param), 
+  m->n_scans = 1;
+  scans_this_tick = rtp_shm->scans_per_tick;
+  aicmd.n_skipped += scans_this_tick - 1;
+  for (i = next_chan_on(0, m->channel_mask, rtp_shm->n_ai_chans), 
+         m->n_samples = 0; 
+       i < rtp_shm->n_ai_chans; 
+       i = next_chan_on(i + 1, m->channel_mask, rtp_shm->n_ai_chans)) {
+    packed_param = rtp_shm->ai_chan[i]; /* for shorter line length  below */
+    if (b != &ai_boards[ai_chan_board[i]]) {
+      /* on to the next board */
+      b = &ai_boards[ai_chan_board[i]];
+      if (n_ai_boards > 1) 
+        ai_boards[ai_chan_board[i]].started = gethrtime();
+    }
+    s = &m->samples[m->n_samples];
+    if (polled_convert.chanspec[i] != packed_param) { /* gain changed */
+#ifdef RTLAB_FIXED_POINT
+      polled_convert.chanspec[i] = packed_param; /* no volts wanted */
+#else
+      set_ai_convert(&polled_convert, i, packed_param);
+#endif
+      polled_oversample[i] = 0; /* the filter is for the old range too */
+    }
+    if (rtp_shm->ai_oversample[i] > 1) {
+      /* oversampled: the extra reads go through the channel's filter, 
+         and each one costs another settling_time */
+      if (polled_oversample[i] != rtp_shm->ai_oversample[i]
+          || polled_cic_order[i] != rtp_shm->ai_cic_order) {
+        polled_oversample[i] = rtp_shm->ai_oversample[i];
+        polled_cic_order[i] = rtp_shm->ai_cic_order;
+        ai_decimate_set(&polled_decimate, i, polled_oversample[i], 
+                        polled_cic_order[i], krange_cache.ai_maxdatas[i]);
+        ai_decimate_reset(&polled_decimate, i);
+      }
+      for (k = 0; k < polled_oversample[i]; k++) {
+        internal_data_read_delayed(b->dev, b->subdev, i - b->first_chan,
+                                   CR_RANGE(packed_param), 
+                                   CR_AREF(packed_param),&samp, settling_time);
+        ai_decimate_put(&polled_decimate, i, samp);
+      }
+      s->code = ai_decimate_get(&polled_decimate, i);
+      s->code_gain = ai_decimate_gain(&polled_decimate, i);
+#ifndef RTLAB_FIXED_POINT
+      s->data = polled_convert.offset[i] 
+        + polled_convert.gain[i] * s->code / (double)s->code_gain;
+#endif
+    } else {
+      polled_oversample[i] = 1; /* so turning it back on starts afresh */
+      internal_data_read_delayed(b->dev, b->subdev, i - b->first_chan,
+                                 CR_RANGE(packed_param), 
                                  CR_AREF(packed_param),&samp, settling_time);
-      m->samples[m->n_samples].data = 
-        sampl_to_volts(AI,CR_CHAN(packed_param),CR_RANGE(packed_param), samp);
-      m->samples[m->n_samples].scan_index = rtp_shm->scan_index;
-      m->samples[m->n_samples].channel_id = i;
-      m->samples[m->n_samples].spike = 0;
-      m->n_samples++;
+      s->code = samp;
+      s->code_gain = 1;
+#ifndef RTLAB_FIXED_POINT
+      s->data = ai_convert_one(&polled_convert, i, samp);
+#endif
     }
+    s->range = CR_RANGE(packed_param);
+    s->scan_index = rtp_shm->scan_index;
+    s->channel_id = i;
+    s->spike = 0;
+    m->n_samples++;
   }  
   m->acq_end = gethrtime();
+
+  /* the boards' skews, see AIBoardInfo */
+  if (n_ai_boards > 1 && b) 
+    for (i = 1; i < n_ai_boards; i++) 
+      if (ai_boards[i].started >= m->acq_start 
+          && ai_boards[0].started >= m->acq_start) /* both polled this tick */
+        note_ai_skew(&rtp_shm->ai_boards[i], 
+                     (int)(ai_boards[i].started - ai_boards[0].started));
 /*---------------------------------------------------------------------------
   /End data acquisition/
 ---------------------------------------------------------------------------*/
 }
 
+#ifdef RTLAB_FIXED_POINT
+
+/*
+  The fixed point build
+  ---------------------
+  Built with RTLAB_FIXED_POINT (make -f Makefile.rt_process FIXED_POINT=1),
+  nothing on the RT loop's own path touches the FPU.  The samples go out 
+  as the ADC codes they came in as (.code, .code_gain and .range, which 
+  are filled in either way), and not in volts; spikes are detected on 
+  those codes, against the thresholds converted to codes once, when they 
+  or the channel's range change; and spike periods are kept in scans.  
+  Userland turns all that back into volts and milliseconds (see 
+  SharedMemStruct.ai_fixed_point and codes_source.h).  With no floating 
+  point left, the task can do without an FPU context -- see the task_fp 
+  module param.
+*/
+
+/* spike_detect_scan_codes()'s thresholds and blanking: thold[chan] is 
+   threshold_uv[chan] as it was in uv[chan], as a code in range range[chan]
+   times code_gain gain[chan]; blank[chan] is in 1/65536ths of a scan */
+static struct spike_tholds {
+  int64 thold[SHD_MAX_CHANNELS];
+  int64 blank[SHD_MAX_CHANNELS];
+  int uv[SHD_MAX_CHANNELS];
+  int range[SHD_MAX_CHANNELS];
+  uint gain[SHD_MAX_CHANNELS];
+} spike_tholds;
+
+static void init_spike_tholds(void)
+{
+  uint i;
+
+  for (i = 0; i < SHD_MAX_CHANNELS; i++) spike_tholds.range[i] = -1;
+}
+
+/* uv as a code in channel chan's range, rounded.  krange's min and max
+   are in millionths of the range's unit, like uv, and for mA ranges uv 
+   is in amps like the volts it stands in for.  Past either end of the 
+   range it's a code one past the end, which compares with every sample 
+   the way uv itself would. */
+static int uv_to_code(uint chan, uint range, int uv)
+{
+  comedi_krange *krange = get_krange(AI, chan, range);
+  lsampl_t maxdata = krange_cache.ai_maxdatas[chan];
+  int64 x;
+  uint64 code;
+  uint span;
+
+  if (!krange || krange->max <= krange->min) return -1;
+  x = (int64)uv * (RF_UNIT(krange->flags) == UNIT_mA ? 1000 : 1) 
+      - krange->min;
+  span = krange->max - krange->min;
+  if (x < 0) return -1;
+  if (x > span) return maxdata + 1;
+  code = (uint64)x * maxdata + span / 2;
+  do_div(code, span);
+  return (int)code;
+}
+
+/* Brings spike_tholds up to date for the channels in the scan s[0..n), 
+   once a tick, so that the detector's per-sample work is just compares.
+   The thresholds only need converting again when they or a range or an 
+   oversampling factor change, which on most ticks is never. */
+static inline void update_spike_tholds(const SampleStruct *s, uint n)
+{
+  const volatile int *uv = rtp_shm->spike_params.threshold_uv;
+  const volatile uint *blanking = rtp_shm->spike_params.blanking;
+  const uint rate = rtp_shm->sampling_rate_hz, scans_per_ms = rate / 1000;
+  uint i, c;
+
+  for (i = 0; i < n; i++) {
+    c = s[i].channel_id;
+    if (spike_tholds.uv[c] != uv[c] || spike_tholds.range[c] != s[i].range
+        || spike_tholds.gain[c] != s[i].code_gain) {
+      spike_tholds.uv[c] = uv[c];
+      spike_tholds.range[c] = s[i].range;
+      spike_tholds.gain[c] = s[i].code_gain;
+      spike_tholds.thold[c] = 
+        (int64)uv_to_code(c, s[i].range, uv[c]) * s[i].code_gain;
+    }
+    /* rates are multiples or factors of 1000 Hz (normalizeSamplingRate()),
+       so scans per ms is either whole or less than 1 */
+    spike_tholds.blank[c] = (int64)(scans_per_ms 
+                                    ? blanking[c] * scans_per_ms 
+                                    : blanking[c] * rate / 1000) << 16;
+  }
+}
+
+static void detectSpikes (MultiSampleStruct *m)
+{
+  uint k, per = m->n_scans > 1 ? m->n_samples / m->n_scans : m->n_samples;
+
+  /* a range can't change in the middle of a block, so the first scan 
+     has them all */
+  update_spike_tholds(m->samples, per);
+  for (k = 0; k < m->n_scans || !k; k++)
+    spike_detect_scan_codes(&spike_info, &rtp_shm->spike_params, 
+                            m->samples + k * per, per, 
+                            m->samples[k * per].scan_index, 
+                            spike_tholds.thold, spike_tholds.blank);
+}
+
+#else
+
+static void init_spike_tholds(void) { }
+
 static void detectSpikes (MultiSampleStruct *m)
 {
-  register uint chan, i, elapsed;
   const uint avg_chan_time =
     ( m->n_samples  ? ((uint)(m->acq_end - m->acq_start)) / m->n_samples : 1 );
-  hrtime_t this_chan_time;   
-  int polarity, saved_polarity;
-  double thold, saved_thold;
-
-  /* clear our spikes_this_scan mask.. */
-  memset(spike_info.spikes_this_scan, 0, CHAN_MASK_SIZE);
-
-  for (i = 0; i < m->n_samples; i++) {
-    chan = m->samples[i].channel_id;
-    this_chan_time = m->acq_start + (hrtime_t)(avg_chan_time * i);
-    elapsed = (uint)(this_chan_time - spike_info.last_spike_ended_time[chan]);
-    polarity = test_bit(chan, rtp_shm->spike_params.polarity_mask) 
-               ? Positive : Negative; /* necessary due to test_bit artifacts */
-    saved_polarity = test_bit(chan, spike_info.saved_polarity) 
-                     ? Positive : Negative; /* necessary ... */
-    thold = rtp_shm->spike_params.threshold[chan];
-    saved_thold = spike_info.saved_thold[chan];
-
-    if (test_bit(chan, spike_info.in_spike)) {
-      /* IN SPIKE..     
-         things are a bit different if we are inside a spike */
-
-      if (/* polarity or threshold changed, so abort spike early.. */
-          saved_thold != thold || polarity != saved_polarity 
-          /* chan is positive polarity and sample dipped below thold */
-          || (saved_polarity && m->samples[i].data <= saved_thold) 
-          /* OR chan is negative polarity and sample dipped above thold */
-          || (!saved_polarity && m->samples[i].data >= saved_thold) 
-         )  {
-        /* THEN end the spike by unsetting spike_info.in_spike
-                and also recording when the spike ended */
-        spike_info.last_spike_ended_time[chan] = this_chan_time;
-        clear_bit(chan, spike_info.in_spike);
-      }
-      
-    } else if (test_bit(chan, rtp_shm->spike_params.enabled_mask)              
-               && elapsed >= rtp_shm->spike_params.blanking[chan] * MILLION) {
-      /* if we get here it means that we were _not_ in a spike
-         and that spike detection is turned on.. thus we need to
-         actually test for the presence of a spike.. */         
-        switch (polarity) {
-        case Positive: /* from enum SpikePolarity */
-          if ( (m->samples[i].spike = (thold <= m->samples[i].data) ) )
-            /* we have a spike, so save the polarity */
-            set_bit(chan, spike_info.saved_polarity); /* save the polarity */
-          break;
-        case Negative: 
-          if ( (m->samples[i].spike = (thold >= m->samples[i].data) ) )
-            /* we have a spike, so save the polarity */
-            clear_bit(chan, spike_info.saved_polarity); /* save polarity */
-          break;
-        default:
-          /* this case is not reached, but defensive rtl_printf follows */
-          rtl_printf(MODULE_NAME ": Bug in " MODULE_NAME ".o, channel %u "
-                     "has an illegal spike polarity!\n", chan); 
-          break;
-        }
+  uint k, per = m->n_scans > 1 ? m->n_samples / m->n_scans : m->n_samples;
+
+  /* see spike_detect.h -- a block goes a scan at a time, each one a scan
+     period after the last */
+  for (k = 0; k < m->n_scans || !k; k++)
+    spike_detect_scan(&spike_info, &rtp_shm->spike_params, 
+                      m->samples + k * per, per, 
+                      m->acq_start + k * (hrtime_t)rtp_shm->nanos_per_scan,
+                      avg_chan_time, rtp_shm->nanos_per_scan);
+}
 
-        if (m->samples[i].spike) {
-          /* we just had a spike this scan, so do some bookkeeping */
-
-          /* calculate period.. */
-          m->samples[i].spike_period = spike_info.period[chan] = 
-            (uint)(this_chan_time - spike_info.last_spike_time[chan]) 
-                  * ((double)0.000001 /*convert to ms*/);
-          /* save spike time... */
-          spike_info.last_spike_time[chan] = this_chan_time;
-          /* set some flags... */
-          set_bit(chan, spike_info.spikes_this_scan);
-          set_bit(chan, spike_info.in_spike);
-          /* save spike threshold so we can detect changes while in_spike */
-          spike_info.saved_thold[chan] = thold;
-        }
-    }
+#endif
+
+/* Allocates the shm ai ring, if the ai_ring module param says so.  On 
+   failure, leaves rtp_shm->ai_ring_slots at 0 so that userland knows
+   to use the ai fifo. */
+static void init_ai_ring(void)
+{
+  unsigned int n_slots, max_slots;
+
+  if (!ai_ring) return;
+
+  if (max_ring < (int)SAMPLE_RING_BYTES(2)) max_ring = SAMPLE_RING_BYTES(2);
+
+  /* like the fifo, fifo_secs worth of every channel, but capped at 
+     max_ring rather than max_fifo */
+  n_slots = sample_ring_pow2_floor(fifo_secs * rtp_shm->sampling_rate_hz 
+                                   * rtp_shm->n_ai_chans);
+  max_slots = sample_ring_pow2_floor( (max_ring - SAMPLE_RING_BYTES(0)) 
+                                      / sizeof(SampleStruct) );
+  if (n_slots > max_slots) n_slots = max_slots;
+  if (n_slots < 2) n_slots = 2;
+
+  rtp_ai_ring = 
+    (struct SampleRing *) rtos_shm_attach(SAMPLE_RING_NAME, 
+                                          SAMPLE_RING_BYTES(n_slots));
+  if (!rtp_ai_ring) {
+    printk(RT_PROCESS_MODULE_NAME": could not allocate the %lu byte ai ring, "
+           "using the ai fifo instead.\n", SAMPLE_RING_BYTES(n_slots));
+    return;
   }
+
+  sample_ring_init(rtp_ai_ring, n_slots);
+  rtp_shm->ai_ring_slots = n_slots;
 }
 
 static void putFullScanIntoAIFifo (MultiSampleStruct *m) 
 {
-  //  static DECLARE_FIFO_DELIMITER(delim);
   register int 
-    i, 
     fifo_minor = rtp_shm->ai_fifo_minor, 
-    n_samples_to_write = m->n_samples;
+    n_bytes = m->n_samples * sizeof(SampleStruct);
 #ifdef TIME_RT_LOOP
   static hrtime_t put_start;
 
   put_start = gethrtime();
 #endif
 
-  for (i = 0; i < n_samples_to_write; i++) {
-  /* Note: error checking is not done here.  The fifo must meet
-     the following three conditions:
-     1) It must have been created with a call to rtf_create
-     2) It must be a fifo that is less than RTF_NO
-     3) It must have sufficient space for what we put in
-     Otherwise, this put will fail! */
-    if (//rtf_put(fifo_minor, &delim, sizeof(FIFO_DELIMITER_T)) < 0 || 
-	rtf_put(fifo_minor, &m->samples[i], sizeof(SampleStruct)) < 0) 
-      /* abort loop if we ran out of fifo to put into */
-      break; 
+  if (rtp_ai_ring) {
+    /* one memcpy (two if it wraps), no fifo at all */
+    sample_ring_put(rtp_ai_ring, m->samples, m->n_samples);
+    n_bytes = 0; 
   }
+
+  /* m->samples is already one contiguous run of SampleStructs, so the 
+     whole scan goes in with a single rtf_put() -- one lock, one copy and 
+     one reader wakeup per tick instead of one per sample.  
+     rtf_put() is all-or-nothing: if the fifo can't take the whole scan 
+     (userland isn't keeping up) nothing is written, so userland never 
+     sees a partial scan.  We just count the dropped scan(s). */
+  if (n_bytes && rtf_put(fifo_minor, m->samples, n_bytes) != n_bytes) 
+    rtp_shm->ai_fifo_scans_dropped += m->n_scans ? m->n_scans : 1;
+
 #ifdef RTP_DEBUG_FIFO_WRITES
-  if (i == n_samples_to_write)
+  if (n_bytes)
     rtl_printf("%s: rtf_length(%d)=%d, rtf_free(%d)=%d, rtf_bufsize(%d)=%d\n",
               MODULE_NAME, fifo_minor, rtf_length(fifo_minor),
   	      fifo_minor, rtf_free(fifo_minor), 
@@ -1162,6 +2138,150 @@ static void putFullScanIntoAIFifo (MultiSampleStruct *m)
 
 }
 
+/* Allocates the shm ao ring, if the ao_ring module param says so, and
+   registers playAORing() to play out of it.  On failure, leaves 
+   rtp_shm->ao_ring_slots at 0 so that userland knows there isn't one. */
+static void init_ao_ring(void)
+{
+  unsigned int n_slots, max_slots, stride = rtp_shm->n_ao_chans;
+
+  if (!ao_ring || !stride) return;
+
+  if (stride > AO_RING_MAX_CHANS) stride = AO_RING_MAX_CHANS;
+  if (max_ring < (int)AO_RING_BYTES(2, stride)) 
+    max_ring = AO_RING_BYTES(2, stride);
+
+  /* fifo_secs worth of scans, capped at max_ring like the ai ring is */
+  n_slots = sample_ring_pow2_floor(fifo_secs * rtp_shm->sampling_rate_hz);
+  max_slots = sample_ring_pow2_floor( (max_ring - AO_RING_BYTES(0, 0)) 
+                                      / (stride * sizeof(lsampl_t)) );
+  if (n_slots > max_slots) n_slots = max_slots;
+  if (n_slots < 2) n_slots = 2;
+
+  rtp_ao_ring = 
+    (struct AORing *) rtos_shm_attach(AO_RING_NAME, 
+                                      AO_RING_BYTES(n_slots, stride));
+  if (!rtp_ao_ring) {
+    printk(RT_PROCESS_MODULE_NAME": could not allocate the %lu byte ao ring, "
+           "ao playback is disabled.\n", AO_RING_BYTES(n_slots, stride));
+    return;
+  }
+
+  ao_ring_init(rtp_ao_ring, n_slots, stride);
+
+  if (__rtp_register_function(playAORing)) {
+    printk(RT_PROCESS_MODULE_NAME": could not register playAORing(), "
+           "ao playback is disabled.\n");
+    rtos_shm_detach((void *)rtp_ao_ring);
+    rtp_ao_ring = 0;
+    return;
+  }
+  __rtp_set_f_active(playAORing, 1);
+  /* once a tick even in burst mode, see playAORing() */
+  __rtp_set_f_blocks(playAORing, 1);
+
+  rtp_shm->ao_ring_slots = n_slots;
+  rtp_shm->ao_ring_stride = stride;
+}
+
+/* Writes out the next scan of the ao ring, if we're playing.  See
+   ao_ring.h for the protocol.  Idle, this is a couple of compares.
+
+   It runs once a tick even in burst mode: the writes are software-timed,
+   so writing all of the tick's scans would just bunch them up at the 
+   start of the tick.  The outputs get the first of them instead and the
+   ring moves on past the lot, so playback still takes as long as it 
+   should but the outputs only change at the tick rate. */
+static void playAORing (MultiSampleStruct *m) 
+{
+  /* our own copy of the feeder's request, so it can't change under us */
+  static unsigned int n_chans, chanspec[AO_RING_MAX_CHANS];
+  static scan_index_t start_scan, stop_scan;
+  struct AORing *r = rtp_ao_ring;
+  scan_index_t now = rtp_shm->scan_index;
+  unsigned int tail, head, i;
+  const lsampl_t *scan;
+  int state = r->state;
+
+  (void)m;
+
+  if (r->start_req != r->start_ack) {
+    /* don't look at the request before we've seen it was made */
+    rmb();
+    n_chans = r->n_chans;
+    if (n_chans > r->stride) n_chans = r->stride;
+    state = AO_RING_WAITING;
+    for (i = 0; i < n_chans; i++) {
+      chanspec[i] = r->chanspec[i];
+      if (CR_CHAN(chanspec[i]) >= rtp_shm->n_ao_chans 
+          || !get_krange(AO, CR_CHAN(chanspec[i]), CR_RANGE(chanspec[i])))
+        state = AO_RING_BADPARM;
+    }
+    start_scan = r->start_scan;
+    stop_scan = r->stop_scan;
+    r->tail = r->first;
+    r->underruns = 0;
+    r->started_at = r->first_underrun = r->last_underrun = 0;
+    r->state = state;
+    /* the feeder may use tail as soon as it sees the ack */
+    wmb();
+    r->start_ack = r->start_req;
+  }
+
+  if (r->stop_req != r->stop_ack) {
+    if (state == AO_RING_WAITING || state == AO_RING_PLAYING) 
+      r->state = state = AO_RING_STOPPED;
+    r->stop_ack = r->stop_req;
+  }
+
+  if (state == AO_RING_WAITING) {
+    if (now < start_scan) return;
+    r->state = state = AO_RING_PLAYING;
+    r->started_at = now;
+  }
+
+  if (state != AO_RING_PLAYING) return;
+
+  if (stop_scan && now >= stop_scan) {
+    r->state = AO_RING_DONE;
+    return;
+  }
+
+  tail = r->tail;
+  /* look at eof before head: if eof is set, the head we then read is the
+     final one (see ao_ring_finish()) */
+  if (r->eof) {
+    rmb();
+    if ((head = r->head) == tail) { r->state = AO_RING_DONE; return; }
+  } else if ((head = r->head) == tail) {
+    /* the feeder fell behind: hold the outputs where they are */
+    if (!r->underruns++) r->first_underrun = now;
+    r->last_underrun = now;
+    return;
+  }
+
+  /* don't look at the scan before we've seen the head that covers it */
+  rmb();
+  scan = r->buf + (tail & (r->n_slots - 1)) * r->stride;
+  for (i = 0; i < n_chans; i++)
+    comedi_data_write(rtp_comedi_ao_dev_handle, rtp_shm->ao_subdev,
+                      CR_CHAN(chanspec[i]), CR_RANGE(chanspec[i]), 
+                      CR_AREF(chanspec[i]), scan[i]);
+
+  /* the rest of the tick's scans are skipped over, see above -- as many 
+     of them as the feeder has put, anyway.  Short of that it's behind */
+  if (head - tail > scans_this_tick) 
+    head = tail + scans_this_tick;
+  else if (head - tail < scans_this_tick && !r->eof) {
+    if (!r->underruns++) r->first_underrun = now;
+    r->last_underrun = now;
+  }
+
+  /* we're done with the slots before the feeder can see they're free */
+  mb();
+  r->tail = head;
+}
+
 /* registers a function to be run within the rtf loop
    returns 0 on succes, ENOMEM or EBUSY on error.  
    Specified function entry won't be run (activated)
@@ -1185,31 +2305,25 @@ int rtp_register_function(rtfunction_t function)
 /* no EBUSY here, no usage increment (meant for internal registrations */
 static int __rtp_register_function(rtfunction_t function)
 {
-  struct rt_function_list *new, *tmp, *last; 
+  struct rt_function_table *t;
+  struct rt_function_entry *new;
 
-  new = kmalloc(sizeof(struct rt_function_list), GFP_KERNEL);
-
-  if (!new) {
+  down(&rt_functions_sem);
+  t = begin_rt_functions_update();
+  if (t->n_functions >= RT_MAX_FUNCTIONS) {
+    /* we don't publish t, so nothing changed */
+    up(&rt_functions_sem);
     return -ENOMEM;
   }
+  /* append, since the table is run in registration order */
+  new = &t->functions[t->n_functions++];
   new->active_flag = 0;
+  new->takes_blocks = 0;
   new->function = function;
   new->time_between_callbacks_us = 0;
   new->next_index_for_cb = 0;
-  new->next = &__end_of_func_list;
-  down(&rt_functions_sem);
-  /* now push this function to the end of the list; we use the semaphore
-     because he don't know what other kernel threads may be doing */
-  if (rt_functions == &__end_of_func_list) { 
-    /* if the list was empty, just prepend */
-    __end_of_func_list.next = rt_functions = new;
-  } else { 
-    /* otherwise find the last element and append */
-    last = rt_functions;
-    while ((tmp = last->next) != &__end_of_func_list) 
-      last = tmp;
-    last->next = new;
-  }
+  new->stats_slot = cb_stats_slot_alloc(function);
+  commit_rt_functions_update(t);
   up(&rt_functions_sem);
 
   return 0;
@@ -1237,22 +2351,28 @@ int rtp_unregister_function(rtfunction_t function)
 /* no EBUSY here, no usage decrement */
 static int __rtp_unregister_function(rtfunction_t function)
 {
-  struct rt_function_list *curr, *prev;
+  struct rt_function_table *t;
+  uint i, n = 0;
   char found_flg = 0;
 
   down(&rt_functions_sem);
-
-  prev = &__end_of_func_list;
-  while ((curr = prev->next) != &__end_of_func_list) {
-    if (curr->function == function) {
+  t = begin_rt_functions_update();
+  /* squeeze out every instance of function, keeping the others in order */
+  for (i = 0; i < t->n_functions; i++) {
+    if (t->functions[i].function == function) {
       found_flg = 1;
-      prev->next = curr->next;
-      kfree(curr);
       continue;
     }
-    prev = curr;
+    if (n != i) t->functions[n] = t->functions[i];
+    n++;
+  }
+  t->n_functions = n;
+  if (found_flg) {
+    commit_rt_functions_update(t);
+    /* only once the RT loop can't be timing it anymore */
+    for (i = 0; i < RT_STATS_MAX_CALLBACKS; i++)
+      if (cb_stats_owner[i] == function) cb_stats_slot_free(i);
   }
-  rt_functions = __end_of_func_list.next; /* re-establish head of list */
   up(&rt_functions_sem);
 
   return (found_flg ? 0 : -EINVAL);
@@ -1283,69 +2403,149 @@ int rtp_deactivate_function(rtfunction_t function)
   return __rtp_set_f_active(function, 0);
 }
 
-static inline struct rt_function_list *
-__find_func(rtfunction_t func, struct rt_function_list *start) 
+/* Returns a scratch copy of the published function table for a writer to
+   change.  Call with rt_functions_sem held, then either publish the copy
+   with commit_rt_functions_update() or just drop it. 
+
+   The RT loop keeps updating next_index_for_cb in the published table
+   while we copy it, so a callback with a frequency divider may come out
+   of an update one scan early or late.  That's it. */
+static struct rt_function_table *begin_rt_functions_update(void)
 {
-  struct rt_function_list *curr;
+  struct rt_function_table *cur = rt_functions,
+                           *spare = (cur == &rt_function_tables[0]
+                                     ? &rt_function_tables[1]
+                                     : &rt_function_tables[0]);
+  uint i;
+  
+  spare->n_functions = cur->n_functions;
+  for (i = 0; i < cur->n_functions; i++)
+    spare->functions[i] = cur->functions[i];
+  return spare;
+}
 
-  for (curr = start; curr != &__end_of_func_list; curr = curr->next)
-    if (curr->function == func) return curr;
-  return 0;
+/* Publishes t (from begin_rt_functions_update()) and waits until the RT 
+   loop is out of the old table, so that the next writer can reuse it. 
+   Call with rt_functions_sem held, from a context that can sleep. */
+static void commit_rt_functions_update(struct rt_function_table *t)
+{
+  struct rt_function_table *old = rt_functions;
+
+  mb(); /* t must be complete before anyone can see it */
+  rt_functions = t;
+  mb(); /* and published before we look at rt_functions_reader */
+  while (rt_functions_reader == old) {
+#ifdef __KERNEL__
+    current->state = TASK_INTERRUPTIBLE;
+    schedule_timeout(1);
+#else
+    sched_yield();
+#endif
+  }
 }
 
 int rtp_set_callback_frequency(rtfunction_t f, uint freq)
 {
-  register struct rt_function_list *r = rt_functions;
+  struct rt_function_table *t;
   int retval = -EINVAL;
+  uint i;
 
   if (__I_AM_BUSY)  return -EBUSY;
 
   down(&rt_functions_sem);
-  while ((r = __find_func(f, r))) {    
+  t = begin_rt_functions_update();
+  for (i = 0; i < t->n_functions; i++) 
     /* keep scanning for this function (as it may appear multiple times!)
        and set all instances of it to frequency_hz = freq */
-      r->time_between_callbacks_us = MILLION / normalizeSamplingRate(freq);
-      r = r->next;
+    if (t->functions[i].function == f) {
+      t->functions[i].time_between_callbacks_us = 
+        MILLION / normalizeSamplingRate(freq);
       retval = 0;
-  }
+    }
+  if (!retval) commit_rt_functions_update(t);
   up(&rt_functions_sem);   
   return retval;
 }
 
 int rtp_get_callback_frequency(rtfunction_t f)
 {
-  struct rt_function_list *r = rt_functions;
+  struct rt_function_table *t;
   int retval = -EINVAL;
+  uint i;
 
   if (__I_AM_BUSY) return -EBUSY;
 
   down(&rt_functions_sem);
-  r = __find_func(f, r);  
-  if (r) retval = 
-           (int)(MILLION / 
-                 (r->time_between_callbacks_us
-                  ? r->time_between_callbacks_us
-                  : rtp_shm->nanos_per_scan/1000));
+  t = rt_functions;
+  for (i = 0; i < t->n_functions; i++) 
+    if (t->functions[i].function == f) {
+      retval = 
+        (int)(MILLION / 
+              (t->functions[i].time_between_callbacks_us
+               ? t->functions[i].time_between_callbacks_us
+               : rtp_shm->nanos_per_scan/1000));
+      break;
+    }
   up(&rt_functions_sem);   
 
   return retval;
 }
 
+int rtp_set_callback_blocks(rtfunction_t f, int blocks)
+{
+  if (__I_AM_BUSY)  return -EBUSY;
+
+  return __rtp_set_f_blocks(f, blocks ? 1 : 0);
+}
+
+int rtp_require_fp(const char *who)
+{
+  if (task_fp) return 0;
+
+  printk(RT_PROCESS_MODULE_NAME": %s does floating point in the RT loop, "
+         "but the RT task has no FPU context.  Load "RT_PROCESS_MODULE_NAME
+         " with task_fp=1 to use it.\n", who);
+  return -EINVAL;
+}
+
 /* sets active flag on an entry in rt_functions 
    returns 0 on success, EBUSY or EINVAL on error */
 static int __rtp_set_f_active(rtfunction_t f, char v) 
 {
-  register struct rt_function_list *r = rt_functions;
-  register int retval = -EINVAL;
+  struct rt_function_table *t;
+  int retval = -EINVAL;
+  uint i;
 
   down(&rt_functions_sem);
-  while ((r = __find_func(f, r))) {    
+  t = begin_rt_functions_update();
+  for (i = 0; i < t->n_functions; i++) 
     /* keep scanning for this function (as it may appear multiple times!)
        and set all instances of it to active_flag = v */
-      r->active_flag = v;
-      r = r->next;
+    if (t->functions[i].function == f) {
+      t->functions[i].active_flag = v;
       retval = 0;
-  }
+    }
+  if (!retval) commit_rt_functions_update(t);
+  up(&rt_functions_sem);
+  
+  return retval;
+}
+
+/* same thing for the takes_blocks flag */
+static int __rtp_set_f_blocks(rtfunction_t f, char v) 
+{
+  struct rt_function_table *t;
+  int retval = -EINVAL;
+  uint i;
+
+  down(&rt_functions_sem);
+  t = begin_rt_functions_update();
+  for (i = 0; i < t->n_functions; i++) 
+    if (t->functions[i].function == f) {
+      t->functions[i].takes_blocks = v;
+      retval = 0;
+    }
+  if (!retval) commit_rt_functions_update(t);
   up(&rt_functions_sem);
   
   return retval;
@@ -1405,6 +2605,21 @@ inline double sampl_to_volts(SubDevT t, uint chan, uint range, lsampl_t sampl)
   return ret;
 }
 
+static void set_ai_convert(struct ai_convert *c, uint slot, uint chanspec)
+{
+  comedi_krange *krange = get_krange(AI, CR_CHAN(chanspec), CR_RANGE(chanspec));
+  double scale = 1e-6;
+
+  if (!krange) { 
+    ai_convert_set_bad(c, slot, chanspec, -666666.66);
+    return;
+  }
+  if (RF_UNIT(krange->flags) == UNIT_mA) scale *= 0.001;
+
+  ai_convert_set(c, slot, chanspec, krange->min * scale, krange->max * scale,
+                 krange_cache.ai_maxdatas[CR_CHAN(chanspec)]);
+}
+
 inline lsampl_t volts_to_sampl(SubDevT t, uint chan, uint range, double data)
 {
   comedi_krange *krange;
@@ -1432,6 +2647,18 @@ inline lsampl_t volts_to_sampl(SubDevT t, uint chan, uint range, double data)
   return ret;
 }
 
+/* what the ao ring is up to, for /proc/rtlab/rtlab */
+static const char *ao_ring_state_str(void)
+{
+  static const char * const names[] = 
+    { "idle", "waiting", "playing", "done", "stopped", "bad channel/range" };
+
+  if (!rtp_ao_ring) return "(no ao ring)";
+  if ((unsigned int)rtp_ao_ring->state >= sizeof(names) / sizeof(*names))
+    return "?";
+  return names[rtp_ao_ring->state];
+}
+
 /* called whenever a file in our /proc/rtlab/ proc directory is read 
    void *data is given a value from the RTLabProcFiles enum above. */
 static int rtlab_proc_read (char *page, char **start, off_t off, int count, 
@@ -1440,7 +2667,10 @@ static int rtlab_proc_read (char *page, char **start, off_t off, int count,
   char pidbuf[24], 
        si_buf[UINT64_BUFSZ], 
        ms_buf[UINT64_BUFSZ], 
-       ns_buf[UINT64_BUFSZ];
+       ns_buf[UINT64_BUFSZ],
+       clk_buf[32];
+  struct rtlab_cmd_stats cmd_stats;
+  uint i;
 
   PROC_PRINT_VARS;
 
@@ -1455,19 +2685,29 @@ static int rtlab_proc_read (char *page, char **start, off_t off, int count,
     else
       sprintf(pidbuf, "(no process attached)");
     pidbuf[23] = 0;
+    rtlab_cmd_get_stats(&cmd_stats);
     PROC_PRINT("RTLab version %s\n"
                "RTLab is attached to PID: %s\n"
                "AI Channels:\n%s\n"
                "AO Channels:\n%s\n"
                "Sampling Rate: %u Hz    Scan Index: %s\n"
                "Relative Time: %s ms    "
-               "Nanos Per Scan: %s ns\n"
+               "Nanos Per Scan: %s ns    Scans Per Tick: %u\n"
                "AI Minor Device: %d    AI Sub-Device ID: %d     "
                "AO Minor Device: %d    AO Sub-Device ID: %d\n"
                "AI FIFO Device Minor: %d    AO FIFO Device Minor: %d\n"
                "AI FIFO Size (bytes): %u    AO FIFO Size (bytes): %u\n"
                "AI FIFO Size (secs) : %u    AO FIFO Size (secs) : %u\n"
-               "Realtime Loop Jitter (in nanos): %u\n",
+               "Realtime Loop Jitter (in nanos): %u\n"
+               "AI Acquisition: %s    Scans Skipped: %u    Restarts: %u\n"
+               "AI FIFO Scans Dropped: %u\n"
+               "AI Oversampling: %s    Conversions Per Scan: %u    "
+               "Filter Order: %u\n"
+               "Fixed Point: %s    RT Task FPU: %s\n"
+               "Commands Queued: %u    Run Late: %u    Ticks Over Cap: %u\n"
+               "AO Playback: %s    Underruns: %u\n"
+               "User Commands Done: %u    Control FIFO: %d    "
+               "Reply FIFO: %d\n",
                VERSION_NUM_STR,
                pidbuf,
                "(unimplmented)",
@@ -1475,7 +2715,7 @@ static int rtlab_proc_read (char *page, char **start, off_t off, int count,
                (uint)rtp_shm->sampling_rate_hz,
                si_buf,
                ms_buf,
-               ns_buf,
+               ns_buf, rtp_shm->scans_per_tick,
                rtp_shm->ai_minor, rtp_shm->ai_subdev, 
                rtp_shm->ao_minor, rtp_shm->ao_subdev,
                rtp_shm->ai_fifo_minor, rtp_shm->ao_fifo_minor,
@@ -1485,8 +2725,35 @@ static int rtlab_proc_read (char *page, char **start, off_t off, int count,
                       / rtp_shm->sampling_rate_hz,
                (uint) rtp_shm->ao_fifo_sz_blocks / rtp_shm->n_ao_chans 
                       / rtp_shm->sampling_rate_hz,
-               rtp_shm->jitter_ns
+               rtp_shm->jitter_ns,
+               aicmd.running ? "hardware-timed" : "polled",
+               aicmd.n_skipped, aicmd.n_restarts,
+               rtp_shm->ai_fifo_scans_dropped,
+               aicmd.oversampling ? "on" : "off", aicmd.n_raw, 
+               rtp_shm->ai_cic_order,
+               rtp_shm->ai_fixed_point ? "yes" : "no", task_fp ? "yes" : "no",
+               cmd_stats.n_queued, cmd_stats.n_late, cmd_stats.n_capped,
+               ao_ring_state_str(),
+               rtp_ao_ring ? rtp_ao_ring->underruns : 0,
+               rtp_shm->cmd_ring.done, 
+               rtp_shm->control_fifo, rtp_shm->reply_fifo
                );    
+    for (i = 0; i < rtp_shm->n_ai_boards; i++) {
+      const AIBoardInfo *info = &rtp_shm->ai_boards[i];
+
+      if (info->ext_clock < 0) 
+        sprintf(clk_buf, "own timer");
+      else
+        sprintf(clk_buf, "external, input %d", info->ext_clock);
+      PROC_PRINT("AI Board %u: Minor Device: %d    Sub-Device ID: %d    "
+                 "Channels: %u-%u    Scan Clock: %s\n"
+                 "AI Board %u: Start Offset: %d ns    Skew: %d ns    "
+                 "Max Skew: %d ns    Scans Slipped: %u\n",
+                 i, info->minor, info->subdev, info->first_chan, 
+                 info->first_chan + info->n_chans - 1, clk_buf,
+                 i, info->start_offset_ns, info->skew_ns, info->max_skew_ns,
+                 info->n_slipped);
+    }
     break;
   default:
     PROC_PRINT_RETURN;
@@ -1502,12 +2769,14 @@ sampling_rate_t rtlab_set_sampling_rate(sampling_rate_t r)
   /* normalize sampling rate -- DANGEROUS if set too high!!! */
   rtp_shm->sampling_rate_hz = normalizeSamplingRate(r);
   computeNanosPerScan();
-  task_period = rtp_shm->nanos_per_scan;
+  computeScansPerTick();
+  task_period = rtp_shm->nanos_per_scan * rtp_shm->scans_per_tick;
 
   if (r != rtp_shm->sampling_rate_hz 
       || last_sampling_rate != rtp_shm->sampling_rate_hz)
-    rtos_printf(RT_PROCESS_MODULE_NAME ": acquisition set to %u Hz\n", 
-                rtp_shm->sampling_rate_hz);
+    rtos_printf(RT_PROCESS_MODULE_NAME ": acquisition set to %u Hz "
+                "(%u scans per tick)\n", 
+                rtp_shm->sampling_rate_hz, rtp_shm->scans_per_tick);
 
   last_sampling_rate = rtp_shm->sampling_rate_hz;
 
@@ -1542,7 +2811,20 @@ double voltage_at(unsigned int channel_id, const MultiSampleStruct *m)
     
     for (i = 0; i < m->n_samples; i++) 
       if (m->samples[i].channel_id == channel_id) {
+#ifdef RTLAB_FIXED_POINT
+        /* .data isn't there, convert it here -- whoever calls this has 
+           the FPU (see task_fp) */
+        const SampleStruct *s = &m->samples[i];
+        uint chanspec = CR_PACK(channel_id, s->range, 0);
+
+        if (voltage_at_convert.chanspec[channel_id] != chanspec)
+          set_ai_convert(&voltage_at_convert, channel_id, chanspec);
+        ret = voltage_at_convert.offset[channel_id] 
+          + voltage_at_convert.gain[channel_id] * s->code 
+            / (double)s->code_gain;
+#else
         ret = m->samples[i].data;
+#endif
         break;
       }
     
@@ -1768,13 +3050,65 @@ static inline void update_wall_clock_times(rtos_time_t now)
 }
 
 
-static inline void possibly_call_cb(struct rt_function_list *it, 
+/*---------------------------------------------------------------------------
+  RT loop stats helpers (see RTLoopStats in shared_stuff.h)
+---------------------------------------------------------------------------*/
+
+/* only the RT task calls this, so no locking, see shared_stuff.h */
+static inline void rt_hist_add(RTHistogram *h, hrtime_t ns)
+{
+  unsigned int v = (ns < 0 ? 0 : (ns > 0xffffffffLL ? 0xffffffff : ns));
+
+  h->buckets[rt_hist_bucket(v)]++;
+  h->sum_ns += v;
+  if (v > h->max_ns) h->max_ns = v;
+  h->count++;
+}
+
+/* called with rt_functions_sem held.  Returns -1 if all the slots are 
+   taken, in which case the function just doesn't get stats */
+static int cb_stats_slot_alloc(rtfunction_t function)
+{
+  int i;
+
+  for (i = 0; i < RT_STATS_MAX_CALLBACKS; i++)
+    if (!cb_stats_owner[i]) {
+      cb_stats_owner[i] = function;
+      if (rtp_shm) {
+        memset(&rtp_shm->rt_stats.callbacks[i].cost, 0, sizeof(RTHistogram));
+        rtp_shm->rt_stats.callbacks[i].function = (unsigned long)function;
+      }
+      return i;
+    }
+  return -1;
+}
+
+/* called with rt_functions_sem held */
+static void cb_stats_slot_free(int slot)
+{
+  if (slot < 0 || slot >= RT_STATS_MAX_CALLBACKS) return;
+  cb_stats_owner[slot] = 0;
+  if (rtp_shm) rtp_shm->rt_stats.callbacks[slot].function = 0;
+}
+
+/* calls it->function, timing the call if it has a stats slot */
+static inline void call_cb(struct rt_function_entry *it, MultiSampleStruct *m)
+{
+  hrtime_t start = gethrtime();
+
+  it->function(m);
+  if (it->stats_slot >= 0)
+    rt_hist_add(&rtp_shm->rt_stats.callbacks[it->stats_slot].cost, 
+                gethrtime() - start);
+}
+
+static inline void possibly_call_cb(struct rt_function_entry *it, 
                                     MultiSampleStruct *m)
 {
   if (it->active_flag) {
     if (it->time_between_callbacks_us == 0) {
       /* Special value of '0' for frequency_hz means we always call.. */
-      it->function(m);
+      call_cb(it, m);
     } else if (it->next_index_for_cb <= rtp_shm->scan_index) {
       static const uint ns_us = 1000;   /* nanos per microsecond */
 
@@ -1783,11 +3117,41 @@ static inline void possibly_call_cb(struct rt_function_list *it,
       it->next_index_for_cb = 
         rtp_shm->scan_index 
         + it->time_between_callbacks_us / (rtp_shm->nanos_per_scan / ns_us);
-      it->function(m);
+      call_cb(it, m);
     }
   }
 }
 
+static inline void run_function(struct rt_function_entry *it, 
+                                MultiSampleStruct *m, scan_index_t base)
+{
+  MultiSampleStruct one;
+  uint i, k, per;
+
+  if (m->n_scans <= 1 || it->takes_blocks) {
+    possibly_call_cb(it, m);
+    return;
+  }
+
+  /* a block, but it only knows about scans: hand it one at a time, with
+     scan_index and spike_info.spikes_this_scan looking like they did back
+     when every scan was a tick */
+  one = *m;
+  per = m->n_samples / m->n_scans;
+  one.n_samples = per;
+  one.n_scans = 1;
+  for (k = 0; k < m->n_scans; k++) {
+    one.samples = m->samples + k * per;
+    rtp_shm->scan_index = per ? one.samples[0].scan_index : base + k;
+    memset(spike_info.spikes_this_scan, 0, CHAN_MASK_SIZE);
+    for (i = 0; i < per; i++)
+      if (one.samples[i].spike) 
+        _set_bit(one.samples[i].channel_id, spike_info.spikes_this_scan, 1);
+    possibly_call_cb(it, &one);
+  }
+  rtp_shm->scan_index = base;
+}
+
 #undef __I_AM_BUSY
 
 #ifdef TIME_RT_LOOP
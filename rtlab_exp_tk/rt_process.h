@@ -24,9 +24,16 @@
 #ifndef _RT_PROCESS_H 
 # define _RT_PROCESS_H
 
+#ifdef RTOS_POSIX
+/* the simulator build uses userspace comedilib (or mock_comedi.o), which
+   looks just like new-style kcomedilib to us */
+# include <comedilib.h>
+# define COMEDI_VERSION_CODE 1856
+#else
 # include <linux/comedilib.h>
 
 #include <version.h> /* in comedi's include/ or include/modbuild directory */
+#endif
 #if (! defined COMEDI_VERSION_CODE) 
 #  define COMEDI_VERSION_CODE 0
 #endif
@@ -54,37 +61,36 @@ typedef comedi_t* COMEDI_T;
 /** Some global defaults */
 # include "rtlab_defaults.h"
 
+/* The most samples one tick can deal with, over all the scans in it.  One
+   full scan of every channel always fits. */
+# define RT_MAX_BLOCK_SAMPLES 8192
+
+/* What the functions in the RT loop get passed each tick.  Normally that's
+   one scan, but in burst mode (see the burst_ns module parameter) a tick 
+   can have a whole block of them: n_scans scans of n_samples / n_scans
+   samples each, one scan after the other in samples[], and each sample 
+   has its own scan_index.  Only functions that said they can take that
+   (rtp_set_callback_blocks()) ever see more than one scan -- everything 
+   else gets called once per scan, as before. */
 typedef struct {
   char channel_mask[CHAN_MASK_SIZE]; /* mask of channels id's */
   hrtime_t acq_start; /* hrtime that data acquisition started for first chan.*/
   hrtime_t acq_end;   /* hrtime that data acquisition ended for last channel */
   unsigned int n_samples;            /* the number of valid elements in the 
-                                        samples array */
-  SampleStruct samples[SHD_MAX_CHANNELS];
+                                        samples array, over all the scans */
+  unsigned int n_scans;              /* how many scans those are           */
+  SampleStruct *samples;
 } MultiSampleStruct;
 
 /** For a given channel id and MultiSampleStruct, gives you the voltage
-    for that channel.  If the channel is not on, returns 0. */
+    for that channel.  If the channel is not on, returns 0.  (The first 
+    scan's, if there is more than one.) */
 extern double voltage_at(unsigned int channel_id, const MultiSampleStruct *m);
 
 typedef void (*rtfunction_t)(MultiSampleStruct *);
 
-struct spike_info {
-  /* The last time a spike was encountered in each channel */
-  hrtime_t last_spike_time[SHD_MAX_CHANNELS]; /* when spike began */
-  hrtime_t last_spike_ended_time[SHD_MAX_CHANNELS]; /* when spike ended */
-  /* Same as SampleStruct.spike_period  */
-  double period[SHD_MAX_CHANNELS]; /* in mlliseconds */
-  /* the set of channels that have spikes - for THIS scan */
-  char spikes_this_scan[CHAN_MASK_SIZE];
-
-  char in_spike[CHAN_MASK_SIZE];       /* stateful bitmask indicating if
-                                          we are in the middle of a spike */
-  char saved_polarity[CHAN_MASK_SIZE]; /* if we are in_spike, this is relevant
-                                          (and true means positive polarity) */
-  double saved_thold[SHD_MAX_CHANNELS];  /* if we are in_spike, 
-                                            this is relevant */
-};
+/* struct spike_info and the detector itself live here */
+#include "spike_detect.h"
 
 /* 
    EXPORTED FUNCTIONS
@@ -99,9 +105,13 @@ struct spike_info {
 */
 
 /* registers a function to be run within the rtf loop
-   returns 0 on succes, ENOMEM or EBUSY on error.  
+   returns 0 on succes, ENOMEM or EBUSY on error (ENOMEM meaning there are 
+   already 32 functions registered).  
    Specified function won't be run (activated)
-   until rtp_activate_function() is called 
+   until rtp_activate_function() is called.  
+   This and the other functions below may sleep for a tick or so while the
+   RT loop finishes with the previous function table, so call them from 
+   module init/cleanup or other regular kernel context, never from RT.
    SIDE Effect: rt_process's use count is incremented */
 extern int rtp_register_function(rtfunction_t function);
 /* de-registers a function that was previously registered,
@@ -163,6 +173,31 @@ extern int rtp_set_callback_frequency(rtfunction_t function,uint frequency_hz);
 */
 extern int rtp_get_callback_frequency(rtfunction_t function);
 
+/* Says whether function can take a whole block of scans at once (blocks
+   nonzero), or wants to be called once for every scan in the block, with
+   rtp_shm->scan_index and spike_info.spikes_this_scan set to that scan's
+   (blocks 0, the default).  This
+   only makes a difference in burst mode, where one tick deals with 
+   several scans.  Calling once per block is cheaper, so anything that 
+   just works through m->samples should say it can.
+
+   Return values: 0 on success, 
+                  -EINVAL if funtion not found or
+                  -EBUSY if module is busy.
+*/
+extern int rtp_set_callback_blocks(rtfunction_t function, int blocks);
+
+/* For modules whose callbacks do floating point.  A fixed point rtlab.o
+   (RTLAB_FIXED_POINT) runs the RT task without an FPU context unless it
+   was loaded with task_fp=1, and floating point in the RT loop would then
+   corrupt whatever else had the FPU.  who is the module's name, for the
+   message printed in that case.
+
+   Return values: 0 if floating point is fine in the RT loop, 
+                  -EINVAL if it isn't.  Call it before registering.
+*/
+extern int rtp_require_fp(const char *who);
+
 /* Finds a free fifo, calls rtf_create(), and puts the minor number in minor.  
    On error a negative errno is returned. 
    Use this to quickly find a free fifos.  Helpful so that don't have to loop
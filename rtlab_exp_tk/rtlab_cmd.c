@@ -21,114 +21,175 @@
  * http://www.gnu.org.
  */
 #define EXPORT_SYMTAB 1 /* <--- for annoying kernels that need this */ 
+#ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
-#include <linux/spinlock.h>
-#include <asm/bitops.h>
-#include <asm/atomic.h>
+#include <linux/list.h>
+#include <linux/sched.h> /* schedule_timeout()                           */
+#include <asm/system.h>  /* mb() and friends                             */
+#include <asm/bitops.h>  /* test_and_set_bit()                           */
 #include <asm/semaphore.h>
 #include <linux/string.h>
+#endif
 #define RTLAB_INTERNAL
 #include "rt_process.h"
 #include "rtlab_cmd.h"
-#include "bheap.h" /* binary heap implements priority-based command list */
 
 EXPORT_SYMBOL(rtlab_cmd_register);
+EXPORT_SYMBOL(rtlab_cmd_cancel);
 EXPORT_SYMBOL(rtlab_cmd_handle_alloc);
 EXPORT_SYMBOL(rtlab_cmd_handle_free);
 
-#define HANDLE_MAGIC (0x4A9D1E)
+int cmd_max_per_tick = 64;
+MODULE_PARM(cmd_max_per_tick, "i");
+MODULE_PARM_DESC(cmd_max_per_tick, "The most rtlab_cmd commands (AO/AI writes and callbacks) that will be run in any one RT loop tick.  Commands over the cap are run on the following ticks, in order, and counted as late in /proc/rtlab.  Defaults to 64.");
 
+#define HANDLE_MAGIC (0x4A9D1E)
 
-typedef struct { 
-  rtlab_cmd_callback_t *cb; 
-  void *arg; 
-} callback_cmd_q;
+/*-----------------------------------------------------------------------------
+  How it works
+
+  Every command that is registered gets copied into a cmd_node, which 
+  comes out of a pool that is preallocated per handle by 
+  rtlab_cmd_handle_alloc().  Nothing is allocated or freed in RT.
+
+  The nodes are kept in a hierarchical timing wheel keyed by scan index,
+  the same way the Linux kernel keeps its timers: level 0 has a slot per 
+  scan for the next 64 scans, level 1 a slot per 64 scans for the next 
+  4096, and so on up for 4 levels (2^24 scans, which is over 4 hours at 
+  1 kHz).  Anything further out than that waits in an overflow list.
+  Whenever a level's index wraps to 0, the slot above is 'cascaded' down 
+  into the finer levels.  So inserting is O(1), and each node gets moved
+  at most once per level before it's due.  Due nodes end up on the due 
+  list, in order, from which rtlab_cmd_process() runs at most 
+  cmd_max_per_tick of them per tick.
+
+  Only the RT loop ever touches the wheel.  Registering (from RT or 
+  non-RT) goes through two single-producer/single-consumer rings per 
+  handle: the inbox, where the registrant puts node indices for the RT 
+  loop to put in the wheel, and the free ring, where the RT loop puts 
+  them back when it's done with them.  Cancels are a request counter the
+  RT loop acks the same way.
+
+  Single producer means one registrant per handle at a time, which the
+  'registering' bit enforces.  It's a test_and_set_bit() and not a lock 
+  because the RT loop (a callback registering the next stim train, say)
+  can't spin on a non-RT registrant that it has preempted -- the loser
+  just gets EBUSY instead.
+-----------------------------------------------------------------------------*/
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+#define MAX_HANDLES  32
+
+struct cmd_node {
+  struct list_head l;        /* in a wheel slot or the due list          */
+  scan_index_t when;
+  unsigned int gen;          /* h->cancel_req when it was registered     */
+  char queued;               /* nonzero iff in the wheel/due list        */
+  struct rtlab_cmd_handle *h;
+  struct rtlab_cmd cmd;      /* our own copy                             */
+};
 
 struct rtlab_cmd_handle {
   int magic;
-  const struct rtlab_cmd **cmds;
-  char *cmd_mask;
-  callback_cmd_q *cmd_q;
-  unsigned int q_sz;
-  unsigned int mask_size;
-  unsigned int cmds_size;
-  unsigned int n_cmds; /* number actually allocated */
-  bheap_t *bheap;
-  struct list_head l;
-  spinlock_t slock;
-};
-
-static struct rtlab_cmd_handle handle_list = {
-  magic      : HANDLE_MAGIC,
-  cmds       : 0,
-  cmd_mask   : 0,
-  cmd_q      : 0,
-  q_sz       : 0,
-  mask_size  : 0,
-  cmds_size  : 0,
-  n_cmds     : 0,
-  bheap      : 0,
-  l          : LIST_HEAD_INIT(handle_list.l),
-  slock      : SPIN_LOCK_UNLOCKED
+  int slot;                  /* index in handles[]                       */
+  struct cmd_node *nodes;
+  unsigned int n_nodes;
+  unsigned int *inbox,       /* registrant -> RT                         */
+               *free_ring;   /* RT -> registrant                         */
+  unsigned int ring_mask;
+  volatile unsigned int inbox_head, inbox_tail, /* written by reg. / RT   */
+                        free_head, free_tail,   /* written by RT / reg.   */
+                        cancel_req, cancel_done;/* written by reg. / RT   */
+  volatile char dying, dead;
+  volatile unsigned long registering; /* bit 0: a registrant is in here  */
 };
 
-DECLARE_MUTEX(handle_list_lock);
-
-/* returns the position in the cmds array of an unused struct rtlab_cmd * 
-   or -1 on error*/
-static int alloc_cmd(struct rtlab_cmd_handle *);
-/* frees command in command array at position pos */
-static void free_cmd(struct rtlab_cmd_handle *, unsigned int pos);
-
+static struct {
+  struct list_head slots[WHEEL_LEVELS][WHEEL_SIZE];
+  struct list_head overflow;
+  struct list_head due;
+  scan_index_t next;         /* next scan index to expire                */
+  unsigned int n_queued;
+  unsigned int n_late;       /* run later than the scan they were due at */
+  unsigned int n_capped;     /* ticks that hit cmd_max_per_tick          */
+} wheel;
+
+static struct rtlab_cmd_handle * volatile handles[MAX_HANDLES];
+static volatile int rt_running = 0; /* see start_cmd_engine()             */
+static int engine_initted = 0;
+
+DECLARE_MUTEX(handle_list_lock); /* non-RT only, serializes handles[] */
+
+static void wheel_insert(struct cmd_node *);
+static void wheel_advance(scan_index_t to);
+static void service_handle(struct rtlab_cmd_handle *);
+static void free_node(struct cmd_node *);
+static void run_cmd(const struct rtlab_cmd *cmd);
+static void sleep_a_tick(void);
+
+/* rounds up to the next power of two */
+static unsigned int pow2_roundup(unsigned int n)
+{
+  unsigned int ret = 1;
+  while (ret < n) ret <<= 1;
+  return ret;
+}
 
 struct rtlab_cmd_handle *rtlab_cmd_handle_alloc(unsigned int max_cmds)
 {
   struct rtlab_cmd_handle *ret = 0;
-  const struct rtlab_cmd **cmds = 0;
-  char *cmd_mask = 0;
-  callback_cmd_q *cmd_q = 0;  
-  bheap_t *heap = 0;
-  unsigned int msk_sz;
-
-  if (!max_cmds) goto err;
-
-  if (!(ret=(struct rtlab_cmd_handle *)kmalloc(sizeof(struct rtlab_cmd_handle),
-                                               GFP_KERNEL)) ||
-      !(cmds = (const struct rtlab_cmd **)kmalloc(sizeof(struct rtlab_cmd *) 
-                                            * max_cmds, GFP_KERNEL)) ||
-      !(cmd_mask = (char *)kmalloc(sizeof(char) * (msk_sz = 
-						   (max_cmds / 8 + 
-						    (max_cmds % 8 ? 1 : 0))),
-				   GFP_KERNEL)) ||
-      !(cmd_q = (callback_cmd_q *)kmalloc(sizeof(callback_cmd_q) * max_cmds,
-                                          GFP_KERNEL))||
-      !(heap = bh_alloc(max_cmds))) 
+  unsigned int ring_sz, i;
+
+  if (!max_cmds || !engine_initted) return 0;
+
+  ring_sz = pow2_roundup(max_cmds);
+
+  if (!(ret = (struct rtlab_cmd_handle *)
+        kmalloc(sizeof(struct rtlab_cmd_handle), GFP_KERNEL))) 
+    return 0;
+  memset(ret, 0, sizeof(*ret));
+  if (!(ret->nodes = (struct cmd_node *)
+        kmalloc(sizeof(struct cmd_node) * max_cmds, GFP_KERNEL)) ||
+      !(ret->inbox = (unsigned int *)
+        kmalloc(sizeof(unsigned int) * ring_sz, GFP_KERNEL)) ||
+      !(ret->free_ring = (unsigned int *)
+        kmalloc(sizeof(unsigned int) * ring_sz, GFP_KERNEL)))
     goto err;
-  
-  /* take default values... */
-  memcpy(ret, &handle_list, sizeof(struct rtlab_cmd_handle));
-  memset(cmd_mask, 0, msk_sz);
-  
-  ret->cmds = cmds;
-  ret->cmd_mask = cmd_mask;
-  ret->cmd_q = cmd_q;
-  ret->bheap = heap;
-  ret->mask_size = msk_sz;
-  ret->cmds_size = max_cmds;
+
+  memset(ret->nodes, 0, sizeof(struct cmd_node) * max_cmds);
+  for (i = 0; i < max_cmds; i++) {
+    ret->nodes[i].h = ret;
+    ret->free_ring[i] = i;
+  }
+  ret->n_nodes = max_cmds;
+  ret->ring_mask = ring_sz - 1;
+  ret->free_head = max_cmds; /* they all start out free */
+  ret->magic = HANDLE_MAGIC;
 
   down(&handle_list_lock);
-  list_add(&ret->l, &handle_list.l);
+  for (i = 0; i < MAX_HANDLES && handles[i]; i++)
+    ;
+  if (i < MAX_HANDLES) {
+    ret->slot = i;
+    mb(); /* all of the above before the RT loop can see it */
+    handles[i] = ret;
+  }
   up(&handle_list_lock);
 
+  if (i >= MAX_HANDLES) goto err;
+
   return ret;
+
  err:
-  if (ret) kfree(ret);
-  if (cmds) kfree(cmds);
-  if (cmd_mask) kfree(cmd_mask);
-  if (cmd_q) kfree(cmd_q);
-  if (heap) bh_free(heap);
+  if (ret->nodes) kfree(ret->nodes);
+  if (ret->inbox) kfree(ret->inbox);
+  if (ret->free_ring) kfree(ret->free_ring);
+  kfree(ret);
   return 0;
 }
 
@@ -137,201 +198,552 @@ void  rtlab_cmd_handle_free(struct rtlab_cmd_handle *h)
   if (!h || h->magic != HANDLE_MAGIC) return;
 
   down(&handle_list_lock);
-  list_del(&h->l);
+  h->dying = 1;
+  mb();
+  if (rt_running) {
+    /* the RT loop unqueues all of h's commands and takes it out of 
+       handles[], then sets h->dead and never looks at h again */
+    while (rt_running && !h->dead) sleep_a_tick();
+  }
+  if (!h->dead) {
+    /* no RT loop (anymore), so do it ourselves */
+    service_handle(h);
+  }
   up(&handle_list_lock);
-  bh_free(h->bheap);
-  kfree(h->cmds);
-  kfree(h->cmd_mask);
-  kfree(h->cmd_q);
+
   h->magic = 0;
+  kfree(h->nodes);
+  kfree(h->inbox);
+  kfree(h->free_ring);
   kfree(h);
 }
 
 int rtlab_cmd_register(struct rtlab_cmd_handle *h,
                        const struct rtlab_cmd *list, uint count)
 {
-  const struct rtlab_cmd *cmd = 0;
-  unsigned int i;
-
-  if (!h || h->magic != HANDLE_MAGIC) return EINVAL;
-
-  if (count > (h->cmds_size - h->n_cmds) )  return E2BIG;
- 
-  for (i = 0; i < count; i++) {
-    int pos;
-    scan_index_t when;
-    int when_ms;
-
-    pos = alloc_cmd(h); /* 'allocate' a command from the semistatic array */
-
-    if (pos < 0) {
-#ifdef DEBUG
-      rtos_printf("rtlab_cmd: BUG in rtlab_cmd_register!! Cannot allocate a "
-                  "command! Cmds_size: %u N_cmds %u\n", h->cmds_size, 
-                  h->n_cmds);
-#endif
-      return ENOSPC;
-    }
+  unsigned int i, head, tail, ns_per_scan;
+  scan_index_t now;
 
-    /* save the pointer */
-    cmd = h->cmds[pos] = &list[i];
+  if (!h || h->magic != HANDLE_MAGIC || h->dying) return EINVAL;
 
-    switch(cmd->type) {
+  for (i = 0; i < count; i++)
+    switch(list[i].type) {
     case RTLAB_CMD_AO:
     case RTLAB_CMD_AI:
     case RTLAB_CMD_CALLBACK:
       break;
     default:
       rtos_printf("rtlab_cmd: Unknown/Unimplemented command type %x\n", 
-                  cmd->type);
+                  list[i].type);
       return EINVAL;
-      break;
     }
 
-    if ( (when_ms = cmd->when_ms) < 0) when_ms = 0;
+  /* we're the inbox's and the free ring's only producer until we clear
+     this */
+  if (test_and_set_bit(0, &h->registering)) return EBUSY;
+
+  tail = h->free_tail;
+  if (count > h->free_head - tail) {
+    clear_bit(0, &h->registering);
+    return E2BIG;
+  }
+  rmb(); /* the free ring entries are only good once we've seen free_head */
+
+  now = rtp_shm->scan_index;
+  ns_per_scan = rtp_shm->nanos_per_scan;
+  if (!ns_per_scan) ns_per_scan = 1;
 
-    when = rtp_shm->scan_index + (scan_index_t)(when_ms * MILLION 
-                                                / rtp_shm->nanos_per_scan);
-    bh_insert(h->bheap, pos, when);
+  head = h->inbox_head;
+  for (i = 0; i < count; i++) {
+    unsigned int idx = h->free_ring[(tail + i) & h->ring_mask];
+    struct cmd_node *n = &h->nodes[idx];
+    int when_ms = list[i].when_ms;
+    unsigned long long scans;
+
+    if (when_ms < 0) when_ms = 0;
+    /* in 64 bits and from the nanos, so that neither long delays nor 
+       scan periods that aren't whole micros come out wrong */
+    scans = (unsigned long long)when_ms * MILLION;
+    do_div(scans, ns_per_scan);
+    n->cmd = list[i];
+    n->when = now + (scan_index_t)scans;
+    n->gen = h->cancel_req;
+    h->inbox[(head + i) & h->ring_mask] = idx;
 
 #ifdef DEBUG
     rtos_printf("rtlab_cmd: Command %x will execute at %u (now it's %u)\n", 
-                cmd, (unsigned int)when, (unsigned int)rtp_shm->scan_index);
+                &list[i], (unsigned int)n->when, (unsigned int)now);
 #endif
   }
+  wmb(); /* the nodes and inbox entries, then publish them all at once */
+  h->free_tail = tail + count;
+  h->inbox_head = head + count;
+  mb(); /* ..before the next registrant can get in */
+  clear_bit(0, &h->registering);
  
   return 0;
 }
 
-#define next_from_bheap(bheap, cmds, cmd, min, k) \
-    (cmd = cmds[(min = bh_min(bheap))], \
-    k = bheap->a[bheap->p[min]].key)
+int rtlab_cmd_cancel(struct rtlab_cmd_handle *h)
+{
+  if (!h || h->magic != HANDLE_MAGIC) return EINVAL;
+
+  /* commands registered from here on get the new generation and 
+     survive the cancel */
+  h->cancel_req++;
+  wmb();
+  return 0;
+}
 
 void rtlab_cmd_process(void) 
 {
-  struct rtlab_cmd_handle *h;
-  struct list_head *pos;
-  const struct rtlab_cmd *cmd;
-  unsigned int i;
-  int min;
-  scan_index_t when;
+  scan_index_t now = rtp_shm->scan_index;
+  unsigned int budget = (cmd_max_per_tick > 0 ? cmd_max_per_tick : 1),
+               pass, i;
+  struct cmd_node *n;
+  struct rtlab_cmd cmd;
+
+  if (!engine_initted) return;
+
+  /* two passes, so that commands registered by callbacks in the first 
+     pass (such as the next stim train) get run this same tick if they're
+     due now */
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < MAX_HANDLES; i++) {
+      struct rtlab_cmd_handle *h = handles[i];
+      if (h) service_handle(h);
+    }
 
-  if (atomic_read(&handle_list_lock.count) != 1) {
-    return; /* handle list is busy so skip it this time around.. this breaks
-	       realtime but that's the best we can do.. */
+    wheel_advance(now);
+
+    while (!list_empty(&wheel.due) && budget) {
+      n = list_entry(wheel.due.next, struct cmd_node, l);
+      if (n->when < now) wheel.n_late++;
+      /* free the node before running it, as a callback may well want
+         to register more commands on the same handle */
+      cmd = n->cmd;
+      list_del(&n->l);
+      wheel.n_queued--;
+      free_node(n);
+      run_cmd(&cmd);
+      budget--;
+    }
   }
+  if (!budget && !list_empty(&wheel.due)) wheel.n_capped++;
+}
 
-  list_for_each(pos, &handle_list.l) {
-    h = list_entry(pos, struct rtlab_cmd_handle, l);
-
-    if ( !h->n_cmds )  continue;
-      
-    for (next_from_bheap(h->bheap, h->cmds, cmd, min, when); 
-         h->bheap->n && /* just incase bh_min() flows past end? */
-         when <= rtp_shm->scan_index; 
-         next_from_bheap(h->bheap, h->cmds, cmd, min, when)) {
-
-      switch (cmd->type) {
-      case RTLAB_CMD_AO:
+static void run_cmd(const struct rtlab_cmd *cmd)
+{
+  switch (cmd->type) {
+  case RTLAB_CMD_AO:
 #ifdef DEBUG
-        // DEBUG
-        rtos_printf("rtlab_cmd: About to do AO command [Dev %x Subdev %u Chan %u Range %u Aref %u Data %hu]\n",
-                    cmd->p1.ctx->dev, cmd->p1.ctx->subdev, 
-                    cmd->p1.ctx->chan,
-                    cmd->p1.ctx->range, cmd->p1.ctx->aref, cmd->p2.data);
+    rtos_printf("rtlab_cmd: About to do AO command [Dev %x Subdev %u Chan %u Range %u Aref %u Data %hu]\n",
+                cmd->p1.ctx->dev, cmd->p1.ctx->subdev, 
+                cmd->p1.ctx->chan,
+                cmd->p1.ctx->range, cmd->p1.ctx->aref, cmd->p2.data);
 #endif
-        comedi_data_write(cmd->p1.ctx->dev, cmd->p1.ctx->subdev, 
-                          cmd->p1.ctx->chan,
-                          cmd->p1.ctx->range, cmd->p1.ctx->aref, cmd->p2.data);
-      break;
-      case RTLAB_CMD_AI:
-        comedi_data_read(cmd->p1.ctx->dev, cmd->p1.ctx->subdev, 
-                         cmd->p1.ctx->chan, cmd->p1.ctx->range, 
-                         cmd->p1.ctx->aref, cmd->p2.data_out);
-        break;
-      case RTLAB_CMD_CALLBACK:
-        h->cmd_q[h->q_sz].cb = cmd->p1.callback;
-        h->cmd_q[h->q_sz++].arg = cmd->p2.callback_arg;
-        break;
-      default:
+    comedi_data_write(cmd->p1.ctx->dev, cmd->p1.ctx->subdev, 
+                      cmd->p1.ctx->chan,
+                      cmd->p1.ctx->range, cmd->p1.ctx->aref, cmd->p2.data);
+    break;
+  case RTLAB_CMD_AI:
+    comedi_data_read(cmd->p1.ctx->dev, cmd->p1.ctx->subdev, 
+                     cmd->p1.ctx->chan, cmd->p1.ctx->range, 
+                     cmd->p1.ctx->aref, cmd->p2.data_out);
+    break;
+  case RTLAB_CMD_CALLBACK:
 #ifdef DEBUG
-        //DEBUG
-        rtos_printf("rtlab_cmd: BUG in rtlab_cmd::rtlab_cmd_process! "
-                    "Unknown command type encountered (%x)\n", cmd->type);
+    rtos_printf("rtlab_cmd: About to do CALLBACK command "
+                "[function %x arg %x]\n", cmd->p1.callback, 
+                cmd->p2.callback_arg);
 #endif
-        break;
+    cmd->p1.callback(cmd->p2.callback_arg);
+    break;
+  default:
+    /* can't happen, rtlab_cmd_register() checks */
+    break;
+  }
+}
+
+/* Acks h's cancels, moves its inbox into the wheel, and takes it out of
+   handles[] if it's being freed.  RT only (or when there is no RT). */
+static void service_handle(struct rtlab_cmd_handle *h)
+{
+  unsigned int req = h->cancel_req, head, i;
+  struct cmd_node *n;
+  char dying = h->dying;
+
+  rmb();
+
+  if (dying || req != h->cancel_done) {
+    /* unqueue everything that was registered before the cancel */
+    for (i = 0; i < h->n_nodes; i++) {
+      n = &h->nodes[i];
+      if (n->queued && (dying || (int)(n->gen - req) < 0)) {
+        list_del(&n->l);
+        wheel.n_queued--;
+        free_node(n);
       }
-      free_cmd(h, min);
-      bh_delete(h->bheap, min);
     }
+    h->cancel_done = req;
+  }
 
-#ifdef DEBUG
-        // DEBUG temporary
-        rtos_printf("rtlab_cmd: possible node off the bheap: min is %d, when is %u\n", min, (unsigned int)when);
-#endif
+  head = h->inbox_head;
+  rmb(); /* see the nodes the registrant filled in before head */
+  while (h->inbox_tail != head) {
+    n = &h->nodes[h->inbox[h->inbox_tail & h->ring_mask]];
+    h->inbox_tail++;
+    if (dying || (int)(n->gen - req) < 0) 
+      free_node(n); /* cancelled before we ever saw it */
+    else
+      wheel_insert(n);
+  }
 
-    for (i = 0; i < h->q_sz; i++) {
-#ifdef DEBUG
-      // DEBUG
-      rtos_printf("rtlab_cmd: About to do CALLBACK command "
-                  "[function %x arg %x]\n",h->cmd_q[i].cb, 
-                  h->cmd_q[i].arg);
-#endif
-      h->cmd_q[i].cb(h->cmd_q[i].arg);
+  if (dying) {
+    handles[h->slot] = 0;
+    wmb();
+    h->dead = 1;
+  }
+}
+
+/* gives n (which must not be in any list) back to its handle's free ring */
+static void free_node(struct cmd_node *n)
+{
+  struct rtlab_cmd_handle *h = n->h;
+
+  n->queued = 0;
+  h->free_ring[h->free_head & h->ring_mask] = n - h->nodes;
+  wmb();
+  h->free_head++;
+}
+
+/* puts n in the wheel slot (or the due list) for n->when */
+static void wheel_insert(struct cmd_node *n)
+{
+  scan_index_t delta;
+  struct list_head *slot;
+
+  if (n->when < wheel.next) {
+    slot = &wheel.due;
+  } else if ((delta = n->when - wheel.next) < WHEEL_SIZE) {
+    slot = &wheel.slots[0][n->when & WHEEL_MASK];
+  } else if (delta < (1 << (2*WHEEL_BITS))) {
+    slot = &wheel.slots[1][(n->when >> WHEEL_BITS) & WHEEL_MASK];
+  } else if (delta < (1 << (3*WHEEL_BITS))) {
+    slot = &wheel.slots[2][(n->when >> (2*WHEEL_BITS)) & WHEEL_MASK];
+  } else if (delta < (1 << (4*WHEEL_BITS))) {
+    slot = &wheel.slots[3][(n->when >> (3*WHEEL_BITS)) & WHEEL_MASK];
+  } else {
+    slot = &wheel.overflow;
+  }
+  list_add_tail(&n->l, slot);
+  if (!n->queued) {
+    n->queued = 1;
+    wheel.n_queued++;
+  }
+}
+
+/* re-sorts everything in list into the (finer) slots it belongs in now,
+   keeping the order they were in */
+static void cascade(struct list_head *list)
+{
+  struct list_head *pos, *tmp;
+
+  list_for_each_safe(pos, tmp, list) {
+    list_del(pos);
+    wheel_insert(list_entry(pos, struct cmd_node, l));
+  }
+}
+
+/* expires every scan index up to and including to, moving what's due 
+   onto the due list */
+static void wheel_advance(scan_index_t to)
+{
+  struct list_head *slot, *pos, *tmp;
+  unsigned int idx;
+
+  while (wheel.next <= to) {
+    idx = wheel.next & WHEEL_MASK;
+    /* level 0 wrapped, so bring down the next level 1 slot, and so on */
+    if (!idx) {
+      int level;
+      for (level = 1; level < WHEEL_LEVELS; level++) {
+        unsigned int li = (wheel.next >> (level*WHEEL_BITS)) & WHEEL_MASK;
+        cascade(&wheel.slots[level][li]);
+        if (li) break;
+      }
+      if (level == WHEEL_LEVELS) cascade(&wheel.overflow);
+    }
+    slot = &wheel.slots[0][idx];
+    list_for_each_safe(pos, tmp, slot) {
+      list_del(pos);
+      list_add_tail(pos, &wheel.due);
     }
-    h->q_sz = 0;
+    wheel.next++;
   }
 }
 
 int init_cmd_engine(void)
 {
+  int i, j;
+
+  for (i = 0; i < WHEEL_LEVELS; i++)
+    for (j = 0; j < WHEEL_SIZE; j++)
+      INIT_LIST_HEAD(&wheel.slots[i][j]);
+  INIT_LIST_HEAD(&wheel.overflow);
+  INIT_LIST_HEAD(&wheel.due);
+  wheel.next = rtp_shm->scan_index;
+  wheel.n_queued = wheel.n_late = wheel.n_capped = 0;
+  for (i = 0; i < MAX_HANDLES; i++) handles[i] = 0;
+  rt_running = 0;
+  engine_initted = 1;
   return 0;
 }
 
-#ifndef list_for_each_safe
- /* list_for_each_safe   -       
-    iterate over a list safe against removal of list entry
-    Stolen from newer linux kernels as older kernels lack this macro
-  * @pos:        the &struct list_head to use as a loop counter.
-  * @n:          another &struct list_head to use as temporary storage
-  * @head:       the head for your list.
-  */
-#define list_for_each_safe(pos, n, head) \
-        for (pos = (head)->next, n = pos->next; pos != (head); \
-                pos = n, n = pos->next)
-#endif
+void start_cmd_engine(void)
+{
+  rt_running = 1;
+}
+
+void stop_cmd_engine(void)
+{
+  rt_running = 0;
+}
+
 void cleanup_cmd_engine(void)
 {
-  struct list_head *pos, *n;
-  struct rtlab_cmd_handle *h;
+  int i;
 
-  list_for_each_safe(pos, n, &handle_list.l) {
-    h = list_entry(pos, struct rtlab_cmd_handle, l);
-    rtlab_cmd_handle_free(h); /* does implicit list_del() */
-  }
+  if (!engine_initted) return;
+
+  rt_running = 0; /* just in case */
+  for (i = 0; i < MAX_HANDLES; i++)
+    if (handles[i]) rtlab_cmd_handle_free(handles[i]);
+  engine_initted = 0;
 }
 
-static int alloc_cmd(struct rtlab_cmd_handle *h)
+void rtlab_cmd_get_stats(struct rtlab_cmd_stats *s)
 {
-  int i = -1; 
+  s->n_queued = wheel.n_queued;
+  s->n_late = wheel.n_late;
+  s->n_capped = wheel.n_capped;
+}
 
-  if (h->n_cmds < h->cmds_size) {
+/* for the non-RT side, when it has to wait on the RT loop */
+static void sleep_a_tick(void)
+{
+#ifdef __KERNEL__
+  current->state = TASK_INTERRUPTIBLE;
+  schedule_timeout(1);
+#else
+  sched_yield();
+#endif
+}
 
-    i = find_first_zero_bit(h->cmd_mask, h->cmds_size);
-    set_bit(i, h->cmd_mask);
-    h->n_cmds++;
-    
-  }
+#ifdef TEST_RTLAB_CMD
+/*
+  Runs the engine in userspace (RTOS_POSIX) with a fake rtp_shm whose 
+  scan_index we move ourselves, at 1 MHz so that when_ms reaches past 
+  the top level of the wheel into the overflow list.  Checks that:
+
+    - every callback runs exactly once, on the first rtlab_cmd_process()
+      whose scan index is at or past the one it was due at, and the ones
+      run in the same call come out in due order -- across every level's
+      cascade, with the clock moving anything from 1 to 5000 scans a call
+    - cmd_max_per_tick holds back the extras and counts them as late
+    - a cancel takes out what was registered before it and only that
+    - delays are converted to scans from the nanos per scan, in 64 bits
+    - a registration that collides with one in progress gets EBUSY and
+      registers nothing, and two threads registering on one handle while
+      it's serviced neither lose nor duplicate commands, and every node 
+      comes back free
+
+  Build with make -f Makefile.sim check.
+*/
+#include <pthread.h>
+
+#define TEST_N      4000
+#define TEST_CAP    10
+#define TEST_PER_THREAD 20000 /* batches of TEST_BATCH */
+#define TEST_BATCH  16
+
+static SharedMemStruct test_shm;
+SharedMemStruct *rtp_shm = &test_shm;
+
+struct test_rec { scan_index_t when; int runs; };
+static struct test_rec recs[TEST_N];
+static scan_index_t last_now, last_when;
+static int n_bad = 0, n_ran = 0;
+static volatile int n_threaded = 0;
+static unsigned int seed = 12345;
+
+static unsigned int test_rand(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) & 0xffffff;
+}
 
-  return i;
+static void test_cb(void *arg)
+{
+  struct test_rec *r = (struct test_rec *)arg;
+  scan_index_t now = rtp_shm->scan_index;
+
+  /* not early, not late, and not before anything due earlier */
+  if (r->when > now || (cmd_max_per_tick > TEST_CAP && r->when <= last_now)
+      || r->when < last_when) 
+    n_bad++;
+  last_when = r->when;
+  r->runs++;
+  n_ran++;
 }
 
-static void free_cmd(struct rtlab_cmd_handle *h, unsigned int pos)
+static void test_threaded_cb(void *arg)
+{ (void)arg; n_threaded++; }
+
+static void test_tick(scan_index_t to)
 {
-  if (pos > h->cmds_size) return; /* invalid c */
+  rtp_shm->scan_index = to;
+  last_when = 0;
+  rtlab_cmd_process();
+  last_now = to;
+}
+
+static struct rtlab_cmd_handle *test_h;
+static volatile int test_done[2];
 
-  if (test_bit(pos, h->cmd_mask)) {
-    h->n_cmds--;
-    clear_bit(pos, h->cmd_mask);
+static void *test_registrant(void *arg)
+{
+  struct rtlab_cmd cmd[TEST_BATCH];
+  int i, err;
+
+  memset(cmd, 0, sizeof(cmd));
+  for (i = 0; i < TEST_BATCH; i++) {
+    cmd[i].type = RTLAB_CMD_CALLBACK;
+    cmd[i].p1.callback = test_threaded_cb;
+  }
+  for (i = 0; i < TEST_PER_THREAD; i++) 
+    while ( (err = rtlab_cmd_register(test_h, cmd, TEST_BATCH)) ) {
+      if (err != EBUSY && err != E2BIG) { n_bad++; return 0; }
+      sched_yield();
+    }
+  test_done[(long)arg] = 1;
+  return 0;
+}
+
+int main(void)
+{
+  struct rtlab_cmd cmd;
+  struct rtlab_cmd_stats st;
+  pthread_t thr[2];
+  unsigned int i, late;
+  scan_index_t now;
+
+  test_shm.nanos_per_scan = 1000;
+  test_shm.scan_index = now = 4000; /* a level 1 wrap is coming right up */
+  /* no start_cmd_engine(): we are the RT loop, so there is nobody for
+     rtlab_cmd_handle_free() to wait on */
+  init_cmd_engine();
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = RTLAB_CMD_CALLBACK;
+  cmd.p1.callback = test_cb;
+
+  /* ordering, up through every level and the overflow list */
+  cmd_max_per_tick = TEST_N;
+  test_h = rtlab_cmd_handle_alloc(TEST_N);
+  for (i = 0; i < TEST_N; i++) {
+    /* mostly near, some out past 2^24 scans */
+    cmd.when_ms = (i % 4 == 0 ? test_rand() % 20000 : test_rand() % 300);
+    recs[i].when = now + (scan_index_t)cmd.when_ms * 1000;
+    cmd.p2.callback_arg = &recs[i];
+    if (rtlab_cmd_register(test_h, &cmd, 1)) n_bad++;
+  }
+  if (rtlab_cmd_register(test_h, &cmd, 1) != E2BIG) n_bad++;
+  last_now = now - 1;
+  while (n_ran < TEST_N && now < 4000 + 21000000ULL) 
+    test_tick(now += 1 + test_rand() % 5000);
+  for (i = 0; i < TEST_N; i++) if (recs[i].runs != 1) n_bad++;
+  printf("ordering: %d of %d ran, %d problems\n", n_ran, TEST_N, n_bad);
+
+  /* the cap */
+  cmd_max_per_tick = TEST_CAP;
+  n_ran = 0;
+  rtlab_cmd_get_stats(&st);
+  late = st.n_late;
+  for (i = 0; i < 5 * TEST_CAP; i++) {
+    cmd.when_ms = 0;
+    recs[i].when = now, recs[i].runs = 0;
+    cmd.p2.callback_arg = &recs[i];
+    rtlab_cmd_register(test_h, &cmd, 1);
+  }
+  for (i = 0; i < 5; i++) {
+    test_tick(++now);
+    if (n_ran != (int)(i + 1) * TEST_CAP) n_bad++;
+  }
+  rtlab_cmd_get_stats(&st);
+  if (st.n_late - late != 5 * TEST_CAP || st.n_queued) n_bad++;
+  printf("cap: %d ran over 5 ticks, %u late, %d problems\n", n_ran, 
+         st.n_late - late, n_bad);
+
+  /* cancel */
+  cmd_max_per_tick = TEST_N;
+  n_ran = 0;
+  for (i = 0; i < 20; i++) {
+    if (i == 10) rtlab_cmd_cancel(test_h);
+    cmd.when_ms = 1 + i;
+    recs[i].when = now + (scan_index_t)cmd.when_ms * 1000, recs[i].runs = 0;
+    cmd.p2.callback_arg = &recs[i];
+    rtlab_cmd_register(test_h, &cmd, 1);
   }
+  last_now = now;
+  while (now < recs[19].when) test_tick(now += 500);
+  for (i = 0; i < 20; i++) if (recs[i].runs != (i >= 10)) n_bad++;
+  printf("cancel: %d of 20 ran, %d problems\n", n_ran, n_bad);
+
+  /* delays at 24 kHz, whose scan period isn't a whole number of micros,
+     and one past the 2^32 micros a 32 bit conversion wraps at */
+  test_shm.nanos_per_scan = 41666;
+  n_ran = 0;
+  for (i = 0; i < 2; i++) {
+    cmd.when_ms = i ? 5000000 : 10000;
+    recs[i].when = now + (scan_index_t)cmd.when_ms * MILLION / 41666;
+    recs[i].runs = 0;
+    cmd.p2.callback_arg = &recs[i];
+    rtlab_cmd_register(test_h, &cmd, 1);
+  }
+  last_now = now;
+  for (i = 0; i < 2; i++) {
+    test_tick(now = recs[i].when - 1);
+    if (n_ran != (int)i) n_bad++;
+    test_tick(now = recs[i].when);
+    if (n_ran != (int)i + 1) n_bad++;
+  }
+  printf("delays: %d of 2 ran on time, %d problems\n", n_ran, n_bad);
+  test_shm.nanos_per_scan = 1000;
+  rtlab_cmd_handle_free(test_h);
+
+  /* two registrants on one handle, against the RT loop.  First one that 
+     got preempted halfway through, so the RT loop must not get in.. */
+  test_h = rtlab_cmd_handle_alloc(TEST_N);
+  test_h->registering = 1;
+  cmd.p1.callback = test_threaded_cb;
+  if (rtlab_cmd_register(test_h, &cmd, 1) != EBUSY) n_bad++;
+  test_h->registering = 0;
+  test_tick(++now);
+  if (n_threaded) n_bad++;
+  /* ..then two real ones racing */
+  for (i = 0; i < 2; i++) 
+    pthread_create(&thr[i], 0, test_registrant, (void *)(long)i);
+  while (!test_done[0] || !test_done[1]) test_tick(++now);
+  for (i = 0; i < 2; i++) pthread_join(thr[i], 0);
+  test_tick(++now);
+  if (n_threaded != 2 * TEST_PER_THREAD * TEST_BATCH
+      || test_h->free_head - test_h->free_tail != test_h->n_nodes) 
+    n_bad++;
+  printf("two registrants: %d of %d ran, %d problems\n", n_threaded, 
+         2 * TEST_PER_THREAD * TEST_BATCH, n_bad);
+  rtlab_cmd_handle_free(test_h);
+
+  cleanup_cmd_engine();
+  return n_bad ? 1 : 0;
 }
+#endif
@@ -23,7 +23,9 @@
 #ifndef _RTLAB_CMD_H
 #define _RTLAB_CMD_H
 
+#ifdef __KERNEL__
 #include <linux/list.h>
+#endif
 #include "rt_process.h"
 
 enum rtlab_cmd_type {
@@ -57,9 +59,20 @@ struct rtlab_cmd
  *  NOT EXPORTED!!
  */
 #ifdef RTLAB_INTERNAL
-extern int  init_cmd_engine(void); /* called once from non-realtime context */
+extern int  init_cmd_engine(void); /* called once from non-realtime context,
+                                      after rtp_shm is set up */
+extern void start_cmd_engine(void); /* just before the RT loop starts.. */
+extern void stop_cmd_engine(void);  /* ..and just after it has stopped   */
 extern void rtlab_cmd_process(void); /* called each time inside realtime loop*/
 extern void cleanup_cmd_engine(void); /* called once from non-realtime context */
+
+struct rtlab_cmd_stats {
+  unsigned int n_queued; /* commands waiting to run                        */
+  unsigned int n_late;   /* commands that ran after the scan they were 
+                            due at, because of the cmd_max_per_tick cap    */
+  unsigned int n_capped; /* ticks that hit the cap with commands left over */
+};
+extern void rtlab_cmd_get_stats(struct rtlab_cmd_stats *); /* for /proc */
 #endif
 
 
@@ -72,21 +85,40 @@ struct rtlab_cmd_handle;
 /* 
    rtlab_cmd_register()
 
-   Registers a command array of size n_cmds.
+   Registers a command array of size n_cmds.  The commands are copied, so 
+   the array can be reused as soon as this returns.  They all become 
+   visible to the RT loop at once, and run no earlier than the next tick.
 
-   Returns E2BIG if there is no more room in the command
-   queue buffer, otherwise returns 0 on success 
+   Returns E2BIG if there is no more room in the handle's command pool 
+   (max_cmds from rtlab_cmd_handle_alloc(), less the commands still
+   waiting to run), EINVAL on a bad handle or command type, EBUSY if 
+   another rtlab_cmd_register() on the same handle was in progress (in 
+   all of which cases nothing was registered), otherwise returns 0 on 
+   success 
 
-   Note that the const struct rtlab_cmd array must be persistent
-   until the command actually runs, which means that you should make sure
-   to not write to the rtlab_cmd's in the array until the last command
-   has been executed.
-
-   Currently supports call from Realtime context only!
+   Safe to call from realtime or non-realtime context.  Calls on the same
+   handle don't wait for each other, so if more than one place registers
+   on a handle (the RT loop and a non-RT thread, say), be ready to retry 
+   on EBUSY -- or give each its own handle.
 */
 extern int  rtlab_cmd_register(struct rtlab_cmd_handle *, 
                                const struct rtlab_cmd *array, 
                                uint n_cmds);
+/* 
+   rtlab_cmd_cancel()
+
+   Cancels every command registered on this handle so far that hasn't 
+   run yet.  Commands registered after this call aren't affected, even if
+   the RT loop hasn't gotten around to the cancel yet.  Takes effect at the 
+   start of the next tick.  Safe from realtime or non-realtime context.
+   Returns EINVAL on a bad handle, 0 otherwise. 
+*/
+extern int  rtlab_cmd_cancel(struct rtlab_cmd_handle *);
+/* 
+   Non-realtime only.  There can be up to 32 handles at once, returns 0
+   if there are no more (or no memory). rtlab_cmd_handle_free() cancels 
+   everything still pending and may sleep for a tick or so.
+*/
 extern struct rtlab_cmd_handle *rtlab_cmd_handle_alloc(unsigned int max_cmds);
 extern void   rtlab_cmd_handle_free(struct rtlab_cmd_handle *);
 #endif
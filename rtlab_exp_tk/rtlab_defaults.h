@@ -34,7 +34,11 @@ extern "C" {
 # define INITIAL_CHANNEL_GAIN 0  /*initial channel gain (COMEDI)*/
 # define INITIAL_SAMPLING_RATE_HZ 1000
 # define THROTTLED_DOWN_SAMPLING_RATE_HZ 10 /* for when rtlab.o is idle */
-# define MAX_SAMPLING_RATE_HZ 25000 //< Dangerous on some hardware!
+# define MAX_SAMPLING_RATE_HZ 100000 //< Dangerous on some hardware!
+/* The fastest rtlab.o's RT loop is ever made to tick.  Above this rate it
+   takes several scans per tick (see the burst_ns module parameter), which
+   only works with hardware-timed scans. */
+# define MAX_TICK_RATE_HZ 25000
 # define MIN_SAMPLING_RATE_HZ 1 //< Will anyone _ever_ use this rate? 
 # define DEFAULT_SETTLING_TIME_ns 0
 /* initial interval for disabling
@@ -53,6 +57,13 @@ extern "C" {
 #define DEFAULT_FIFO_SECS 5
 /** Each fifo shouldn't exceeed this size in bytes by default */
 #define DEFAULT_MAX_FIFO 1000000
+/** ...and the shared memory ai ring (see sample_ring.h) shouldn't exceed
+    this.  It's vmalloc'd, so it can afford to be a lot bigger */
+#define DEFAULT_MAX_RING 16000000
+
+/** How many commands from userland rtlab.o deals with per RT tick, at 
+    most (a batch always goes in one tick, however big) */
+#define DEFAULT_CMD_QUOTA 64
 
 #define DEFAULT_SPIKE_BLANKING ((unsigned int)100) /* In milliseconds        */
 
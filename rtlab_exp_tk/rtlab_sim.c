@@ -0,0 +1,630 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  rtlab_sim.c -- runs rtlab.o (and optionally some of the plugin modules) 
+  as an ordinary userspace process, on top of the RTOS_POSIX flavour of 
+  rtos_middleman and userspace comedilib or mock_comedi.o.
+
+  It does what insmod + daq_system would: sets the module parameters, 
+  calls init_module(), turns channels on through the command mailbox, and
+  then reads samples off the ai ring (or ai fifo) for a while, checking 
+  that nothing got lost.  At the end it prints what it saw plus the
+  contents of the module's /proc files, and calls cleanup_module().
+
+  With -p it also streams a waveform out of the AO ring the way ao_play 
+  would (see ao_ring.h), and reports underruns.  With mock_comedi's 
+  loopback=1 the waveform comes back in on the AI channels.
+
+  This is mainly so the RT loop can be profiled and debugged with ordinary
+  tools, eg:
+
+    MOCK_COMEDI="ai=16" perf record -g ./rtlab_sim -t 10 -c 16 sampling_rate=20000
+*/
+
+#include "rtos_middleman.h"
+#include "rt_process.h"
+#include "user_to_kernel.h"
+#include "user_cmd.h"
+#include "sample_ring.h"
+#include "ao_ring.h"
+
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MAX_PLUGINS 8
+
+/* rt_process.c's */
+extern int init_module(void);
+extern void cleanup_module(void);
+
+static volatile sig_atomic_t stop = 0;
+static int use_fifos = 0; /* -F */
+
+static void on_signal(int sig) { (void)sig; stop = 1; }
+
+static void usage(const char *prog)
+{
+  fprintf(stderr,
+    "Usage: %s [options] [parm=value ...]\n\n"
+    "Runs rtlab.o in userspace.  parm=value sets a module parameter, just\n"
+    "like insmod would (eg sampling_rate=10000 ai_device=/dev/comedi0).\n"
+    "Several boards go in one ai_device=/dev/comedi0,/dev/comedi1 and the\n"
+    "mock comedi has as many as MOCK_COMEDI=boards=N says.\n\n"
+    "  -t SECS     run for SECS seconds (default: 5, 0 = until interrupted)\n"
+    "  -c N        turn on the first N ai channels (default: 8)\n"
+    "  -m MODULE   also load plugin MODULE after rtlab.o (eg apd_control),\n"
+    "              may be given more than once\n"
+    "  -p FILE     play FILE (raw native doubles, in volts) out of the ao\n"
+    "              ring, starting 100 ms in\n"
+    "  -P N        FILE has N columns, played on ao channels 0..N-1 at\n"
+    "              range 0 (default: 1)\n"
+    "  -O N[,ORD]  oversample the channels N times per scan, decimated by\n"
+    "              a CIC filter of order ORD (default: 1, the boxcar)\n"
+    "  -s VOLTS    detect spikes on the channels, at threshold VOLTS\n"
+    "  -S          turn the channels on one command at a time, rather than\n"
+    "              as one batch\n"
+    "  -F          send commands through the control and reply fifos rather\n"
+    "              than the mailbox (needs cmd_fifos=1)\n"
+    "  -L N        time N command round trips, and the RT loop's cost of\n"
+    "              checking for commands when there are none\n"
+    "  -q          don't print the /proc files at exit\n"
+    "  -h          this help\n", prog);
+}
+
+/* Waiting for rtlab.o, the way RTLabKernelNotifier does: spin for the
+   first 50us, then sleep -- on *done if given, which the RT loop wakes us
+   up on.  The fifos have no such thing, so they get short naps. */
+static void wait_a_bit(hrtime_t since, volatile unsigned int *done, 
+                       unsigned int seen)
+{
+  struct timespec nap = { 0, 1000000 };
+
+  if (gethrtime() - since < 50000) return;
+  if (!done) { usleep(50); return; }
+  rtp_shm->cmd_ring.waiters = 1;
+  mb();
+  if (*done == seen) 
+    syscall(SYS_futex, done, FUTEX_WAIT, seen, &nap, 0, 0);
+  rtp_shm->cmd_ring.waiters = 0;
+}
+
+static int fifo_cmd(struct rtfifo_cmd *cmd)
+{
+  hrtime_t start = gethrtime();
+  char reply;
+  int ret;
+
+  RTFIFO_CMD_CLR(cmd);
+  if ( (ret = rtf_put(rtp_shm->control_fifo, cmd, sizeof(*cmd))) < 0 ) 
+    return ret;
+  /* the rt loop picks it up on its next scan and writes one byte back */
+  while (rtf_get(rtp_shm->reply_fifo, &reply, 1) < 1 && !stop) 
+    wait_a_bit(start, 0, 0);
+  return 0;
+}
+
+/* like RTLabKernelNotifier::commitBatch() used to, returns how many 
+   failed */
+static int fifo_batch(struct rtfifo_cmd *cmds, unsigned int n)
+{
+  static struct rtfifo_cmd msg[RTLAB_MAX_BATCH + 1];
+  static struct rtfifo_batch_reply reply;
+  static unsigned int seq;
+  unsigned int i, got = 0, len = RTFIFO_BATCH_REPLY_BYTES(n);
+  hrtime_t start = gethrtime();
+  int ret;
+
+  if (n > RTLAB_MAX_BATCH) return -EINVAL;
+  RTFIFO_CMD_CLR((&msg[0]));
+  msg[0].command = RTLAB_BATCH;
+  msg[0].chan = n;
+  msg[0].u.seq = ++seq;
+  for (i = 0; i < n; i++) {
+    msg[i+1] = cmds[i];
+    RTFIFO_CMD_CLR((&msg[i+1]));
+  }
+  if ( (ret = rtf_put(rtp_shm->control_fifo, msg, (n+1) * sizeof(*msg))) < 0 )
+    return ret;
+  while (got < len && !stop) {
+    ret = rtf_get(rtp_shm->reply_fifo, (char *)&reply + got, len - got);
+    if (ret > 0) got += ret;
+    else wait_a_bit(start, 0, 0);
+  }
+  if (got < len || reply.seq != seq || reply.n_cmds != n) return -EIO;
+  return reply.n_failed;
+}
+
+/* like RTLabKernelNotifier::submit(), returns how many failed */
+static int mailbox_send(struct rtfifo_cmd *cmds, unsigned int n, int as_batch)
+{
+  struct CmdRing *r = &rtp_shm->cmd_ring;
+  unsigned int first = r->head, at = first, i, done;
+  hrtime_t start = gethrtime();
+  struct rtfifo_cmd header;
+  int n_failed = 0;
+
+  if (n + as_batch > cmd_ring_space(r)) return -EAGAIN;
+  if (as_batch) {
+    RTFIFO_CMD_CLR((&header));
+    header.command = RTLAB_BATCH;
+    header.chan = n;
+    header.u.seq = first;
+    at = cmd_ring_put(r, at, &header);
+  }
+  for (i = 0; i < n; i++) {
+    RTFIFO_CMD_CLR((&cmds[i]));
+    at = cmd_ring_put(r, at, &cmds[i]);
+  }
+  cmd_ring_publish(r, at);
+
+  while ( (done = r->done) != at && !stop) wait_a_bit(start, &r->done, done);
+  if (done != at) return -EINTR;
+  rmb();
+  for (i = as_batch; i < n + as_batch; i++) 
+    if (r->status[(first + i) % CMD_RING_SLOTS] != RTLAB_CMD_OK) n_failed++;
+  return n_failed;
+}
+
+static int send_cmd(struct rtfifo_cmd *cmd)
+{ return use_fifos ? fifo_cmd(cmd) : mailbox_send(cmd, 1, 0); }
+
+/* in pieces of RTLAB_MAX_BATCH, like RTLabKernelNotifier::commitBatch() */
+static int send_batch(struct rtfifo_cmd *cmds, unsigned int n)
+{
+  unsigned int i, k;
+  int ret, n_failed = 0;
+
+  for (i = 0; i < n; i += k) {
+    k = (n - i > RTLAB_MAX_BATCH ? RTLAB_MAX_BATCH : n - i);
+    ret = use_fifos ? fifo_batch(cmds + i, k) : mailbox_send(cmds + i, k, 1);
+    if (ret < 0) return ret;
+    n_failed += ret;
+  }
+  return n_failed;
+}
+
+/* -L: n round trips of a do-nothing command, and what do_user_commands()
+   costs the RT loop when there's nothing to do */
+static void bench_commands(unsigned int n)
+{
+  static const double pcts[] = { 0.5, 0.9, 0.99, 1.0 };
+  hrtime_t *lat = (hrtime_t *)malloc(n * sizeof(*lat)), t, tmp;
+  struct rtfifo_cmd cmd;
+  unsigned int i, j;
+
+  if (!lat || !n) { free(lat); return; }
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.command = RTLAB_SET_ATTACHED_PID;
+  cmd.u.pid = getpid();
+  for (i = 0; i < n && !stop; i++) {
+    t = gethrtime();
+    send_cmd(&cmd);
+    lat[i] = gethrtime() - t;
+  }
+  n = i;
+  for (i = 1; i < n; i++)  /* insertion sort, n is small */
+    for (j = i; j > 0 && lat[j-1] > lat[j]; j--) 
+      tmp = lat[j], lat[j] = lat[j-1], lat[j-1] = tmp;
+  printf("rtlab_sim: %u command round trips through the %s at %u Hz, us:", 
+         n, use_fifos ? "fifos" : "mailbox", rtp_shm->sampling_rate_hz);
+  for (i = 0; i < sizeof(pcts)/sizeof(*pcts) && n; i++)
+    printf(" p%g %.1f", pcts[i] * 100, 
+           lat[(unsigned)(pcts[i] * (n - 1))] / 1e3);
+  printf("\n");
+  free(lat);
+
+  /* nothing is pending now, so this is the RT loop's idle cost */
+  t = gethrtime();
+  for (i = 0; i < 1000000; i++) do_user_commands(rtp_shm, 1);
+  printf("rtlab_sim: idle do_user_commands() (%s): %.1f ns\n", 
+         rtp_shm->control_fifo >= 0 ? "mailbox + fifos" : "mailbox only",
+         (gethrtime() - t) / 1e6);
+}
+
+/* upper bound of the bucket percentile p falls in, like rtLoopReport() */
+static double hist_percentile_us(const RTHistogram *h, double p)
+{
+  unsigned int b, want = (unsigned int)(p * h->count), seen = 0;
+  uint64 top;
+
+  if (!h->count) return 0.0;
+  if (want >= h->count) want = h->count - 1;
+  for (b = 0; b < RT_HIST_BUCKETS; b++)
+    if ( (seen += h->buckets[b]) > want ) break;
+  top = (b < RT_HIST_BUCKETS ? rt_hist_bucket_top(b) : h->max_ns);
+  return (top > h->max_ns ? h->max_ns : top) / 1000.0;
+}
+
+static void print_hist(const char *name, const RTHistogram *h)
+{
+  printf("  %-24s %9u %9.1f %9.1f %9.1f %9.1f\n", name, h->count, 
+         h->count ? (double)h->sum_ns / h->count / 1000.0 : 0.0,
+         hist_percentile_us(h, 0.5), hist_percentile_us(h, 0.99), 
+         h->max_ns / 1000.0);
+}
+
+/* rtp_shm->rt_stats, roughly like 'daq_recorder -R' shows it */
+static void print_rt_stats(void)
+{
+  const RTLoopStats *s = &rtp_shm->rt_stats;
+  unsigned int i;
+  Dl_info info;
+  char buf[32];
+
+  printf("rtlab_sim: RT loop timing (us)  %9s %9s %9s %9s %9s\n", 
+         "Count", "Mean", "p50", "p99", "Max");
+  print_hist("Wakeup jitter", &s->jitter);
+  print_hist("Tick (total)", &s->tick);
+  for (i = 0; i < RT_STATS_MAX_CALLBACKS; i++) {
+    if (!s->callbacks[i].function) continue;
+    if (!dladdr((void *)(unsigned long)s->callbacks[i].function, &info) 
+        || !info.dli_sname) {
+      snprintf(buf, sizeof(buf), "%#lx", 
+               (unsigned long)s->callbacks[i].function);
+      info.dli_sname = buf;
+    }
+    print_hist(info.dli_sname, &s->callbacks[i].cost);
+  }
+  printf("  %u overruns\n", s->overruns);
+}
+
+struct stats {
+  unsigned long long n_samples, n_lost, n_bad, n_short, n_spikes, n_gap;
+  double period_ms; /* sum of the spikes' periods, but the first ones */
+  scan_index_t first_scan, last_scan;
+  unsigned int n_chans, in_scan; /* samples per scan, and so far in this one*/
+};
+
+static void account(struct stats *st, const SampleStruct *s, unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; i++) {
+    if (s[i].magic_number != SAMPLE_STRUCT_MAGIC) { st->n_bad++; continue; }
+    if (!st->n_samples) st->first_scan = s[i].scan_index;
+    else if (s[i].scan_index != st->last_scan) {
+      /* every scan should have every channel that's on */
+      if (st->in_scan != st->n_chans) st->n_short++;
+      st->in_scan = 0;
+      /* and the scans rtlab.o skipped (or we lost) leave a gap */
+      if (s[i].scan_index > st->last_scan + 1) 
+        st->n_gap += s[i].scan_index - st->last_scan - 1;
+    }
+    st->last_scan = s[i].scan_index;
+    st->in_scan++;
+    st->n_samples++;
+    if (s[i].spike && st->n_spikes++ >= st->n_chans)
+      /* a fixed point rtlab.o only does the period in scans, 24.8 */
+      st->period_ms += (rtp_shm->ai_fixed_point 
+                        ? s[i].spike_period_fx * 1000.0 
+                          / ((double)SPIKE_PERIOD_FX_ONE 
+                             * rtp_shm->sampling_rate_hz)
+                        : s[i].spike_period);
+  }
+}
+
+/* returns the new read position */
+static unsigned int drain_ring(struct SampleRing *r, unsigned int pos, 
+                               struct stats *st)
+{
+  unsigned int head = r->head, mask = r->n_slots - 1, n, chunk;
+
+  SAMPLE_RING_RMB();
+  if ( (n = head - pos) > r->n_slots - r->n_slots / 4 ) {
+    /* lapped, or about to be -- skip ahead like SampleStructRingSource */
+    st->n_lost += head - r->n_slots / 2 - pos;
+    pos = head - r->n_slots / 2;
+    n = head - pos;
+  }
+  while (n) {
+    chunk = r->n_slots - (pos & mask);
+    if (chunk > n) chunk = n;
+    account(st, r->buf + (pos & mask), chunk);
+    pos += chunk, n -= chunk;
+  }
+  return pos;
+}
+
+/* -p: a raw file streamed through the ao ring, like AORingFeeder does */
+struct ao_feed {
+  FILE *f;
+  struct AORing *ring;
+  unsigned int n_cols, eof, started;
+  comedi_range *range[AO_RING_MAX_CHANS];
+  lsampl_t maxdata[AO_RING_MAX_CHANS];
+  unsigned long long n_put;
+};
+
+/* tops up the ring from the file */
+static void feed_ao(struct ao_feed *a)
+{
+  double volts[AO_RING_MAX_CHANS];
+  lsampl_t codes[AO_RING_MAX_CHANS];
+  unsigned int i;
+
+  while (!a->eof && ao_ring_space(a->ring)) {
+    if (fread(volts, sizeof(double), a->n_cols, a->f) != a->n_cols) {
+      a->eof = 1;
+      break;
+    }
+    for (i = 0; i < a->n_cols; i++) 
+      codes[i] = comedi_from_phys(volts[i], a->range[i], a->maxdata[i]);
+    a->n_put += ao_ring_put(a->ring, codes, a->n_cols, 1);
+  }
+  /* eof has to come after the start, which clears it */
+  if (a->eof && a->started) ao_ring_finish(a->ring);
+}
+
+static int start_ao(struct ao_feed *a, const char *file)
+{
+  unsigned int chanspec[AO_RING_MAX_CHANS], i;
+
+  if (!rtp_shm->ao_ring_slots 
+      || !(a->ring = (struct AORing *)
+           rtos_shm_attach(AO_RING_NAME, 
+                           AO_RING_BYTES(rtp_shm->ao_ring_slots, 
+                                         rtp_shm->ao_ring_stride)))) {
+    fprintf(stderr, "rtlab_sim: no ao ring to play %s through\n", file);
+    return -1;
+  }
+  if (a->n_cols < 1 || a->n_cols > a->ring->stride) {
+    fprintf(stderr, "rtlab_sim: -P must be 1 to %u\n", a->ring->stride);
+    return -1;
+  }
+  if ( !(a->f = fopen(file, "rb")) ) { perror(file); return -1; }
+
+  for (i = 0; i < a->n_cols; i++) {
+    a->range[i] = comedi_get_range(rtp_comedi_ao_dev_handle, 
+                                   rtp_shm->ao_subdev, i, 0);
+    a->maxdata[i] = comedi_get_maxdata(rtp_comedi_ao_dev_handle, 
+                                       rtp_shm->ao_subdev, i);
+    chanspec[i] = CR_PACK(i, 0, AREF_GROUND);
+  }
+
+  ao_ring_begin(a->ring);
+  feed_ao(a);
+  ao_ring_start(a->ring, chanspec, a->n_cols, rtp_shm->scan_index 
+                + rtp_shm->sampling_rate_hz / 10, 0);
+  a->started = 1;
+  if (a->eof) ao_ring_finish(a->ring);
+  return 0;
+}
+
+static void drain_fifo(int fifo, struct stats *st)
+{
+  static SampleStruct buf[1024];
+  int n;
+
+  while ( (n = rtf_get(fifo, buf, sizeof(buf))) > 0 ) 
+    account(st, buf, n / sizeof(SampleStruct));
+}
+
+int main(int argc, char *argv[])
+{
+  const char *plugins[MAX_PLUGINS];
+  rtos_posix_exit_t plugin_exits[MAX_PLUGINS];
+  int n_plugins = 0, n_loaded = 0, opt, i, ret, quiet = 0, ok;
+  int one_at_a_time = 0, n_bench = 0;
+  unsigned int n_chans = 8, pos = 0, oversample = 1, cic_order = 1;
+  double secs = 5.0, elapsed, thold = 0.0;
+  int spikes = 0;
+  struct SampleRing *ring = 0;
+  const char *ao_file = 0;
+  struct ao_feed ao;
+  struct rtfifo_cmd cmd;
+  struct stats st;
+  hrtime_t start;
+
+  memset(&ao, 0, sizeof(ao));
+  ao.n_cols = 1;
+
+  while ( (opt = getopt(argc, argv, "t:c:m:p:P:O:s:SFL:qh")) != -1 ) {
+    switch(opt) {
+    case 't': secs = atof(optarg); break;
+    case 'c': n_chans = atoi(optarg); break;
+    case 'm': 
+      if (n_plugins >= MAX_PLUGINS) { 
+        fprintf(stderr, "Too many -m options\n"); 
+        return 1; 
+      }
+      plugins[n_plugins++] = optarg; 
+      break;
+    case 'p': ao_file = optarg; break;
+    case 'P': ao.n_cols = atoi(optarg); break;
+    case 'O': 
+      if (sscanf(optarg, "%u,%u", &oversample, &cic_order) < 1) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's': thold = atof(optarg); spikes = 1; break;
+    case 'S': one_at_a_time = 1; break;
+    case 'F': use_fifos = 1; break;
+    case 'L': n_bench = atoi(optarg); break;
+    case 'q': quiet = 1; break;
+    default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+  for (i = optind; i < argc; i++)
+    if ( (ret = rtos_posix_set_parm(argv[i])) ) {
+      fprintf(stderr, "Bad module parameter '%s': %s\n", argv[i], 
+              strerror(-ret));
+      return 1;
+    }
+
+  /* no page faults in the rt loop, if we're allowed */
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  if (init_module()) return 1; /* it already said why */
+
+  for (i = 0; i < n_plugins; i++) {
+    rtos_posix_init_t init = 0;
+
+    if (!rtos_posix_find_module(plugins[i], &init, &plugin_exits[i]) 
+        || !init) {
+      fprintf(stderr, "No such module '%s' in this simulator\n", plugins[i]);
+      break;
+    }
+    if ( (ret = init()) ) {
+      fprintf(stderr, "%s: init failed (%d)\n", plugins[i], ret);
+      break;
+    }
+    n_loaded++;
+  }
+
+  if ( (ok = (n_loaded == n_plugins)) ) {
+    if (n_chans > rtp_shm->n_ai_chans) n_chans = rtp_shm->n_ai_chans;
+    start = gethrtime();
+    if (one_at_a_time) {
+      cmd.command = RTLAB_SET_CHAN;
+      cmd.u.enabled = 1;
+      for (cmd.chan = 0; cmd.chan < n_chans && !stop; cmd.chan++) 
+        send_cmd(&cmd);
+    } else {
+      static struct rtfifo_cmd cmds[SHD_MAX_CHANNELS];
+      unsigned int c;
+
+      for (c = 0; c < n_chans; c++) {
+        cmds[c].command = RTLAB_SET_CHAN;
+        cmds[c].chan = c;
+        cmds[c].u.enabled = 1;
+      }
+      if ( (ret = send_batch(cmds, n_chans)) )
+        fprintf(stderr, "rtlab_sim: channel batch failed (%d)\n", ret);
+    }
+    if (oversample > 1) {
+      static struct rtfifo_cmd cmds[2];
+
+      cmds[0].command = RTLAB_SET_OVERSAMPLE_ALL;
+      cmds[0].u.oversample = oversample;
+      cmds[1].command = RTLAB_SET_CIC_ORDER;
+      cmds[1].u.cic_order = cic_order;
+      if ( (ret = send_batch(cmds, 2)) )
+        fprintf(stderr, "rtlab_sim: oversampling batch failed (%d)\n", ret);
+    }
+    if (spikes) {
+      static struct rtfifo_cmd cmds[2];
+
+      cmds[0].command = RTLAB_SET_SPIKE_THRESHOLD_ALL;
+      cmds[0].u.threshold.volts = thold;
+      cmds[0].u.threshold.microvolts = (int)rint(thold * 1e6);
+      cmds[1].command = RTLAB_SET_SPIKE_ALL;
+      cmds[1].u.enabled = 1;
+      if ( (ret = send_batch(cmds, 2)) )
+        fprintf(stderr, "rtlab_sim: spike batch failed (%d)\n", ret);
+    }
+    printf("rtlab_sim: turning channels on took %.2f ms (%s, %s)\n", 
+           (gethrtime() - start) / 1e6, 
+           one_at_a_time ? "one command at a time" : "one batch",
+           use_fifos ? "fifos" : "mailbox");
+    if (n_bench) bench_commands(n_bench);
+
+    if (rtp_shm->ai_ring_slots) 
+      ring = (struct SampleRing *)
+        rtos_shm_attach(SAMPLE_RING_NAME, 
+                        SAMPLE_RING_BYTES(rtp_shm->ai_ring_slots));
+    if (ring) pos = ring->head;
+    else drain_fifo(rtp_shm->ai_fifo_minor, &st); /* stale, from before */
+
+    printf("rtlab_sim: %u of %u channels on at %u Hz, reading from the ai %s "
+           "for %s%g seconds\n", n_chans, rtp_shm->n_ai_chans, 
+           rtp_shm->sampling_rate_hz, ring ? "ring" : "fifo",
+           secs > 0 ? "" : "(until interrupted) ", secs);
+
+    if (ao_file && start_ao(&ao, ao_file)) stop = 1;
+
+    memset(&st, 0, sizeof(st));
+    st.n_chans = n_chans;
+    start = gethrtime();
+    while (!stop && (secs <= 0 || gethrtime() - start < secs * 1e9)) {
+      usleep(10000);
+      if (ring) pos = drain_ring(ring, pos, &st);
+      else drain_fifo(rtp_shm->ai_fifo_minor, &st);
+      if (ao.started) feed_ao(&ao);
+    }
+    elapsed = (gethrtime() - start) / 1e9;
+
+    if (ao.started) {
+      static const char *states[] = 
+        { "idle", "waiting", "playing", "done", "stopped", "bad parm" };
+
+      printf("rtlab_sim: ao playback %s, %llu scans put, started at scan "
+             "%lu, %u underruns", 
+             states[ao.ring->state % 6], ao.n_put, 
+             (unsigned long)ao.ring->started_at, ao.ring->underruns);
+      if (ao.ring->underruns) 
+        printf(" (scans %lu-%lu)", (unsigned long)ao.ring->first_underrun,
+               (unsigned long)ao.ring->last_underrun);
+      printf("\n");
+      if (ao_ring_busy(ao.ring)) ao_ring_stop(ao.ring);
+    }
+
+    printf("rtlab_sim: %llu samples in %.3f s (%.0f/s, expected %u/s), "
+           "scans %lu-%lu (%llu missing), %llu lost, %llu bad, "
+           "%llu short scans\n", 
+           st.n_samples, elapsed, st.n_samples / elapsed, 
+           n_chans * rtp_shm->sampling_rate_hz,
+           (unsigned long)st.first_scan, (unsigned long)st.last_scan,
+           st.n_gap, st.n_lost, st.n_bad, st.n_short);
+    if (spikes)
+      printf("rtlab_sim: %llu spikes, mean period %.3f ms\n", st.n_spikes,
+             st.n_spikes > st.n_chans 
+             ? st.period_ms / (st.n_spikes - st.n_chans) : 0.0);
+    for (i = 0; rtp_shm->n_ai_boards > 1 && i < (int)rtp_shm->n_ai_boards; 
+         i++) {
+      const AIBoardInfo *b = &rtp_shm->ai_boards[i];
+
+      printf("rtlab_sim: ai board %d (channels %u-%u, %s): start offset %d "
+             "ns, skew %d ns, max skew %d ns, %u scans slipped\n", 
+             i, b->first_chan, b->first_chan + b->n_chans - 1,
+             b->ext_clock < 0 ? "own timer" : "external clock",
+             b->start_offset_ns, b->skew_ns, b->max_skew_ns, b->n_slipped);
+    }
+
+    if (!quiet) {
+      print_rt_stats();
+      rtos_posix_proc_dump(stdout);
+    }
+
+    if (ring) rtos_shm_detach(ring);
+  }
+
+  if (ao.f) fclose(ao.f);
+  if (ao.ring) rtos_shm_detach(ao.ring);
+
+  while (n_loaded--) 
+    if (plugin_exits[n_loaded]) plugin_exits[n_loaded]();
+  cleanup_module();
+
+  return ok ? 0 : 1;
+}
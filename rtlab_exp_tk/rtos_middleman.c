@@ -24,10 +24,12 @@
 /* rtos_middleman.c
    Implementation of RTOS-specific routines.  This api attempts to 
    be a neutral bridge between different implementations of 
-   RTOS api's.  Currently supports a subset of RTAI and RTLinux */
+   RTOS api's.  Currently supports a subset of RTAI and RTLinux, plus
+   the RTOS_POSIX userspace build (see rtos_posix.h) */
 #define EXPORT_SYMTAB 1 /* <--- for annoying kernels that need this */
 #include "rtos_middleman.h"
 
+#ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
@@ -36,6 +38,14 @@
 #include <asm/atomic.h>
 #include <asm/semaphore.h>
 #include <linux/spinlock.h>
+#endif
+
+#ifdef RTOS_POSIX
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 /*-----------------------------------------------------------------------------
   Some globally exported symbols
@@ -46,6 +56,7 @@ EXPORT_SYMBOL_NOVERS(rtos_fifo_put);
 EXPORT_SYMBOL_NOVERS(rtos_fifo_get);
 EXPORT_SYMBOL_NOVERS(rtos_shm_attach);
 EXPORT_SYMBOL_NOVERS(rtos_shm_detach);
+EXPORT_SYMBOL_NOVERS(rtos_wake_user);
 
 
 /*-----------------------------------------------------------------------------
@@ -94,6 +105,13 @@ int WARNING_THIS_MODULE_COMPILED_FOR_RTAI = 0;
 /* grrr.. this isn't defined in the headers so I have to hard code it here */
 #define RTF_NO_ 64
 
+#elif defined(RTOS_POSIX)
+
+int WARNING_THIS_MODULE_COMPILED_FOR_RTOS_POSIX = 0;
+
+/* same as RTAI, so that the minors come out the same */
+#define RTF_NO_ 64
+
 #endif
 /*-----------------------------------------------------------------------------
   Common declarations
@@ -146,6 +164,17 @@ int rtos_fifo_put(unsigned int fifo, void *buf, int count)
   return rtf_put(fifo, buf, count);
 }
 
+void rtos_wake_user(volatile unsigned int *addr)
+{
+#ifdef RTOS_POSIX
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#else
+  /* Nothing we can do from RT context.  Userland doesn't sleep for long
+     at a time waiting on shared memory, so it'll notice soon enough. */
+  (void)addr;
+#endif
+}
+
 /*-----------------------------------------------------------------------------
   RTOS-specific definitions
 -----------------------------------------------------------------------------*/
@@ -570,4 +599,492 @@ int pthread_attr_setfp_np(pthread_attr_t *a, int b) { (void)a; (void)b; return 0
 int pthread_attr_setstackaddr(pthread_attr_t *a, void *b) { (void)a; (void)b; return 0;}
 int pthread_attr_setstacksize(pthread_attr_t *a, size_t b) { (void)a; (void)b; return 0;}
 
-#endif /* defined RTAI */
+#elif defined(RTOS_POSIX)
+
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+
+struct module __this_module = { MOD_RUNNING };
+
+/*-----------------------------------------------------------------------------
+  RT-FIFOs -- a byte ring per minor, each with its own mutex.  Only the 
+  simulator process itself can get at them.
+-----------------------------------------------------------------------------*/
+struct posix_fifo {
+  pthread_mutex_t lock;
+  char *buf;
+  int size, rd, len;
+};
+
+static struct posix_fifo posix_fifos[RTF_NO_];
+static pthread_once_t posix_fifos_once = PTHREAD_ONCE_INIT;
+
+static void posix_fifos_init(void)
+{
+  int i;
+  for (i = 0; i < RTF_NO_; i++) pthread_mutex_init(&posix_fifos[i].lock, 0);
+}
+
+static struct posix_fifo *posix_fifo_get(unsigned int fifo)
+{
+  pthread_once(&posix_fifos_once, posix_fifos_init);
+  return fifo < RTF_NO_ ? &posix_fifos[fifo] : 0;
+}
+
+int rtf_create(unsigned int fifo, int size)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+  char *buf;
+
+  if (!f || size <= 0) return -EINVAL;
+  if (!(buf = malloc(size))) return -ENOMEM;
+
+  pthread_mutex_lock(&f->lock);
+  if (f->buf) { 
+    pthread_mutex_unlock(&f->lock); 
+    free(buf); 
+    return -EBUSY; 
+  }
+  f->buf = buf, f->size = size, f->rd = f->len = 0;
+  pthread_mutex_unlock(&f->lock);
+  return 0;
+}
+
+int rtf_destroy(unsigned int fifo)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+
+  if (!f) return -EINVAL;
+  pthread_mutex_lock(&f->lock);
+  free(f->buf);
+  f->buf = 0, f->size = f->rd = f->len = 0;
+  pthread_mutex_unlock(&f->lock);
+  return 0;
+}
+
+/* all or nothing, like RTLinux's */
+int rtf_put(unsigned int fifo, void *buf, int count)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+  int wr, chunk, ret = count;
+
+  if (!f || count < 0) return -EINVAL;
+  pthread_mutex_lock(&f->lock);
+  if (!f->buf) ret = -EINVAL;
+  else if (f->size - f->len < count) ret = -ENOSPC;
+  else {
+    wr = (f->rd + f->len) % f->size;
+    chunk = f->size - wr < count ? f->size - wr : count;
+    memcpy(f->buf + wr, buf, chunk);
+    memcpy(f->buf, (char *)buf + chunk, count - chunk);
+    f->len += count;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return ret;
+}
+
+int rtf_get(unsigned int fifo, void *buf, int count)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+  int chunk;
+
+  if (!f || count < 0) return -EINVAL;
+  pthread_mutex_lock(&f->lock);
+  if (!f->buf) count = -EINVAL;
+  else {
+    if (count > f->len) count = f->len;
+    chunk = f->size - f->rd < count ? f->size - f->rd : count;
+    memcpy(buf, f->buf + f->rd, chunk);
+    memcpy((char *)buf + chunk, f->buf, count - chunk);
+    f->rd = (f->rd + count) % f->size;
+    f->len -= count;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return count;
+}
+
+int rtf_length(unsigned int fifo)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+  return f ? f->len : -EINVAL;
+}
+
+int rtf_free(unsigned int fifo)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+  return f ? f->size - f->len : -EINVAL;
+}
+
+int rtf_bufsize(unsigned int fifo)
+{
+  struct posix_fifo *f = posix_fifo_get(fifo);
+  return f ? f->size : -EINVAL;
+}
+
+/*-----------------------------------------------------------------------------
+  Shared memory -- SysV shm keyed on the sum of the name's characters, 
+  the same way ShmController does it for its IPC type, so that daq_system 
+  and friends can attach to a running simulator.
+-----------------------------------------------------------------------------*/
+struct posix_shm_map
+{
+  struct list_head lh;
+  int shmid;
+  void *address;
+};
+
+static LIST_HEAD(posix_shm_maps);
+DECLARE_MUTEX(posix_shm_maps_sem);
+
+void *rtos_shm_attach(const char *name, int size)
+{
+  key_t key = 0;
+  int shmid;
+  void *addr;
+  struct posix_shm_map *map;
+  const char *c;
+
+  for (c = name; *c; c++) key += *c;
+
+  shmid = shmget(key, size, IPC_CREAT | 0666);
+  if (shmid < 0 && errno == EINVAL) {
+    /* a leftover segment of the wrong size from some earlier run */
+    if ((shmid = shmget(key, 0, 0)) >= 0) shmctl(shmid, IPC_RMID, 0);
+    shmid = shmget(key, size, IPC_CREAT | 0666);
+  }
+  if (shmid < 0) {
+    rtos_printf("rtos_middleman: shmget() for '%s' failed: %s\n", 
+                name, strerror(errno));
+    return 0;
+  }
+  if ((addr = shmat(shmid, 0, 0)) == (void *)-1) {
+    rtos_printf("rtos_middleman: shmat() for '%s' failed: %s\n", 
+                name, strerror(errno));
+    return 0;
+  }
+  /* like mbuff, a new region comes zeroed and an existing one (someone
+     else has it attached) is handed out as-is */
+  if (!(map = malloc(sizeof(*map)))) { shmdt(addr); return 0; }
+
+  map->shmid = shmid;
+  map->address = addr;
+  down(&posix_shm_maps_sem);
+  list_add(&map->lh, &posix_shm_maps);
+  up(&posix_shm_maps_sem);
+
+  return addr;
+}
+
+void rtos_shm_detach(void *addr)
+{
+  struct list_head *cur;
+  struct posix_shm_map *map = 0;
+
+  down(&posix_shm_maps_sem);
+  list_for_each(cur, &posix_shm_maps) {
+    map = list_entry(cur, struct posix_shm_map, lh);
+    if (map->address == addr) break;
+  }
+  if (cur != &posix_shm_maps) {
+    list_del(cur);
+    shmdt(addr);
+    /* goes away once userland detaches too */
+    shmctl(map->shmid, IPC_RMID, 0);
+    free(map);
+  }
+  up(&posix_shm_maps_sem);
+}
+
+/*-----------------------------------------------------------------------------
+  pthreads
+-----------------------------------------------------------------------------*/
+/* clear some aliases, we want the real ones in here */
+#undef pthread_attr_setfp_np
+#undef pthread_attr_setstackaddr
+#undef pthread_attr_setstacksize
+#undef pthread_create
+
+int rtos_posix_attr_setfp_np(pthread_attr_t *attr, int use_fp)
+{
+  (void)attr; (void)use_fp;
+  return 0;
+}
+
+int rtos_posix_attr_setstackaddr(pthread_attr_t *attr, void *addr)
+{
+  /* the RT code's kmalloc'd stacks are far too small for glibc, so we 
+     let pthreads allocate its own */
+  (void)attr; (void)addr;
+  return 0;
+}
+
+int rtos_posix_attr_setstacksize(pthread_attr_t *attr, size_t size)
+{
+  if (size < RTOS_POSIX_STACK_MIN) size = RTOS_POSIX_STACK_MIN;
+  return pthread_attr_setstacksize(attr, size);
+}
+
+int rtos_posix_pthread_create(pthread_t *thread, pthread_attr_t *attr,
+                              void *(*start_routine)(void *), void *arg)
+{
+  static int warned = 0;
+  struct sched_param sp;
+  int ret;
+
+  if (attr && !pthread_attr_getschedparam(attr, &sp)) {
+    if (sp.sched_priority < sched_get_priority_min(SCHED_FIFO))
+      sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    if (sp.sched_priority > sched_get_priority_max(SCHED_FIFO))
+      sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+    pthread_attr_setschedparam(attr, &sp);
+
+    if ( (ret = pthread_create(thread, attr, start_routine, arg)) != EPERM ) 
+      return ret;
+
+    if (!warned++)
+      rtos_printf("rtos_middleman: not allowed to use SCHED_FIFO, RT threads "
+                  "will be ordinary threads (try running as root)\n");
+    pthread_attr_setinheritsched(attr, PTHREAD_INHERIT_SCHED);
+  }
+  return pthread_create(thread, attr, start_routine, arg);
+}
+
+/*-----------------------------------------------------------------------------
+  comedi_map()/comedi_unmap() -- mmap()s the device's async buffer and 
+  remembers where, so it can be unmapped again
+-----------------------------------------------------------------------------*/
+#define POSIX_MAX_MAPS 8
+static struct { comedi_t *dev; unsigned subdev; void *addr; size_t size; } 
+  posix_maps[POSIX_MAX_MAPS];
+
+int comedi_map(comedi_t *dev, unsigned int subdev, void *ptr)
+{
+  int i, size;
+  void *addr;
+
+  for (i = 0; i < POSIX_MAX_MAPS && posix_maps[i].addr; i++)
+    ;
+  if (i >= POSIX_MAX_MAPS) return -ENOMEM;
+  if ( (size = comedi_get_buffer_size(dev, subdev)) <= 0 ) return -EINVAL;
+  addr = mmap(0, size, PROT_READ, MAP_SHARED, comedi_fileno(dev), 0);
+  if (addr == MAP_FAILED) return -errno;
+
+  posix_maps[i].dev = dev;
+  posix_maps[i].subdev = subdev;
+  posix_maps[i].addr = addr;
+  posix_maps[i].size = size;
+  *(void **)ptr = addr;
+  return 0;
+}
+
+int comedi_unmap(comedi_t *dev, unsigned int subdev)
+{
+  int i;
+
+  for (i = 0; i < POSIX_MAX_MAPS; i++)
+    if (posix_maps[i].addr && posix_maps[i].dev == dev 
+        && posix_maps[i].subdev == subdev) {
+      munmap(posix_maps[i].addr, posix_maps[i].size);
+      posix_maps[i].addr = 0;
+      return 0;
+    }
+  return -EINVAL;
+}
+
+/*-----------------------------------------------------------------------------
+  /proc
+-----------------------------------------------------------------------------*/
+static struct proc_dir_entry *posix_proc_entries = 0;
+
+struct proc_dir_entry *create_proc_entry(const char *name, mode_t mode,
+                                         struct proc_dir_entry *parent)
+{
+  struct proc_dir_entry *ent = calloc(1, sizeof(*ent));
+
+  if (!ent) return 0;
+  ent->name = name;
+  ent->mode = mode;
+  ent->parent = parent;
+  ent->next = posix_proc_entries;
+  posix_proc_entries = ent;
+  return ent;
+}
+
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+  struct proc_dir_entry **p;
+
+  for (p = &posix_proc_entries; *p; p = &(*p)->next)
+    if ((*p)->parent == parent && !strcmp((*p)->name, name)) {
+      struct proc_dir_entry *dead = *p;
+      *p = dead->next;
+      free(dead);
+      return;
+    }
+}
+
+static void posix_proc_print_path(FILE *out, const struct proc_dir_entry *e)
+{
+  if (!e) { fputs("/proc", out); return; }
+  posix_proc_print_path(out, e->parent);
+  fprintf(out, "/%s", e->name);
+}
+
+void rtos_posix_proc_dump(FILE *out)
+{
+  static char page[4096];
+  struct proc_dir_entry *e;
+  char *start;
+  off_t off;
+  int eof, len;
+
+  for (e = posix_proc_entries; e; e = e->next) {
+    if (!e->read_proc) continue;
+    fputs("---- ", out);
+    posix_proc_print_path(out, e);
+    fputs(" ----\n", out);
+    for (off = 0, eof = 0; !eof; off += len) {
+      start = 0;
+      len = e->read_proc(page, &start, off, sizeof(page), &eof, e->data);
+      if (len <= 0) break;
+      fwrite(start ? start : page, 1, len, out);
+    }
+  }
+}
+
+/*-----------------------------------------------------------------------------
+  Module parameters and module_init()/module_exit()
+-----------------------------------------------------------------------------*/
+#define POSIX_MAX_PARMS 64
+#define POSIX_MAX_MODULES 16
+
+static struct { const char *name, *type; } posix_parms[POSIX_MAX_PARMS];
+static int posix_n_parms = 0;
+
+static struct { 
+  char name[64]; 
+  rtos_posix_init_t init; 
+  rtos_posix_exit_t exit; 
+} posix_modules[POSIX_MAX_MODULES];
+static int posix_n_modules = 0;
+
+void rtos_posix_register_parm(const char *name, const char *type)
+{
+  if (posix_n_parms >= POSIX_MAX_PARMS) {
+    fprintf(stderr, "rtos_middleman: too many module parms, dropping %s\n", 
+            name);
+    return;
+  }
+  posix_parms[posix_n_parms].name = name;
+  posix_parms[posix_n_parms].type = type;
+  posix_n_parms++;
+}
+
+/* type is "i" or "s", or an array of them like "1-4s", where the values 
+   are separated by commas just like with insmod */
+static int posix_set_parm_value(const char *type, void *addr, const char *val)
+{
+  char *end, *copy, *tok, *save = 0;
+  int min = 1, max = 1, n = 0;
+  char t;
+
+  if (type[0] >= '0' && type[0] <= '9') {
+    min = (int)strtol(type, &end, 10);
+    if (*end++ != '-') return -EINVAL;
+    max = (int)strtol(end, &end, 10);
+    type = end;
+  }
+  t = type[0];
+  if ((t != 's' && t != 'i') || type[1]) return -EINVAL;
+
+  copy = strdup(val);
+  for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(0, ",", &save)){
+    if (n >= max) { free(copy); return -EINVAL; }
+    if (t == 's') {
+      ((char **)addr)[n] = strdup(tok);
+    } else {
+      long l = strtol(tok, &end, 0);
+      if (*end) { free(copy); return -EINVAL; }
+      ((int *)addr)[n] = (int)l;
+    }
+    n++;
+  }
+  free(copy);
+  /* an empty string is still a string */
+  if (!n && t == 's' && max == 1) { *(char **)addr = strdup(val); n = 1; }
+  return n < min ? -EINVAL : 0;
+}
+
+int rtos_posix_set_parm(const char *name_eq_value)
+{
+  const char *val = strchr(name_eq_value, '=');
+  void *addr;
+  int i;
+
+  if (!val) return -EINVAL;
+
+  for (i = 0; i < posix_n_parms; i++) {
+    if (strncmp(posix_parms[i].name, name_eq_value, val - name_eq_value) 
+        || posix_parms[i].name[val - name_eq_value]) continue;
+    if (!(addr = dlsym(RTLD_DEFAULT, posix_parms[i].name))) {
+      fprintf(stderr, "rtos_middleman: can't find module parm %s (%s), "
+              "was the simulator linked with -rdynamic?\n", 
+              posix_parms[i].name, dlerror());
+      return -ENOENT;
+    }
+    val++;
+    return posix_set_parm_value(posix_parms[i].type, addr, val);
+  }
+  return -ENOENT;
+}
+
+/* "/foo/apd_control.c" and "apd_control.o" both become "apd_control" */
+static void posix_module_name(const char *in, char *out, size_t outsz)
+{
+  const char *slash = strrchr(in, '/');
+  char *dot;
+
+  strncpy(out, slash ? slash + 1 : in, outsz - 1)[outsz - 1] = 0;
+  if ((dot = strrchr(out, '.'))) *dot = 0;
+}
+
+void rtos_posix_register_module(const char *file, rtos_posix_init_t init,
+                                rtos_posix_exit_t exit)
+{
+  char name[sizeof(posix_modules[0].name)];
+  int i;
+
+  posix_module_name(file, name, sizeof(name));
+  for (i = 0; i < posix_n_modules; i++)
+    if (!strcmp(posix_modules[i].name, name)) break;
+  if (i == posix_n_modules) {
+    if (i >= POSIX_MAX_MODULES) return;
+    strcpy(posix_modules[i].name, name);
+    posix_n_modules++;
+  }
+  if (init) posix_modules[i].init = init;
+  if (exit) posix_modules[i].exit = exit;
+}
+
+int rtos_posix_find_module(const char *file, rtos_posix_init_t *init,
+                           rtos_posix_exit_t *exit)
+{
+  char name[sizeof(posix_modules[0].name)];
+  int i;
+
+  posix_module_name(file, name, sizeof(name));
+  for (i = 0; i < posix_n_modules; i++)
+    if (!strcmp(posix_modules[i].name, name)) {
+      if (init) *init = posix_modules[i].init;
+      if (exit) *exit = posix_modules[i].exit;
+      return 1;
+    }
+  return 0;
+}
+
+#endif /* defined RTAI / RTOS_POSIX */
@@ -24,18 +24,22 @@
 /* rtos_middleman.h
    Implementation of RTOS-specific routines.  This api attempts to 
    be a neutral bridge between different implementations of 
-   RTOS api's.  Currently supports a subset of RTAI and RTLinux */
+   RTOS api's.  Currently supports a subset of RTAI and RTLinux, plus
+   RTOS_POSIX, which is plain userspace pthreads (see rtos_posix.h) for
+   running the RT modules in the simulator */
 #ifndef RTOS_MIDDLEMAN_H
 #define RTOS_MIDDLEMAN_H
 
-#ifndef __KERNEL__
-#error The rtos_middleman API is a bridging layer which is only be used in the kernel!
+#if !defined(__KERNEL__) && !defined(RTOS_POSIX)
+#error The rtos_middleman API is a bridging layer which is only be used in the kernel (or in the RTOS_POSIX simulator)!
 #endif
 
+#ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/version.h>
 #include <asm/div64.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -153,9 +157,22 @@ extern  int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
 
 static inline rtos_time_t rtos_get_time(void) { return count2nano(rt_get_time()); }
 
+#elif defined(RTOS_POSIX)
+
+# include "rtos_posix.h"
+
+extern int WARNING_THIS_MODULE_COMPILED_FOR_RTOS_POSIX;
+
+typedef hrtime_t rtos_time_t;
+
+# define rtos_printf printf
+# define RTL_PTHREAD_STACK_MIN RTOS_THREAD_STACK_MIN
+# define RTF_NO RTOS_RTF_NO
+
+static inline rtos_time_t rtos_get_time(void) { return gethrtime(); }
 
 #else
-#  error Must define one of RTAI or RTLINUX to use this header file!
+#  error Must define one of RTAI, RTLINUX or RTOS_POSIX to use this header file!
 #endif
 
 
@@ -168,6 +185,11 @@ extern int rtos_fifo_destroy(unsigned int fifo);
 extern int rtos_fifo_get(unsigned int fifo, void *buf, int count);
 extern int rtos_fifo_put(unsigned int fifo, void *buf, int count);
 
+/* Wakes up userland threads futex-waiting on addr, which is in shared
+   memory.  Only the POSIX simulator can actually do that -- elsewhere 
+   this does nothing and userland has to wait with a timeout. */
+extern void rtos_wake_user(volatile unsigned int *addr);
+
 /* allocates/attaches to a shm buff named name */
 extern void *rtos_shm_attach(const char *name, int size);
 extern void rtos_shm_detach(void *addr);
@@ -187,6 +209,8 @@ static void dont_call_me(void)
     &WARNING_THIS_MODULE_COMPILED_FOR_RTAI;
 #elif defined(RTLINUX)
     &WARNING_THIS_MODULE_COMPILED_FOR_RTLINUX;
+#elif defined(RTOS_POSIX)
+    &WARNING_THIS_MODULE_COMPILED_FOR_RTOS_POSIX;
 #endif
 
   if (!x) return;
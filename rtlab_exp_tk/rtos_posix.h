@@ -0,0 +1,426 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/* rtos_posix.h
+   Userspace stand-ins for the handful of kernel facilities that the RT 
+   modules (rt_process.c, rtlab_cmd.c, stimulator.c, user_cmd.c, 
+   apd_control.c, avn_stim.c and friends) use on top of rtos_middleman.h.
+
+   This is only ever included by rtos_middleman.h, and only when building
+   with -DRTOS_POSIX and without __KERNEL__.  That build links the RT 
+   modules into one ordinary process (see rtlab_sim.c), running the rt loop
+   as a pthread with a SCHED_FIFO priority if we are allowed one, talking 
+   to userspace comedilib (or mock_comedi.o), so that the whole RT side can
+   be run, debugged and profiled (gdb, valgrind, perf) without RTLinux, 
+   RTAI or a DAQ board.
+
+   Nothing here tries to be a faithful kernel -- it is just enough for 
+   the code we have.  In particular:
+
+     - kmalloc() is malloc(), printk() is printf()
+     - semaphores are a count + a pthread mutex/condvar
+     - bitops are byte-wise __sync builtins (same bit layout as x86)
+     - /proc entries are kept in a list that rtos_posix_proc_dump() prints
+     - MODULE_PARM() registers the variable so that the simulator can 
+       set it from a name=value argument, just like insmod would
+     - module_init()/module_exit() register the functions so that the 
+       simulator can 'insmod' plugin modules by name
+*/
+#ifndef _RTOS_POSIX_H
+#define _RTOS_POSIX_H
+
+#if defined(__KERNEL__) || !defined(RTOS_POSIX)
+#error rtos_posix.h is only for the userspace RTOS_POSIX build!
+#endif
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <comedilib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*-----------------------------------------------------------------------------
+  printk, kmalloc and friends
+-----------------------------------------------------------------------------*/
+#define printk printf
+#define rtl_printf printf
+#define KERN_EMERG   ""
+#define KERN_ALERT   ""
+#define KERN_CRIT    ""
+#define KERN_ERR     ""
+#define KERN_WARNING ""
+#define KERN_NOTICE  ""
+#define KERN_INFO    ""
+#define KERN_DEBUG   ""
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+#define kmalloc(sz, flags) malloc(sz)
+#define kfree(p) free(p)
+
+/* like the kernel's: divides n in place, evaluates to the remainder */
+#define do_div(n, base) ({ \
+  unsigned long __rem = (unsigned long)((n) % (base)); \
+  (n) = (n) / (base); \
+  __rem; \
+})
+
+/*-----------------------------------------------------------------------------
+  Module boilerplate
+-----------------------------------------------------------------------------*/
+#define MOD_UNINITIALIZED 0
+#define MOD_RUNNING       1
+#define MOD_DELETED       2
+#define MOD_AUTOCLEAN     4
+#define MOD_VISITED       8
+#define MOD_USED_ONCE     16
+#define MOD_JUST_FREED    32
+#define MOD_INITIALIZING  64
+
+struct module { unsigned long flags; };
+/* there is only the one 'module', the simulator process */
+extern struct module __this_module;
+#define THIS_MODULE (&__this_module)
+
+#define MOD_INC_USE_COUNT do { } while (0)
+#define MOD_DEC_USE_COUNT do { } while (0)
+
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_PARM_DESC(var, desc)
+#define EXPORT_SYMBOL(sym)       extern int rtos_posix_no_exports
+#define EXPORT_SYMBOL_NOVERS(sym) extern int rtos_posix_no_exports
+
+/* type is the insmod type string -- only "i" and "s" are supported, and
+   arrays of them like "1-4s" */
+extern void rtos_posix_register_parm(const char *name, const char *type);
+/* applies a name=value string to a registered parm, returns 0 on success.
+   Like insmod, this finds the variable by its symbol name (so link with
+   -rdynamic), since MODULE_PARM() usually comes before the variable. */
+extern int rtos_posix_set_parm(const char *name_eq_value);
+
+#define MODULE_PARM(var, type) \
+  static void __attribute__((constructor)) rtos_posix_parm_##var(void) \
+  { rtos_posix_register_parm(#var, type); }
+
+typedef int (*rtos_posix_init_t)(void);
+typedef void (*rtos_posix_exit_t)(void);
+
+/* name is the source file the module_init() is in, eg "apd_control.c" */
+extern void rtos_posix_register_module(const char *name, 
+                                       rtos_posix_init_t init, 
+                                       rtos_posix_exit_t exit);
+/* finds a module by name, with or without the .c/.o, or 0 if none */
+extern int rtos_posix_find_module(const char *name, rtos_posix_init_t *init,
+                                  rtos_posix_exit_t *exit);
+
+#define module_init(fn) \
+  static void __attribute__((constructor)) rtos_posix_init_##fn(void) \
+  { rtos_posix_register_module(__FILE__, fn, 0); }
+#define module_exit(fn) \
+  static void __attribute__((constructor)) rtos_posix_exit_##fn(void) \
+  { rtos_posix_register_module(__FILE__, 0, fn); }
+#define __init
+#define __exit
+
+/*-----------------------------------------------------------------------------
+  atomic_t and bitops
+-----------------------------------------------------------------------------*/
+typedef struct { volatile int counter; } atomic_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define atomic_read(v) ((v)->counter)
+#define atomic_set(v, i) (((v)->counter) = (i))
+#define atomic_inc(v) ((void)__sync_fetch_and_add(&(v)->counter, 1))
+#define atomic_dec(v) ((void)__sync_fetch_and_sub(&(v)->counter, 1))
+#define atomic_dec_and_test(v) (__sync_sub_and_fetch(&(v)->counter, 1) == 0)
+
+/* returns the old *ptr */
+#define xchg(ptr, v) __sync_lock_test_and_set((ptr), (v))
+
+/* full barriers everywhere, the sim doesn't care about the cost */
+#define mb()  __sync_synchronize()
+#define rmb() __sync_synchronize()
+#define wmb() __sync_synchronize()
+
+#define RTOS_POSIX_BYTE(nr, addr) \
+  (((volatile unsigned char *)(addr)) + ((unsigned)(nr) >> 3))
+#define RTOS_POSIX_BIT(nr) ((unsigned char)(1 << ((unsigned)(nr) & 7)))
+
+static inline void set_bit(int nr, volatile void *addr)
+{ __sync_fetch_and_or(RTOS_POSIX_BYTE(nr, addr), RTOS_POSIX_BIT(nr)); }
+
+static inline void clear_bit(int nr, volatile void *addr)
+{ __sync_fetch_and_and(RTOS_POSIX_BYTE(nr, addr), ~RTOS_POSIX_BIT(nr)); }
+
+static inline int test_bit(int nr, const volatile void *addr)
+{ return (*RTOS_POSIX_BYTE(nr, addr) & RTOS_POSIX_BIT(nr)) != 0; }
+
+static inline int test_and_set_bit(int nr, volatile void *addr)
+{ 
+  return (__sync_fetch_and_or(RTOS_POSIX_BYTE(nr, addr), RTOS_POSIX_BIT(nr)) 
+          & RTOS_POSIX_BIT(nr)) != 0; 
+}
+
+static inline int test_and_clear_bit(int nr, volatile void *addr)
+{ 
+  return (__sync_fetch_and_and(RTOS_POSIX_BYTE(nr, addr), ~RTOS_POSIX_BIT(nr))
+          & RTOS_POSIX_BIT(nr)) != 0; 
+}
+
+/* returns size if there is no zero bit */
+static inline int find_first_zero_bit(const volatile void *addr, int size)
+{
+  int nr;
+  for (nr = 0; nr < size && test_bit(nr, addr); nr++)
+    ;
+  return nr;
+}
+
+/*-----------------------------------------------------------------------------
+  Semaphores and spinlocks
+-----------------------------------------------------------------------------*/
+struct semaphore {
+  atomic_t count; /* read directly by some of the RT code */
+  pthread_mutex_t lock;
+  pthread_cond_t  wait;
+};
+
+#define __MUTEX_INITIALIZER(name) \
+  { ATOMIC_INIT(1), PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER }
+#define DECLARE_MUTEX(name) struct semaphore name = __MUTEX_INITIALIZER(name)
+
+static inline void sema_init(struct semaphore *s, int val)
+{
+  atomic_set(&s->count, val);
+  pthread_mutex_init(&s->lock, 0);
+  pthread_cond_init(&s->wait, 0);
+}
+
+static inline void down(struct semaphore *s)
+{
+  pthread_mutex_lock(&s->lock);
+  while (atomic_read(&s->count) <= 0) pthread_cond_wait(&s->wait, &s->lock);
+  atomic_dec(&s->count);
+  pthread_mutex_unlock(&s->lock);
+}
+
+static inline int down_interruptible(struct semaphore *s) 
+{ down(s); return 0; }
+
+static inline int down_trylock(struct semaphore *s)
+{
+  int ret = 1;
+  pthread_mutex_lock(&s->lock);
+  if (atomic_read(&s->count) > 0) { atomic_dec(&s->count); ret = 0; }
+  pthread_mutex_unlock(&s->lock);
+  return ret;
+}
+
+static inline void up(struct semaphore *s)
+{
+  pthread_mutex_lock(&s->lock);
+  atomic_inc(&s->count);
+  pthread_cond_signal(&s->wait);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* plain old data so that it survives being memcpy'd around like the 
+   kernel's does */
+typedef struct { volatile int lock; } spinlock_t;
+
+#define SPIN_LOCK_UNLOCKED ((spinlock_t) { 0 })
+#define spin_lock_init(l) ((l)->lock = 0)
+#define spin_lock(l) \
+  do { while (__sync_lock_test_and_set(&(l)->lock, 1)) sched_yield(); } \
+  while (0)
+#define spin_unlock(l) __sync_lock_release(&(l)->lock)
+#define spin_lock_irqsave(l, flags) do { (void)(flags); spin_lock(l); } while(0)
+#define spin_unlock_irqrestore(l, flags) spin_unlock(l)
+
+/*-----------------------------------------------------------------------------
+  <linux/list.h>
+-----------------------------------------------------------------------------*/
+struct list_head { struct list_head *next, *prev; };
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+#define INIT_LIST_HEAD(ptr) do { (ptr)->next = (ptr); (ptr)->prev = (ptr); } \
+                            while (0)
+
+static inline void __list_add(struct list_head *n, struct list_head *prev, 
+                              struct list_head *next)
+{
+  next->prev = n;
+  n->next = next;
+  n->prev = prev;
+  prev->next = n;
+}
+
+static inline void list_add(struct list_head *n, struct list_head *head)
+{ __list_add(n, head, head->next); }
+
+static inline void list_add_tail(struct list_head *n, struct list_head *head)
+{ __list_add(n, head->prev, head); }
+
+static inline void list_del(struct list_head *entry)
+{
+  entry->next->prev = entry->prev;
+  entry->prev->next = entry->next;
+  entry->next = entry->prev = 0;
+}
+
+static inline int list_empty(const struct list_head *head)
+{ return head->next == head; }
+
+#define list_entry(ptr, type, member) \
+  ((type *)((char *)(ptr) - (unsigned long)(&((type *)0)->member)))
+#define list_for_each(pos, head) \
+  for (pos = (head)->next; pos != (head); pos = pos->next)
+#define list_for_each_safe(pos, n, head) \
+  for (pos = (head)->next, n = pos->next; pos != (head); \
+       pos = n, n = pos->next)
+
+/*-----------------------------------------------------------------------------
+  /proc -- entries just go into a list, rtos_posix_proc_dump() prints them
+-----------------------------------------------------------------------------*/
+#ifndef S_IRUGO
+#  define S_IRUGO (S_IRUSR|S_IRGRP|S_IROTH)
+#endif
+
+typedef int (read_proc_t)(char *page, char **start, off_t off, int count, 
+                          int *eof, void *data);
+
+struct proc_dir_entry {
+  const char *name;
+  mode_t mode;
+  struct module *owner;
+  read_proc_t *read_proc;
+  void *data;
+  struct proc_dir_entry *parent, *next;
+};
+
+extern struct proc_dir_entry *create_proc_entry(const char *name, mode_t mode,
+                                                struct proc_dir_entry *parent);
+extern void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+/* 'cat's every regular /proc entry there is, to out */
+extern void rtos_posix_proc_dump(FILE *out);
+
+/*-----------------------------------------------------------------------------
+  kcomedilib bits that userspace comedilib doesn't have
+-----------------------------------------------------------------------------*/
+static inline int comedi_get_krange(comedi_t *dev, unsigned int subdev,
+                                    unsigned int chan, unsigned int range,
+                                    comedi_krange *krange)
+{
+  comedi_range *r = comedi_get_range(dev, subdev, chan, range);
+
+  if (!r) return -EINVAL;
+  /* kranges are in millionths of a volt (or mA) */
+  krange->min = (int)(r->min * 1e6);
+  krange->max = (int)(r->max * 1e6);
+  krange->flags = r->unit;
+  return 0;
+}
+
+/* kcomedilib hands out the async buffer's kernel address, userspace has to
+   mmap() the device for it -- these do that (see rtos_middleman.c) */
+extern int comedi_map(comedi_t *dev, unsigned int subdev, void *ptr);
+extern int comedi_unmap(comedi_t *dev, unsigned int subdev);
+
+/*-----------------------------------------------------------------------------
+  Time -- hrtime is CLOCK_MONOTONIC in nanoseconds, but the RT loops do
+  their absolute sleeps on CLOCK_REALTIME just like under RTLinux
+-----------------------------------------------------------------------------*/
+typedef long long hrtime_t;
+#define HRTIME_INFINITY LLONG_MAX
+#define NSECS_PER_SEC 1000000000
+
+static inline hrtime_t gethrtime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (hrtime_t)ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+static inline void timespec_add_ns(struct timespec *t, long n)
+{
+  t->tv_nsec += n;
+  while (t->tv_nsec >= NSECS_PER_SEC) { t->tv_nsec -= NSECS_PER_SEC; t->tv_sec++; }
+  while (t->tv_nsec < 0) { t->tv_nsec += NSECS_PER_SEC; t->tv_sec--; }
+}
+
+/*-----------------------------------------------------------------------------
+  pthreads -- the RT code hands us a kmalloc'd stack and the RTLinux 
+  minimum stack size, neither of which is any good to a glibc thread
+-----------------------------------------------------------------------------*/
+#define RTOS_POSIX_STACK_MIN (256 * 1024)
+
+extern int rtos_posix_attr_setfp_np(pthread_attr_t *attr, int use_fp);
+extern int rtos_posix_attr_setstackaddr(pthread_attr_t *attr, void *addr);
+extern int rtos_posix_attr_setstacksize(pthread_attr_t *attr, size_t size);
+/* tries for SCHED_FIFO at the attr's priority, and falls back to an 
+   ordinary thread (with a one-time warning) if we aren't allowed to */
+extern int rtos_posix_pthread_create(pthread_t *thread, pthread_attr_t *attr,
+                                     void *(*start_routine)(void *), 
+                                     void *arg);
+
+#define pthread_attr_setfp_np     rtos_posix_attr_setfp_np
+#define pthread_attr_setstackaddr rtos_posix_attr_setstackaddr
+#define pthread_attr_setstacksize rtos_posix_attr_setstacksize
+#define pthread_create            rtos_posix_pthread_create
+
+/*-----------------------------------------------------------------------------
+  RT-FIFOs, in-process only.  Same semantics as the RTLinux ones: puts are
+  all or nothing, gets return what there is.
+-----------------------------------------------------------------------------*/
+extern int rtf_create(unsigned int fifo, int size);
+extern int rtf_destroy(unsigned int fifo);
+extern int rtf_put(unsigned int fifo, void *buf, int count);
+extern int rtf_get(unsigned int fifo, void *buf, int count);
+extern int rtf_length(unsigned int fifo);
+extern int rtf_free(unsigned int fifo);
+extern int rtf_bufsize(unsigned int fifo);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,6 +31,7 @@
 #include <string.h>
 #include "sample_reader.h"
 #include "sample_source.h"
+#include "pipeline_stats.h"
 
 /*----------------------------------------------------------------------------
   SampleStructReader method definitions
@@ -80,25 +81,41 @@ SampleStructReader::readAll()
     scan_started_index = samples->scan_index;
   }
   
+  /* the oldest sample in this read is the one that waited the longest */
+  if (num_samples_read) pipelineNote(PIPELINE_READ, samples->scan_index);
+
   for (i = 0; i < num_samples_read; i++) {
+    const uint chan = samples[i].channel_id;
+
+    if (chan >= channelSeenOnce.size()) { /* a channel id we've not had */
+      channelSeenOnce.resize(chan + 1, false);
+      current_scan_indices.resize(chan + 1, 0);
+      num_dropped_chan.resize(chan + 1, 0);
+    }
+
     /* we are in a non-first pass, so we can rely on the
        current_scan_indices array, thus we can calculate
        whether we dropped any scans */
-    if (channelSeenOnce[samples[i].channel_id]) {
-      num_dropped_last += /* bump up num_dropped if we see a jump in 
-			     scan index no.'s */
-	samples[i].scan_index
-	- current_scan_indices[samples[i].channel_id] - 1;
+    if (channelSeenOnce[chan]) {
+      scan_index_t d = /* bump up num_dropped if we see a jump in 
+                          scan index no.'s */
+	samples[i].scan_index - current_scan_indices[chan] - 1;
+      if (d) {
+        num_dropped_last += d;
+        num_dropped_chan[chan] += d;
+        pipelineDrops(chan, d);
+      }
     } else {
       /* this is the first pass for this channel.  After this point
 	 we will be able to rely on the record of current scan indices
 	 for this channel */
-      channelSeenOnce[samples[i].channel_id] = true;
+      channelSeenOnce[chan] = true;
     }
     
     /* update the record of all the current indices for each channel */
-    current_scan_indices[samples[i].channel_id] = samples[i].scan_index;
-    
+    current_scan_indices[chan] = samples[i].scan_index;
+    if (samples[i].scan_index > newest_scan_index) 
+      newest_scan_index = samples[i].scan_index;
   }
   num_dropped_total += num_dropped_last;
   
@@ -111,6 +128,10 @@ SampleStructReader::numRead() const { return num_samples_total; }
 scan_index_t
 SampleStructReader::numDropped() const { return num_dropped_total; }
 
+scan_index_t
+SampleStructReader::numDropped(uint chan) const 
+{ return (chan < num_dropped_chan.size() ? num_dropped_chan[chan] : 0); }
+
 uint
 SampleStructReader::numLastRead() const { return source->numSamplesLastRead();}
 
@@ -123,18 +144,7 @@ SampleStructReader::firstScanIndex() const {  return scan_started_index; }
 
 /* returns the index of the greatest scan encountered */
 scan_index_t 
-SampleStructReader::currentScanIndex() const 
-{
-  uint i;
-  scan_index_t ret = 0;
-
-  for (i = 0; i < SHD_MAX_CHANNELS; i++) {
-    if (channelSeenOnce[i] && current_scan_indices[i] > ret)
-      ret = current_scan_indices[i];
-  }
-
-  return ret;
-}
+SampleStructReader::currentScanIndex() const { return newest_scan_index; }
 
 /* protected default constructor */
 SampleStructReader::SampleStructReader() 
@@ -153,11 +163,12 @@ SampleStructReader::init()
   num_samples_total =  
   num_dropped_total =
   num_dropped_last =
-  scan_started_index = 0;
+  scan_started_index = 
+  newest_scan_index = 0;
 
-  for (int i = 0; i < SHD_MAX_CHANNELS; i++) {
-    channelSeenOnce[i] = false;
-  }
+  channelSeenOnce.clear();
+  current_scan_indices.clear();
+  num_dropped_chan.clear();
 
 }
 
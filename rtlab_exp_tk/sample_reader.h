@@ -24,6 +24,7 @@
 # define _SAMPLE_READER_H
 
 #include <string>
+#include <vector>
 #include "shared_stuff.h"
 #include "common.h"
 
@@ -74,6 +75,9 @@ class SampleStructReader {
      read from this source */
   unsigned long long numDropped() const;
 
+  /* same as above, for just one channel */
+  unsigned long long numDropped(uint chan) const;
+
   /* the number of samples last read */
   uint numLastRead() const;
   
@@ -93,9 +97,11 @@ class SampleStructReader {
 
   /* statistics properties */
   
-  scan_index_t current_scan_indices[SHD_MAX_CHANNELS], scan_started_index,
+  scan_index_t scan_started_index, newest_scan_index,
                num_samples_total, num_dropped_total, num_dropped_last;
-  bool channelSeenOnce[SHD_MAX_CHANNELS];
+  /* per channel id, grown as higher channel ids show up */
+  vector<scan_index_t> current_scan_indices, num_dropped_chan;
+  vector<char> channelSeenOnce;
   /* a negative number here indicates that reads block indefinitely */
   int secs_to_block_on_reads;
   
@@ -0,0 +1,178 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  Sample Ring dot h
+  -----------------
+  A single-producer/multi-consumer ring of SampleStructs that lives in 
+  shared memory.  This replaces the AI RT-FIFO (and the comedi coprocess's
+  pipe) as the way samples get to userland: the producer (rt_process.c or
+  the ComediCoprocess thread) memcpy's whole scans in, and readers
+  (SampleStructRingSource) copy them out again, so there is no syscall 
+  per read.
+
+  The producer never waits for anybody.  It owns 'head', the total number 
+  of samples ever put (mod 2^32), and 'write_end', which it bumps to 
+  where it is about to write up to *before* it touches any slots.  Each
+  reader keeps its own position and publishes it in one of the tails[] 
+  so that others can see how far behind it is, but nothing depends on 
+  that.  A reader that falls more than a ring behind has been lapped and 
+  must skip ahead -- those samples are lost, exactly as they would be if
+  an RT-FIFO had filled up.  Since the producer can also lap a reader 
+  while it is copying, readers copy first and then ask 
+  sample_ring_overwritten() how much of what they got is garbage.
+
+  head, the tails and the slots are each on their own cache line(s) so 
+  the producer and the readers don't fight over lines they don't share.
+*/
+#ifndef _SAMPLE_RING_H
+#define _SAMPLE_RING_H
+
+#include "shared_stuff.h"
+
+#ifdef __KERNEL__
+#  include <linux/string.h>
+#  include <asm/system.h>
+#  define SAMPLE_RING_WMB() wmb()
+#  define SAMPLE_RING_RMB() rmb()
+#else
+#  include <string.h>
+#  if defined(__i386__) || defined(__x86_64__)
+   /* x86 never reorders stores with stores or loads with loads, so all we
+      need is to keep the compiler from doing it */
+#    define SAMPLE_RING_WMB() __asm__ __volatile__ ("" : : : "memory")
+#    define SAMPLE_RING_RMB() __asm__ __volatile__ ("" : : : "memory")
+#  else
+#    define SAMPLE_RING_WMB() __sync_synchronize()
+#    define SAMPLE_RING_RMB() __sync_synchronize()
+#  endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+# define SAMPLE_RING_NAME "DAQ System AI Ring" /* text ID for mbuff/rtai shm */
+# define SAMPLE_RING_MAGIC 0x53524e48          /* 'SRNH', has write_end      */
+# define SAMPLE_RING_CACHELINE 64
+# define SAMPLE_RING_MAX_READERS 8
+
+struct SampleRingTail {
+  volatile unsigned int pos;     /* this reader's position, like head       */
+  volatile int in_use;           /* nonzero if some reader owns this slot   */
+  char pad[SAMPLE_RING_CACHELINE - 2 * sizeof(int)];
+};
+
+struct SampleRing {
+  /* set by the producer at init time, read-only afterwards                 */
+  unsigned int magic;
+  unsigned int n_slots;          /* always a power of 2                     */
+  char pad0[SAMPLE_RING_CACHELINE - 2 * sizeof(int)];
+
+  /* written by the producer only                                           */
+  volatile unsigned int head;    /* no. of samples ever put, mod 2^32       */
+  volatile unsigned int write_end; /* slots up to here may be being written */
+  char pad1[SAMPLE_RING_CACHELINE - 2 * sizeof(int)];
+
+  struct SampleRingTail tails[SAMPLE_RING_MAX_READERS];
+
+  SampleStruct buf[1];           /* actually n_slots of them                */
+};
+
+#ifndef __cplusplus
+typedef struct SampleRing SampleRing;
+typedef struct SampleRingTail SampleRingTail;
+#endif
+
+/* the number of bytes of shared memory to allocate for n_slots samples */
+#define SAMPLE_RING_BYTES(n_slots) \
+  ((unsigned long)(((struct SampleRing *)0)->buf) \
+   + (unsigned long)(n_slots) * sizeof(SampleStruct))
+
+/* the largest power of 2 that is <= n, or 0 if n is 0 */
+static inline unsigned int sample_ring_pow2_floor(unsigned int n)
+{
+  unsigned int p = 1;
+  if (!n) return 0;
+  while (p <= n / 2) p <<= 1;
+  return p;
+}
+
+/* n_slots must be a power of 2 */
+static inline void sample_ring_init(struct SampleRing *r, unsigned int n_slots)
+{
+  int i;
+
+  r->n_slots = n_slots;
+  r->head = r->write_end = 0;
+  for (i = 0; i < SAMPLE_RING_MAX_READERS; i++) 
+    r->tails[i].pos = 0, r->tails[i].in_use = 0;
+  SAMPLE_RING_WMB();
+  r->magic = SAMPLE_RING_MAGIC;
+}
+
+/* Producer side: appends n samples.  Never blocks, never fails. */
+static inline void sample_ring_put(struct SampleRing *r, 
+                                   const SampleStruct *s, unsigned int n)
+{
+  unsigned int mask = r->n_slots - 1, head = r->head, pos, chunk;
+
+  /* readers must be able to tell which slots we may have scribbled over
+     before we scribble on any of them */
+  r->write_end = head + n;
+  SAMPLE_RING_WMB();
+
+  while (n) {
+    pos = head & mask;
+    chunk = r->n_slots - pos;
+    if (chunk > n) chunk = n;
+    memcpy(r->buf + pos, s, chunk * sizeof(SampleStruct));
+    s += chunk, n -= chunk, head += chunk;
+  }
+  
+  /* the samples must be visible before the new head is */
+  SAMPLE_RING_WMB();
+  r->head = head;
+}
+
+/* Reader side: call after copying n samples starting at pos out of the
+   ring.  Returns how many of them, counting from the front, the producer
+   may have overwritten while we copied -- those must be thrown away. */
+static inline unsigned int sample_ring_overwritten(const struct SampleRing *r,
+                                                   unsigned int pos, 
+                                                   unsigned int n)
+{
+  unsigned int end;
+
+  /* the copy must be done before we look */
+  SAMPLE_RING_RMB();
+  end = r->write_end - r->n_slots; /* slots before this are still intact */
+  if ((int)(end - pos) <= 0) return 0;
+  return end - pos > n ? n : end - pos;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
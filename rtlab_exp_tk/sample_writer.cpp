@@ -27,13 +27,22 @@
 #include <errno.h>
 #include "sample_writer.h"
 #include "shm.h"
+#include "pipeline_stats.h"
 
 SampleWriter::SampleWriter(uint sampling_rate_hz) 
-  : sampling_rate_hz(sampling_rate_hz), scan_index(0)
+  : sampling_rate_hz(sampling_rate_hz), scan_index(0), next_note_scan(0)
 { 
   _periodicFlush = flushPending = false; 
 }
 
+void SampleWriter::noteWritten(scan_index_t si)
+{
+  /* at most ~100 notes a second, gettimeofday() isn't free */
+  if (si < next_note_scan) return;
+  pipelineNote(PIPELINE_WRITE, si);
+  next_note_scan = si + sampling_rate_hz / 100 + 1;
+}
+
 void SampleWriter::scanIndexChanged(scan_index_t newIndex)
 {
   scan_index = newIndex;
@@ -73,6 +82,7 @@ SampleGZWriter::init()
   /* do init stuff here */
   file = NULL;
   bufEnd = 0;
+  buf_first_scan = 0;
   buffer[0] = 0;
   channel_ids_that_have_a_committed_state.clear();
 }
@@ -113,6 +123,8 @@ SampleGZWriter::consume(const SampleStruct *s)
 		      which relies on expensive gzwrite() */
   }
 
+  if (!bufEnd) buf_first_scan = s->scan_index;
+
   if (channel_ids_that_have_a_committed_state.find(s->channel_id) == 
       channel_ids_that_have_a_committed_state.end()) {
     putStateChangeInfo(s);
@@ -162,6 +174,8 @@ SampleGZWriter::flushBuffer()
 				errmsg);
   }
   
+  if (bufEnd) noteWritten(buf_first_scan);
+
   buffer[(bufEnd = 0)] = 0;
 
   flushPending = false;
@@ -203,6 +217,7 @@ void SampleBinWriter::consume(const SampleStruct *s)
 {
   if (s->scan_index > scan_index) scanIndexChanged(s->scan_index);
   dsdostream.writeSample(s);
+  noteWritten(s->scan_index);
 }
 
 void SampleBinWriter::channelStateChanged(uint channel_id, bool on_or_off = true)
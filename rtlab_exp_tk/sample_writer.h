@@ -46,6 +46,12 @@ public:
   virtual void consume(const SampleStruct *s) = 0;
 
   virtual bool & periodicFlush() { return _periodicFlush; };
+
+  /* name/value pairs describing the recording, kept by the formats that 
+     have somewhere to put them (see DSDStream::putUserMetaData()) and 
+     ignored by the rest.  Putting a name again replaces its value. */
+  virtual void putMetaData(const QString & name, const QString & value) 
+    { (void)name; (void)value; }
   virtual void schedulePeriodicFlush(); // calls a timer on flushBuffer()
 
 public slots:
@@ -60,11 +66,17 @@ public slots:
 
 protected:
 
+  /* tells pipeline_stats that scan si made it to disk, rate limited */
+  void noteWritten(scan_index_t si);
+
   bool flushPending,   /* if this is false, we need to schedule a flush */
        _periodicFlush; /* this needs to be true for the timed flushes to
                           be enabled -- default is false */
   uint sampling_rate_hz;
   scan_index_t scan_index;
+
+ private:
+  scan_index_t next_note_scan;
 };
 
 class SampleGZWriter: public SampleWriter
@@ -102,6 +114,7 @@ class SampleGZWriter: public SampleWriter
     * const dataLineFormat = "C[%03u] SI[%020llu] D[%#.14g]\n";
   char buffer[BUFSIZE+1];
   uint bufEnd; /* index of the first free pos in buffer (always <= BUFSIZE) */
+  scan_index_t buf_first_scan; /* oldest scan sitting in buffer */
 };
 
 
@@ -116,6 +129,9 @@ public:
   void setFile(const char *filename);
   void consume(const SampleStruct *s);
 
+  void putMetaData(const QString & name, const QString & value)
+    { dsdostream.putUserMetaData(name, value); }
+
 public slots:
 
   void channelStateChanged(uint channel_id, bool on_or_off = true);
@@ -41,11 +41,17 @@ extern "C" {
 # define SS_RT_QUEUE_BLOCK_SZ_BYTES (sizeof(SampleStruct))
 
 /* The maximum number of channels per subdevice for our automatically
-   allocated shared memory struct */
-# define SHD_MAX_CHANNELS 256
+   allocated shared memory struct.  This only sizes the per-channel tables
+   in it -- how many channels there really are is only known at runtime 
+   (n_ai_chans, over all the boards), and the per-scan work everywhere 
+   is in terms of that or of the channels that are on, not of this.  */
+# define SHD_MAX_CHANNELS 1024
 
 # define CHAN_MASK_SIZE (SHD_MAX_CHANNELS / 8)
 
+/* the bytes of a channel mask that n channels actually use */
+# define CHAN_MASK_BYTES(n) (((n) + 7) / 8)
+
 
 #include "rtlab_types.h"
 
@@ -66,12 +72,288 @@ struct SpikeParams {
   volatile unsigned int blanking [SHD_MAX_CHANNELS]; /* in milliseconds      */
   volatile double threshold [SHD_MAX_CHANNELS];      /* NaNs here can be 
                                                         dangerous!           */
+  volatile int threshold_uv [SHD_MAX_CHANNELS];      /* the same, in micro-
+                                                        volts, for a fixed 
+                                                        point rtlab.o        */
 };
 
 #ifndef __cplusplus
 typedef struct SpikeParams SpikeParams;
 #endif
 
+/*
+  RTLoopStats
+  -----------
+  Timing statistics for rtlab.o's RT loop, kept up to date every tick.
+  Only the kernel ever writes these and every counter is a single word 
+  that it bumps in place, so userland can read them whenever it likes 
+  without any locking.  A reader can catch a tick half-accounted for (a 
+  bucket bumped but not the count yet, say), which doesn't matter for 
+  statistics.  There is no reset.  Readers that want 'since I last 
+  looked' keep a copy and subtract (see rtLoopReport() in 
+  pipeline_stats.h).
+
+  The histograms are log-linear in nanoseconds: bucket 0 is everything 
+  under 2^RT_HIST_MIN_SHIFT ns, then there are 2^RT_HIST_SUB_BITS buckets
+  per power of two up to 2^32 ns, so percentiles are good to within 25%.
+*/
+# define RT_HIST_MIN_SHIFT 10
+# define RT_HIST_SUB_BITS 2
+# define RT_HIST_BUCKETS (1 + ((32 - RT_HIST_MIN_SHIFT) << RT_HIST_SUB_BITS))
+# define RT_STATS_MAX_CALLBACKS 16
+
+struct RTHistogram {
+  volatile unsigned int count;
+  volatile unsigned int max_ns;
+  volatile uint64 sum_ns;
+  volatile unsigned int buckets[RT_HIST_BUCKETS];
+};
+
+struct RTCallbackStats {
+  volatile uint64 function;     /* address of the registered rtfunction_t,
+                                   0 if this slot is free                  */
+  struct RTHistogram cost;      /* how long each call took                 */
+};
+
+struct RTLoopStats {
+  volatile unsigned int overruns; /* ticks that still weren't done when the
+                                     next one was due                      */
+  struct RTHistogram jitter;    /* wakeup interval vs. the task period     */
+  struct RTHistogram tick;      /* wakeup to the end of the tick's work    */
+  struct RTCallbackStats callbacks[RT_STATS_MAX_CALLBACKS]; /* in no 
+                                                               particular
+                                                               order       */
+};
+
+#ifndef __cplusplus
+typedef struct RTHistogram RTHistogram;
+typedef struct RTCallbackStats RTCallbackStats;
+typedef struct RTLoopStats RTLoopStats;
+#endif
+
+/* which RTHistogram bucket ns goes in */
+static inline unsigned int
+rt_hist_bucket (unsigned int ns)
+{
+  unsigned int msb = 0, v = ns;
+
+  if (ns < (1U << RT_HIST_MIN_SHIFT)) return 0;
+
+  if (v >> 16) { msb += 16; v >>= 16; }
+  if (v >> 8)  { msb += 8;  v >>= 8;  }
+  if (v >> 4)  { msb += 4;  v >>= 4;  }
+  if (v >> 2)  { msb += 2;  v >>= 2;  }
+  if (v >> 1)  { msb += 1; }
+
+  return 1 + ((msb - RT_HIST_MIN_SHIFT) << RT_HIST_SUB_BITS)
+           + ((ns >> (msb - RT_HIST_SUB_BITS)) 
+              & ((1U << RT_HIST_SUB_BITS) - 1));
+}
+
+/* the (exclusive) upper bound of RTHistogram bucket b, in ns */
+static inline uint64
+rt_hist_bucket_top (unsigned int b)
+{
+  unsigned int msb, sub;
+
+  if (!b) return 1U << RT_HIST_MIN_SHIFT;
+  msb = RT_HIST_MIN_SHIFT + ((b - 1) >> RT_HIST_SUB_BITS);
+  sub = (b - 1) & ((1U << RT_HIST_SUB_BITS) - 1);
+  return ((uint64)((1U << RT_HIST_SUB_BITS) + sub + 1)) 
+         << (msb - RT_HIST_SUB_BITS);
+}
+
+/*
+  AIBoardInfo
+  -----------
+  rtlab.o can acquire from several boards at once (see its ai_device 
+  module parameter), and they all end up in the one AI channel space in 
+  the order they were given: board b's channel c is global channel 
+  first_chan + c.  ai_minor and ai_subdev in the SharedMemStruct are 
+  always board 0's.
+
+  Board 0 always scans on its own timer.  The others either do too, or 
+  are clocked by an external scan clock (normally board 0's, routed to
+  them over RTSI or a cable) on trigger input ext_clock.
+
+  The skew numbers are for the hardware-timed case, where they say how far
+  board b's scans are behind board 0's: start_offset_ns is how much later
+  its command started (0 for external clocks, which start on board 0's 
+  first scan), and skew_ns is measured every tick from how many scans 
+  each board has buffered, so it is in whole scans and mostly shows drift
+  between boards on their own clocks.  When polling, skew_ns is the time
+  between reading board 0's first channel and board b's.  Only rtlab.o
+  writes any of this.
+*/
+# define SHD_MAX_AI_BOARDS 4
+
+struct AIBoardInfo {
+  int minor, subdev;            /* /dev/comediX and its ai subdevice       */
+  unsigned int first_chan;      /* its first channel in the global space   */
+  unsigned int n_chans;         /* how many of them                        */
+  int ext_clock;                /* -1: own timer, else the trigger input 
+                                   its scans are clocked by                */
+  volatile int start_offset_ns; /* see above                               */
+  volatile int skew_ns;         /* see above, smoothed over ~16 ticks      */
+  volatile int max_skew_ns;     /* largest |skew_ns| since the start       */
+  volatile unsigned int n_slipped; /* scans thrown away to get back in step 
+                                      with the other boards               */
+};
+
+#ifndef __cplusplus
+typedef struct AIBoardInfo AIBoardInfo;
+#endif
+
+/* Oversampling, see SharedMemStruct.ai_oversample and ai_decimate.h */
+# define AI_MAX_OVERSAMPLE 16
+# define AI_MAX_CIC_ORDER 3
+
+/* for the SharedMemStruct below (and the commands, which carry the 
+   version too) */
+# define SHARED_MEM_NAME "DAQ System SHM" /* text ID for mbuff               */
+# define SHD_SHM_STRUCT_VERSION 78        /* test this against the below 
+                                             struct_version member           */
+
+/*
+  Commands from userland to rtlab.o, see user_to_kernel.h
+*/
+  /*
+    TODO: Implement ability to affect AO subdevice from userland? 
+  */
+
+typedef enum {
+  RTLAB_SET_CHAN = 0,
+  RTLAB_SET_CHAN_ALL,
+  RTLAB_SET_GAIN,
+  RTLAB_SET_GAIN_ALL,
+  RTLAB_SET_AREF,
+  RTLAB_SET_AREF_ALL,
+  RTLAB_SET_SPIKE,
+  RTLAB_SET_SPIKE_ALL,
+  RTLAB_SET_SPIKE_POLARITY,
+  RTLAB_SET_SPIKE_POLARITY_ALL,
+  RTLAB_SET_SPIKE_BLANKING,
+  RTLAB_SET_SPIKE_BLANKING_ALL,
+  RTLAB_SET_SPIKE_THRESHOLD,
+  RTLAB_SET_SPIKE_THRESHOLD_ALL,
+  RTLAB_SET_ATTACHED_PID,
+  RTLAB_SET_SAMPLING_RATE,
+  RTLAB_SET_SCAN_INDEX,
+  RTLAB_SET_OVERSAMPLE,
+  RTLAB_SET_OVERSAMPLE_ALL,
+  RTLAB_SET_CIC_ORDER,
+  RTLAB_BATCH
+} rtlab_user_cmd;
+
+/* The most commands in one RTLAB_BATCH.  The control fifo holds one full
+   batch plus its RTLAB_BATCH header.  Bigger batches go over in pieces
+   (see RTLabKernelNotifier::commitBatch()), so this needn't grow with 
+   SHD_MAX_CHANNELS. */
+#define RTLAB_MAX_BATCH 1023
+
+#define RTFIFO_BEGIN (0xfade)
+#define RTFIFO_END   (0xedaf)
+
+#define RTFIFO_CMD_INIT \
+{ \
+  struct_version : SHD_SHM_STRUCT_VERSION, \
+  cmd_begin : RTFIFO_BEGIN, \
+  cmd_end : RTFIFO_END \
+}
+
+#define RTFIFO_CMD_CLR(x) \
+do { \
+  x->struct_version = SHD_SHM_STRUCT_VERSION;\
+  x->cmd_begin = RTFIFO_BEGIN; \
+  x->cmd_end = RTFIFO_END; \
+} while(0)
+
+
+struct rtfifo_cmd {
+#ifdef __cplusplus
+  rtfifo_cmd() { RTFIFO_CMD_CLR(this); }
+#endif
+  int cmd_begin;
+  int struct_version; /**< Always equals SHD_SHM_STRUCT_VERSION */
+
+  rtlab_user_cmd command;
+  unsigned int chan; /**< Not used for every command */
+  union {
+    unsigned int gain; /**< for RTLAB_SET_GAIN* */
+    unsigned int aref; /**< for RTLAB_SET_AREF* */
+    SpikePolarity polarity; /**< for RTLAB_SET_SPIKE_POLARITY */
+    char enabled;  /**< for RTLAB_SET_CHAN and RTLAB_SET_SPIKE */
+    unsigned int blanking; /**< for RTLAB_SET_SPIKE_BLANKING */
+    struct {
+      double volts;
+      int microvolts; /* rounded, for a fixed point rtlab.o */
+    } threshold; /**< for RTLAB_SET_SPIKE_THRESHOLD* */
+    scan_index_t    scan_index; /**< for RTLAB_SET_SCAN_INDEX */
+    int pid; /**< for RTLAB_SET_ATTACHED_PID */
+    sampling_rate_t sampling_rate_hz; /**< for RTLAB_SET_SAMPLING_RATE */
+    unsigned int oversample; /**< for RTLAB_SET_OVERSAMPLE* */
+    unsigned int cic_order; /**< for RTLAB_SET_CIC_ORDER */
+    unsigned int seq; /**< for RTLAB_BATCH, echoed back in the reply */
+
+  } u;
+  int cmd_end;
+};
+
+/* per-command status in an rtfifo_batch_reply */
+typedef enum {
+  RTLAB_CMD_OK = 0,     /**< applied */
+  RTLAB_CMD_BADCHAN,    /**< channel out of range */
+  RTLAB_CMD_BADCMD,     /**< unknown, unimplemented or mangled command */
+  RTLAB_CMD_NOT_APPLIED /**< fine, but something else in the batch wasn't */
+} rtlab_cmd_status;
+
+struct rtfifo_batch_reply {
+  int cmd_begin;          /**< RTFIFO_BEGIN */
+  unsigned int seq;       /**< u.seq of the RTLAB_BATCH command */
+  unsigned int n_cmds;    /**< how many entries of status[] follow */
+  unsigned int n_failed;  /**< 0 if the whole batch was applied */
+  int cmd_end;            /**< RTFIFO_END */
+  /** one rtlab_cmd_status per command, only n_cmds of these are sent */
+  unsigned char status[RTLAB_MAX_BATCH];
+};
+
+/* what actually goes over the reply fifo for a batch of n */
+#define RTFIFO_BATCH_REPLY_BYTES(n) \
+  ((unsigned long)&((struct rtfifo_batch_reply *)0)->status + (n))
+
+/*
+  The command mailbox.  Userland (the one producer) puts rtfifo_cmds in
+  cmds[] and bumps head; rtlab.o (the one consumer) picks them up from
+  its RT loop, writes each one's rtlab_cmd_status to status[], and bumps
+  done.  A command's sequence number is the value head had when it was
+  put in, and it lives at cmds[seq % CMD_RING_SLOTS] -- it is finished
+  once done has gone past seq.  Batches work like on the fifo: an 
+  RTLAB_BATCH command with the count in chan, then the commands, with 
+  done only moving past the batch once all of it has been dealt with.  
+  The RTLAB_BATCH command's own status is RTLAB_CMD_OK if the batch was 
+  applied.
+
+  Slots are only reused once done has passed them (not merely once 
+  rtlab.o has read them), so there's always room for the statuses of a 
+  whole batch.  There's one producer at a time: userland processes take
+  lock for as long as it takes to put their commands in and get the 
+  statuses back.
+*/
+#define CMD_RING_SLOTS (RTLAB_MAX_BATCH + 1) /* a power of 2 */
+
+struct CmdRing {
+  volatile unsigned int head;    /* written by userland only              */
+  volatile unsigned int done;    /* written by rtlab.o only -- userland 
+                                    may futex-wait on this               */
+  volatile unsigned int waiters; /* nonzero if userland is asleep on done,
+                                    so rtlab.o knows to wake it          */
+  volatile int lock;             /* userland only: pid of the process 
+                                    talking to rtlab.o right now, as 
+                                    there can be more than one of them   */
+  volatile unsigned char status[CMD_RING_SLOTS];
+  struct rtfifo_cmd cmds[CMD_RING_SLOTS];
+};
+
 /*
   SharedMemStruct
   ---------------
@@ -79,9 +361,6 @@ typedef struct SpikeParams SpikeParams;
   for configuration-related communication from the non-real-time
   process to the real-time task.
 */
-# define SHARED_MEM_NAME "DAQ System SHM" /* text ID for mbuff               */
-# define SHD_SHM_STRUCT_VERSION 66        /* test this against the below 
-                                             struct_version member           */
 struct SharedMemStruct {
 #ifdef __cplusplus
 /* prevent compiler errors due to consts below */
@@ -138,10 +417,12 @@ struct SharedMemStruct {
   int ai_fifo_minor;              /* the /dev/rtfX where ai sampls go        */
   int ao_fifo_minor;              /* (currently unused)                      */
   int control_fifo;               /* The RT-FIFO rtlab.o listens on
-                                     for control commands..
-                                     (unimplemented)                         */
-  int reply_fifo;                 /* Reply FIFO from rtlab.o to user         */
-  unsigned int n_ai_chans;        /* the number of channels in subdev        */
+                                     for control commands, -1 unless 
+                                     loaded with cmd_fifos=1 (see 
+                                     cmd_ring)                               */
+  int reply_fifo;                 /* Reply FIFO from rtlab.o to user, ditto  */
+  unsigned int n_ai_chans;        /* the number of channels, over all the
+                                     ai boards                               */
   unsigned int n_ao_chans;        /* ditto                                   */
   volatile  unsigned int jitter_ns;/* Jitter of rt-task in nanos             */
   unsigned int ai_fifo_sz_blocks; /* The size of the RT-Queue in terms
@@ -150,6 +431,21 @@ struct SharedMemStruct {
   unsigned int ao_fifo_sz_blocks; /* The size of the RT-Queue in terms
                                      of SS_RT_QUEUE_BLOCK_SZ_BYTES 
                                      units                                   */
+  unsigned int ai_ring_slots;     /* If nonzero, ai samples go to the 
+                                     shared memory SampleRing named 
+                                     SAMPLE_RING_NAME (of this many slots)
+                                     instead of to ai_fifo_minor.  See 
+                                     sample_ring.h                           */
+  unsigned int ao_ring_slots;     /* If nonzero, there is an AORing named
+                                     AO_RING_NAME of this many scans for 
+                                     streaming analog output.  See 
+                                     ao_ring.h                               */
+  unsigned int ao_ring_stride;    /* ..and this many codes per scan          */
+  volatile  unsigned int ai_fifo_scans_dropped; /* Whole scans that didn't
+                                                   fit in ai_fifo_minor and 
+                                                   were thrown away.  A scan
+                                                   is never partially 
+                                                   written.                 */
 
   /* Keep track of real wall clock time as scan_index is not monotonically
      increasing (due to the fact that sampling rate can change)              */
@@ -158,6 +454,38 @@ struct SharedMemStruct {
                                       number of milliseconds since rtlab.o
                                       was loaded. */
   uint64 time_us;                  /* Just like above, except in micros      */
+
+  RTLoopStats rt_stats;            /* RT loop timing, see above             */
+
+  struct CmdRing cmd_ring;         /* Commands from userland, see above.  
+                                      Replaces control_fifo/reply_fifo, 
+                                      which only exist now if rtlab.o was
+                                      loaded with cmd_fifos=1             */
+
+  unsigned int n_ai_boards;        /* see AIBoardInfo above, at least 1    */
+  AIBoardInfo ai_boards[SHD_MAX_AI_BOARDS];
+
+  unsigned int scans_per_tick;     /* how many scans rtlab.o's RT loop does
+                                      per tick: 1, unless it is in burst 
+                                      mode (see its burst_ns param)       */
+
+  /* Oversampling: each channel is converted ai_oversample[chan] times per
+     scan (up to AI_MAX_OVERSAMPLE, 0 and 1 both mean off), and rtlab.o 
+     filters those down to the one sample that goes out for the scan.  
+     ai_cic_order is the filter for all of them, 1 (or 0, the boxcar 
+     average) to AI_MAX_CIC_ORDER.  See ai_decimate.h.  The sampling rate, 
+     and so what userland gets, stays the same -- it's the board that 
+     works harder.
+     Only rtlab.o oversamples; for other sources these stay at 1.         */
+  unsigned char ai_oversample[SHD_MAX_CHANNELS];
+  unsigned int ai_cic_order;
+
+  /* Nonzero if rtlab.o was built with RTLAB_FIXED_POINT: its RT loop 
+     then never touches the FPU, and the SampleStructs it puts out only 
+     have the raw ADC codes (.code, .code_gain, .range) and 
+     .spike_period_fx filled in, not .data and .spike_period.  Userland 
+     converts those (see codes_source.h).                                */
+  unsigned int ai_fixed_point;
 };
 #ifndef __cplusplus
 typedef struct SharedMemStruct SharedMemStruct;
@@ -193,7 +521,26 @@ _set_bit (unsigned int bit, volatile char *bits, int onoroff)
 static inline 
 int
 is_chan_on (unsigned int chan, volatile const char array[CHAN_MASK_SIZE])
-{ return (chan > SHD_MAX_CHANNELS ? 0 : _test_bit(chan, array) ); }
+{ return (chan >= SHD_MAX_CHANNELS ? 0 : _test_bit(chan, array) ); }
+
+/* The first channel at or after chan that is on in mask, or n_chans if 
+   there are none.  Skips empty bytes whole, so walking a mask with
+
+     for (c = next_chan_on(0, m, n); c < n; c = next_chan_on(c + 1, m, n))
+
+   costs about the number of channels that are on, not n. */
+static inline
+unsigned int
+next_chan_on (unsigned int chan, volatile const char *mask, 
+              unsigned int n_chans)
+{
+  while (chan < n_chans) {
+    if (!(chan & 7) && !mask[chan >> 3]) chan += 8;
+    else if (_test_bit(chan, mask)) return chan;
+    else chan++;
+  }
+  return n_chans;
+}
 
 static inline 
 void
@@ -214,16 +561,21 @@ init_spike_params (SpikeParams *p)
   for (i = 0; i < SHD_MAX_CHANNELS; i++) {
     p->blanking[i] = DEFAULT_SPIKE_BLANKING;
     p->threshold[i] = 0.0;
+    p->threshold_uv[i] = 0;
   }
 }
 
 #ifdef __KERNEL__
 /* For round, et al */
 #include "kmath.h"
+#else
+#include <math.h>
 #endif
 
 /** This enforces sampling rates to be 'millisecond friendly' numbers  --
-    numbers that are factors of 1000 or are multiples of 1000 */
+    numbers that are factors of 1000 or are multiples of 1000.  Rounds in
+    integer arithmetic, since rtlab.o's RT task calls it too and may have
+    no FPU (see RTLAB_FIXED_POINT in rt_process.c). */
 static inline sampling_rate_t normalizeSamplingRate(sampling_rate_t rate)
 { 
   sampling_rate_t ret = INITIAL_SAMPLING_RATE_HZ;
@@ -233,10 +585,10 @@ static inline sampling_rate_t normalizeSamplingRate(sampling_rate_t rate)
   if (rate > MAX_SAMPLING_RATE_HZ ) ret = MAX_SAMPLING_RATE_HZ;
   else if (rate < MIN_SAMPLING_RATE_HZ ) ret = MIN_SAMPLING_RATE_HZ;
 
-  if (rate > 1000 && (multiple = static_cast<int>(round(rate / 1000.0)))) { 
+  if (rate > 1000 && (multiple = (rate + 500) / 1000)) { 
     /* rate > 1000 */
     ret = multiple * 1000;
-  } else if (rate && (multiple = static_cast<int>(round(1000.0 / rate))) ) { 
+  } else if (rate && (multiple = (2000 + rate) / (2 * rate)) ) { 
     /* rate < 1000 */
     ret = 1000 / multiple;
   }
@@ -256,24 +608,39 @@ static inline sampling_rate_t normalizeSamplingRate(sampling_rate_t rate)
    1 of the below structs, and so on.
 
 
-   channel_id - the channel that this sample corresponds to
+   channel_id - the channel that this sample corresponds to (16 bits, so
+                anything up to SHD_MAX_CHANNELS fits)
    scan_index - this counter keeps going up as rt_process runs, +1 for each
                 scan it does
    data -       an element of lsample_t which contains the sample obtained 
                 from one particular channel at one particular time.
+   code, code_gain, range - the same sample as it came off the board: the
+                ADC code, times code_gain if the channel is oversampled 
+                (see ai_decimate.h), and the comedi range it was taken in.
+                Only rtlab.o fills these in.
+   spike_period_fx - spike_period, in scans, as a 24.8 fixed point 
+                number (SPIKE_PERIOD_FX_ONE per scan), so it goes up to 
+                2^24 scans -- almost 3 minutes at 100 kHz -- and sticks
+                at 0xffffffff past that.  Only a fixed point rtlab.o (see
+                ai_fixed_point in SharedMemStruct) fills this in.
    magic_number - sanity check on this should always be equal to
                   SAMPLE_STRUCT_MAGIC
 */
-#define SAMPLE_STRUCT_MAGIC ((int)0xbeeff00d)
+#define SAMPLE_STRUCT_MAGIC ((int)0xbeeff00e)
+#define SPIKE_PERIOD_FX_ONE 256 /* spike_period_fx's units per scan */
 struct SampleStruct {  
 #ifdef __cplusplus
   SampleStruct() : magic_number(SAMPLE_STRUCT_MAGIC) {};
 #endif
-  uint8 channel_id;
+  uint16 channel_id;
   scan_index_t scan_index;
   double data;         /* the actual sample, in volts */
   uint8 spike; /* if nonzero, there is a spike this scan */
+  uint8 range;
+  uint16 code_gain;
+  uint32 code;
   double spike_period; /* in milliseconds */
+  uint32 spike_period_fx; /* in 1/256ths of a scan */
   int magic_number;    /*if this is wrong userland can throw out this 'sample'
                          this might not be necessary, since kernel will always 
                          do complete writes and userland should
@@ -30,6 +30,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <errno.h>
+#include <iostream>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -239,6 +241,53 @@ ShmController::detach (const SharedMemStruct *shm, ShmType t)
   }
 }
 
+/* static */
+void *
+ShmController::attachRegion(ShmType t, const char *name, size_t size)
+{
+  void *addr = 0;
+  int shmid = 0;
+
+  switch (t) {
+  case MBuff:
+    addr = mbuff_attach(name, size);
+    break;
+  case RTAI_Shm:
+    addr = rtai_shm_attach(name, size);
+    break;
+  case IPC:
+    /* same naming scheme as attach() uses for the SharedMemStruct */
+    for (uint i = 0; i < strlen(name); i++) shmid += name[i];
+    addr = shmat(shmid, 0, 0);
+    if (addr == reinterpret_cast<void *>(-1)) addr = 0;
+    break;
+  default:
+    break;
+  }
+  return addr;
+}
+
+/* static */
+void
+ShmController::detachRegion(ShmType t, const char *name, void *addr)
+{
+  if (!addr) return;
+
+  switch (t) {
+  case MBuff:
+    mbuff_detach(name, addr);
+    break;
+  case RTAI_Shm:
+    rtai_shm_detach(name, addr); 
+    break;
+  case IPC:
+    shmdt(addr);
+    break;
+  default:
+    break;
+  }
+}
+
 /* static */
 bool /* mbuff file exists and is readable */
 ShmController::mbuffDevFileIsValid() 
@@ -302,7 +351,8 @@ bool ShmController::haveRTLabDotO()
 ShmControllerWithFifo::ShmControllerWithFifo()
   : rtlab(0)
 {
-  rtlab = new RTLabKernelNotifier(shm->control_fifo, shm->reply_fifo);
+  /* the mailbox is the one part of the shm userland writes to */
+  rtlab = new RTLabKernelNotifier(const_cast<SharedMemStruct *>(shm));
   /* tell rtlab.o who we are? */
   rtlab->setAttachedPid(getpid());
 }
@@ -341,12 +391,29 @@ void ShmControllerWithFifo::setChannelAREF(int subdevtype, uint chan, uint a)
   rtlab->setAREF(chan, a);
 }
 
+void ShmControllerWithFifo::setOversample(uint chan, uint factor)
+{
+  rtlab->setOversample(chan, factor);
+}
+
+void ShmControllerWithFifo::setOversampleAll(uint factor)
+{
+  rtlab->setAllOversamples(factor);
+}
+
+void ShmControllerWithFifo::setCICOrder(uint order)
+{
+  rtlab->setCICOrder(order);
+}
+
 void ShmControllerWithFifo::clearSpikeSettings()
 {
+  rtlab->beginBatch();
   rtlab->setAllSpikes(false);
   rtlab->setAllSpikePolarities(Negative);
   rtlab->setAllSpikeBlankings(DEFAULT_SPIKE_BLANKING);
   rtlab->setAllSpikeThresholds(0.0);
+  rtlab->commitBatch();
 }
 
 void ShmControllerWithFifo::setSpikePolarity(uint chan, SpikePolarity p) 
@@ -374,3 +441,94 @@ uint ShmControllerWithFifo::setSamplingRateHz(uint rate)
 {
   return rtlab->setSamplingRate(rate);
 }
+
+void ShmControllerWithFifo::beginBatch()
+{
+  rtlab->beginBatch();
+}
+
+void ShmControllerWithFifo::commitBatch()
+{
+  /* like the rest of the setters, errors are swallowed here, but do
+     complain about the ones rtlab.o rejected */
+  vector<int> status;
+  if (rtlab->commitBatch(&status) == EINVAL)
+    for (uint i = 0; i < status.size(); i++)
+      if (status[i] != RTLAB_CMD_OK && status[i] != RTLAB_CMD_NOT_APPLIED)
+        cerr << "Command " << i << " of a batch was rejected by " RTO 
+             << " (status " << status[i] << "), so none of it was applied" 
+             << endl;
+}
+
+
+ShmControllerLocal::ShmControllerLocal(SharedMemStruct *s)
+  : ShmController(s), local(s)
+{}
+
+ShmControllerLocal::~ShmControllerLocal() {}
+
+void ShmControllerLocal::setChannel(int t, uint chan, bool onoroff)
+{
+  if (chan >= numChannels(t)) return;
+  set_chan(chan, 
+           (t == COMEDI_SUBD_AO ? local->ao_chans_in_use 
+                                : local->ai_chans_in_use), 
+           onoroff);
+}
+
+void ShmControllerLocal::setChannelRange(int subdevtype, uint chan, uint r)
+{
+  if (chan >= numChannels(subdevtype)) return;
+  volatile uint *c = chans(subdevtype);
+  c[chan] = CR_PACK(chan, r, CR_AREF(c[chan]));
+}
+
+void ShmControllerLocal::setChannelAREF(int subdevtype, uint chan, uint a)
+{
+  if (chan >= numChannels(subdevtype)) return;
+  volatile uint *c = chans(subdevtype);
+  c[chan] = CR_PACK(chan, CR_RANGE(c[chan]), a);
+}
+
+void 
+ShmControllerLocal::setAREFAll(int s, uint a)
+{
+  for (uint i = 0; i < numChannels(s); i++) setChannelAREF(s, i, a);
+}
+
+void ShmControllerLocal::clearSpikeSettings()
+{
+  init_spike_params(&local->spike_params);
+}
+
+void ShmControllerLocal::setSpikePolarity(uint chan, SpikePolarity p) 
+{
+  if (chan < SHD_MAX_CHANNELS)
+    _set_bit(chan, local->spike_params.polarity_mask, p);
+}
+
+void ShmControllerLocal::setSpikeEnabled(uint chan, bool onoroff)
+{
+  if (chan < SHD_MAX_CHANNELS)
+    _set_bit(chan, local->spike_params.enabled_mask, onoroff);
+}
+
+void ShmControllerLocal::setSpikeThreshold(uint chan, double d)
+{
+  if (chan >= SHD_MAX_CHANNELS) return;
+  local->spike_params.threshold[chan] = d;
+  local->spike_params.threshold_uv[chan] = int(round(d * 1e6));
+}
+
+void ShmControllerLocal::setSpikeBlanking(uint chan, uint msec)
+{
+  if (chan < SHD_MAX_CHANNELS) local->spike_params.blanking[chan] = msec;
+}
+
+uint ShmControllerLocal::setSamplingRateHz(uint rate)
+{
+  rate = normalizeSamplingRate(rate);
+  local->sampling_rate_hz = rate;
+  local->nanos_per_scan = BILLION / rate;
+  return rate;
+}
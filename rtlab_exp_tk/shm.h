@@ -54,6 +54,15 @@ class ShmController
   static const SharedMemStruct *attach(ShmType t = MBuff);
   static void detach(const SharedMemStruct *, ShmType t = MBuff);
 
+  /* Attach to/detach from some other named region exported by rtlab.o 
+     (such as the AI sample ring) using the same mechanism t as the 
+     SharedMemStruct.  attachRegion() returns NULL on failure. */
+  static void *attachRegion(ShmType t, const char *name, size_t size);
+  static void detachRegion(ShmType t, const char *name, void *addr);
+
+  /* how we are attached -- NotSharedOrUnknown if we were handed the shm */
+  ShmType type() const { return shmType; }
+
   /* GETTERS */
 
   /* channel-specific stuff--basically wrappers to CR_PACK */
@@ -82,6 +91,27 @@ class ShmController
   uint samplingRateHz() const;
   scan_index_t scanIndex() const;  
   uint aiFifoMinor() const; /* not meaningful in all contexts */
+  uint aiRingSlots() const; /* size of the AI sample ring, 0 if none */
+  uint aoRingSlots() const; /* size of the AO playback ring, 0 if none */
+  uint aoRingStride() const; /* codes per scan in the AO playback ring */
+  int  aoMinor() const;  /* /dev/comediX rtlab.o does analog output on */
+  int  aoSubdev() const; /* ..and its AO subdevice */
+  uint aiFifoScansDropped() const; /* scans thrown away on a full ai fifo */
+  uint numAIBoards() const; /* boards rtlab.o aggregates into one AI scan */
+  /* conversions per scan of an AI channel, 1 if it isn't oversampled, and
+     the order of the filter that decimates them (1 is the boxcar), see 
+     ai_decimate.h */
+  uint channelOversample(uint chan) const;
+  uint cicOrder() const;
+  /* true for a fixed point rtlab.o, whose samples are ADC codes that need
+     converting (see codes_source.h) */
+  bool aiFixedPoint() const;
+  /* board i's slice of the AI channel space, its clock and measured skew.
+     Live, like rtLoopStats() */
+  const AIBoardInfo & aiBoard(uint i) const { return shm->ai_boards[i]; }
+  /* rtlab.o's RT loop timing, all zeroes for sources that aren't rtlab.o.
+     Live -- copy it if you want a snapshot, see rtLoopReport() */
+  const RTLoopStats & rtLoopStats() const { return shm->rt_stats; }
 
   /* SETTERS */
 
@@ -100,6 +130,13 @@ class ShmController
   virtual void setAREFAll(ComediSubDevice::SubdevType s, uint aref);
   virtual void setAREFAll(int subdevtype, uint aref) = 0;
 
+  /* AI oversampling.  Only rtlab.o does it, so these do nothing 
+     otherwise and the channels stay at 1 */
+  virtual void setOversample(uint chan, uint factor) 
+    { (void)chan; (void)factor; }
+  virtual void setOversampleAll(uint factor) { (void)factor; }
+  virtual void setCICOrder(uint order) { (void)order; }
+
   /* Spikes.. */
   virtual void clearSpikeSettings() = 0;
   virtual void setSpikePolarity(uint chan, SpikePolarity polarity) = 0;
@@ -110,6 +147,13 @@ class ShmController
   /* Dangerous if misused in realtime version of RTLab... */
   virtual uint setSamplingRateHz(uint) = 0;
 
+  /* Setters called between these two may be held back and then all take
+     effect at once, in the same scan, at commitBatch().  Use this when
+     setting up lots of channels.  They nest.  Nothing to do unless 
+     there's an rtlab.o at the other end. */
+  virtual void beginBatch() {}
+  virtual void commitBatch() {}
+
 
  protected:
  
@@ -162,6 +206,10 @@ class ShmControllerWithFifo : public ShmController
   void setChannelAREF(int subdevtype, uint chan, uint aref);
   void setAREFAll(int subdevtype, uint aref);
 
+  void setOversample(uint chan, uint factor);
+  void setOversampleAll(uint factor);
+  void setCICOrder(uint order);
+
   /* Spikes.. */
   void clearSpikeSettings();
   void setSpikePolarity(uint chan, SpikePolarity polarity);
@@ -172,6 +220,9 @@ class ShmControllerWithFifo : public ShmController
   // try and set the rate to new_rate and return the new rate 
   uint setSamplingRateHz(uint new_rate);
 
+  void beginBatch();
+  void commitBatch();
+
  private:
 
   uint controlFifo() const; /* minor of the control fifo */
@@ -179,6 +230,45 @@ class ShmControllerWithFifo : public ShmController
   RTLabKernelNotifier *rtlab;
 };
 
+/* 
+   A ShmController for a SharedMemStruct that lives in our own address 
+   space, such as the one owned by a SampleStructComediSource.  There is no
+   rtlab.o to talk to, so the setters just poke the struct directly and 
+   whoever owns the struct picks up the changes on its next read().
+
+   The struct is not detached (or freed) upon destruction.
+*/
+class ShmControllerLocal : public ShmController
+{
+ public:
+  ShmControllerLocal(SharedMemStruct *s);
+  ~ShmControllerLocal();
+
+  /* SETTERS */
+
+  void setChannel (int t, uint chan, bool onoroff);  
+  void setChannelRange(int subdevtype, uint chan, uint r);
+  
+  void setChannelAREF(int subdevtype, uint chan, uint aref);
+  void setAREFAll(int subdevtype, uint aref);
+
+  /* Spikes.. */
+  void clearSpikeSettings();
+  void setSpikePolarity(uint chan, SpikePolarity polarity);
+  void setSpikeEnabled(uint chan, bool onoroff);
+  void setSpikeThreshold(uint chan, double threshold);  
+  void setSpikeBlanking(uint chan, uint milliseconds);
+
+  // normalizes the rate, sets it, and returns the new rate 
+  uint setSamplingRateHz(uint new_rate);
+
+ private:
+  volatile uint *chans(int subdevtype) 
+    { return subdevtype == COMEDI_SUBD_AO ? local->ao_chan : local->ai_chan; }
+
+  SharedMemStruct *local; /* non-const alias of shm */
+};
+
 inline
 volatile const uint *
 ShmController::chanArray(int subdevtype) 
@@ -336,6 +426,76 @@ ShmController::aiFifoMinor() const
   return shm->ai_fifo_minor; 
 }
 
+inline 
+uint 
+ShmController::aiRingSlots() const
+{ 
+  return shm->ai_ring_slots; 
+}
+
+inline 
+uint 
+ShmController::aoRingSlots() const
+{ 
+  return shm->ao_ring_slots; 
+}
+
+inline 
+uint 
+ShmController::aoRingStride() const
+{ 
+  return shm->ao_ring_stride; 
+}
+
+inline 
+int
+ShmController::aoMinor() const
+{ 
+  return shm->ao_minor; 
+}
+
+inline 
+uint
+ShmController::numAIBoards() const
+{ 
+  return shm->n_ai_boards; 
+}
+
+inline 
+int
+ShmController::aoSubdev() const
+{ 
+  return shm->ao_subdev; 
+}
+
+inline 
+uint 
+ShmController::aiFifoScansDropped() const
+{ 
+  return shm->ai_fifo_scans_dropped; 
+}
+
+inline 
+uint 
+ShmController::channelOversample(uint chan) const
+{ 
+  return shm->ai_oversample[chan] > 1 ? shm->ai_oversample[chan] : 1; 
+}
+
+inline 
+uint 
+ShmController::cicOrder() const
+{ 
+  return shm->ai_cic_order > 1 ? shm->ai_cic_order : 1; 
+}
+
+inline 
+bool 
+ShmController::aiFixedPoint() const
+{ 
+  return shm->ai_fixed_point != 0; 
+}
+
 inline
 uint 
 ShmControllerWithFifo::controlFifo() const /* minor of the control fifo */
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <string>
+#include "exception.h"
+#include "sample_source.h"
+#include "comedi_source.h"
+#include "synth_source.h"
+#include "ring_source.h"
+#include "codes_source.h"
+#include "sample_writer.h"
+#include "shm.h"
+#include "source_factory.h"
+
+SampleStructSource *
+buildSampleSource(const DAQSettings & settings, const ComediDevice & dev,
+                  ShmController * & shmCtl)
+{
+  SampleStructSource *source = 0;
+  const ComediSubDevice & ai = dev.find(ComediSubDevice::AnalogInput);
+  
+  shmCtl = 0;
+
+  switch (settings.getInputSource()) {
+  
+  case DAQSettings::RTProcess:
+    shmCtl = new ShmControllerWithFifo(); /* auto-probe a shm_type */
+
+    /* prefer the shared memory ring, but older (or ai_ring=0) rtlab.o's 
+       only have the fifo */
+    if (shmCtl->aiRingSlots())
+      source = new SampleStructRingSource(shmCtl->type(), 
+                                          shmCtl->aiRingSlots());
+    else
+      source = new SampleStructFIFOSource(string("/dev/rtf") + shmCtl->aiFifoMinor());
+
+    /* a fixed point rtlab.o leaves the conversion to volts to us */
+    if (shmCtl->aiFixedPoint())
+      source = new SampleStructCodesSource(source, *shmCtl);
+    break;
+  case DAQSettings::Comedi:
+    {
+      /* no rtlab.o -- talk to the board directly via comedi commands */
+      SampleStructComediSource *cs = new SampleStructComediSource(dev);
+      source = cs;
+      shmCtl = new ShmControllerLocal(cs->shm());
+    }
+    break;
+  case DAQSettings::Synthetic:
+    {
+      /* fake data, for testing without a board */
+      SampleStructSynthSource *ss = 
+        new SampleStructSynthSource(settings.getSyntheticSourceSpec(),
+                                    (ai.isNull() || ai.n_channels <= 0 
+                                     ? SHD_MAX_CHANNELS : ai.n_channels));
+      source = ss;
+      shmCtl = new ShmControllerLocal(ss->shm());
+    }
+    break;
+  default:
+    throw UnimplementedException 
+      ("Unimplemented feature",
+       "The use of file input sources is not yet implemented!\n"
+       "Either insmod rtlab.o, use the comedi input source, or give up "
+       "for now... (Sorry!)");
+    break;
+  }
+
+  return source;
+}
+
+SampleWriter *
+buildSampleWriter(const DAQSettings & settings, sampling_rate_t rate, 
+                  const char *filename)
+{
+  SampleWriter *writer = 0;
+
+  if (!filename) filename = settings.getDataFile().latin1();
+
+  switch(settings.getDataFileFormat()) {
+  case DAQSettings::Binary:
+    writer = new SampleBinWriter(rate, filename);
+    break;
+  case DAQSettings::Ascii:
+    writer = new SampleGZWriter(rate, filename);
+    break;
+  default:
+    throw UnimplementedException("INTERNAL ERROR", 
+                                 "Unknown data file format specified in "
+                                 "settings");
+    break;
+  }
+
+  return writer;
+}
+
+void
+putAcquisitionMetaData(SampleWriter *writer, const ShmController & shm)
+{
+  QString oversample;
+  uint i, n = shm.numChannels(ComediSubDevice::AnalogInput);
+
+  /* "chan:factor" for just the oversampled channels, the rest are 1 */
+  for (i = 0; i < n; i++)
+    if (shm.channelOversample(i) > 1) 
+      oversample += QString(oversample.isEmpty() ? "%1:%2" : ",%1:%2")
+                    .arg(i).arg(shm.channelOversample(i));
+
+  writer->putMetaData("ai_oversample", 
+                      oversample.isEmpty() ? QString("none") : oversample);
+  writer->putMetaData("ai_decimation", 
+                      shm.cicOrder() > 1 
+                      ? QString("cic%1").arg(shm.cicOrder()) 
+                      : QString("boxcar"));
+}
@@ -0,0 +1,61 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _SOURCE_FACTORY_H
+#define _SOURCE_FACTORY_H
+
+#include "common.h"
+#include "daq_settings.h"
+#include "comedi_device.h"
+
+class SampleStructSource;
+class SampleWriter;
+class ShmController;
+
+/* 
+   Helpers for building the acquisition pipeline from a DAQSettings without
+   dragging in any of the GUI.  Used by DAQSystem's ReaderLoop as well as 
+   the headless recorder (daq_recorder.cpp).
+*/
+
+/* Builds the SampleStructSource for settings.getInputSource(), along with
+   a ShmController that controls it (returned in shmCtl).  The caller owns
+   both, and should delete the source before the controller.
+
+   Throws UnimplementedException for input sources we can't handle yet,
+   plus whatever the source and controller constructors throw. */
+SampleStructSource *buildSampleSource(const DAQSettings & settings,
+                                      const ComediDevice & dev,
+                                      ShmController * & shmCtl);
+
+/* Builds the SampleWriter for settings.getDataFileFormat().  If filename 
+   is NULL, settings.getDataFile() is used. */
+SampleWriter *buildSampleWriter(const DAQSettings & settings, 
+                                sampling_rate_t rate,
+                                const char *filename = 0);
+
+/* Records the acquisition settings that shape the data but aren't in the
+   samples themselves (at present, AI oversampling) as writer's metadata.
+   Call it again whenever they change -- the file keeps the last values. */
+void putAcquisitionMetaData(SampleWriter *writer, const ShmController & shm);
+
+#endif
@@ -0,0 +1,461 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+
+/*
+  Spike Detect dot h
+  ------------------
+  The threshold spike detector.  rtlab.o runs it over every scan in its RT
+  loop, and the userspace sources that talk to a board themselves (see 
+  comedi_source.cpp) run it over the scans they read, so a 'spike' means
+  the same thing no matter where the samples came from.
+
+  All the per-channel state lives in struct spike_info as parallel arrays
+  indexed by channel id, and the per-sample test is straight arithmetic 
+  and selects rather than a tree of ifs on polarity and in_spike state.  
+  The polarity is folded into a sign (+1 or -1) so that 'at or past the 
+  threshold' is just  dir * (x - thold) >= 0  for either polarity.  The 
+  only real branch left is the one taken by the (rare) sample that 
+  starts a spike.
+
+  When a spike starts, the threshold crossing is linearly interpolated 
+  between the channel's previous sample (one scan ago) and this one, so 
+  spike times and spike_period are not rounded to whole scans.  This 
+  matters at low sampling rates: at 1 kHz a beat-to-beat interval is 
+  otherwise only good to +/- 1 ms.  The interpolation fraction is a 16 bit
+  fixed point number so that all of the time arithmetic stays integer and
+  there is no 64 bit division (which the kernel doesn't have).
+
+  spike_detect_scan_codes() is the same detector for the fixed point 
+  rtlab.o (see RTLAB_FIXED_POINT in rt_process.c), which keeps its hands
+  off the FPU: it works on the raw ADC codes and on time in scans, and 
+  leaves the conversion to volts and milliseconds to userland.
+
+  Compile with -DTEST_SPIKE_DETECT (make -f Makefile.sim check) for a 
+  self-checking test of the detector in userspace.
+*/
+#ifndef _SPIKE_DETECT_H
+#define _SPIKE_DETECT_H
+
+#include "shared_stuff.h"
+
+#ifdef __KERNEL__
+#  include <linux/string.h>
+#else
+#  include <string.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct spike_info {
+  /* The last time a spike was encountered in each channel, in nanos.  
+     Userspace can use any time base it likes, as long as it's in nanos */
+  int64 last_spike_time[SHD_MAX_CHANNELS]; /* when spike began 
+                                              (interpolated)            */
+  int64 last_spike_ended_time[SHD_MAX_CHANNELS]; /* when spike ended    */
+  /* Same as SampleStruct.spike_period  */
+  double period[SHD_MAX_CHANNELS]; /* in mlliseconds */
+  /* ..and SampleStruct.spike_period_fx, for spike_detect_scan_codes(), 
+     whose last_spike_time and last_spike_ended_time above are in 
+     1/65536ths of a scan rather than in nanos (the period is in 
+     1/SPIKE_PERIOD_FX_ONEths) */
+  unsigned int period_fx[SHD_MAX_CHANNELS];
+  /* the set of channels that have spikes - for THIS scan */
+  char spikes_this_scan[CHAN_MASK_SIZE];
+
+  /* the rest is the detector's own state, one element per channel */
+  double prev[SHD_MAX_CHANNELS];        /* the channel's previous sample  */
+  double saved_thold[SHD_MAX_CHANNELS]; /* if we are in_spike, the 
+                                           threshold the spike started at */
+  /* spike_detect_scan_codes()'s versions of the above two: codes, times 
+     the sample's code_gain */
+  unsigned int prev_code[SHD_MAX_CHANNELS];
+  int64 saved_thold_code[SHD_MAX_CHANNELS];
+  signed char saved_dir[SHD_MAX_CHANNELS]; /* ..and its polarity, +1 for
+                                              Positive, -1 for Negative  */
+  unsigned char in_spike[SHD_MAX_CHANNELS]; /* 1 in the middle of a spike */
+};
+
+static inline void
+spike_detect_init(struct spike_info *si)
+{
+  register unsigned int i;
+
+  memset(si, 0, sizeof(*si));
+  for (i = 0; i < SHD_MAX_CHANNELS; i++) {
+    si->period[i] = 0xffffffff;
+    si->period_fx[i] = 0xffffffff;
+    si->saved_dir[i] = 1;
+  }
+}
+
+/* How far back from the sample x, in nanos, the threshold was actually 
+   crossed -- somewhere between 0 and one scan.  0 if that can't be told
+   because prev was already at or past the threshold (the first sample 
+   after the blanking period, for instance). */
+static inline unsigned int
+spike_crossing_offset(double prev, double x, double thold, int dir, 
+                      unsigned int ns_per_scan)
+{
+  const double over = dir * (x - thold), rise = dir * (x - prev);
+  unsigned int frac; /* fraction of the scan, 65536 == all of it */
+
+  if (rise <= over) return 0;
+  frac = (unsigned int)(over * 65536.0 / rise);
+  return (unsigned int)(((uint64)ns_per_scan * frac) >> 16);
+}
+
+/* Runs spike detection over the n samples of one scan, setting .spike
+   (and .spike_period on the ones that start a spike) and 
+   si->spikes_this_scan.  The first sample was taken at time t0 (nanos), 
+   and each one after that ns_per_sample later.  ns_per_scan is the time 
+   between scans, for the interpolation.  Returns the number of spikes. */
+static inline unsigned int
+spike_detect_scan(struct spike_info *si, const SpikeParams *p, 
+                  SampleStruct *s, unsigned int n, int64 t0, 
+                  unsigned int ns_per_sample, unsigned int ns_per_scan)
+{
+  register unsigned int i, c;
+  unsigned int n_spikes = 0;
+  int64 t = t0, t_cross;
+  int dir, in, end, hit;
+  double x, thold;
+
+  memset(si->spikes_this_scan, 0, CHAN_MASK_SIZE);
+
+  for (i = 0; i < n; i++, t += ns_per_sample) {
+    c = s[i].channel_id;
+    x = s[i].data;
+    thold = p->threshold[c];
+    dir = (_test_bit(c, p->polarity_mask) << 1) - 1; 
+    in = si->in_spike[c];
+
+    /* a spike ends when the signal comes back to the threshold it started 
+       at, or early if its threshold or polarity got changed under it */
+    end = in & ( (si->saved_dir[c] * (x - si->saved_thold[c]) <= 0.0)
+                 | (si->saved_thold[c] != thold) 
+                 | (si->saved_dir[c] != dir) );
+
+    /* a new one starts if we're not in one, detection is on for this 
+       channel, we're past the blanking period and at/past the threshold */
+    hit = (!in) & _test_bit(c, p->enabled_mask)
+          & (t - si->last_spike_ended_time[c] 
+             >= (int64)p->blanking[c] * MILLION)
+          & (dir * (x - thold) >= 0.0);
+
+    si->last_spike_ended_time[c] = end ? t : si->last_spike_ended_time[c];
+    si->in_spike[c] = (in & !end) | hit;
+    s[i].spike = hit;
+
+    if (hit) {
+      t_cross = 
+        t - spike_crossing_offset(si->prev[c], x, thold, dir, ns_per_scan);
+      s[i].spike_period = si->period[c] = 
+        (t_cross - si->last_spike_time[c]) * ((double)0.000001 /* to ms */);
+      si->last_spike_time[c] = t_cross;
+      /* save the threshold and polarity so we can detect changes while 
+         in_spike */
+      si->saved_thold[c] = thold;
+      si->saved_dir[c] = dir;
+      _set_bit(c, si->spikes_this_scan, 1);
+      n_spikes++;
+    }
+    si->prev[c] = x;
+  }
+
+  return n_spikes;
+}
+
+/* spike_crossing_offset() for spike_detect_scan_codes(), in 1/65536ths 
+   of a scan.  Shifting over and rise down together until rise fits in 16
+   bits keeps the division 32 bit -- over < rise, so the fraction only 
+   loses bits that are below the 16 we want anyway. */
+static inline unsigned int
+spike_crossing_offset_codes(int64 prev, int64 x, int64 thold, int dir)
+{
+  int64 over = dir * (x - thold), rise = dir * (x - prev);
+
+  if (rise <= over) return 0;
+  while (rise >= 0x10000) { over >>= 1; rise >>= 1; }
+  return ((unsigned int)over << 16) / (unsigned int)rise;
+}
+
+/* spike_detect_scan() without floating point.  .code is compared with 
+   thold[chan], each channel's threshold already converted to an ADC code
+   in the range it is in, times the samples' .code_gain.  The scan is 
+   number 'scan' and every sample in it gets that time, and blank[chan] 
+   is the blanking in 1/65536ths of a scan.  Sets .spike_period_fx and 
+   si->period_fx instead of .spike_period and si->period, rounded to 
+   1/SPIKE_PERIOD_FX_ONE scan.  Returns the number of spikes. */
+static inline unsigned int
+spike_detect_scan_codes(struct spike_info *si, const SpikeParams *p, 
+                        SampleStruct *s, unsigned int n, scan_index_t scan,
+                        const int64 *thold, const int64 *blank)
+{
+  register unsigned int i, c;
+  unsigned int n_spikes = 0;
+  const int64 t = (int64)scan << 16;
+  int64 x, t_cross, period;
+  int dir, in, end, hit;
+
+  memset(si->spikes_this_scan, 0, CHAN_MASK_SIZE);
+
+  for (i = 0; i < n; i++) {
+    c = s[i].channel_id;
+    x = s[i].code;
+    dir = (_test_bit(c, p->polarity_mask) << 1) - 1; 
+    in = si->in_spike[c];
+
+    end = in & ( (si->saved_dir[c] * (x - si->saved_thold_code[c]) <= 0)
+                 | (si->saved_thold_code[c] != thold[c]) 
+                 | (si->saved_dir[c] != dir) );
+
+    hit = (!in) & _test_bit(c, p->enabled_mask)
+          & (t - si->last_spike_ended_time[c] >= blank[c])
+          & (dir * (x - thold[c]) >= 0);
+
+    si->last_spike_ended_time[c] = end ? t : si->last_spike_ended_time[c];
+    si->in_spike[c] = (in & !end) | hit;
+    s[i].spike = hit;
+
+    if (hit) {
+      t_cross = 
+        t - spike_crossing_offset_codes(si->prev_code[c], x, thold[c], dir);
+      period = t_cross - si->last_spike_time[c];
+      period = (period + (0x10000 / SPIKE_PERIOD_FX_ONE) / 2) 
+               / (0x10000 / SPIKE_PERIOD_FX_ONE);
+      s[i].spike_period_fx = si->period_fx[c] = 
+        (period < 0xffffffffLL ? (unsigned int)period : 0xffffffff);
+      si->last_spike_time[c] = t_cross;
+      si->saved_thold_code[c] = thold[c];
+      si->saved_dir[c] = dir;
+      _set_bit(c, si->spikes_this_scan, 1);
+      n_spikes++;
+    }
+    si->prev_code[c] = s[i].code;
+  }
+
+  return n_spikes;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef TEST_SPIKE_DETECT
+/*
+  A triangle wave from -1 to 1 whose period is not a whole number of 
+  scans, so the crossings fall between samples.  Linear interpolation is
+  exact on a triangle's legs, so the periods that come out have to match
+  the wave's to within the 1/65536 scan the fraction is good to.
+  Channel 0 is the wave with positive polarity, channel 1 is it upside 
+  down with negative polarity, channel 2 has detection off and channel 3
+  has a blanking period that should skip the next two spikes every time.
+
+  Then the same kind of wave, as 24 bit codes, goes through both 
+  spike_detect_scan() and spike_detect_scan_codes() at 100 Hz to 100 kHz,
+  with periods from a few scans to well past 65536 of them.  They have to
+  find the same spikes, agree on the periods to within a 
+  1/SPIKE_PERIOD_FX_ONE scan, and be near the wave's period.  Last,
+  spike_period_fx has to stick at 0xffffffff past 2^24 scans, not wrap.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define TEST_SCANS 100000
+#define TEST_WAVE_PERIOD 37.3 /* in scans, at 1 kHz so also in ms */
+#define TEST_BLANKING 100     /* ms, so every 3rd spike in channel 3 */
+
+static double test_wave(unsigned int scan)
+{
+  double phase = fmod(scan / TEST_WAVE_PERIOD, 1.0);
+  return phase < 0.5 ? -1.0 + 4.0 * phase : 3.0 - 4.0 * phase;
+}
+
+#define TEST_FULL_SCALE 0xffffff /* a 24 bit board, so that even the 
+                                     longest wave rises every scan */
+#define TEST_THOLD 0xc00000
+
+/* the wave as a code, for a period of period scans */
+static unsigned int test_code(unsigned int scan, double period)
+{
+  double phase = fmod(scan / period, 1.0);
+  return (unsigned int)(TEST_FULL_SCALE * (phase < 0.5 ? 2.0 * phase 
+                                           : 2.0 - 2.0 * phase) + 0.5);
+}
+
+/* float against fixed point, returns the number of periods compared */
+static unsigned int test_fixed_point(unsigned int rate, double period, 
+                                     int *bad)
+{
+  static struct spike_info si_float, si_fixed;
+  static SpikeParams p;
+  const unsigned int ns_per_scan = BILLION / rate;
+  const int64 thold[1] = { TEST_THOLD }, blank[1] = { 0 };
+  const double ms_per_scan = 1000.0 / rate;
+  SampleStruct f, x;
+  unsigned int scan, n = 0, end = (unsigned int)(4 * period) + 1;
+  double ms_fixed;
+
+  memset(&p, 0, sizeof(p));
+  memset(&f, 0, sizeof(f));
+  memset(&x, 0, sizeof(x));
+  _set_bit(0, p.enabled_mask, 1);
+  _set_bit(0, p.polarity_mask, 1);
+  p.threshold[0] = thold[0];
+  x.code_gain = 1;
+  spike_detect_init(&si_float);
+  spike_detect_init(&si_fixed);
+
+  for (scan = 0; scan < end; scan++) {
+    x.code = test_code(scan, period);
+    f.data = x.code;
+    spike_detect_scan(&si_float, &p, &f, 1, (int64)scan * ns_per_scan, 
+                      0, ns_per_scan);
+    spike_detect_scan_codes(&si_fixed, &p, &x, 1, scan, thold, blank);
+    if (f.spike != x.spike) {
+      printf("%u Hz, period %g: scan %u spike %d float, %d fixed\n",
+             rate, period, scan, f.spike, x.spike);
+      ++*bad;
+    }
+    if (!x.spike || !n++) continue; /* the first one means nothing */
+
+    ms_fixed = x.spike_period_fx * ms_per_scan / SPIKE_PERIOD_FX_ONE;
+    /* the fixed one's rounding, and a nano per crossing for the float's */
+    if (fabs(ms_fixed - f.spike_period) 
+        > ms_per_scan / SPIKE_PERIOD_FX_ONE + 2e-6
+        /* a short wave's crossings can straddle its peak, where 
+           interpolating isn't exact */
+        || fabs(ms_fixed / ms_per_scan - period) > 0.1) {
+      printf("%u Hz, period %g: %g ms fixed, %g ms float\n",
+             rate, period, ms_fixed, f.spike_period);
+      ++*bad;
+    }
+  }
+  return n - 1;
+}
+
+static void test_period(const char *what, double got, double want, int *bad)
+{
+  if (fabs(got - want) > 1e-4) {
+    printf("%s: spike_period %g, should be %g\n", what, got, want);
+    ++*bad;
+  }
+}
+
+int main(void)
+{
+  static struct spike_info si;
+  static SpikeParams p;
+  SampleStruct s[4];
+  const unsigned int ns_per_scan = MILLION, ns_per_sample = 1000;
+  unsigned int scan, c, n, n_spikes[4] = { 0, 0, 0, 0 };
+  int bad = 0;
+
+  memset(&p, 0, sizeof(p));
+  memset(s, 0, sizeof(s));
+  for (c = 0; c < 4; c++) {
+    _set_bit(c, p.enabled_mask, c != 2);
+    _set_bit(c, p.polarity_mask, c != 1);
+    p.threshold[c] = c == 1 ? -0.5 : 0.5;
+    s[c].channel_id = c;
+  }
+  p.blanking[3] = TEST_BLANKING;
+  spike_detect_init(&si);
+
+  for (scan = 0; scan < TEST_SCANS; scan++) {
+    for (c = 0; c < 4; c++) 
+      s[c].data = c == 1 ? -test_wave(scan) : test_wave(scan);
+    n = spike_detect_scan(&si, &p, s, 4, (int64)scan * ns_per_scan, 
+                          ns_per_sample, ns_per_scan);
+    for (c = 0; c < 4; c++) {
+      if (s[c].spike != _test_bit(c, si.spikes_this_scan)) bad++;
+      if (!s[c].spike) continue;
+      n--;
+      /* the first one's period is from time 0, which means nothing */
+      if (n_spikes[c]++ && c != 3)
+        test_period(c ? "negative polarity" : "positive polarity", 
+                    s[c].spike_period, TEST_WAVE_PERIOD, &bad);
+      else if (n_spikes[c] > 1)
+        test_period("blanking", s[c].spike_period, 3 * TEST_WAVE_PERIOD,
+                    &bad);
+    }
+    if (n) { printf("scan %u: wrong spike count returned\n", scan); bad++; }
+  }
+
+  if (abs((int)n_spikes[0] - (int)(TEST_SCANS / TEST_WAVE_PERIOD)) > 1
+      || n_spikes[1] != n_spikes[0] || n_spikes[2]
+      || abs((int)n_spikes[3] - (int)(n_spikes[0] / 3)) > 1) {
+    printf("spike counts %u %u %u %u are off\n", 
+           n_spikes[0], n_spikes[1], n_spikes[2], n_spikes[3]);
+    bad++;
+  }
+  
+  printf("spike_detect_scan: %u spikes in %u scans, %d problems\n",
+         n_spikes[0] + n_spikes[1] + n_spikes[3], TEST_SCANS, bad);
+
+  {
+    static const unsigned int rates[] = { 100, 1000, 10000, 100000 };
+    static const double periods[] = { 5.3, 977.7, 70000.3, 300001.7 };
+    static struct spike_info si_fixed;
+    const int64 thold[1] = { TEST_THOLD }, blank[1] = { 0 };
+    const scan_index_t long_gaps[] = { (1 << 24) - 100, (1 << 24) + 11 };
+    scan_index_t scan = 10;
+    unsigned int r, i, n = 0;
+    int fixed_bad = 0;
+
+    for (r = 0; r < 4; r++)
+      for (i = 0; i < 4; i++)
+        n += test_fixed_point(rates[r], periods[i], &fixed_bad);
+
+    /* one spike at scan 10, then two more after long gaps */
+    spike_detect_init(&si_fixed);
+    memset(s, 0, sizeof(s));
+    s[0].code_gain = 1;
+    for (i = 0; i < 3; i++) {
+      s[0].code = 0;
+      spike_detect_scan_codes(&si_fixed, &p, s, 1, scan - 1, thold, blank);
+      s[0].code = TEST_FULL_SCALE;
+      spike_detect_scan_codes(&si_fixed, &p, s, 1, scan, thold, blank);
+      if (i && s[0].spike_period_fx 
+               != (i == 1 ? long_gaps[0] * SPIKE_PERIOD_FX_ONE 
+                   : 0xffffffff)) {
+        printf("after %u scans spike_period_fx is %u\n", 
+               (unsigned int)long_gaps[i - 1], s[0].spike_period_fx);
+        fixed_bad++;
+      }
+      if (i < 2) scan += long_gaps[i];
+    }
+
+    printf("spike_detect_scan_codes: %u periods checked against "
+           "spike_detect_scan, %d problems\n", n, fixed_bad);
+    bad += fixed_bad;
+  }
+
+  return bad ? 1 : 0;
+}
+#endif
+
+#endif
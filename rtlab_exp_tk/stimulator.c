@@ -21,53 +21,109 @@
  * http://www.gnu.org.
  */
 #define EXPORT_SYMTAB 1
+#ifdef __KERNEL__
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
-#include <linux/spinlock.h>
-#include <linux/list.h>
+#include <linux/sched.h>  /* schedule_timeout()                          */
 #include <asm/atomic.h>
-#include <asm/bitops.h>
+#include <asm/system.h>   /* xchg(), mb() and friends                    */
 #include <asm/semaphore.h>
+#endif
 #define RTLAB_INTERNAL
 #include "rt_process.h"
 #include "stimulator.h"
 
 #define STIM_MAGIC (0x571801A7) /* Funny way to write STIMULAT */
-#define TRAINS_2_N_CMDS(n) ((n) * 2 + 1)
+#define WAVE_MAGIC (0x3A7EF0A3)
+#define MAX_STIMULATORS 32
+
+/* rtlab_stimulate() trains: an on and an off segment per stim */
+#define TRAIN_2_N_SEGS(n) ((n) * 2)
+
+/*-----------------------------------------------------------------------------
+  How it works
+
+  Each stimulator plays a waveform, which is a precomputed table of AO 
+  sample values, run-length encoded as (value, number of scans) segments.
+  The RT loop calls stim_process() once per tick, which steps every 
+  stimulator along its table by as many scans as the tick covers and only
+  writes to the board when the value changes.  So a train costs the same
+  per tick no matter how long it is, and there's nothing in the rtlab_cmd
+  queue for it at all.
+
+  In burst mode (see burst_ns in rt_process.c) a tick covers several 
+  scans, but the AO writes are still software-timed, so writing every 
+  value the table went through would only bunch them all up at the 
+  start of the tick.  Instead the output is set once per tick, to the 
+  value of the first scan the tick plays, and the table moves on by the
+  whole tick.  So timing stays right on average but edges land on tick 
+  boundaries, and a segment shorter than a tick may not make it to the 
+  output at all.
+
+  Starting, swapping and stopping a waveform is a single xchg() of the 
+  stimulator's 'next' pointer, which the RT loop picks up at the start of
+  the next scan.  The RT loop owns everything else about playback.  
+  Waveforms are refcounted (one ref while pending, one while playing) so 
+  that they can't be freed out from under it.
+
+  rtlab_stimulate() builds its rectangular trains into one of two tables 
+  preallocated per stimulator, so it doesn't allocate and still works 
+  from realtime.
+-----------------------------------------------------------------------------*/
+struct rtlab_stim_segment {
+  lsampl_t value;
+  unsigned int n_scans;
+};
+
+struct rtlab_stim_waveform {
+  int magic;
+  atomic_t refs;
+  struct rtlab_stimulator *owner; /* only plays on the stimulator it was 
+                                     built for (same channel/range)       */
+  char owned;                     /* one of owner->trains[], not user's   */
+  unsigned int range;             /* AO range the values are for          */
+  lsampl_t rest;                  /* written when playback ends/stops     */
+  unsigned int nanos_per_scan;    /* the rate it was built for            */
+  unsigned int n_segs, max_segs;
+  struct rtlab_stim_segment *segs;
+};
+
 struct rtlab_stimulator {
   int magic;
-  struct list_head l;
+  int slot;                       /* index in stims[]                     */
   struct rtlab_comedi_context ctx;
-  struct rtlab_stim_params params;
   rtlab_cmd_callback_t *callback;
   void *callback_arg;
-  struct rtlab_cmd_handle *cmd_h; /* opaque handle to rtlab_cmd.c 
-                                       functionality */
-  struct rtlab_cmd *cmds;
   unsigned int max_train_sz;
-  spinlock_t slock; /* spinlock for this stimulator is this needed? */
+  struct rtlab_stim_waveform trains[2]; /* for rtlab_stimulate()          */
   atomic_t active; /* active flag  -- nonzero iff there is a stim going on 
                       zero if cancelled/stim ended */
-  char was_in_realloc;
+
+  /* play requests, from whoever calls rtlab_stim_play() and friends */
+  struct rtlab_stim_waveform * volatile next;
+  volatile int next_repeats;
+  volatile unsigned int next_delay;
+
+  /* RT loop only */
+  struct rtlab_stim_waveform *cur;
+  unsigned int seg, left, delay;
+  int repeats;
+  lsampl_t last;
+  char wrote_any;
 };
 
-static struct rtlab_stimulator stim_list_head = { 
-  magic:           STIM_MAGIC,
-  l:               LIST_HEAD_INIT(stim_list_head.l),
-  ctx:             EMPTY_CONTEXT,
-  params:          EMPTY_STIM_PARAMS,
-  callback:        0, 
-  callback_arg:    0,
-  cmd_h:           0,
-  cmds:            0,
-  max_train_sz:    0,
-  slock:           SPIN_LOCK_UNLOCKED,
-  active:          ATOMIC_INIT(0),
-  was_in_realloc:  0
+/* rtlab_stim_play(s, 0, 0) puts this in s->next to mean 'stop' */
+static struct rtlab_stim_waveform stop_wave = {
+  magic:     WAVE_MAGIC,
+  refs:      ATOMIC_INIT(1) /* never goes away */
 };
 
-/* stim list might be busy because of non-realtime modifications */
+static struct rtlab_stimulator * volatile stims[MAX_STIMULATORS];
+static volatile unsigned int stim_passes = 0; /* bumped every tick by RT */
+static volatile int rt_running = 0;
+
+/* serializes stims[] changes, non-RT only */
 DECLARE_MUTEX(stim_list_lock);
 
 EXPORT_SYMBOL(rtlab_stimulate);
@@ -76,15 +132,19 @@ EXPORT_SYMBOL(rtlab_stim_alloc);
 EXPORT_SYMBOL(rtlab_stim_free);
 EXPORT_SYMBOL(rtlab_stim_set_context);
 EXPORT_SYMBOL(rtlab_stim_set_callback);
+EXPORT_SYMBOL(rtlab_stim_waveform_build);
+EXPORT_SYMBOL(rtlab_stim_waveform_from_volts);
+EXPORT_SYMBOL(rtlab_stim_waveform_free);
+EXPORT_SYMBOL(rtlab_stim_play);
 EXPORT_SYMBOL(rtlab_default_stimulator);
 
 /* Exported ... */
 struct rtlab_stimulator * rtlab_default_stimulator;
 
-static void stim_reaper(void *);
-static int  stim_create_cmds(struct rtlab_stimulator *);
-static void alloc_cmds(struct rtlab_stimulator *);
-
+static int  queue_play(struct rtlab_stimulator *, struct rtlab_stim_waveform *,
+                       int repeats, unsigned int delay);
+static void stim_process_one(struct rtlab_stimulator *, unsigned int);
+static void sleep_a_tick(void);
 
 int init_stim_engine(void)
 {
@@ -103,245 +163,490 @@ int init_stim_engine(void)
   return 0;
 }
 
-static void alloc_cmds(struct rtlab_stimulator *s)
+void start_stim_engine(void)
 {
-  int err = 0;
-  unsigned int n_cmds = TRAINS_2_N_CMDS(s->max_train_sz);
+  rt_running = 1;
+}
 
-  struct rtlab_cmd *newcmds = 0;
-  
-  newcmds = (struct rtlab_cmd *)
-    kmalloc(sizeof(struct rtlab_cmd) * n_cmds, GFP_KERNEL);
+void stop_stim_engine(void)
+{
+  rt_running = 0;
+}
 
-  if (!newcmds) { 
-    err = ENOMEM; 
-    s->cmds = 0;
-    return;
-  }
+void cleanup_stim_engine(void) 
+{ 
+  int i;
 
-  memset(newcmds, 0, sizeof(struct rtlab_cmd) * n_cmds);
-  
-  s->cmds = newcmds;
+  rt_running = 0; /* just in case */
+  for (i = 0; i < MAX_STIMULATORS; i++)
+    if (stims[i]) rtlab_stim_free(stims[i]);
+  DEFAULT_STIMULATOR = 0;
 }
 
 struct rtlab_stimulator *rtlab_stim_alloc(const struct rtlab_comedi_context *c,
                                           unsigned int max_num_trains)
 {
-  struct rtlab_stimulator *ret = (struct rtlab_stimulator *)
-    kmalloc(sizeof(struct rtlab_stimulator), GFP_KERNEL);
-  struct rtlab_cmd_handle *h = rtlab_cmd_handle_alloc(TRAINS_2_N_CMDS(max_num_trains));
-  
-  if (!ret) return ret;
-  if (!h) { kfree(ret); return 0; }
-
-  /* give defaults from stim_list_head */
-  memcpy(ret, &stim_list_head, sizeof(struct rtlab_stimulator));
-
-  /* allocate cmd list */
-  alloc_cmds(ret);
-  if (!ret->cmds) { rtlab_cmd_handle_free(h); kfree(ret); return 0; }
-
-  ret->cmd_h = h;
+  struct rtlab_stimulator *ret;
+  unsigned int i, n_segs = TRAIN_2_N_SEGS(max_num_trains);
+
+  if (!c || !max_num_trains) return 0;
+
+  if (!(ret = (struct rtlab_stimulator *)
+        kmalloc(sizeof(struct rtlab_stimulator), GFP_KERNEL)))
+    return 0;
+  memset(ret, 0, sizeof(*ret));
+
+  for (i = 0; i < 2; i++) {
+    struct rtlab_stim_waveform *w = &ret->trains[i];
+    w->magic = WAVE_MAGIC;
+    atomic_set(&w->refs, 0);
+    w->owner = ret;
+    w->owned = 1;
+    w->max_segs = n_segs;
+    if (!(w->segs = (struct rtlab_stim_segment *)
+          kmalloc(sizeof(struct rtlab_stim_segment) * n_segs, GFP_KERNEL))) {
+      if (i) kfree(ret->trains[0].segs);
+      kfree(ret);
+      return 0;
+    }
+  }
 
   /* set up this rtlab_stimulator with passed-in values */
   ret->max_train_sz = max_num_trains;
   memcpy(&ret->ctx, c, sizeof(struct rtlab_comedi_context));
+  atomic_set(&ret->active, 0);
+  ret->magic = STIM_MAGIC;
 
   down(&stim_list_lock);
-  list_add(&ret->l, &stim_list_head.l);
+  for (i = 0; i < MAX_STIMULATORS && stims[i]; i++)
+    ;
+  if (i < MAX_STIMULATORS) {
+    ret->slot = i;
+    mb(); /* all of the above before the RT loop can see it */
+    stims[i] = ret;
+  }
   up(&stim_list_lock);
 
+  if (i >= MAX_STIMULATORS) {
+    kfree(ret->trains[0].segs);
+    kfree(ret->trains[1].segs);
+    kfree(ret);
+    return 0;
+  }
+
   return ret;
 }
 
 void rtlab_stim_free(struct rtlab_stimulator *s)
 {
+  unsigned int pass;
+
   if (!s || s->magic != STIM_MAGIC) return;
 
+  /* stop it (putting the output back at rest), then wait for the RT loop 
+     to have done that and to be done with s */
   rtlab_cancel_stim(s);
   down(&stim_list_lock);
-  list_del(&s->l);
+  pass = stim_passes;
+  while (rt_running && stim_passes - pass < 2) sleep_a_tick();
+  stims[s->slot] = 0;
+  mb();
+  pass = stim_passes;
+  while (rt_running && stim_passes - pass < 2) sleep_a_tick();
   up(&stim_list_lock);
 
-  rtlab_cmd_handle_free(s->cmd_h);
-  kfree(s->cmds);
+  /* drop whatever refs s still held, in case there was no RT loop */
+  if (s->cur) atomic_dec(&s->cur->refs);
+  if (s->next) atomic_dec(&s->next->refs);
+
+  kfree(s->trains[0].segs);
+  kfree(s->trains[1].segs);
 
   /* invalidate the memory, then free */
   s->magic = 0;
   kfree(s);
 }
 
-#ifndef list_for_each_safe
- /* list_for_each_safe   -       
-    iterate over a list safe against removal of list entry
-    Stolen from newer linux kernels as older kernels lack this macro
-  * @pos:        the &struct list_head to use as a loop counter.
-  * @n:          another &struct list_head to use as temporary storage
-  * @head:       the head for your list.
-  */
-#define list_for_each_safe(pos, n, head) \
-        for (pos = (head)->next, n = pos->next; pos != (head); \
-                pos = n, n = pos->next)
-#endif
-void cleanup_stim_engine(void) 
-{ 
-  struct list_head *pos, *n;
-  struct rtlab_stimulator *stimulator;
-
+/*-----------------------------------------------------------------------------
+  Building waveforms
+-----------------------------------------------------------------------------*/
 
-  /* delete all the existing stim. params */
-  list_for_each_safe(pos, n, &stim_list_head.l) {
-    stimulator = list_entry(pos, struct rtlab_stimulator, l);
-    rtlab_stim_free(stimulator); /* does implicit list_del() */
+/* appends n scans of value v to w, merging with the last segment if it's
+   the same value.  If w->segs is 0 this just counts segments. */
+static void add_seg(struct rtlab_stim_waveform *w, lsampl_t v, unsigned int n)
+{
+  if (!n) return;
+  if (w->n_segs && w->segs && w->segs[w->n_segs-1].value == v) {
+    w->segs[w->n_segs-1].n_scans += n;
+    return;
+  }
+  if (w->n_segs && !w->segs && w->rest == v) {
+    /* counting pass: w->rest doubles as 'last value' */
+    return;
   }
+  if (w->segs) {
+    if (w->n_segs >= w->max_segs) return; /* can't happen, we counted */
+    w->segs[w->n_segs].value = v;
+    w->segs[w->n_segs].n_scans = n;
+  } else 
+    w->rest = v;
+  w->n_segs++;
+}
+
+/* microseconds to scans at the current sampling rate, rounded, and at 
+   least 1 if us > 0 */
+static unsigned int us_to_scans(int us)
+{
+  unsigned int ns_per_scan = rtp_shm->nanos_per_scan;
+  unsigned long long scans;
 
+  if (us <= 0) return 0;
+  scans = (unsigned long long)us * 1000ULL + ns_per_scan / 2;
+  do_div(scans, ns_per_scan);
+  return scans ? (unsigned int)scans : 1;
 }
 
-/* 
-   reregs stims at the end of a train that have trains left,
-   or reaps zombie stims
-   also responsible for doing callbacks..
-*/
-static void stim_reaper(void *arg)
+/* sets up w->range and w->nanos_per_scan for s, for voltages in 
+   [min_v, max_v], and returns the context to convert volts with */
+static int wave_setup(struct rtlab_stimulator *s, 
+                      struct rtlab_stim_waveform *w, double min_v, 
+                      double max_v, struct rtlab_comedi_context *ctx)
 {
-  struct rtlab_stimulator *stim = (struct rtlab_stimulator *)arg;
-  struct rtlab_stim_params *p;
-
-
-  /* TODO SYNCHRONISATION HERE!!! This HAS A RACE CONDITION
-     WITH NON-REALTIME */
-
-  if (stim->magic != STIM_MAGIC) {
-    rtos_printf(RT_PROCESS_MODULE_NAME": BUG! Illegal stim arg %x.\n", stim);
-  } else if (atomic_read(&stim_list_lock.count) != 1) {
-    /* stim list is busy, so postpone this callback by re-registering it! 
-       note that this breaks realtime, but that is the tradeoff when 
-       the user is installing new stim willy nilly :) */
-    stim->cmds[0].type = RTLAB_CMD_CALLBACK;
-    stim->cmds[0].when_ms = 1;
-    stim->cmds[0].p1.callback = stim_reaper;
-    stim->cmds[0].p2.callback_arg = (void *)stim;
-    rtlab_cmd_register(stim->cmd_h, stim->cmds, 1);
-    return;
-  } else if (atomic_read(&stim->active)) {
-#ifdef DEBUG
-    // DEBUG
-    rtos_printf("stimulator: in stim_reaper().. stim is %x\n", stim);
-#endif
-    p = &stim->params;
+  double probe = max_v;
+  int err;
 
-    if (p->num_trains > 0) p->num_trains--;
+  /* rtlab_find_and_set_best_range() only looks at one voltage, so if we 
+     go negative at all ask for a bipolar range big enough for both ends */
+  if (min_v < 0.0) probe = (-min_v > max_v ? min_v : -max_v);
 
-    /* end of a finite train  ... */
-    if (p->num_trains == 0) {
-      atomic_set(&stim->active, 0);
-      if (stim->callback) stim->callback(stim->callback_arg);
-      goto ret;
-    }
+  memcpy(ctx, &s->ctx, sizeof(*ctx));
+  if ( (err = rtlab_find_and_set_best_range(ctx, probe)) ) return err;
+  w->range = ctx->range;
+  w->nanos_per_scan = rtp_shm->nanos_per_scan;
+  return 0;
+}
 
-    /* end of a continuous train */
-    if (p->num_trains < 0 && stim->callback) {
-#ifdef DEBUG
-      //DEBUG
-      rtos_printf("stimulator: stim_reaper: about to do continuous callback with %x %x..\n", stim->callback, stim->callback_arg);
-#endif
-      stim->callback(stim->callback_arg);    
+/* one pass of rtlab_stim_waveform_build(), see add_seg() */
+static void build_pulses(struct rtlab_stim_waveform *w, 
+                         const struct rtlab_stim_wave_params *p,
+                         const struct rtlab_comedi_context *ctx)
+{
+  lsampl_t rest = rtlab_volts_to_lsampl(ctx, p->rest_voltage),
+           on = rtlab_volts_to_lsampl(ctx, p->rest_voltage + p->amplitude),
+           neg = rtlab_volts_to_lsampl(ctx, p->rest_voltage - p->amplitude);
+  unsigned int width = us_to_scans(p->width_us), 
+               gap = us_to_scans(p->gap_us),
+               ramp = us_to_scans(p->ramp_us),
+               period = us_to_scans(p->period_us),
+               pulse = 0, i;
+  int n;
+
+  if (p->shape == RTLAB_WAVE_RAMP && ramp * 2 > width) ramp = width / 2;
+
+  for (n = 0; n < p->num_pulses; n++) {
+    switch (p->shape) {
+    case RTLAB_WAVE_BIPHASIC:
+      add_seg(w, on, width);
+      add_seg(w, rest, gap);
+      add_seg(w, neg, width);
+      pulse = width * 2 + gap;
+      break;
+    case RTLAB_WAVE_RAMP:
+      /* one segment per scan on the ramps, flat in between */
+      for (i = 1; i <= ramp; i++)
+        add_seg(w, rtlab_volts_to_lsampl(ctx, p->rest_voltage 
+                                         + p->amplitude * i / (ramp + 1)), 1);
+      add_seg(w, on, width - 2 * ramp);
+      for (i = ramp; i >= 1; i--)
+        add_seg(w, rtlab_volts_to_lsampl(ctx, p->rest_voltage 
+                                         + p->amplitude * i / (ramp + 1)), 1);
+      pulse = width;
+      break;
+    case RTLAB_WAVE_RECT:
+    default:
+      add_seg(w, on, width);
+      pulse = width;
+      break;
     }
+    if (period > pulse) add_seg(w, rest, period - pulse);
+  }
+  add_seg(w, rest, us_to_scans(p->end_silence_us));
+}
+
+struct rtlab_stim_waveform *
+rtlab_stim_waveform_build(struct rtlab_stimulator *s, 
+                          const struct rtlab_stim_wave_params *p)
+{
+  struct rtlab_stim_waveform *w;
+  struct rtlab_comedi_context ctx;
+  double min_v, max_v, a;
+
+  if (!s || s->magic != STIM_MAGIC || !p || p->num_pulses <= 0 
+      || p->width_us <= 0) 
+    return 0;
+
+  if (!(w = (struct rtlab_stim_waveform *)
+        kmalloc(sizeof(struct rtlab_stim_waveform), GFP_KERNEL)))
+    return 0;
+  memset(w, 0, sizeof(*w));
+
+  /* rest +/- amplitude covers every shape we build */
+  a = (p->amplitude < 0 ? -p->amplitude : p->amplitude);
+  min_v = p->rest_voltage - (p->shape == RTLAB_WAVE_BIPHASIC ? a : 0.0);
+  max_v = p->rest_voltage + (p->shape == RTLAB_WAVE_BIPHASIC ? a : 0.0);
+  if (p->rest_voltage + p->amplitude < min_v) 
+    min_v = p->rest_voltage + p->amplitude;
+  if (p->rest_voltage + p->amplitude > max_v) 
+    max_v = p->rest_voltage + p->amplitude;
+  if (wave_setup(s, w, min_v, max_v, &ctx)) goto err;
+
+  build_pulses(w, p, &ctx); /* count.. */
+  w->max_segs = w->n_segs;
+  w->n_segs = 0;
+  if (!(w->segs = (struct rtlab_stim_segment *)
+        kmalloc(sizeof(struct rtlab_stim_segment) * w->max_segs, GFP_KERNEL)))
+    goto err;
+  build_pulses(w, p, &ctx); /* ..then fill in */
+
+  w->rest = rtlab_volts_to_lsampl(&ctx, p->rest_voltage);
+  w->owner = s;
+  atomic_set(&w->refs, 0);
+  w->magic = WAVE_MAGIC;
+  return w;
+
+ err:
+  kfree(w);
+  return 0;
+}
+
+struct rtlab_stim_waveform *
+rtlab_stim_waveform_from_volts(struct rtlab_stimulator *s, 
+                               const double *volts, unsigned int n_scans,
+                               double rest_voltage)
+{
+  struct rtlab_stim_waveform *w;
+  struct rtlab_comedi_context ctx;
+  double min_v = rest_voltage, max_v = rest_voltage;
+  unsigned int i, pass;
 
-    p->when_ms = 0; /* make sure the next time we stim_create_cmds, 
-                       it happens immediately */
+  if (!s || s->magic != STIM_MAGIC || !volts || !n_scans) return 0;
 
-    if (atomic_read(&stim->active) && stim_create_cmds(stim)) {
-      /* command creation failed, so clear the stim */
-      atomic_set(&stim->active, 0);
-      goto ret;
+  if (!(w = (struct rtlab_stim_waveform *)
+        kmalloc(sizeof(struct rtlab_stim_waveform), GFP_KERNEL)))
+    return 0;
+  memset(w, 0, sizeof(*w));
+
+  for (i = 0; i < n_scans; i++) {
+    if (volts[i] < min_v) min_v = volts[i];
+    if (volts[i] > max_v) max_v = volts[i];
+  }
+  if (wave_setup(s, w, min_v, max_v, &ctx)) goto err;
+
+  /* count, allocate, then fill in */
+  for (pass = 0; pass < 2; pass++) {
+    if (pass) {
+      w->max_segs = w->n_segs;
+      w->n_segs = 0;
+      if (!(w->segs = (struct rtlab_stim_segment *)
+            kmalloc(sizeof(struct rtlab_stim_segment) * w->max_segs, 
+                    GFP_KERNEL)))
+        goto err;
     }
-  } else {
-    /* Must have been cancelled!  Note that if cancelled we do the
-       last callback! */
-    if (stim->callback) stim->callback(stim->callback_arg);
+    for (i = 0; i < n_scans; i++)
+      add_seg(w, rtlab_volts_to_lsampl(&ctx, volts[i]), 1);
   }
 
- ret:
-#ifdef DEBUG
-  //DEBUG
-  rtos_printf("stimulator: exiting stim_reaper()..\n");
-#endif
+  w->rest = rtlab_volts_to_lsampl(&ctx, rest_voltage);
+  w->owner = s;
+  atomic_set(&w->refs, 0);
+  w->magic = WAVE_MAGIC;
+  return w;
+
+ err:
+  kfree(w);
+  return 0;
+}
+
+int rtlab_stim_waveform_free(struct rtlab_stim_waveform *w)
+{
+  unsigned int pass = stim_passes;
+
+  if (!w || w->magic != WAVE_MAGIC || w->owned || w == &stop_wave) 
+    return EINVAL;
+
+  /* if it was just stopped or swapped out, the RT loop lets go of it
+     on its next tick.. */
+  while (rt_running && atomic_read(&w->refs) && stim_passes - pass < 2) 
+    sleep_a_tick();
+  /* ..otherwise it's still playing */
+  if (atomic_read(&w->refs)) return EBUSY;
+
+  w->magic = 0;
+  kfree(w->segs);
+  kfree(w);
+  return 0;
+}
+
+/*-----------------------------------------------------------------------------
+  Playback
+-----------------------------------------------------------------------------*/
+
+/* hands w to the RT loop as s's next waveform, to start after delay scans */
+static int queue_play(struct rtlab_stimulator *s, 
+                      struct rtlab_stim_waveform *w, int repeats,
+                      unsigned int delay)
+{
+  struct rtlab_stim_waveform *old;
+
+  atomic_inc(&w->refs);
+  s->next_repeats = repeats;
+  s->next_delay = delay;
+  wmb(); /* the above, then the pointer */
+  old = xchg(&s->next, w);
+  /* a play request the RT loop never got to */
+  if (old) atomic_dec(&old->refs);
+  return 0;
+}
+
+int rtlab_stim_play(struct rtlab_stimulator *s, 
+                    struct rtlab_stim_waveform *w, int num_repeats)
+{
+  if (!s || s->magic != STIM_MAGIC) return EINVAL;
+
+  if (!w) {
+    if (!atomic_read(&s->active)) return 0;
+    atomic_set(&s->active, 0);
+    return queue_play(s, &stop_wave, 0, 0);
+  }
+
+  if (w->magic != WAVE_MAGIC || w->owner != s || !w->n_segs || !num_repeats)
+    return EINVAL;
+  if (w->nanos_per_scan != rtp_shm->nanos_per_scan) 
+    return EINVAL; /* the sampling rate changed, rebuild it */
+
+  atomic_set(&s->active, 1);
+  return queue_play(s, w, num_repeats, 0);
 }
 
-static int stim_create_cmds(struct rtlab_stimulator *stim)
+/* called once per tick from the RT loop, which covers n_scans scans */
+void stim_process(unsigned int n_scans)
 {
-  const struct rtlab_stim_params *p = &stim->params;
-
-  /* number of commands: 
-     on phase, off phase * number per train + 1 (1 is the callback wrapper) */
-  int num_cmds = TRAINS_2_N_CMDS(p->num_per_train);
-  int time = p->when_ms;
-  char is_attack = 1;
-  int ret, i;
-  struct rtlab_cmd *cmds = stim->cmds;    
-
-  for (i = 0; num_cmds; i++) {
-    struct rtlab_cmd *c = &cmds[i];
-
-    c->when_ms = time;
-
-    if (num_cmds == 1) { /* the callback */
-      c->type = RTLAB_CMD_CALLBACK;
-      /* do the fake callback wrapper -- either does cleanup or 
-         sets up the next train */
-      c->p1.callback = stim_reaper;
-      c->p2.callback_arg = (void *)stim;
-    } else if (is_attack) {
-      c->type = RTLAB_CMD_AO;
-      c->p1.ctx = &stim->ctx;
-      c->p2.data = rtlab_volts_to_lsampl(c->p1.ctx, p->on_voltage); 
-    } else { /* is not attack but sustain/decay */
-      c->type = RTLAB_CMD_AO;
-      c->p1.ctx = &stim->ctx;
-      c->p2.data = rtlab_volts_to_lsampl(c->p1.ctx, p->off_voltage);
+  unsigned int i;
+
+  for (i = 0; i < MAX_STIMULATORS; i++) {
+    struct rtlab_stimulator *s = stims[i];
+    if (s) stim_process_one(s, n_scans);
+  }
+  wmb();
+  stim_passes++;
+}
+
+static inline void stim_write(struct rtlab_stimulator *s, unsigned int range,
+                              lsampl_t v)
+{
+  if (s->wrote_any && s->last == v) return;
+  comedi_data_write(s->ctx.dev, s->ctx.subdev, s->ctx.chan, range, 
+                    s->ctx.aref, v);
+  s->last = v;
+  s->wrote_any = 1;
+}
+
+/* stops s->cur, putting the output back at rest */
+static void stim_stop_cur(struct rtlab_stimulator *s)
+{
+  struct rtlab_stim_waveform *w = s->cur;
+
+  if (!w) return;
+  if (s->wrote_any) stim_write(s, w->range, w->rest);
+  s->cur = 0;
+  atomic_dec(&w->refs);
+}
+
+static void stim_process_one(struct rtlab_stimulator *s, unsigned int n)
+{
+  struct rtlab_stim_waveform *w;
+  unsigned int k;
+  char wrote = 0;
+
+  if (s->next && (w = xchg(&s->next, 0))) {
+    rmb(); /* next_repeats and next_delay were written before next */
+    if (w == &stop_wave) {
+      char was_playing = (s->cur != 0);
+      atomic_dec(&w->refs);
+      stim_stop_cur(s);
+      /* Note that if cancelled we do the last callback! */
+      if (was_playing && s->callback) s->callback(s->callback_arg);
+      return;
+    }
+    /* a swap: the old one just stops where it is, the new one takes over 
+       the output from this very scan */
+    if (s->cur) { atomic_dec(&s->cur->refs); s->cur = 0; }
+    s->cur = w;
+    s->seg = 0;
+    s->left = w->segs[0].n_scans;
+    s->repeats = s->next_repeats;
+    s->delay = s->next_delay;
+  }
+
+  while (n && (w = s->cur)) {
+    if (s->delay) { 
+      k = s->delay < n ? s->delay : n;
+      s->delay -= k, n -= k;
+      continue;
     }
 
-    num_cmds--;
-    is_attack = !is_attack; /* swap is_attack */
+    /* one write a tick, see above */
+    if (!wrote) stim_write(s, w->range, w->segs[s->seg].value), wrote = 1;
 
-    /* update time for next iter */
-    if (num_cmds == 1) {
-      time += p->end_silence_ms;
-    } else if (is_attack) {
-      time += p->spacing_ms;
-    } else {
-      time += p->duration_ms;
+    k = s->left < n ? s->left : n;
+    s->left -= k, n -= k;
+    if (s->left) return;
+
+    if (++s->seg < w->n_segs) {
+      s->left = w->segs[s->seg].n_scans;
+      continue;
     }
 
+    /* end of one pass through the table */
+    s->seg = 0;
+    s->left = w->segs[0].n_scans;
+    if (s->repeats > 0) s->repeats--;
+    if (!s->repeats) {
+      /* end of a finite stim */
+      stim_stop_cur(s);
+      atomic_set(&s->active, 0);
+    }
+    /* continuous stims do a callback at the end of each cycle, finite ones
+       once when done */
+    if (s->callback) s->callback(s->callback_arg);
   }
-  ret = rtlab_cmd_register(stim->cmd_h, cmds, num_cmds);
-  
-  return ret;
 }
 
+/*-----------------------------------------------------------------------------
+  The original rectangular-train interface
+-----------------------------------------------------------------------------*/
 int rtlab_cancel_stim(struct rtlab_stimulator *stim)
 {
 
   if (!stim || stim->magic != STIM_MAGIC || !atomic_read(&stim->active)) 
     return EINVAL;
   
-  
-  atomic_set(&stim->active, 0);
-  return 0;
+  return rtlab_stim_play(stim, 0, 0);
 }
 
 int rtlab_stimulate( struct rtlab_stimulator *stim,
                      const struct rtlab_stim_params *in)
 {
-  int err = 0;
+  int err = 0, n;
   struct rtlab_comedi_context *ctx; 
-  struct rtlab_stim_params *p; 
+  struct rtlab_stim_waveform *w;
+  lsampl_t on, off;
+  unsigned int dur, spacing, silence, delay;
 
   if (!stim) stim = DEFAULT_STIMULATOR;
+  if (!stim || stim->magic != STIM_MAGIC) return EINVAL;
 
   ctx = &stim->ctx; 
-  p = &stim->params;
 
   if (atomic_read(&stim->active)) {
 #ifdef DEBUG
@@ -361,15 +666,39 @@ int rtlab_stimulate( struct rtlab_stimulator *stim,
     goto end_error;
   
   
-  if (in->when_ms < 0 || in->num_per_train < 0 
-      || in->num_per_train > stim->max_train_sz) 
+  if (in->when_ms < 0 || in->num_per_train <= 0 
+      || (unsigned int)in->num_per_train > stim->max_train_sz 
+      || !in->num_trains) 
     { err = EINVAL; goto end_error; }
 
-  memcpy(p, in, sizeof(struct rtlab_stim_params));
-  
-  if ( (err = stim_create_cmds(stim)) ) goto end_error;
+  /* whichever of the two tables the RT loop is done with */
+  if (!atomic_read(&stim->trains[0].refs))       w = &stim->trains[0];
+  else if (!atomic_read(&stim->trains[1].refs))  w = &stim->trains[1];
+  else { err = EBUSY; goto end_error; }
+
+  on = rtlab_volts_to_lsampl(ctx, in->on_voltage);
+  off = rtlab_volts_to_lsampl(ctx, in->off_voltage);
+  dur = us_to_scans(in->duration_ms * 1000);
+  spacing = us_to_scans(in->spacing_ms * 1000);
+  silence = us_to_scans(in->end_silence_ms * 1000);
+  delay = us_to_scans(in->when_ms * 1000);
+
+  /* one train: on for duration, off for spacing, ..., and the last off 
+     lasts end_silence instead */
+  w->n_segs = 0;
+  for (n = 0; n < in->num_per_train; n++) {
+    add_seg(w, on, dur);
+    add_seg(w, off, n + 1 < in->num_per_train ? spacing : silence);
+  }
+  if (!w->n_segs) { err = EINVAL; goto end_error; }
+  w->range = ctx->range;
+  w->rest = off;
+  w->nanos_per_scan = rtp_shm->nanos_per_scan;
 
   atomic_set(&stim->active, 1);
+  err = queue_play(stim, w, 
+                   in->num_trains < 0 ? RTLAB_STIM_CONTINUOUS : in->num_trains,
+                   delay);
 
  end_error:
   return err;
@@ -378,10 +707,10 @@ int rtlab_stimulate( struct rtlab_stimulator *stim,
 int rtlab_stim_set_context(struct rtlab_stimulator *s, 
                            const struct rtlab_comedi_context *c)
 {
+  if (!s || s->magic != STIM_MAGIC || !c) return EINVAL;
   if (atomic_read(&s->active)) {
     return EAGAIN;
   }
-  if (!s || s->magic != STIM_MAGIC || !c) return EINVAL;
 
   memcpy(&s->ctx, c, sizeof(struct rtlab_comedi_context));
 
@@ -392,10 +721,21 @@ int rtlab_stim_set_callback(struct rtlab_stimulator *s,
                             rtlab_cmd_callback_t *callback,
                             void *callback_arg)
 {
-  if (!s || !s->magic == STIM_MAGIC || !callback) return EINVAL;
+  if (!s || s->magic != STIM_MAGIC) return EINVAL;
 
   s->callback = callback;
   s->callback_arg = callback_arg;
 
   return 0;
 }
+
+/* for the non-RT side, when it has to wait on the RT loop */
+static void sleep_a_tick(void)
+{
+#ifdef __KERNEL__
+  current->state = TASK_INTERRUPTIBLE;
+  schedule_timeout(1);
+#else
+  sched_yield();
+#endif
+}
@@ -21,6 +21,7 @@
  * http://www.gnu.org.
  */
 #ifndef _STIMULATOR_H
+#define _STIMULATOR_H
 #include "rt_process.h"
 #include "rtlab_cmd.h"
 
@@ -55,6 +56,10 @@ struct rtlab_stim_params
 /* called from rtlab.o upon module initialization */
 extern int init_stim_engine(void);
 extern void cleanup_stim_engine(void);
+extern void start_stim_engine(void); /* just before the RT loop starts.. */
+extern void stop_stim_engine(void);  /* ..and just after it has stopped   */
+extern void stim_process(unsigned int n_scans); /* once a tick, with the 
+                                                  scans the tick covers  */
 #endif
 
 
@@ -119,9 +124,78 @@ extern int rtlab_stim_set_callback(struct rtlab_stimulator *,
 extern int  rtlab_stimulate  ( struct rtlab_stimulator *,
                                const struct rtlab_stim_params * );
 /* 
-   Cancels a (continuous only!) stim.  The parameter is an int
-   that was returned from a previously created continuous (num=-1) stim
-   from rtlab_stimulate()
+   Cancels whatever the stimulator is doing (a train from 
+   rtlab_stimulate() or a waveform from rtlab_stim_play()) as of the next 
+   scan, puts the output back at the off/rest voltage, and does the 
+   callback one last time.  Returns EINVAL if it wasn't doing anything.
 */
 extern int  rtlab_cancel_stim ( struct rtlab_stimulator * );
+
+/*-----------------------------------------------------------------------------
+  Waveforms
+
+  A waveform is a precomputed table of output values, one per scan (run
+  length encoded), that a stimulator plays back from the RT loop.  Build
+  them ahead of time, from non-realtime context, for the stimulator that 
+  is going to play them -- the values are computed for its channel, in the
+  best AO range for the voltages involved, at the current sampling rate.
+  Change the sampling rate and you have to rebuild them.
+-----------------------------------------------------------------------------*/
+struct rtlab_stim_waveform; /* Opaque type */
+
+enum rtlab_stim_wave_shape {
+  RTLAB_WAVE_RECT = 0, /* monophasic rectangular pulses                  */
+  RTLAB_WAVE_BIPHASIC, /* +amplitude for width_us, gap_us at rest, then 
+                          -amplitude for width_us (charge balanced)      */
+  RTLAB_WAVE_RAMP      /* trapezoid, rising over ramp_us, flat, then 
+                          falling over ramp_us, width_us in all          */
+};
+
+struct rtlab_stim_wave_params {
+  enum rtlab_stim_wave_shape shape;
+  double amplitude;    /* volts, relative to rest_voltage                 */
+  double rest_voltage; /* between pulses, and after playback ends         */
+  int width_us;        /* the width of each pulse (each phase if biphasic)*/
+  int gap_us;          /* interphase gap, RTLAB_WAVE_BIPHASIC only        */
+  int ramp_us;         /* rise and fall time, RTLAB_WAVE_RAMP only        */
+  int period_us;       /* from the start of one pulse to the next         */
+  int num_pulses;      /* pulses in the waveform                          */
+  int end_silence_us;  /* extra rest at the end, before it repeats        */
+};
+
+/* Builds a pulse train waveform.  Non-realtime only.  Times are rounded
+   to the nearest scan (but a nonzero width is always at least 1 scan).  
+   Returns 0 on error. */
+extern struct rtlab_stim_waveform *
+rtlab_stim_waveform_build(struct rtlab_stimulator *,
+                          const struct rtlab_stim_wave_params *);
+
+/* Builds a waveform from an arbitrary array of voltages, one per scan. 
+   Non-realtime only.  Returns 0 on error. */
+extern struct rtlab_stim_waveform *
+rtlab_stim_waveform_from_volts(struct rtlab_stimulator *,
+                               const double *volts, unsigned int n_scans,
+                               double rest_voltage);
+
+/* Non-realtime only.  Returns EBUSY (and doesn't free it) if it is still
+   playing, EINVAL if it's not a valid waveform, 0 on success. */
+extern int rtlab_stim_waveform_free(struct rtlab_stim_waveform *);
+
+/* 
+   Plays a waveform num_repeats times over (RTLAB_STIM_CONTINUOUS to 
+   loop until cancelled).  If the stimulator is already playing something,
+   the new waveform replaces it as of the next scan, in one go -- there is
+   never a scan with a bit of each.  Passing 0 for the waveform stops 
+   playback, like rtlab_cancel_stim().  
+
+   The callback is called at the end of each repeat of a continuous 
+   waveform, or once at the end of a finite one, same as for 
+   rtlab_stimulate().
+
+   Safe to call from realtime, but only from one place at a time per 
+   stimulator.  Returns 0 on success, EINVAL on bad parameters or if the 
+   waveform was built for another stimulator or sampling rate.
+*/
+extern int rtlab_stim_play(struct rtlab_stimulator *, 
+                           struct rtlab_stim_waveform *, int num_repeats);
 #endif
@@ -0,0 +1,481 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "common.h"
+#include "exception.h"
+#include "synth_source.h"
+
+/* all table waveforms are this many points per cycle */
+#define SYNTH_TABLE_BITS 12
+#define SYNTH_TABLE_SZ (1 << SYNTH_TABLE_BITS)
+#define SYNTH_PHASE_SHIFT (32 - SYNTH_TABLE_BITS)
+
+/* injected spikes use the action potential template squeezed into 
+   this many milliseconds */
+#define SYNTH_SPIKE_MS 2.0
+
+static double tables[SampleStructSynthSource::n_waveforms][SYNTH_TABLE_SZ];
+static bool tables_built = false;
+
+static inline double gauss_bump(double x, double mu, double sigma)
+{ 
+  double d = (x - mu) / sigma;
+  return exp(-0.5 * d * d);
+}
+
+/* static */
+void
+SampleStructSynthSource::buildTables()
+{
+  if (tables_built) return;
+
+  for (uint i = 0; i < SYNTH_TABLE_SZ; i++) {
+    double x = static_cast<double>(i) / SYNTH_TABLE_SZ; /* [0, 1) */
+
+    tables[Sine][i] = sin(2.0 * M_PI * x);
+    tables[Square][i] = (x < 0.5 ? 1.0 : -1.0);
+    tables[Noise][i] = 0.0; /* noise is all additive */
+    tables[Flat][i] = 0.0;
+
+    /* A cheap ECG: P wave, QRS complex and T wave as a sum of gaussians,
+       normalized so that R peaks at 1.0 */
+    tables[ECG][i] = 
+        0.12 * gauss_bump(x, 0.20, 0.025)   /* P   */
+      - 0.10 * gauss_bump(x, 0.36, 0.008)   /* Q   */
+      + 1.00 * gauss_bump(x, 0.38, 0.010)   /* R   */
+      - 0.20 * gauss_bump(x, 0.40, 0.008)   /* S   */
+      + 0.30 * gauss_bump(x, 0.62, 0.045);  /* T   */
+
+    /* A cardiac-ish action potential: fast upstroke, plateau, 
+       repolarization, resting at -1.0 with a peak of 1.0 */
+    double ap;
+    if (x < 0.02)       ap = -1.0 + 2.0 * (x / 0.02);
+    else if (x < 0.05)  ap = 1.0 - 0.4 * ((x - 0.02) / 0.03);
+    else if (x < 0.30)  ap = 0.6 - 0.2 * ((x - 0.05) / 0.25);
+    else if (x < 0.45)  ap = 0.4 - 1.4 * ((x - 0.30) / 0.15);
+    else                ap = -1.0;
+    tables[ActionPotential][i] = ap;
+  }
+  
+  tables_built = true;
+}
+
+/* static */
+const char *
+SampleStructSynthSource::waveformName(Waveform w)
+{
+  static const char * const names[] = 
+    { "sine", "square", "noise", "ecg", "ap", "flat" };
+  
+  return (w >= 0 && w < n_waveforms ? names[w] : "");
+}
+
+SampleStructSynthSource::ChannelParams::ChannelParams()
+  : waveform(Sine), frequency_hz(1.0), amplitude(1.0), dc_offset(0.0),
+    noise(0.0), spike_rate_hz(0.0), spike_amplitude(1.0)
+{}
+
+SampleStructSynthSource::SampleStructSynthSource(uint n_channels)
+{
+  init(n_channels);
+}
+
+SampleStructSynthSource::SampleStructSynthSource(const QString & spec, 
+                                                 uint n_channels)
+{
+  init(n_channels);
+  applySpec(spec);
+}
+
+SampleStructSynthSource::~SampleStructSynthSource()
+{}
+
+void
+SampleStructSynthSource::init(uint n_channels)
+{
+  buildTables();
+
+  if (n_channels > SHD_MAX_CHANNELS) n_channels = SHD_MAX_CHANNELS;
+
+  config.struct_version = SHD_SHM_STRUCT_VERSION;
+  config.ai_minor = config.ao_minor = -1;
+  config.ai_subdev = config.ao_subdev = -1;
+  config.ai_fifo_minor = config.ao_fifo_minor = -1;
+  config.ai_ring_slots = 0;
+  config.control_fifo = config.reply_fifo = -1;
+  config.n_ai_chans = n_channels;
+  config.n_ao_chans = 0;
+  config.sampling_rate_hz = INITIAL_SAMPLING_RATE_HZ;
+  config.nanos_per_scan = BILLION / config.sampling_rate_hz;
+  config.scan_index = 0;
+  config.attached_pid = getpid();
+  config.jitter_ns = 0;
+  config.time_ms = config.time_us = 0;
+
+  init_spike_params(&config.spike_params);
+
+  for (uint i = 0; i < SHD_MAX_CHANNELS; i++) {
+    config.ai_chan[i] = config.ao_chan[i] = i;
+    set_chan(i, config.ai_chans_in_use, 0);
+    set_chan(i, config.ao_chans_in_use, 0);
+
+    phase[i] = 0;
+    rng[i] = 2463534242U + i * 2654435761U; /* any nonzero seed will do */
+    spike_pos[i] = 0;
+    last_spike[i] = 0;
+    next_spike[i] = 0;
+  }
+
+  drop_prob = gap_every_secs = 0.0;
+  gap_len_ms = 0;
+  drop_rng = 88172645U;
+  scans_dropped = 0;
+  is_realtime = true;
+  scans_per_read = 1000;
+
+  resetClock();
+}
+
+void
+SampleStructSynthSource::setChannelParams(uint chan, const ChannelParams & p)
+{
+  if (chan >= SHD_MAX_CHANNELS) return;
+  params[chan] = p;
+  next_spike[chan] = 0;
+}
+
+void
+SampleStructSynthSource::setAllChannelParams(const ChannelParams & p)
+{
+  for (uint i = 0; i < SHD_MAX_CHANNELS; i++) setChannelParams(i, p);
+}
+
+void
+SampleStructSynthSource::setRealtime(bool rt)
+{
+  is_realtime = rt;
+  resetClock();
+}
+
+void
+SampleStructSynthSource::resetClock()
+{
+  gettimeofday(&clock_base, 0);
+  clock_base_scan = config.scan_index;
+  clock_rate = config.sampling_rate_hz;
+}
+
+/* static */
+double
+SampleStructSynthSource::gaussian(uint32 & s)
+{
+  /* Irwin-Hall: the sum of 4 uniforms has variance 1/3, 
+     scale it to unit variance. Good enough for test signals. */
+  double sum = uniform(s) + uniform(s) + uniform(s) + uniform(s) - 2.0;
+  return sum * 1.7320508075688772;
+}
+
+uint
+SampleStructSynthSource::nextSpikeGap(uint chan)
+{
+  /* exponentially distributed inter-spike intervals (poisson process) */
+  double u = uniform(rng[chan]);
+  double scans = -log(1.0 - u) * clock_rate / params[chan].spike_rate_hz;
+
+  return (scans < 1.0 ? 1 : static_cast<uint>(scans));
+}
+
+uint
+SampleStructSynthSource::scansDue() const
+{
+  if (!is_realtime) return scans_per_read;
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+  
+  double elapsed = (now.tv_sec - clock_base.tv_sec) 
+    + (now.tv_usec - clock_base.tv_usec) / static_cast<double>(MILLION);
+  scan_index_t due = 
+    clock_base_scan + static_cast<scan_index_t>(elapsed * clock_rate);
+
+  if (due <= config.scan_index) return 0;
+
+  /* don't let a stalled reader make us generate an absurd block */
+  scan_index_t n = due - config.scan_index, 
+               max = static_cast<scan_index_t>(clock_rate) * DEFAULT_FIFO_SECS;
+  return (n > max ? max : n);
+}
+
+size_t 
+SampleStructSynthSource::numBytesReady() const
+{
+  return numSamplesReady() * SAMPLE_SOURCE_BLOCK_SZ_BYTES;
+}
+
+int 
+SampleStructSynthSource::numSamplesReady() const
+{
+  uint n = 0;
+
+  for (uint i = next_chan_on(0, config.ai_chans_in_use, config.n_ai_chans); 
+       i < config.n_ai_chans; 
+       i = next_chan_on(i + 1, config.ai_chans_in_use, config.n_ai_chans))
+    n++;
+
+  return n * scansDue();
+}
+
+int
+SampleStructSynthSource::suggestPollWaitTime() const
+{
+  return (is_realtime ? DESIRED_FIFO_FEEL_MS : 1);
+}
+
+bool
+SampleStructSynthSource::scanIsDropped(scan_index_t si)
+{
+  if (gap_every_secs > 0.0 && gap_len_ms) {
+    scan_index_t period = 
+      static_cast<scan_index_t>(gap_every_secs * clock_rate),
+                 len = static_cast<scan_index_t>(gap_len_ms) * clock_rate / 1000;
+    if (period && si % period >= period - len) return true;
+  }
+
+  return drop_prob > 0.0 && uniform(drop_rng) < drop_prob;
+}
+
+/*
+  Fills out[0..n_scans) with n_scans worth of signal for one channel,
+  and flags the scans where an injected spike starts in onset[].
+  The waveform switch is outside the loops, so each loop is just a table
+  lookup and a multiply-add.  Noise and spikes are separate passes, and
+  are skipped entirely if not enabled.
+*/
+void
+SampleStructSynthSource::synthChannel(uint chan, uint n_scans, double *out,
+                                      char *onset)
+{
+  const ChannelParams & p = params[chan];
+  const uint32 inc = 
+    static_cast<uint32>(p.frequency_hz / clock_rate * 4294967296.0);
+  const double *tab = tables[p.waveform < n_waveforms ? p.waveform : Flat];
+  const double amp = p.amplitude, off = p.dc_offset;
+  uint32 ph = phase[chan];
+  uint i;
+
+  if (p.waveform == Noise || p.waveform == Flat) {
+    for (i = 0; i < n_scans; i++) out[i] = off;
+  } else {
+    for (i = 0; i < n_scans; i++, ph += inc) 
+      out[i] = off + amp * tab[ph >> SYNTH_PHASE_SHIFT];
+  }
+  phase[chan] = ph;
+
+  /* for the Noise waveform, amplitude doubles as the noise level */
+  double sigma = (p.waveform == Noise ? amp : 0.0) + p.noise;
+  if (sigma > 0.0) {
+    uint32 & s = rng[chan];
+    for (i = 0; i < n_scans; i++) out[i] += sigma * gaussian(s);
+  }
+
+  if (p.spike_rate_hz > 0.0) {
+    const double *ap = tables[ActionPotential];
+    uint spike_len = static_cast<uint>(SYNTH_SPIKE_MS * clock_rate / 1000.0);
+    
+    if (!spike_len) spike_len = 1;
+    if (!next_spike[chan]) next_spike[chan] = nextSpikeGap(chan);
+
+    for (i = 0; i < n_scans; i++) {
+      if (spike_pos[chan]) {
+        /* in the middle of a spike, keep playing it back */
+        uint idx = 
+          static_cast<uint>((static_cast<uint64>(spike_pos[chan]) 
+                             * SYNTH_TABLE_SZ) / spike_len);
+        out[i] += p.spike_amplitude * 0.5 * (ap[idx] + 1.0);
+        if (++spike_pos[chan] >= spike_len) spike_pos[chan] = 0;
+      } else if (!--next_spike[chan]) {
+        /* start a new one */
+        out[i] += p.spike_amplitude * 0.5 * (ap[0] + 1.0);
+        spike_pos[chan] = (spike_len > 1 ? 1 : 0);
+        next_spike[chan] = nextSpikeGap(chan);
+        onset[i] = 1;
+      }
+    }
+  }
+}
+
+uint
+SampleStructSynthSource::generate(uint n_scans)
+{
+  /* figure out who is on */
+  enabled.clear();
+  for (uint i = next_chan_on(0, config.ai_chans_in_use, config.n_ai_chans); 
+       i < config.n_ai_chans; 
+       i = next_chan_on(i + 1, config.ai_chans_in_use, config.n_ai_chans))
+    enabled.push_back(i);
+
+  const uint n_chans = enabled.size();
+
+  if (!n_chans || !n_scans) {
+    config.scan_index += n_scans;
+    return 0;
+  }
+
+  if (scratch.size() < n_chans * n_scans) scratch.resize(n_chans * n_scans);
+
+  if (n_chans * n_scans * sizeof(SampleStruct) > read_memory_sz) {
+    if (read_memory) delete read_memory;
+    read_memory_sz = n_chans * n_scans * sizeof(SampleStruct);
+    read_memory = (SampleStruct *)new char[read_memory_sz];
+  }
+
+  /* channel-major synthesis */
+  spike_flags.assign(n_chans * n_scans, 0);
+  for (uint c = 0; c < n_chans; c++) 
+    synthChannel(enabled[c], n_scans, &scratch[c * n_scans], 
+                 &spike_flags[c * n_scans]);
+
+  /* now interleave into scans, skipping dropped ones */
+  SampleStruct *out = read_memory;
+  scan_index_t si = config.scan_index;
+  uint n_out = 0;
+
+  for (uint s = 0; s < n_scans; s++, si++) {
+    if (scanIsDropped(si)) { scans_dropped++; continue; }
+
+    for (uint c = 0; c < n_chans; c++, out++, n_out++) {
+      const uint chan = enabled[c];
+      out->channel_id = chan;
+      out->scan_index = si;
+      out->data = scratch[c * n_scans + s];
+      out->magic_number = SAMPLE_STRUCT_MAGIC;
+      if ( (out->spike = spike_flags[c * n_scans + s]) ) {
+        out->spike_period = 
+          (last_spike[chan] 
+           ? (si - last_spike[chan]) * 1000.0 / clock_rate : 0.0);
+        last_spike[chan] = si;
+      } else 
+        out->spike_period = 0.0;
+    }
+  }
+
+  config.scan_index = si;
+  return n_out;
+}
+
+const SampleStruct *
+SampleStructSynthSource::read(int b_time)
+{
+  if (config.sampling_rate_hz != clock_rate) resetClock();
+
+  uint n = scansDue();
+
+  if (!n && b_time) {
+    /* sleep until the next scan is due, or b_time seconds */
+    uint us = MILLION / (clock_rate ? clock_rate : 1) + 1;
+    if (b_time > 0 && us > static_cast<uint>(b_time) * MILLION) 
+      us = b_time * MILLION;
+    usleep(us);
+    n = scansDue();
+  }
+
+  num_bytes_last_read = generate(n) * sizeof(SampleStruct);
+
+  return read_memory;
+}
+
+void
+SampleStructSynthSource::flush()
+{
+  if (is_realtime) {
+    /* skip over whatever is due without generating it */
+    config.scan_index += scansDue();
+  }
+  num_bytes_last_read = 0;
+}
+
+void
+SampleStructSynthSource::applySpec(const QString & spec)
+{
+  ChannelParams p = params[0];
+  const char *waves[] = { "sine", "square", "noise", "ecg", "ap", "flat" };
+  char *buf = strdup(spec.latin1() ? spec.latin1() : ""), *save = 0;
+  int n_on = -1;
+  bool bad = false;
+
+  for (char *tok = strtok_r(buf, ", \t", &save); tok && !bad; 
+       tok = strtok_r(0, ", \t", &save)) {
+    char *val = strchr(tok, '=');
+    if (!val) { bad = true; break; }
+    *val++ = 0;
+
+    if (!strcmp(tok, "wave")) {
+      int w;
+      for (w = 0; w < n_waveforms && strcmp(val, waves[w]); w++) 
+        ;
+      if (w == n_waveforms) bad = true;
+      else p.waveform = static_cast<Waveform>(w);
+    } 
+    else if (!strcmp(tok, "freq"))      p.frequency_hz = atof(val);
+    else if (!strcmp(tok, "amp"))       p.amplitude = atof(val);
+    else if (!strcmp(tok, "offset"))    p.dc_offset = atof(val);
+    else if (!strcmp(tok, "noise"))     p.noise = atof(val);
+    else if (!strcmp(tok, "spikes"))    p.spike_rate_hz = atof(val);
+    else if (!strcmp(tok, "spike_amp")) p.spike_amplitude = atof(val);
+    else if (!strcmp(tok, "drop"))      drop_prob = atof(val);
+    else if (!strcmp(tok, "gap_every")) gap_every_secs = atof(val);
+    else if (!strcmp(tok, "gap_ms"))    gap_len_ms = atoi(val);
+    else if (!strcmp(tok, "realtime"))  is_realtime = atoi(val);
+    else if (!strcmp(tok, "block"))     setScansPerRead(atoi(val));
+    else if (!strcmp(tok, "chans"))     n_on = atoi(val);
+    else if (!strcmp(tok, "rate") && atoi(val) > 0) {
+      config.sampling_rate_hz = atoi(val);
+      config.nanos_per_scan = BILLION / config.sampling_rate_hz;
+    }
+    else bad = true;
+  }
+
+  free(buf);
+
+  if (bad) 
+    throw Exception("Invalid synthetic source specification",
+                    QString("Could not parse the synthetic source spec \"")
+                    + spec + "\".  It should be a comma-separated list of "
+                    "key=value pairs, with keys: wave, freq, amp, offset, "
+                    "noise, spikes, spike_amp, drop, gap_every, gap_ms, "
+                    "realtime, block, chans, rate.");
+
+  setAllChannelParams(p);
+
+  if (n_on >= 0) 
+    for (uint i = 0; i < config.n_ai_chans; i++)
+      set_chan(i, config.ai_chans_in_use, static_cast<int>(i) < n_on);
+
+  resetClock();
+}
@@ -0,0 +1,179 @@
+/*
+ * This file is part of the RT-Linux Multichannel Data Acquisition System
+ *
+ * Copyright (C) 1999,2000 David Christini
+ * Copyright (c) 2001 David Christini, Lyuba Golub, Calin Culianu
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (see COPYRIGHT file); if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA, or go to their website at
+ * http://www.gnu.org.
+ */
+#ifndef _SYNTH_SOURCE_H
+#define _SYNTH_SOURCE_H
+
+#include <sys/time.h>
+#include <vector>
+#include "sample_source.h"
+#include "shared_stuff.h"
+
+/*
+   SampleStructSynthSource --
+
+   A SampleStructSource that makes up its own data.  Useful for running
+   daq_system, the writers and plugins at a known, controllable load
+   without an RTLinux box or a DAQ board attached.
+
+   Each channel gets one of a handful of waveforms (sine, square, noise, 
+   or ECG/action potential templates played back at a given beat rate), 
+   plus optional additive noise and randomly injected spikes.  Injected
+   spikes get the spike flag set in their SampleStruct, so this can be 
+   used as ground truth for spike detection.  Whole scans can be dropped
+   at random and periodic gaps can be simulated, both of which show up as
+   dropped samples in SampleStructReader.
+
+   Generation is done a channel at a time over whole blocks of scans using
+   table lookups off a 32-bit phase accumulator, so it is cheap enough to
+   go at several hundred thousand samples per second without being the 
+   bottleneck.
+
+   Like SampleStructComediSource, the channel mask and sampling rate are 
+   controlled through a private SharedMemStruct -- wrap shm() in a 
+   ShmControllerLocal.
+
+   In realtime mode (the default) scans are produced according to the 
+   wall clock at the configured sampling rate.  Otherwise every read() 
+   returns scansPerRead() scans immediately, for benchmarking as fast as
+   the consumers can go.
+*/
+class SampleStructSynthSource : public SampleStructSource
+{
+ public:
+
+  enum Waveform { 
+    Sine = 0, 
+    Square, 
+    Noise, 
+    ECG, 
+    ActionPotential, 
+    Flat,
+    n_waveforms
+  };
+
+  struct ChannelParams {
+    ChannelParams();
+    Waveform waveform;
+    double frequency_hz;    /* cycles (or beats) per second               */
+    double amplitude;       /* peak, in volts                             */
+    double dc_offset;       /* volts                                      */
+    double noise;           /* std. deviation of additive noise, in volts */
+    double spike_rate_hz;   /* mean rate of injected spikes, 0 for none   */
+    double spike_amplitude; /* volts                                      */
+  };
+  
+  SampleStructSynthSource(uint n_channels = SHD_MAX_CHANNELS);
+  /* like above, but calls applySpec(spec) */
+  SampleStructSynthSource(const QString & spec, 
+                          uint n_channels = SHD_MAX_CHANNELS);
+  virtual ~SampleStructSynthSource();
+
+  virtual size_t numBytesReady() const; 
+  virtual int numSamplesReady() const; 
+  virtual const SampleStruct * read(int b_time = -1);
+  virtual void flush(); /* discards any scans that are due */
+  virtual int suggestPollWaitTime() const;
+
+  /* the control panel for this source -- wrap it in a ShmControllerLocal */
+  SharedMemStruct *shm() { return &config; }
+
+  const ChannelParams & channelParams(uint chan) const { return params[chan]; }
+  void setChannelParams(uint chan, const ChannelParams & p);
+  void setAllChannelParams(const ChannelParams & p);
+
+  /* each scan is independently dropped with probability p */
+  double dropProbability() const { return drop_prob; }
+  void setDropProbability(double p) { drop_prob = p; }
+
+  /* every every_secs seconds, drop gap_ms worth of scans. 0 disables */
+  void setGaps(double every_secs, uint gap_ms) 
+    { gap_every_secs = every_secs; gap_len_ms = gap_ms; }
+
+  bool realtime() const { return is_realtime; }
+  void setRealtime(bool rt);
+  uint scansPerRead() const { return scans_per_read; }
+  void setScansPerRead(uint n) { scans_per_read = (n ? n : 1); }
+
+  /* Parses a comma-separated list of key=value pairs and applies it to 
+     all channels.  Keys are:
+
+       wave=sine|square|noise|ecg|ap|flat  freq=HZ  amp=V  offset=V  
+       noise=V  spikes=HZ  spike_amp=V  drop=P  gap_every=SECS  gap_ms=MS
+       realtime=0|1  block=SCANS  chans=N (turns on the first N channels)
+       rate=HZ
+
+     Throws Exception on an unparseable spec. */
+  void applySpec(const QString & spec);
+
+  /* total scans that were dropped or gapped on purpose */
+  scan_index_t numScansDropped() const { return scans_dropped; }
+
+  static const char *waveformName(Waveform w);
+  
+ private:
+  void init(uint n_channels);
+  void resetClock();
+  uint scansDue() const;
+  uint generate(uint n_scans); /* returns the number of samples made */
+  void synthChannel(uint chan, uint n_scans, double *out, char *onset);
+  bool scanIsDropped(scan_index_t si);
+  
+  /* cheap xorshift PRNGs -- we don't need anything fancy */
+  static uint32 xorshift(uint32 & s) 
+    { s ^= s << 13; s ^= s >> 17; s ^= s << 5; return s; }
+  static double uniform(uint32 & s) /* [0,1) */
+    { return xorshift(s) * (1.0 / 4294967296.0); }
+  static double gaussian(uint32 & s); 
+  uint nextSpikeGap(uint chan); /* in scans */
+
+  static void buildTables();
+  
+  SharedMemStruct config;
+
+  ChannelParams params[SHD_MAX_CHANNELS];
+
+  /* per channel generator state */
+  uint32 phase[SHD_MAX_CHANNELS], rng[SHD_MAX_CHANNELS];
+  uint next_spike[SHD_MAX_CHANNELS];    /* scans until next injected spike */
+  uint spike_pos[SHD_MAX_CHANNELS];     /* position in a spike in progress */
+  scan_index_t last_spike[SHD_MAX_CHANNELS];
+
+  vector<double> scratch; /* n_enabled_chans x n_scans */
+  vector<char> spike_flags; /* same layout as scratch */
+  vector<uint> enabled;   
+  
+  double drop_prob, gap_every_secs;
+  uint gap_len_ms;
+  uint32 drop_rng;
+  scan_index_t scans_dropped;
+
+  bool is_realtime;
+  uint scans_per_read;
+
+  /* realtime pacing: scan 'clock_base_scan' was due at 'clock_base' */
+  struct timeval clock_base;
+  scan_index_t clock_base_scan;
+  sampling_rate_t clock_rate;
+};
+
+#endif
@@ -25,38 +25,148 @@
 */
 #include "user_cmd.h"
 #include "user_to_kernel.h"
+#ifndef RTOS_POSIX
 #include <asm/bitops.h>
+#endif
 
-#ifdef __KERNEL__
-#  include <linux/comedilib.h>
+#if defined(__KERNEL__) || defined(RTOS_POSIX)
+#  ifdef __KERNEL__
+#    include <linux/comedilib.h>
+#    include <linux/string.h>
+#  endif
 #  include "rtos_middleman.h"
 #  include "rt_process.h"
 #  define ERROR(a...) rtos_printf(a)
 #else
 #  include <unistd.h>
 #  include <stdio.h>
+#  include <string.h>
 #  include <comedilib.h>
 #  define ERROR(a...) fprintf(stderr, a)
 #endif
 
 static int check_basic_sanity(int count, const struct rtfifo_cmd *cmd);
+static rtlab_cmd_status check_command(const struct rtfifo_cmd *cmd, 
+                                      const SharedMemStruct *);
+static void apply_command(const struct rtfifo_cmd *cmd, SharedMemStruct *);
 static void dispatch_command(const struct rtfifo_cmd *cmd, SharedMemStruct *);
+static inline void set_threshold(SharedMemStruct *, unsigned int chan,
+                                 const struct rtfifo_cmd *cmd);
+static unsigned int run_batch(const struct rtfifo_cmd *cmds, unsigned int first,
+                              unsigned int n, volatile unsigned char *status,
+                              SharedMemStruct *);
+static void do_ring_commands(SharedMemStruct *, unsigned int quota);
+static void do_fifo_commands(SharedMemStruct *);
 static int read_fifo(int fifo, void *buf, unsigned int count);
 static int write_fifo(int fifo, const void *buf, unsigned int count);
 
-void do_user_commands(SharedMemStruct *rtp_shm)
+/* how far into rtp_shm->cmd_ring we've read */
+static unsigned int cmd_tail;
+
+/* The batch being read in off the control fifo.  Userland writes a batch
+   in one go, but it may still straddle two ticks, so what we have of it 
+   is kept here until the rest shows up. */
+static struct {
+  unsigned int n_cmds, n_read, seq;
+  struct rtfifo_cmd cmds[RTLAB_MAX_BATCH];
+} batch;
+static struct rtfifo_batch_reply batch_reply;
+
+void do_user_commands(SharedMemStruct *rtp_shm, unsigned int quota)
+{
+  /* the usual case, nothing to do, costs just this */
+  if (rtp_shm->cmd_ring.head != cmd_tail) do_ring_commands(rtp_shm, quota);
+
+  if (rtp_shm->control_fifo >= 0) do_fifo_commands(rtp_shm);
+}
+
+void reset_user_commands(SharedMemStruct *rtp_shm)
+{
+  struct CmdRing *r = &rtp_shm->cmd_ring;
+
+  r->head = r->done = r->waiters = cmd_tail = 0;
+  batch.n_cmds = batch.n_read = 0;
+}
+
+/* Up to quota commands off the mailbox.  A batch is only started on once
+   all of it is in, and then goes in one go regardless of the quota. */
+static void do_ring_commands(SharedMemStruct *rtp_shm, unsigned int quota)
+{
+  struct CmdRing *r = &rtp_shm->cmd_ring;
+  unsigned int head = r->head, n_done = 0, n, seq;
+  const struct rtfifo_cmd *cmd;
+  rtlab_cmd_status status;
+
+  rmb(); /* the commands are there if head says they are */
+
+  while (cmd_tail != head && n_done < quota) {
+    seq = cmd_tail;
+    cmd = &r->cmds[seq % CMD_RING_SLOTS];
+
+    if (!check_basic_sanity(sizeof(*cmd), cmd)) 
+      status = RTLAB_CMD_BADCMD;
+    else if (cmd->command == RTLAB_BATCH) {
+      n = (cmd->chan > RTLAB_MAX_BATCH ? RTLAB_MAX_BATCH : cmd->chan);
+      if (head - seq < n + 1) break; /* rest of it is yet to come */
+      status = (run_batch(r->cmds, seq + 1, n, r->status, rtp_shm) 
+                ? RTLAB_CMD_NOT_APPLIED : RTLAB_CMD_OK);
+      cmd_tail += n;
+      n_done += n;
+    } else if ( (status = check_command(cmd, rtp_shm)) == RTLAB_CMD_OK )
+      apply_command(cmd, rtp_shm);
+
+    r->status[seq % CMD_RING_SLOTS] = status;
+    cmd_tail++;
+    n_done++;
+  }
+
+  if (!n_done) return;
+
+  wmb(); /* statuses before done */
+  r->done = cmd_tail;
+  mb();  /* done before waiters, pairs with userland's side */
+  if (r->waiters) rtos_wake_user(&r->done);
+}
+
+static void do_fifo_commands(SharedMemStruct *rtp_shm)
 {
   int count, fifo = rtp_shm->control_fifo;
   struct rtfifo_cmd cmd;
+  unsigned int n_failed;
 
-  if (fifo < 0) return; /* should never happen! */
-  
   while ( (count = read_fifo(fifo, &cmd, sizeof(struct rtfifo_cmd))) > 0) 
     {
-      if (!check_basic_sanity(count, &cmd)) continue;
-      /* todo handle seeking forward to the beginning of a cmd if 
-	 we are stuck in the middle of one! */
-      dispatch_command(&cmd, rtp_shm);
+      if (batch.n_read < batch.n_cmds) {
+        /* part of a batch -- a mangled one fails the whole batch */
+        if (count != sizeof(cmd)) cmd.cmd_begin = 0;
+        batch.cmds[batch.n_read++] = cmd;
+        if (batch.n_read < batch.n_cmds) continue;
+      } else {
+        if (!check_basic_sanity(count, &cmd)) continue;
+        /* todo handle seeking forward to the beginning of a cmd if 
+           we are stuck in the middle of one! */
+        if (cmd.command != RTLAB_BATCH) {
+          dispatch_command(&cmd, rtp_shm);
+          continue;
+        }
+        batch.n_cmds = (cmd.chan > RTLAB_MAX_BATCH ? RTLAB_MAX_BATCH 
+                        : cmd.chan);
+        batch.n_read = 0;
+        batch.seq = cmd.u.seq;
+        if (batch.n_cmds) continue;
+      }
+
+      /* got all of the batch */
+      n_failed = run_batch(batch.cmds, 0, batch.n_cmds, batch_reply.status, 
+                           rtp_shm);
+      batch_reply.cmd_begin = RTFIFO_BEGIN;
+      batch_reply.seq = batch.seq;
+      batch_reply.n_cmds = batch.n_cmds;
+      batch_reply.n_failed = n_failed;
+      batch_reply.cmd_end = RTFIFO_END;
+      write_fifo(rtp_shm->reply_fifo, &batch_reply, 
+                 RTFIFO_BATCH_REPLY_BYTES(batch.n_cmds));
+      batch.n_cmds = batch.n_read = 0;
     }
 }
 
@@ -85,15 +195,109 @@ static int check_basic_sanity(int count, const struct rtfifo_cmd *cmd)
     return ret;
 }
 
+/* Checks all of a batch, then applies it only if it all checked out, so 
+   that the RT loop sees either none of it or all of it.  Command i is 
+   cmds[(first + i) % CMD_RING_SLOTS], and its status goes in the same
+   place in status[].  Returns how many were bad. */
+static unsigned int run_batch(const struct rtfifo_cmd *cmds, unsigned int first,
+                              unsigned int n, volatile unsigned char *status,
+                              SharedMemStruct *rtp_shm)
+{
+  unsigned int i, n_failed = 0;
+  const struct rtfifo_cmd *cmd;
+  rtlab_cmd_status st;
+
+  for (i = 0; i < n; i++) {
+    cmd = &cmds[(first + i) % CMD_RING_SLOTS];
+    st = (check_basic_sanity(sizeof(*cmd), cmd) 
+          ? check_command(cmd, rtp_shm) : RTLAB_CMD_BADCMD);
+    status[(first + i) % CMD_RING_SLOTS] = st;
+    if (st != RTLAB_CMD_OK) n_failed++;
+  }
+
+  for (i = 0; i < n; i++) 
+    if (!n_failed) 
+      apply_command(&cmds[(first + i) % CMD_RING_SLOTS], rtp_shm);
+    else if (status[(first + i) % CMD_RING_SLOTS] == RTLAB_CMD_OK)
+      status[(first + i) % CMD_RING_SLOTS] = RTLAB_CMD_NOT_APPLIED;
+
+  return n_failed;
+}
+
+/* A lone command.  These have always been applied as far as they could
+   be, and always been answered with a 1. */
 static void dispatch_command(const struct rtfifo_cmd *cmd, 
                              SharedMemStruct *rtp_shm)
 {
-  unsigned int i;
   static const unsigned char reply = 1;
-#define CHKCHAN if (cmd->chan >= rtp_shm->n_ai_chans) break
+
+  if (check_command(cmd, rtp_shm) == RTLAB_CMD_OK)
+    apply_command(cmd, rtp_shm);
+
+  /* synchronous reply is always 1 for now... */
+  write_fifo(rtp_shm->reply_fifo, (void *)&reply, sizeof(reply));
+}
+
+static rtlab_cmd_status check_command(const struct rtfifo_cmd *cmd, 
+                                      const SharedMemStruct *rtp_shm)
+{
+  switch(cmd->command) {
+  case RTLAB_SET_CHAN:
+  case RTLAB_SET_GAIN:
+  case RTLAB_SET_AREF:
+  case RTLAB_SET_SPIKE:
+  case RTLAB_SET_SPIKE_POLARITY:
+  case RTLAB_SET_SPIKE_BLANKING:
+  case RTLAB_SET_SPIKE_THRESHOLD:
+    return (cmd->chan < rtp_shm->n_ai_chans 
+            ? RTLAB_CMD_OK : RTLAB_CMD_BADCHAN);
+  case RTLAB_SET_OVERSAMPLE:
+    if (cmd->chan >= rtp_shm->n_ai_chans) return RTLAB_CMD_BADCHAN;
+    /* fall through */
+  case RTLAB_SET_OVERSAMPLE_ALL:
+    return (cmd->u.oversample <= AI_MAX_OVERSAMPLE 
+            ? RTLAB_CMD_OK : RTLAB_CMD_BADCMD);
+  case RTLAB_SET_CIC_ORDER:
+    return (cmd->u.cic_order >= 1 && cmd->u.cic_order <= AI_MAX_CIC_ORDER
+            ? RTLAB_CMD_OK : RTLAB_CMD_BADCMD);
+  case RTLAB_SET_CHAN_ALL:
+  case RTLAB_SET_GAIN_ALL:
+  case RTLAB_SET_AREF_ALL:
+  case RTLAB_SET_SPIKE_ALL:
+  case RTLAB_SET_SPIKE_POLARITY_ALL:
+  case RTLAB_SET_SPIKE_BLANKING_ALL:
+  case RTLAB_SET_SPIKE_THRESHOLD_ALL:
+  case RTLAB_SET_ATTACHED_PID:
+  case RTLAB_SET_SAMPLING_RATE:
+    return RTLAB_CMD_OK;
+  case RTLAB_SET_SCAN_INDEX:
+    ERROR("user_cmd.c: Scan Index change unimplemented!!");
+    return RTLAB_CMD_BADCMD;
+  default:
+    ERROR("user_cmd.c: Unknown user command encountered!\n");
+    return RTLAB_CMD_BADCMD;
+  }
+}
+
+/* The volts are only kept for userland to read back, so they are copied
+   as bytes: a fixed point rtlab.o's RT task may have no FPU, and gcc is
+   free to move a double through it. */
+static inline void set_threshold(SharedMemStruct *rtp_shm, unsigned int chan,
+                                 const struct rtfifo_cmd *cmd)
+{
+  memcpy((void *)&rtp_shm->spike_params.threshold[chan],
+         &cmd->u.threshold.volts, sizeof(double));
+  rtp_shm->spike_params.threshold_uv[chan] = cmd->u.threshold.microvolts;
+}
+
+/* cmd has been through check_command() already */
+static void apply_command(const struct rtfifo_cmd *cmd, 
+                          SharedMemStruct *rtp_shm)
+{
+  unsigned int i;
+
   switch(cmd->command) {
   case RTLAB_SET_CHAN:
-    CHKCHAN;
     if (cmd->u.enabled)
       set_bit(cmd->chan, rtp_shm->ai_chans_in_use);
     else
@@ -107,7 +311,6 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
 	clear_bit(i, rtp_shm->ai_chans_in_use);
     break;
   case RTLAB_SET_GAIN:
-    CHKCHAN;
     rtp_shm->ai_chan[cmd->chan] = 
       CR_PACK(cmd->chan, cmd->u.gain, CR_AREF(rtp_shm->ai_chan[cmd->chan]));
     break;
@@ -117,7 +320,6 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
         CR_PACK(i, cmd->u.gain, CR_AREF(rtp_shm->ai_chan[i]));
     break;
   case RTLAB_SET_AREF:
-    CHKCHAN;
     rtp_shm->ai_chan[cmd->chan] = 
       CR_PACK(cmd->chan, CR_RANGE(rtp_shm->ai_chan[cmd->chan]), cmd->u.aref);
     break;
@@ -127,7 +329,6 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
         CR_PACK(i, CR_RANGE(rtp_shm->ai_chan[i]), cmd->u.aref);
     break;
   case RTLAB_SET_SPIKE:
-    CHKCHAN;
     if (cmd->u.enabled)
       set_bit(cmd->chan, rtp_shm->spike_params.enabled_mask);
     else
@@ -141,7 +342,6 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
 	clear_bit(i, rtp_shm->spike_params.enabled_mask);
     break;
   case RTLAB_SET_SPIKE_POLARITY:
-    CHKCHAN;
     if (cmd->u.polarity)
       set_bit(cmd->chan, rtp_shm->spike_params.polarity_mask);
     else
@@ -155,7 +355,6 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
 	clear_bit(i, rtp_shm->spike_params.polarity_mask);
     break;
   case RTLAB_SET_SPIKE_BLANKING:
-    CHKCHAN;
     rtp_shm->spike_params.blanking[cmd->chan] = cmd->u.blanking;
     break;
   case RTLAB_SET_SPIKE_BLANKING_ALL:
@@ -163,12 +362,23 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
       rtp_shm->spike_params.blanking[i] = cmd->u.blanking;
     break;
   case RTLAB_SET_SPIKE_THRESHOLD:
-    CHKCHAN;
-    rtp_shm->spike_params.threshold[cmd->chan] = cmd->u.threshold;
+    set_threshold(rtp_shm, cmd->chan, cmd);
     break;
   case RTLAB_SET_SPIKE_THRESHOLD_ALL:
     for (i = 0; i < rtp_shm->n_ai_chans; i++)
-      rtp_shm->spike_params.threshold[i] = cmd->u.threshold;
+      set_threshold(rtp_shm, i, cmd);
+    break;
+  case RTLAB_SET_OVERSAMPLE:
+    /* 0 is as good as 1, but the shm only ever says 1 for off */
+    rtp_shm->ai_oversample[cmd->chan] = 
+      cmd->u.oversample ? cmd->u.oversample : 1;
+    break;
+  case RTLAB_SET_OVERSAMPLE_ALL:
+    for (i = 0; i < rtp_shm->n_ai_chans; i++)
+      rtp_shm->ai_oversample[i] = cmd->u.oversample ? cmd->u.oversample : 1;
+    break;
+  case RTLAB_SET_CIC_ORDER:
+    rtp_shm->ai_cic_order = cmd->u.cic_order;
     break;
   case RTLAB_SET_ATTACHED_PID:
     rtp_shm->attached_pid = ( cmd->u.pid <= 0 ? 0 : cmd->u.pid );
@@ -181,21 +391,14 @@ static void dispatch_command(const struct rtfifo_cmd *cmd,
     rtlab_set_sampling_rate(cmd->u.sampling_rate_hz);
     break;
   case RTLAB_SET_SCAN_INDEX:
-    ERROR("user_cmd.c: Scan Index change unimplemented!!");
     /*rtp_shm->scan_index = cmd.u->scan_index;*/
     /* TODO: Handle scan index changes!! */
-    break;
   default:
-    ERROR("user_cmd.c: Unknown user command encountered!\n");
     break;
   }
-
-  /* synchronous reply is always 1 for now... */
-  write_fifo(rtp_shm->reply_fifo, (void *)&reply, sizeof(reply));
-#undef CHKCHAN
 }
 
-#ifdef __KERNEL__
+#if defined(__KERNEL__) || defined(RTOS_POSIX)
 static int read_fifo(int fifo, void *buf, unsigned int count)
 {
   return rtos_fifo_get(fifo, buf, count);
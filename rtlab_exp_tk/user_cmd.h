@@ -25,7 +25,10 @@
 
 struct SharedMemStruct;
 
-/* called from rtlab.o's main loop -- reads off the control fifo
-   and executes commands from user process */
-extern void do_user_commands(struct SharedMemStruct *);
+/* called from rtlab.o's main loop -- picks up to quota commands from 
+   user process off the command mailbox (and the control fifo, if any),
+   executes them and replies */
+extern void do_user_commands(struct SharedMemStruct *, unsigned int quota);
+/* empties the command mailbox, for when the shm is (re)initialized */
+extern void reset_user_commands(struct SharedMemStruct *);
 #endif
@@ -21,60 +21,155 @@
  */
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/stat.h> 
-#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#ifdef SYS_futex
+#include <linux/futex.h>
+#endif
 #include <comedilib.h>
 #include "user_to_kernel.h"
 #include "exception.h"
 
-RTLabKernelNotifier::RTLabKernelNotifier(int control_fifo, int reply_fifo)
-  : fd(0)
-{
-  QString pathname1 = "/dev/rtf%1", pathname2;
-  pathname2 = pathname1;
-  if (control_fifo < 0 
-      || (fd = ::open( (pathname1 = pathname1.arg(control_fifo)).latin1(),
-		       O_WRONLY | O_SYNC)) < 0 ) {
-    throw IllegalStateException("No control FIFO", 
-				QString("Could not open rtlab control fifo") +
-				(fd < 0 
-				 ? QString(". Error was: %1").arg(strerror(errno))
-				 : QString("")));
-  }
-  if (reply_fifo < 0 
-      || (replyfd = ::open( (pathname2 = pathname2.arg(reply_fifo)).latin1(),
-                            O_RDONLY | O_SYNC)) < 0 ) {
-    throw IllegalStateException("No control reply FIFO", 
-				QString("Could not open rtlab control reply fifo") +
-				(fd < 0 
-				 ? QString(". Error was: %1").arg(strerror(errno))
-				 : QString("")));
-  }
-  
+/* how long we busy-wait on the mailbox before going to sleep on it */
+#define SPIN_US 50
+/* how long we give rtlab.o to answer before giving up */
+#define TIMEOUT_US 2000000
+
+RTLabKernelNotifier::RTLabKernelNotifier(SharedMemStruct *s)
+  : shm(s), ring(&s->cmd_ring), batch_depth(0)
+{
+  Assert<IllegalStateException>(shm->struct_version == SHD_SHM_STRUCT_VERSION,
+                                "No command mailbox", 
+                                "The shared memory struct is the wrong "
+                                "version, and may not have a command "
+                                "mailbox.");
 }
 
 
 RTLabKernelNotifier::~RTLabKernelNotifier()
 {
-  if (fd > -1) {
-    ::close(fd);
+}
+
+static long usecs_since(const struct timeval & start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, 0);
+  return (now.tv_sec - start.tv_sec) * 1000000 + now.tv_usec - start.tv_usec;
+}
+
+/* Takes the mailbox's producer lock.  A lock held by a process that no 
+   longer exists is taken over. */
+bool RTLabKernelNotifier::lock()
+{
+  int me = getpid(), owner;
+  struct timeval start;
+
+  gettimeofday(&start, 0);
+  while ( (owner = __sync_val_compare_and_swap(&ring->lock, 0, me)) ) {
+    if (owner == me) break; /* a previous instance of us died holding it */
+    if (kill(owner, 0) < 0 && errno == ESRCH
+        && __sync_bool_compare_and_swap(&ring->lock, owner, me))
+      break;
+    if (usecs_since(start) > TIMEOUT_US) return false;
+    usleep(1000);
   }
+  /* whoever had it last may not have seen their commands through */
+  return ring->head == ring->done || waitFor(ring->head - 1);
 }
 
-int RTLabKernelNotifier::do_cmd()
+void RTLabKernelNotifier::unlock()
+{
+  __sync_lock_release(&ring->lock);
+}
+
+/* Waits until rtlab.o is done with sequence number seq: spins for a 
+   little while (a fast RT loop will be done by then), then sleeps on 
+   ring->done.  Only the POSIX simulator actually wakes us up when it 
+   changes, so the sleeps are kept to about a tick each. */
+bool RTLabKernelNotifier::waitFor(unsigned int seq)
+{
+  struct timeval start;
+  unsigned int done;
+  long nap_ns = shm->nanos_per_scan;
+
+  if (nap_ns < 50000) nap_ns = 50000;
+  if (nap_ns > 10000000) nap_ns = 10000000;
+
+  gettimeofday(&start, 0);
+  while ( int((done = ring->done) - seq) <= 0 ) {
+    long waited = usecs_since(start);
+
+    if (waited > TIMEOUT_US) return false;
+    if (waited < SPIN_US) continue;
+#ifdef SYS_futex
+    {
+      struct timespec nap = { 0, nap_ns };
+
+      ring->waiters = 1;
+      __sync_synchronize(); /* pairs with rtlab.o's mb() after done */
+      if (ring->done == done)
+        syscall(SYS_futex, &ring->done, FUTEX_WAIT, done, &nap, 0, 0);
+      ring->waiters = 0;
+    }
+#else
+    usleep(nap_ns / 1000);
+#endif
+  }
+  SAMPLE_RING_RMB(); /* the statuses are in if done says so */
+  return true;
+}
+
+/* Puts n commands in the mailbox, behind an RTLAB_BATCH if as_batch, and
+   waits for rtlab.o to get through them.  status, if given, gets an 
+   rtlab_cmd_status for each. */
+int RTLabKernelNotifier::submit(const rtfifo_cmd *cmds, unsigned int n, 
+                                bool as_batch, int *status)
 {
-  unsigned char reply = 0;
-  ssize_t ret =  ::write(fd, &cmd, sizeof(cmd));
-  if (ret < 0) goto reterr;
+  unsigned int first, at, i;
+  int ret = 0;
+
+  if (!lock()) return ETIMEDOUT;
+
+  first = at = ring->head;
+  if (as_batch) {
+    rtfifo_cmd header;
+
+    header.command = RTLAB_BATCH;
+    header.chan = n;
+    header.u.seq = first;
+    at = cmd_ring_put(ring, at, &header);
+  }
+  for (i = 0; i < n; i++) at = cmd_ring_put(ring, at, &cmds[i]);
+  cmd_ring_publish(ring, at);
+
+  if (!waitFor(at - 1)) ret = ETIMEDOUT;
   else {
-    /* synchronously wait for reply */
-    ret = ::read(replyfd, &reply, sizeof(reply));
-    if (ret < 0 || !reply) goto reterr;
+    if (as_batch && ring->status[first % CMD_RING_SLOTS] != RTLAB_CMD_OK)
+      ret = EINVAL;
+    for (i = 0; i < n; i++) {
+      int st = ring->status[(first + as_batch + i) % CMD_RING_SLOTS];
+
+      if (status) status[i] = st;
+      if (st != RTLAB_CMD_OK) ret = EINVAL;
+    }
+  }
+  unlock();
+  return ret;
+}
+
+int RTLabKernelNotifier::do_cmd()
+{
+  if (batch_depth) { 
+    batch.push_back(cmd); 
+    return 0; 
   }
-  return 0;
- reterr:
-  return errno;
+  return submit(&cmd, 1, false, 0);
 }
 
 int RTLabKernelNotifier::setChan(uint chan, bool on)
@@ -122,6 +217,28 @@ int RTLabKernelNotifier::setAllAREFs(uint aref)
   return do_cmd();
 }
 
+int RTLabKernelNotifier::setOversample(uint chan, uint factor)
+{
+  cmd.command = RTLAB_SET_OVERSAMPLE;
+  cmd.chan = chan;
+  cmd.u.oversample = factor;
+  return do_cmd();
+}
+
+int RTLabKernelNotifier::setAllOversamples(uint factor)
+{
+  cmd.command = RTLAB_SET_OVERSAMPLE_ALL;
+  cmd.u.oversample = factor;
+  return do_cmd();
+}
+
+int RTLabKernelNotifier::setCICOrder(uint order)
+{
+  cmd.command = RTLAB_SET_CIC_ORDER;
+  cmd.u.cic_order = order;
+  return do_cmd();
+}
+
 int RTLabKernelNotifier::setSpike(uint chan, bool on)
 {
   cmd.command = RTLAB_SET_SPIKE;
@@ -167,18 +284,30 @@ int RTLabKernelNotifier::setAllSpikeBlankings(uint blanking)
   return do_cmd();
 }
   
+/* a fixed point rtlab.o goes by the microvolts, which have to fit an int */
+static int to_microvolts(double volts)
+{
+  double uv = round(volts * 1e6);
+
+  if (uv >= INT_MAX) return INT_MAX;
+  if (uv <= INT_MIN) return INT_MIN;
+  return int(uv);
+}
+
 int RTLabKernelNotifier::setSpikeThreshold(uint chan, double thold)
 {
   cmd.command = RTLAB_SET_SPIKE_THRESHOLD;
   cmd.chan = chan;
-  cmd.u.threshold = thold;
+  cmd.u.threshold.volts = thold;
+  cmd.u.threshold.microvolts = to_microvolts(thold);
   return do_cmd();
 }
 
 int RTLabKernelNotifier::setAllSpikeThresholds(double thold)
 {
   cmd.command = RTLAB_SET_SPIKE_THRESHOLD_ALL;
-  cmd.u.threshold = thold;
+  cmd.u.threshold.volts = thold;
+  cmd.u.threshold.microvolts = to_microvolts(thold);
   return do_cmd();
 }
 
@@ -207,3 +336,31 @@ int RTLabKernelNotifier::setScanIndex(scan_index_t index)
   return do_cmd();
 }
 
+void RTLabKernelNotifier::beginBatch()
+{
+  batch_depth++;
+}
+
+void RTLabKernelNotifier::abortBatch()
+{
+  batch_depth = 0;
+  batch.clear();
+}
+
+int RTLabKernelNotifier::commitBatch(std::vector<int> *status)
+{
+  int ret = 0, err;
+  unsigned int i, n;
+
+  if (!batch_depth || --batch_depth) return 0; /* not the outermost one */
+
+  if (status) status->assign(batch.size(), RTLAB_CMD_NOT_APPLIED);
+  for (i = 0; i < batch.size(); i += n) {
+    n = batch.size() - i;
+    if (n > RTLAB_MAX_BATCH) n = RTLAB_MAX_BATCH;
+    err = submit(&batch[i], n, true, status ? &(*status)[i] : 0);
+    if (err && !ret) ret = err;
+  }
+  batch.clear();
+  return ret;
+}
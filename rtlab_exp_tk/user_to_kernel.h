@@ -27,90 +27,72 @@
 
   All communication is _synchronous_.. meaning user process doesn't
   resume until kernel process replied to command!
+
+  Commands go through the command mailbox in the SharedMemStruct (struct
+  CmdRing, see shared_stuff.h), which rtlab.o looks at once per RT tick.
+  With nothing in it that costs rtlab.o one load.  Replies are a status
+  per command in the same place.  The control and reply RT-FIFOs this 
+  used to go over are still there if rtlab.o is loaded with cmd_fifos=1.
+
+  Commands can also go over as a batch: an RTLAB_BATCH command whose chan
+  field is the number of commands that follow it.  rtlab.o checks the
+  whole batch, then applies all of it (or, if anything in it was bad, 
+  none of it) within a single RT tick.  On the fifos the batch goes in
+  one write() and is answered with one struct rtfifo_batch_reply 
+  carrying a status per command; single commands there get the old one 
+  byte reply.
 */
 #ifndef _USER_TO_KERNEL_H
 #define _USER_TO_KERNEL_H 1
 
 #include "shared_stuff.h"
+#include "sample_ring.h" /* for the barriers */
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-
-  /*
-    TODO: Implement ability to affect AO subdevice from userland? 
-  */
-
-typedef enum {
-  RTLAB_SET_CHAN = 0,
-  RTLAB_SET_CHAN_ALL,
-  RTLAB_SET_GAIN,
-  RTLAB_SET_GAIN_ALL,
-  RTLAB_SET_AREF,
-  RTLAB_SET_AREF_ALL,
-  RTLAB_SET_SPIKE,
-  RTLAB_SET_SPIKE_ALL,
-  RTLAB_SET_SPIKE_POLARITY,
-  RTLAB_SET_SPIKE_POLARITY_ALL,
-  RTLAB_SET_SPIKE_BLANKING,
-  RTLAB_SET_SPIKE_BLANKING_ALL,
-  RTLAB_SET_SPIKE_THRESHOLD,
-  RTLAB_SET_SPIKE_THRESHOLD_ALL,
-  RTLAB_SET_ATTACHED_PID,
-  RTLAB_SET_SAMPLING_RATE,
-  RTLAB_SET_SCAN_INDEX
-} rtlab_user_cmd;
-
-#define RTFIFO_BEGIN (0xfade)
-#define RTFIFO_END   (0xedaf)
-
-#define RTFIFO_CMD_INIT \
-{ \
-  struct_version : SHD_SHM_STRUCT_VERSION, \
-  cmd_begin : RTFIFO_BEGIN, \
-  cmd_end : RTFIFO_END \
+/* The command mailbox in SharedMemStruct, userland's side of it.  See 
+   struct CmdRing. */
+
+/* how many more commands fit */
+static inline unsigned int
+cmd_ring_space (const struct CmdRing *r)
+{ return CMD_RING_SLOTS - (r->head - r->done); }
+
+/* userland: puts c at sequence number at, without publishing it yet, and
+   returns the next sequence number */
+static inline unsigned int
+cmd_ring_put (struct CmdRing *r, unsigned int at, const struct rtfifo_cmd *c)
+{ 
+  r->cmds[at % CMD_RING_SLOTS] = *c; 
+  return at + 1;
 }
 
-#define RTFIFO_CMD_CLR(x) \
-do { \
-  x->struct_version = SHD_SHM_STRUCT_VERSION;\
-  x->cmd_begin = RTFIFO_BEGIN; \
-  x->cmd_end = RTFIFO_END; \
-} while(0)
-
-
-struct rtfifo_cmd {
-#ifdef __cplusplus
-  rtfifo_cmd() { RTFIFO_CMD_CLR(this); }
-#endif
-  int cmd_begin;
-  int struct_version; /**< Always equals SHD_SHM_STRUCT_VERSION */
-
-  rtlab_user_cmd command;
-  unsigned int chan; /**< Not used for every command */
-  union {
-    unsigned int gain; /**< for RTLAB_SET_GAIN* */
-    unsigned int aref; /**< for RTLAB_SET_AREF* */
-    SpikePolarity polarity; /**< for RTLAB_SET_SPIKE_POLARITY */
-    char enabled;  /**< for RTLAB_SET_CHAN and RTLAB_SET_SPIKE */
-    unsigned int blanking; /**< for RTLAB_SET_SPIKE_BLANKING */
-    double threshold; /**< for RTLAB_SET_SPIKE_THRESHOLD */
-    scan_index_t    scan_index; /**< for RTLAB_SET_SCAN_INDEX */
-    int pid; /**< for RTLAB_SET_ATTACHED_PID */
-    sampling_rate_t sampling_rate_hz; /**< for RTLAB_SET_SAMPLING_RATE */
-
-  } u;
-  int cmd_end;
-};
+/* userland: makes everything put up to (but not including) end visible */
+static inline void
+cmd_ring_publish (struct CmdRing *r, unsigned int end)
+{
+  SAMPLE_RING_WMB();
+  r->head = end;
+}
 
 #ifdef __cplusplus
 }
 
+#include <vector>
+
+/* 
+   Every set*() below is a synchronous round trip through rtlab.o's RT
+   loop, unless a batch is open: between beginBatch() and commitBatch()
+   they are just queued (and return 0), and commitBatch() sends them all
+   at once.  Batches nest -- only the outermost commitBatch() sends.
+*/
 class RTLabKernelNotifier
 {
  public:
-   RTLabKernelNotifier(int control_fifo, int reply_fifo);
+  /* talks to rtlab.o through shm's command mailbox */
+  RTLabKernelNotifier(SharedMemStruct *shm);
   ~RTLabKernelNotifier();
 
   /* channel on/off */
@@ -122,6 +104,11 @@ class RTLabKernelNotifier
   int setAllGains(uint range);
   int setAREF(uint chan, uint aref);
   int setAllAREFs(uint aref);
+
+  /* oversampling (see ai_decimate.h) */
+  int setOversample(uint chan, uint factor);
+  int setAllOversamples(uint factor);
+  int setCICOrder(uint order);
   
   /* spike on/off */
   int setSpike(uint chan, bool on);
@@ -149,11 +136,30 @@ class RTLabKernelNotifier
   /* scan index (dangerous!) */
   int setScanIndex(scan_index_t index);
 
+  /* batches */
+  void beginBatch();
+  /* returns 0 if every queued command was applied, otherwise an errno 
+     (EINVAL if rtlab.o rejected anything, ETIMEDOUT if it never answered).
+     If status is given, it gets an rtlab_cmd_status per queued command.
+     Batches of more than RTLAB_MAX_BATCH commands go over in pieces, 
+     each atomic on its own. */
+  int commitBatch(std::vector<int> *status = 0);
+  void abortBatch(); /* throws away what was queued */
+  bool inBatch() const { return batch_depth > 0; }
+
  private:
   rtfifo_cmd cmd;
-  int fd, replyfd;
+  SharedMemStruct *shm;
+  CmdRing *ring;
+  int batch_depth;
+  std::vector<rtfifo_cmd> batch;
 
   int do_cmd();
+  int submit(const rtfifo_cmd *cmds, unsigned int n, bool as_batch, 
+             int *status);
+  bool lock();
+  void unlock();
+  bool waitFor(unsigned int seq); /* until done passes seq */
 };
 #endif
 